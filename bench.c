@@ -0,0 +1,324 @@
+/*
+Workload set for benchmarking a mounted toyfs, see bench.sh
+
+Usage: ./toyfs-bench [mount point] [scale]
+    prints one JSON object per workload: throughput, latency percentiles and
+    device requests issued by toyfs (read from the .toyfs/stats.json virtual file)
+*/
+#include "checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FILE_SIZE (4 << 20) // size of files for sequential and random io
+#define RANDOM_IO_SIZE 4096
+
+const char* mount_point;
+int scale = 1;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// latencies of one workload
+struct Samples {
+    uint64_t* values;
+    int count;
+    int capacity;
+};
+
+void add_sample(struct Samples* samples, uint64_t value) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->values = (uint64_t*) realloc(samples->values, samples->capacity * sizeof(uint64_t));
+    }
+    samples->values[samples->count++] = value;
+}
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+uint64_t percentile(struct Samples* samples, double p) {
+    if (samples->count == 0) return 0;
+    int rank = (int) (p / 100 * samples->count + 0.5);
+    if (rank < 1) rank = 1;
+    return samples->values[rank - 1];
+}
+
+// device request counters of the mounted toyfs
+struct DeviceCounts {
+    long long reads;
+    long long writes;
+};
+
+long long json_op_count(const char* json, const char* op) {
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\":{\"count\":", op);
+    const char* pos = strstr(json, key);
+    if (pos == NULL) return -1;
+    return atoll(pos + strlen(key));
+}
+
+struct DeviceCounts get_device_counts() {
+    struct DeviceCounts counts = { -1, -1 };
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/.toyfs/stats.json", mount_point);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return counts;
+    static char json[1 << 16];
+    int len = 0;
+    int bytes;
+    while (len < (int) sizeof(json) - 1 && (bytes = read(fd, json + len, sizeof(json) - 1 - len)) > 0) len += bytes;
+    json[len] = 0;
+    close(fd);
+    counts.reads = json_op_count(json, "dev_read");
+    counts.writes = json_op_count(json, "dev_write");
+    return counts;
+}
+
+// print the result of one workload as a JSON line and reset samples
+void report(const char* workload, int io_size, long long bytes, uint64_t elapsed_ns, struct Samples* samples, struct DeviceCounts* before) {
+    struct DeviceCounts after = get_device_counts();
+    qsort(samples->values, samples->count, sizeof(uint64_t), compare_u64);
+    double seconds = elapsed_ns / 1e9;
+    printf("{\"workload\":\"%s\",\"io_size\":%d,\"ops\":%d,\"bytes\":%lld,\"seconds\":%.6f,\"ops_per_s\":%.1f,\"mb_per_s\":%.3f,"
+        "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"dev_reads\":%lld,\"dev_writes\":%lld}\n",
+        workload, io_size, samples->count, bytes, seconds, samples->count / seconds, bytes / seconds / (1 << 20),
+        percentile(samples, 50) / 1000.0, percentile(samples, 99) / 1000.0, percentile(samples, 100) / 1000.0,
+        before->reads < 0 ? -1 : after.reads - before->reads, before->writes < 0 ? -1 : after.writes - before->writes);
+    fflush(stdout);
+    samples->count = 0;
+}
+
+void die(const char* what, const char* path) {
+    fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+    exit(1);
+}
+
+void bench_sequential(int io_size, struct Samples* samples) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/seq%d", mount_point, io_size);
+    char* buffer = (char*) malloc(io_size);
+    for (int i = 0; i < io_size; i++) buffer[i] = 'a' + i % 26;
+
+    struct DeviceCounts before = get_device_counts();
+    uint64_t start = now_ns();
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) die("open", path);
+    for (long long offset = 0; offset < FILE_SIZE; offset += io_size) {
+        uint64_t op_start = now_ns();
+        if (pwrite(fd, buffer, io_size, offset) != io_size) die("write", path);
+        add_sample(samples, now_ns() - op_start);
+    }
+    if (fsync(fd) < 0) die("fsync", path);
+    close(fd);
+    report("seq_write", io_size, FILE_SIZE, now_ns() - start, samples, &before);
+
+    before = get_device_counts();
+    start = now_ns();
+    fd = open(path, O_RDONLY);
+    if (fd < 0) die("open", path);
+    for (long long offset = 0; offset < FILE_SIZE; offset += io_size) {
+        uint64_t op_start = now_ns();
+        if (pread(fd, buffer, io_size, offset) != io_size) die("read", path);
+        add_sample(samples, now_ns() - op_start);
+    }
+    close(fd);
+    report("seq_read", io_size, FILE_SIZE, now_ns() - start, samples, &before);
+
+    // random io on the file just written
+    if (io_size == RANDOM_IO_SIZE) {
+        int num_ops = 1000 * scale;
+        srand(io_size);
+        before = get_device_counts();
+        start = now_ns();
+        fd = open(path, O_WRONLY);
+        if (fd < 0) die("open", path);
+        for (int i = 0; i < num_ops; i++) {
+            off_t offset = (off_t) (rand() % (FILE_SIZE / RANDOM_IO_SIZE)) * RANDOM_IO_SIZE;
+            uint64_t op_start = now_ns();
+            if (pwrite(fd, buffer, RANDOM_IO_SIZE, offset) != RANDOM_IO_SIZE) die("write", path);
+            add_sample(samples, now_ns() - op_start);
+        }
+        if (fsync(fd) < 0) die("fsync", path);
+        close(fd);
+        report("rand_write", RANDOM_IO_SIZE, (long long) num_ops * RANDOM_IO_SIZE, now_ns() - start, samples, &before);
+
+        before = get_device_counts();
+        start = now_ns();
+        fd = open(path, O_RDONLY);
+        if (fd < 0) die("open", path);
+        for (int i = 0; i < num_ops; i++) {
+            off_t offset = (off_t) (rand() % (FILE_SIZE / RANDOM_IO_SIZE)) * RANDOM_IO_SIZE;
+            uint64_t op_start = now_ns();
+            if (pread(fd, buffer, RANDOM_IO_SIZE, offset) != RANDOM_IO_SIZE) die("read", path);
+            add_sample(samples, now_ns() - op_start);
+        }
+        close(fd);
+        report("rand_read", RANDOM_IO_SIZE, (long long) num_ops * RANDOM_IO_SIZE, now_ns() - start, samples, &before);
+    }
+
+    if (unlink(path) < 0) die("unlink", path);
+    free(buffer);
+}
+
+void bench_small_files(struct Samples* samples) {
+    int num_files = 1000 * scale;
+    char dir[2048], path[4096];
+    snprintf(dir, sizeof(dir), "%s/small", mount_point);
+    if (mkdir(dir, 0755) < 0) die("mkdir", dir);
+    char content[100];
+    memset(content, 'x', sizeof(content));
+
+    struct DeviceCounts before = get_device_counts();
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_files; i++) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        uint64_t op_start = now_ns();
+        int fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) die("create", path);
+        if (write(fd, content, sizeof(content)) != sizeof(content)) die("write", path);
+        close(fd);
+        add_sample(samples, now_ns() - op_start);
+    }
+    report("small_create", sizeof(content), (long long) num_files * sizeof(content), now_ns() - start, samples, &before);
+
+    struct stat st;
+    before = get_device_counts();
+    start = now_ns();
+    for (int i = 0; i < num_files; i++) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        uint64_t op_start = now_ns();
+        if (stat(path, &st) < 0) die("stat", path);
+        add_sample(samples, now_ns() - op_start);
+    }
+    report("small_stat", 0, 0, now_ns() - start, samples, &before);
+
+    before = get_device_counts();
+    start = now_ns();
+    for (int i = 0; i < num_files; i++) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        uint64_t op_start = now_ns();
+        if (unlink(path) < 0) die("unlink", path);
+        add_sample(samples, now_ns() - op_start);
+    }
+    report("small_unlink", 0, 0, now_ns() - start, samples, &before);
+    if (rmdir(dir) < 0) die("rmdir", dir);
+}
+
+void bench_large_dir(struct Samples* samples) {
+    int num_entries = 5000 * scale;
+    char dir[2048], path[4096];
+    snprintf(dir, sizeof(dir), "%s/large", mount_point);
+    if (mkdir(dir, 0755) < 0) die("mkdir", dir);
+    for (int i = 0; i < num_entries; i++) {
+        snprintf(path, sizeof(path), "%s/e%d", dir, i);
+        if (mknod(path, S_IFREG | 0644, 0) < 0) die("mknod", path);
+    }
+
+    struct stat st;
+    srand(num_entries);
+    struct DeviceCounts before = get_device_counts();
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_entries; i++) {
+        snprintf(path, sizeof(path), "%s/e%d", dir, rand() % num_entries);
+        uint64_t op_start = now_ns();
+        if (stat(path, &st) < 0) die("stat", path);
+        add_sample(samples, now_ns() - op_start);
+    }
+    report("large_dir_lookup", 0, 0, now_ns() - start, samples, &before);
+
+    before = get_device_counts();
+    start = now_ns();
+    char command[8192];
+    snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+    if (system(command) != 0) die("rm -rf", dir);
+    add_sample(samples, now_ns() - start);
+    report("large_dir_remove", 0, 0, now_ns() - start, samples, &before);
+}
+
+void bench_copy_tree(struct Samples* samples) {
+    int num_dirs = 10 * scale, num_files = 20;
+    int file_size = 16384;
+    char src[2048], dst[2048], path[4096];
+    snprintf(src, sizeof(src), "%s/tree", mount_point);
+    snprintf(dst, sizeof(dst), "%s/copy", mount_point);
+    if (mkdir(src, 0755) < 0) die("mkdir", src);
+    char* content = (char*) malloc(file_size);
+    memset(content, 'y', file_size);
+    for (int d = 0; d < num_dirs; d++) {
+        snprintf(path, sizeof(path), "%s/d%d", src, d);
+        if (mkdir(path, 0755) < 0) die("mkdir", path);
+        for (int f = 0; f < num_files; f++) {
+            snprintf(path, sizeof(path), "%s/d%d/f%d", src, d, f);
+            int fd = open(path, O_CREAT | O_WRONLY, 0644);
+            if (fd < 0 || write(fd, content, file_size) != file_size) die("write", path);
+            close(fd);
+        }
+    }
+
+    char command[16384];
+    struct DeviceCounts before = get_device_counts();
+    uint64_t start = now_ns();
+    snprintf(command, sizeof(command), "cp -r '%s' '%s' && sync", src, dst);
+    if (system(command) != 0) die("cp -r", src);
+    add_sample(samples, now_ns() - start);
+    report("cp_r_tree", file_size, (long long) num_dirs * num_files * file_size, now_ns() - start, samples, &before);
+
+    snprintf(command, sizeof(command), "rm -rf '%s' '%s'", src, dst);
+    if (system(command) != 0) die("rm -rf", src);
+    free(content);
+}
+
+// CPU cost of the block checksums toyfs computes on device reads and write-backs with the checksum feature,
+// 64 blocks of 512 bytes per op, the workload name tells the CRC32C implementation
+void bench_checksum(struct Samples* samples) {
+    int num_blocks = 64;
+    int num_ops = 10000 * scale;
+    char* buffer = (char*) malloc(num_blocks * 512);
+    for (int i = 0; i < num_blocks * 512; i++) buffer[i] = rand();
+    volatile uint32_t sink = crc32c(buffer, 512);
+
+    char workload[64];
+    snprintf(workload, sizeof(workload), "crc32c_block_%s", crc32c_impl_name());
+    struct DeviceCounts before = get_device_counts();
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_ops; i++) {
+        uint64_t op_start = now_ns();
+        for (int j = 0; j < num_blocks; j++) sink ^= crc32c(buffer + j * 512, 512);
+        add_sample(samples, now_ns() - op_start);
+    }
+    report(workload, num_blocks * 512, (long long) num_ops * num_blocks * 512, now_ns() - start, samples, &before);
+    free(buffer);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s [mount point] [scale]\n", argv[0]);
+        return 1;
+    }
+    mount_point = argv[1];
+    if (argc > 2) scale = atoi(argv[2]) > 0 ? atoi(argv[2]) : 1;
+
+    struct Samples samples = { NULL, 0, 0 };
+    int io_sizes[] = { 4096, 65536, 1048576 };
+    for (int i = 0; i < sizeof(io_sizes) / sizeof(io_sizes[0]); i++) bench_sequential(io_sizes[i], &samples);
+    bench_small_files(&samples);
+    bench_large_dir(&samples);
+    bench_copy_tree(&samples);
+    bench_checksum(&samples);
+
+    free(samples.values);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Benchmark toyfs on a sparse image file
+# Usage: ./bench.sh [output json lines file] [scale]
+#     TOYFS_BENCH_IMAGE: image file path, on a file system supporting O_DIRECT (default bench.img)
+#     TOYFS_BENCH_SIZE: image size for mkfs.toyfs (default 1G)
+#     TOYFS_BENCH_MNT: mount point (default bench_mnt)
+#     TOYFS_BENCH_MKFS_OPTS: extra mkfs.toyfs options, e.g. "-O checksum" to measure the cost of a feature
+set -e
+
+OUTPUT=${1:-bench_results.json}
+SCALE=${2:-1}
+IMAGE=${TOYFS_BENCH_IMAGE:-bench.img}
+SIZE=${TOYFS_BENCH_SIZE:-1G}
+MNT=${TOYFS_BENCH_MNT:-bench_mnt}
+MKFS_OPTS=${TOYFS_BENCH_MKFS_OPTS:-}
+
+# fresh sparse image
+rm -f "$IMAGE"
+./mkfs.toyfs $MKFS_OPTS -s "$SIZE" "$IMAGE"
+mkdir -p "$MNT"
+
+./toyfs -f --device="$IMAGE" "$MNT" > bench_toyfs.log 2>&1 &
+TOYFS_PID=$!
+trap 'fusermount -u "$MNT" 2> /dev/null; wait $TOYFS_PID' EXIT
+
+# wait for mount
+for i in $(seq 1 300); do
+    if [ -e "$MNT/.toyfs/stats" ]; then break; fi
+    if ! kill -0 $TOYFS_PID 2> /dev/null; then echo "toyfs exited, see bench_toyfs.log"; exit 1; fi
+    sleep 0.1
+done
+
+./toyfs-bench "$MNT" "$SCALE" | tee "$OUTPUT"
+cp "$MNT/.toyfs/stats.json" "${OUTPUT%.json}_toyfs_stats.json"
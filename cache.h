@@ -10,11 +10,19 @@ LRU + Hash cache
 #include "my_io.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 
+// cache_lock guards the lru queue, the hash table, dirty state and pin counts, and the block data of cached blocks
+// that are not pinned, a thread holding a pin reads and writes the block data under the content lock of the node
+// instead, so copies of block data need not hold cache_lock, content locks are taken after cache_lock and a
+// thread holding a content lock never waits for cache_lock
 pthread_mutex_t cache_lock;
+// serializes device writes of cached blocks, taken after cache_lock, see clean_lru_tail
+pthread_mutex_t write_back_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // linked list node for buffer cache
 struct CacheNode {
@@ -22,15 +30,39 @@ struct CacheNode {
     struct CacheNode* queue_next; // next pointer for lru queue
     struct CacheNode* hash_prev; // next pointer for hash bucket list
     struct CacheNode* hash_next; // next pointer for hash bucket list
+    struct DirtyList* dirty_list; // per-inode dirty list the node is linked in, NULL if untracked
+    struct CacheNode* dirty_prev; // prev pointer for per-inode dirty list
+    struct CacheNode* dirty_next; // next pointer for per-inode dirty list
     bool dirty; // cache is modified or not
-    int block_id; // block id in disk drive
+    int pins; // threads using the block data outside cache_lock, a pinned node is not evicted
+    pthread_rwlock_t content_lock; // block data of a pinned node
+    long long block_id; // block id in disk drive
     char* block_ptr; // pointer to cached block data
+    struct CacheQueue* queue; // cache holding the node
+};
+
+// dirty cache nodes owned by one inode, so that fsync only writes back blocks of that file
+struct DirtyList {
+    int ino_num; // owner inode number, or DIRTY_OWNER_ALLOC for bitmap blocks
+    bool meta_dirty; // inode fields needed to read data back (size, block pointers) changed since last sync
+    struct CacheNode* first;
+    struct DirtyList* next; // next list in hash bucket
+};
+
+#define DIRTY_OWNER_NONE -1 // dirty block not tracked per inode
+#define DIRTY_OWNER_ALLOC -2 // allocation metadata (inode and data block bitmaps)
+
+// hash table of per-inode dirty lists (linked list hash bucket)
+struct DirtyTable {
+    int capacity; // number of hash buckets
+    struct DirtyList** buckets; // buckets
 };
 
 // cache queue (doubly linked list)
 struct CacheQueue {
     unsigned count; // number of filled frames
     unsigned cache_capacity; // maximum number of nodes in cache
+    unsigned num_dirty; // number of dirty nodes in cache
     struct CacheNode* front;
     struct CacheNode* rear;
 };
@@ -43,24 +75,86 @@ struct Hash {
 
 struct CacheQueue* queue;
 struct Hash* hash;
+struct CacheQueue* meta_queue = NULL; // metadata blocks, before the data region, NULL if cached with data blocks
+struct Hash* meta_hash = NULL;
+struct CacheQueue* bitmap_queue = NULL; // inode and data block bitmaps when pinned, holds all of them
+struct Hash* bitmap_hash = NULL;
+struct DirtyTable* dirty_table;
+unsigned num_dirty_blocks = 0; // number of dirty nodes in all caches
+
+// cache cleaner, a background thread writing back the dirty nodes among the least recently used ones, so that
+// cache misses evict clean nodes without device writes
+// it keeps clean_frames_low nodes at the lru end clean: it is woken once as many nodes were evicted since it last
+// ran, or an eviction found a dirty node, and then cleans the 2 * clean_frames_low least recently used nodes
+unsigned clean_frames_low = 1024;
+unsigned evictions_since_clean = 0;
+bool cleaner_running = false;
+bool cleaner_stop = false;
+pthread_cond_t cleaner_cond = PTHREAD_COND_INITIALIZER;
+
+// dirty block thresholds in percent of the data cache capacity, with the cache cleaner running, they bound the dirty
+// nodes of the data cache (queue->num_dirty), dirty metadata blocks are written back as their caches evict them
+// above dirty_background_ratio the cleaner writes back dirty blocks from the lru end, between it and dirty_ratio
+// writers are paused in proportion to the dirty blocks, at dirty_ratio they wait for the cleaner
+unsigned dirty_background_ratio = 10;
+unsigned dirty_ratio = 20;
+pthread_cond_t dirty_cond = PTHREAD_COND_INITIALIZER; // broadcast when dirty blocks become clean below dirty_ratio
+
+// a cache whose nodes are all pinned grows past its capacity up to queue_hard_limit nodes, a miss beyond waits for a pin to be released, and fails after CACHE_PIN_WAIT_MAX_MS
+#define CACHE_PIN_SLACK_DIV 8
+#define CACHE_PIN_WAIT_MAX_MS 1000
+pthread_cond_t pin_cond = PTHREAD_COND_INITIALIZER; // broadcast when a node is unpinned with pin_waiters > 0
+int pin_waiters = 0;
+
+unsigned dirty_background_blocks(struct CacheQueue* queue) {
+    return (unsigned long long) queue->cache_capacity * dirty_background_ratio / 100;
+}
+
+unsigned dirty_limit_blocks(struct CacheQueue* queue) {
+    return (unsigned long long) queue->cache_capacity * dirty_ratio / 100;
+}
+
+// block checksum hooks, set when the device keeps block checksums, called under cache_lock
+// verify_block_hook returns false if a block read from device does not match its checksum, the block is not cached
+// record_block_hook is called with every block written back
+bool (*verify_block_hook)(long long block_id, const char* data) = NULL;
+void (*record_block_hook)(long long block_id, const char* data) = NULL;
 
 // create a new cache node
-struct CacheNode* newCacheNode(unsigned block_id) {
+// a block about to be overwritten whole is not read, it starts zeroed
+// NULL if the block cannot be read or fails its checksum
+struct CacheNode* newCacheNode(long long block_id, bool read) {
     // read block
     struct CacheNode* temp = (struct CacheNode*) malloc(sizeof(struct CacheNode));
     int result = posix_memalign((void**) &(temp->block_ptr), block_size, block_size);
-    if (result != 0) return NULL;
-    int fd = open(device_path, O_RDONLY | O_DIRECT);
-    if (fd < 0) return NULL;
-    io_read(fd, temp->block_ptr, block_id);
-    result = close(fd);
-    if (result < 0) return NULL;
+    if (result != 0) {
+        free(temp);
+        return NULL;
+    }
+    if (read) {
+        int fd = open(device_path, O_RDONLY | O_DIRECT);
+        if (fd >= 0) {
+            io_read(fd, temp->block_ptr, block_id);
+            result = close(fd);
+        }
+        if (fd < 0 || result < 0 || (verify_block_hook != NULL && !verify_block_hook(block_id, temp->block_ptr))) {
+            free(temp->block_ptr);
+            free(temp);
+            return NULL;
+        }
+    }
+    else memset(temp->block_ptr, 0, block_size);
 
     // set values
     temp->dirty = false;
+    temp->pins = 0;
+    pthread_rwlock_init(&temp->content_lock, NULL);
     temp->block_id = block_id;
     temp->queue_prev = temp->queue_next = NULL;
     temp->hash_prev = temp->hash_next = NULL;
+    temp->dirty_list = NULL;
+    temp->dirty_prev = temp->dirty_next = NULL;
+    temp->queue = NULL;
 
     return temp;
 } 
@@ -70,6 +164,7 @@ struct CacheQueue* create_cache_queue(int cache_capacity) {
     struct CacheQueue* queue = (struct CacheQueue*) malloc(sizeof(struct CacheQueue));
 
     queue->count = 0;
+    queue->num_dirty = 0;
     queue->front = queue->rear = NULL;
 
     queue->cache_capacity = cache_capacity;
@@ -88,9 +183,164 @@ struct Hash* create_hash_table(int hash_capacity) {
     return hash;
 } 
   
+// create empty per-inode dirty table
+struct DirtyTable* create_dirty_table(int capacity) {
+    struct DirtyTable* table = (struct DirtyTable*) malloc(sizeof(struct DirtyTable));
+    table->capacity = capacity;
+
+    table->buckets = (struct DirtyList**) malloc(table->capacity * sizeof(struct DirtyList*));
+    for (int i = 0; i < table->capacity; i++) table->buckets[i] = NULL;
+
+    return table;
+}
+
+// find the dirty list of an inode, create an empty one if asked to
+struct DirtyList* get_dirty_list(struct DirtyTable* table, int ino_num, bool create) {
+    int hash_key = (unsigned) ino_num % table->capacity;
+    struct DirtyList* list = table->buckets[hash_key];
+    while (list != NULL && list->ino_num != ino_num) list = list->next;
+    if (list != NULL || !create) return list;
+
+    list = (struct DirtyList*) malloc(sizeof(struct DirtyList));
+    list->ino_num = ino_num;
+    list->meta_dirty = false;
+    list->first = NULL;
+    list->next = table->buckets[hash_key];
+    table->buckets[hash_key] = list;
+
+    return list;
+}
+
+// unlink a cache node from the dirty list it is tracked in
+void unlink_dirty_node(struct CacheNode* node) {
+    if (node->dirty_list == NULL) return;
+    if (node->dirty_prev == NULL) node->dirty_list->first = node->dirty_next;
+    else node->dirty_prev->dirty_next = node->dirty_next;
+    if (node->dirty_next != NULL) node->dirty_next->dirty_prev = node->dirty_prev;
+    node->dirty_list = NULL;
+    node->dirty_prev = node->dirty_next = NULL;
+}
+
+// mark a dirty cache node clean, under cache_lock
+// writers waiting at the hard limit are woken by whichever write-back brings the dirty blocks below it, not only the
+// cache cleaner, see balance_dirty_blocks
+void clear_block_dirty(struct CacheNode* node) {
+    node->dirty = false;
+    num_dirty_blocks--;
+    node->queue->num_dirty--;
+    unlink_dirty_node(node);
+    if (node->queue == queue && queue->num_dirty < dirty_limit_blocks(queue)) pthread_cond_broadcast(&dirty_cond);
+}
+
+// mark a cache node dirty and track it in the dirty list of its owner
+// a block reassigned to another inode moves to the list of its latest owner
+void mark_block_dirty(struct DirtyTable* table, struct CacheNode* node, int ino_num) {
+    if (!node->dirty) {
+        num_dirty_blocks++;
+        node->queue->num_dirty++;
+    }
+    node->dirty = true;
+    if (ino_num == DIRTY_OWNER_NONE) return;
+    if (node->dirty_list != NULL && node->dirty_list->ino_num == ino_num) return;
+    unlink_dirty_node(node);
+
+    struct DirtyList* list = get_dirty_list(table, ino_num, true);
+    node->dirty_list = list;
+    node->dirty_prev = NULL;
+    node->dirty_next = list->first;
+    if (list->first != NULL) list->first->dirty_prev = node;
+    list->first = node;
+}
+
+// drop the dirty list of an inode, its nodes become untracked
+void remove_dirty_list(struct DirtyTable* table, int ino_num) {
+    int hash_key = (unsigned) ino_num % table->capacity;
+    struct DirtyList** link = &table->buckets[hash_key];
+    while (*link != NULL && (*link)->ino_num != ino_num) link = &(*link)->next;
+    if (*link == NULL) return;
+
+    struct DirtyList* list = *link;
+    while (list->first != NULL) unlink_dirty_node(list->first);
+    *link = list->next;
+    free(list);
+}
+
+// drop all dirty lists, used after every dirty block has been written back
+void clear_dirty_table(struct DirtyTable* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        while (table->buckets[i] != NULL) remove_dirty_list(table, table->buckets[i]->ino_num);
+    }
+}
+
+// write a dirty cache node back to device opened as fd, it stays dirty if the device fails
+// return 0 on success and negative integer if not success
+int write_back_block(int fd, struct CacheNode* node) {
+    pthread_rwlock_rdlock(&node->content_lock);
+    if (record_block_hook != NULL) record_block_hook(node->block_id, node->block_ptr);
+    int result = io_write(fd, node->block_ptr, node->block_id);
+    pthread_rwlock_unlock(&node->content_lock);
+    if (result < 0) return result;
+    clear_block_dirty(node);
+    stats_add(STAT_CACHE_WRITE_BACK, 1);
+    return 0;
+}
+
+#define WRITE_BACK_RUN_BLKS 256 // blocks per write request of write_back_blocks, at most IOV_MAX
+
+int compare_block_id(const void* a, const void* b) {
+    long long x = (*(struct CacheNode* const*) a)->block_id, y = (*(struct CacheNode* const*) b)->block_id;
+    return x < y ? -1 : x > y;
+}
+
+// write back dirty cache nodes in block order, consecutive blocks with one request, nodes is sorted in place
+// the nodes of a failed request stay dirty, the remaining runs are still written
+// return 0 on success and the error of the first failed request otherwise
+int write_back_blocks(int fd, struct CacheNode** nodes, int count) {
+    qsort(nodes, count, sizeof(struct CacheNode*), compare_block_id);
+    struct iovec iov[WRITE_BACK_RUN_BLKS];
+    int error = 0;
+    int i = 0;
+    while (i < count) {
+        int run = 1;
+        while (i + run < count && run < WRITE_BACK_RUN_BLKS && nodes[i + run]->block_id == nodes[i]->block_id + run) run++;
+        for (int j = 0; j < run; j++) {
+            struct CacheNode* node = nodes[i + j];
+            pthread_rwlock_rdlock(&node->content_lock);
+            if (record_block_hook != NULL) record_block_hook(node->block_id, node->block_ptr);
+            iov[j].iov_base = node->block_ptr;
+            iov[j].iov_len = block_size;
+        }
+        int result = io_write_run(fd, iov, nodes[i]->block_id, run);
+        for (int j = 0; j < run; j++) {
+            pthread_rwlock_unlock(&nodes[i + j]->content_lock);
+            if (result == 0) clear_block_dirty(nodes[i + j]);
+        }
+        if (result == 0) stats_add(STAT_CACHE_WRITE_BACK, run);
+        else if (error == 0) error = result;
+        i += run;
+    }
+    return error;
+}
+
+// find a cached block without bringing it to cache or touching lru order
+struct CacheNode* find_block_cache(struct Hash* hash, long long block_id) {
+    int hash_key = (unsigned long long) block_id % hash->hash_capacity;
+    struct CacheNode* target = hash->buckets[hash_key];
+    while (target != NULL && target->block_id != block_id) target = target->hash_next;
+    return target;
+}
+
+// drop dirty state of a cached block whose content is no longer needed, e.g. a freed data block
+void discard_block_cache(struct Hash* hash, long long block_id) {
+    struct CacheNode* node = find_block_cache(hash, block_id);
+    if (node == NULL || !node->dirty) return;
+    clear_block_dirty(node);
+}
+
 // check if there is slot available in memory 
+// the queue holds more nodes than its capacity while every node that would be evicted is pinned
 bool is_queue_full(struct CacheQueue* queue) { 
-    return queue->count == queue->cache_capacity; 
+    return queue->count >= queue->cache_capacity; 
 }
   
 // check if queue is empty
@@ -98,32 +348,52 @@ bool is_queue_empty(struct CacheQueue* queue) {
     return queue->count == 0;
 }
   
-// delete a cache node from cache
+// delete the least recently used clean cache node that is not pinned from cache
+// dirty nodes are left to the cache cleaner, the least recently used dirty one is written back only without clean nodes
 // return 0 on success and negative integer if not success
 int dequeue(struct CacheQueue* queue, struct Hash* hash) {
-    if (is_queue_empty(queue)) return 0;
-
     struct CacheNode* temp = queue->rear;
+    bool skipped_dirty = false;
+    while (temp != NULL && (temp->dirty || __atomic_load_n(&temp->pins, __ATOMIC_ACQUIRE) > 0)) {
+        skipped_dirty |= temp->dirty;
+        temp = temp->queue_prev;
+    }
+    if (temp == NULL) {
+        temp = queue->rear;
+        while (temp != NULL && __atomic_load_n(&temp->pins, __ATOMIC_ACQUIRE) > 0) temp = temp->queue_prev;
+    }
+    if (temp == NULL) return -EAGAIN; // resource temporarily unavailable [4], every node is pinned
+
+    if (skipped_dirty || temp->dirty) evictions_since_clean = clean_frames_low;
+    else evictions_since_clean++;
+    if (cleaner_running && evictions_since_clean >= clean_frames_low) pthread_cond_signal(&cleaner_cond);
+
+    // write back if dirty, a block the device failed to take stays cached
+    stats_add(STAT_CACHE_EVICT, 1);
+    if (temp->dirty) {
+        stats_add(STAT_CACHE_EVICT_DIRTY, 1);
+        int fd = open(device_path, O_WRONLY | O_DIRECT);
+        if (fd < 0) return fd;
+        pthread_mutex_lock(&write_back_lock);
+        int result = write_back_block(fd, temp);
+        pthread_mutex_unlock(&write_back_lock);
+        close(fd);
+        if (result < 0) return result;
+    }
 
     // handle cache queue
-    if (queue->front == queue->rear) queue->front = NULL;
-    queue->rear = queue->rear->queue_prev;
-    if (queue->rear != NULL) queue->rear->queue_next = NULL;
+    if (temp->queue_prev == NULL) queue->front = temp->queue_next;
+    else temp->queue_prev->queue_next = temp->queue_next;
+    if (temp->queue_next == NULL) queue->rear = temp->queue_prev;
+    else temp->queue_next->queue_prev = temp->queue_prev;
 
     // handle hash table
-    int hash_key = temp->block_id % hash->hash_capacity;
+    int hash_key = (unsigned long long) temp->block_id % hash->hash_capacity;
     if (temp->hash_prev == NULL) hash->buckets[hash_key] = temp->hash_next;
     if (temp->hash_prev != NULL) temp->hash_prev->hash_next = temp->hash_next;
     if (temp->hash_next != NULL) temp->hash_next->hash_prev = temp->hash_prev;
 
-    // write back if dirty
-    if (temp->dirty) {
-        int fd = open(device_path, O_WRONLY | O_DIRECT);
-        if (fd < 0) return fd;
-        io_write(fd, temp->block_ptr, temp->block_id);
-        int result = close(fd);
-        if (result < 0) return result;
-    }
+    pthread_rwlock_destroy(&temp->content_lock);
     free(temp->block_ptr);
     free(temp);
 
@@ -132,14 +402,44 @@ int dequeue(struct CacheQueue* queue, struct Hash* hash) {
     return 0;
 } 
   
+// nodes a cache holds at most, a small cache may still grow by one node
+unsigned queue_hard_limit(struct CacheQueue* queue) {
+    return queue->cache_capacity + queue->cache_capacity / CACHE_PIN_SLACK_DIV + 1;
+}
+
+// wait up to 1 ms under cache_lock for a node to be unpinned, unpinning takes no cache_lock, so a wakeup can be missed
+void wait_for_unpin() {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    __atomic_add_fetch(&pin_waiters, 1, __ATOMIC_RELAXED);
+    pthread_cond_timedwait(&pin_cond, &cache_lock, &deadline);
+    __atomic_sub_fetch(&pin_waiters, 1, __ATOMIC_RELAXED);
+}
+
 // add a cache node to cache
 // return 0 on success and negative integer if not success
-int enqueue(struct CacheQueue* queue, struct Hash* hash, unsigned block_id) {
-    // evict lru node if cache is full
-    if (is_queue_full(queue)) dequeue(queue, hash);
+int enqueue(struct CacheQueue* queue, struct Hash* hash, long long block_id, bool read) {
+    // evict lru node if cache is full, a cache with every node pinned grows up to its slack and then waits for a pin
+    if (is_queue_full(queue)) {
+        int result = 0;
+        int waited_ms = 0;
+        while ((result = dequeue(queue, hash)) < 0 && queue->count >= queue_hard_limit(queue)) {
+            if (result != -EAGAIN || waited_ms++ == CACHE_PIN_WAIT_MAX_MS) return result;
+            wait_for_unpin();
+            // another thread may have cached the block meanwhile
+            if (find_block_cache(hash, block_id) != NULL) return -EEXIST; // file exists [4]
+        }
+    }
 
     // create new node
-    struct CacheNode* temp = newCacheNode(block_id);
+    struct CacheNode* temp = newCacheNode(block_id, read);
+    if (temp == NULL) return -1;
+    temp->queue = queue;
 
     // handle cache queue
     temp->queue_next = queue->front;
@@ -153,7 +453,7 @@ int enqueue(struct CacheQueue* queue, struct Hash* hash, unsigned block_id) {
     }
 
     // handle hash table
-    int hash_key = temp->block_id % hash->hash_capacity;
+    int hash_key = (unsigned long long) temp->block_id % hash->hash_capacity;
     temp->hash_next = hash->buckets[hash_key];
     if (hash->buckets[hash_key] != NULL) hash->buckets[hash_key]->hash_prev = temp;
     hash->buckets[hash_key] = temp;
@@ -163,10 +463,10 @@ int enqueue(struct CacheQueue* queue, struct Hash* hash, unsigned block_id) {
 } 
 
 // get pointer to the block data cached
-// bring the block to cache if not in cache
-struct CacheNode* get_block_cache(struct CacheQueue* queue, struct Hash* hash, unsigned block_id) {
-    // printf("[CACHE DBUG INFO] get_block_cache: block_id = %d\n", block_id);
-    int hash_key = block_id % hash->hash_capacity;
+// bring the block to cache if not in cache, read from device unless read is false
+struct CacheNode* fetch_block_cache(struct CacheQueue* queue, struct Hash* hash, long long block_id, bool read) {
+    // printf("[CACHE DBUG INFO] get_block_cache: block_id = %lld\n", block_id);
+    int hash_key = (unsigned long long) block_id % hash->hash_capacity;
     struct CacheNode* target = hash->buckets[hash_key];
     while (target != NULL) {
         if (target->block_id == block_id) break;
@@ -174,12 +474,16 @@ struct CacheNode* get_block_cache(struct CacheQueue* queue, struct Hash* hash, u
     }
     // bring the block to cache
     if (target == NULL || target->block_id != block_id) {
-        // printf("[CACHE DBUG INFO] get_block_cache: bring block %d to cache\n", block_id);
-        enqueue(queue, hash, block_id);
+        // printf("[CACHE DBUG INFO] get_block_cache: bring block %lld to cache\n", block_id);
+        stats_add(STAT_CACHE_MISS, 1);
+        int result = enqueue(queue, hash, block_id, read);
+        if (result == -EEXIST) return fetch_block_cache(queue, hash, block_id, read);
+        if (result < 0) return NULL;
         return queue->front;
     }
+    stats_add(STAT_CACHE_HIT, 1);
     // move target to front
-    else if (target->block_id == block_id && target != queue->front) {
+    if (target->block_id == block_id && target != queue->front) {
         // change prev and next
         target->queue_prev->queue_next = target->queue_next;
         if (target->queue_next != NULL) target->queue_next->queue_prev = target->queue_prev;
@@ -202,9 +506,77 @@ struct CacheNode* get_block_cache(struct CacheQueue* queue, struct Hash* hash, u
         return queue->front;
     }
     else {
-        // printf("[CACHE ERROR] get_block_cache: block_id = %d\n", block_id);
+        // printf("[CACHE ERROR] get_block_cache: block_id = %lld\n", block_id);
         return NULL;
     };
 } 
 
+#define PREFETCH_MAX_RUN 64 // blocks read by one device request when prefetching
+
+// bring blocks to cache ahead of use, block_ids sorted ascending without duplicates
+// consecutive missing blocks are read with one device request
+// return number of blocks brought to cache and negative integer if not success
+int prefetch_block_cache(struct CacheQueue* queue, struct Hash* hash, const long long* block_ids, int count) {
+    char* run = NULL;
+    int fd = -1;
+    int num_fetched = 0;
+    int i = 0;
+    while (i < count) {
+        if (find_block_cache(hash, block_ids[i]) != NULL) {
+            i++;
+            continue;
+        }
+        int run_len = 1;
+        while (i + run_len < count && run_len < PREFETCH_MAX_RUN && block_ids[i + run_len] == block_ids[i] + run_len
+               && find_block_cache(hash, block_ids[i + run_len]) == NULL) run_len++;
+
+        if (run == NULL) {
+            if (posix_memalign((void**) &run, block_size, block_size * PREFETCH_MAX_RUN) != 0) return -1;
+            fd = open(device_path, O_RDONLY | O_DIRECT);
+            if (fd < 0) {
+                free(run);
+                return fd;
+            }
+        }
+        io_read_run(fd, run, block_ids[i], run_len);
+        int num_inserted = 0;
+        for (int j = 0; j < run_len; j++) {
+            // a block failing its checksum is left out, its later read fails
+            if (verify_block_hook != NULL && !verify_block_hook(block_ids[i + j], run + j * block_size)) continue;
+            struct CacheNode* node = fetch_block_cache(queue, hash, block_ids[i + j], false);
+            if (node == NULL) break;
+            memcpy(node->block_ptr, run + j * block_size, block_size);
+            num_inserted++;
+        }
+        stats_add(STAT_CACHE_PREFETCH, num_inserted);
+        num_fetched += num_inserted;
+        i += run_len;
+    }
+
+    if (run != NULL) {
+        free(run);
+        if (close(fd) < 0) return -1;
+    }
+    return num_fetched;
+}
+
+// get pointer to the block data cached, read from device if not in cache
+// the node is only valid until cache_lock is released, see pin_block_cache
+struct CacheNode* get_block_cache(struct CacheQueue* queue, struct Hash* hash, long long block_id) {
+    return fetch_block_cache(queue, hash, block_id, true);
+}
+
+// pin the cached block so it stays in cache after cache_lock is released, as fetch_block_cache
+// the block data is then accessed under the content lock of the node until unpin_block_cache
+struct CacheNode* pin_block_cache(struct CacheQueue* queue, struct Hash* hash, long long block_id, bool read) {
+    struct CacheNode* node = fetch_block_cache(queue, hash, block_id, read);
+    if (node != NULL) __atomic_add_fetch(&node->pins, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+// release a pin, needs no cache_lock, a node is only pinned under cache_lock and evicted when not pinned
+void unpin_block_cache(struct CacheNode* node) {
+    if (__atomic_sub_fetch(&node->pins, 1, __ATOMIC_RELEASE) == 0 && __atomic_load_n(&pin_waiters, __ATOMIC_RELAXED) > 0) pthread_cond_broadcast(&pin_cond);
+}
+
 #endif
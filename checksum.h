@@ -0,0 +1,131 @@
+/*
+CRC32C (Castagnoli) checksums of blocks
+
+On x86-64 processors with SSE4.2 and PCLMULQDQ the crc32 instruction consumes 8 bytes at a time in three
+independent streams, hiding its 3 cycle latency, and the stream checksums are combined with carry-less
+multiplications. Other processors use a portable slicing-by-8 table implementation.
+The implementation is chosen once at first use.
+
+Reference:
+    [1] CRC32C: https://datatracker.ietf.org/doc/html/rfc3720#appendix-B.4
+    [2] Fast CRC computation for iSCSI polynomial using CRC32 instruction: Intel white paper 323405
+*/
+#ifndef __CHECKSUM_H_
+#define __CHECKSUM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // reversed Castagnoli polynomial
+#define CRC32C_STREAM_SIZE 168 // bytes per stream of the three-way loop, 3 streams cover 504 bytes of a 512 byte block
+
+uint32_t crc32c_tables[8][256];
+
+void crc32c_init_tables() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        crc32c_tables[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) crc32c_tables[t][i] = (crc32c_tables[t - 1][i] >> 8) ^ crc32c_tables[0][crc32c_tables[t - 1][i] & 0xff];
+    }
+}
+
+// portable slicing-by-8, crc is the running value without the final inversion
+uint32_t crc32c_table(uint32_t crc, const char* data, int size) {
+    const unsigned char* p = (const unsigned char*) data;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc; // little endian
+        crc = crc32c_tables[7][word & 0xff] ^ crc32c_tables[6][(word >> 8) & 0xff] ^ crc32c_tables[5][(word >> 16) & 0xff]
+            ^ crc32c_tables[4][(word >> 24) & 0xff] ^ crc32c_tables[3][(word >> 32) & 0xff] ^ crc32c_tables[2][(word >> 40) & 0xff]
+            ^ crc32c_tables[1][(word >> 48) & 0xff] ^ crc32c_tables[0][word >> 56];
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0) crc = (crc >> 8) ^ crc32c_tables[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+// x^k modulo the polynomial, bit reflected
+uint32_t crc32c_x_pow(int k) {
+    uint32_t value = 0x80000000; // x^0
+    while (k-- > 0) value = (value >> 1) ^ (CRC32C_POLY & -(value & 1));
+    return value;
+}
+
+#if defined(__x86_64__)
+// multipliers moving a stream checksum past the CRC32C_STREAM_SIZE and 2 * CRC32C_STREAM_SIZE bytes that follow it
+uint32_t crc32c_shift1, crc32c_shift2;
+
+// checksum crc followed by n zero bytes with multiplier x^(8n - 33), the crc32 instruction reduces the 64 bit product [2]
+__attribute__((target("sse4.2,pclmul")))
+uint32_t crc32c_shift(uint32_t crc, uint32_t multiplier) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(multiplier), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+uint32_t crc32c_sse42(uint32_t crc, const char* data, int size) {
+    uint64_t crc64 = crc;
+    while (size >= 3 * CRC32C_STREAM_SIZE) {
+        uint64_t crc_a = crc64, crc_b = 0, crc_c = 0;
+        for (int pos = 0; pos < CRC32C_STREAM_SIZE; pos += 8) {
+            uint64_t words[3];
+            memcpy(&words[0], data + pos, sizeof(uint64_t));
+            memcpy(&words[1], data + CRC32C_STREAM_SIZE + pos, sizeof(uint64_t));
+            memcpy(&words[2], data + 2 * CRC32C_STREAM_SIZE + pos, sizeof(uint64_t));
+            crc_a = _mm_crc32_u64(crc_a, words[0]);
+            crc_b = _mm_crc32_u64(crc_b, words[1]);
+            crc_c = _mm_crc32_u64(crc_c, words[2]);
+        }
+        crc64 = crc32c_shift(crc_a, crc32c_shift2) ^ crc32c_shift(crc_b, crc32c_shift1) ^ crc_c;
+        data += 3 * CRC32C_STREAM_SIZE;
+        size -= 3 * CRC32C_STREAM_SIZE;
+    }
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = crc64;
+    while (size-- > 0) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+// 1 with the crc32 and pclmulqdq instructions, 0 with tables, -1 before first use
+int crc32c_use_sse42 = -1;
+
+const char* crc32c_impl_name() {
+    return crc32c_use_sse42 == 1 ? "sse4.2" : "table";
+}
+
+uint32_t crc32c(const char* data, int size) {
+    if (crc32c_use_sse42 < 0) {
+        int use_sse42 = 0;
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        use_sse42 = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul") ? 1 : 0;
+        crc32c_shift1 = crc32c_x_pow(8 * CRC32C_STREAM_SIZE - 33);
+        crc32c_shift2 = crc32c_x_pow(8 * 2 * CRC32C_STREAM_SIZE - 33);
+#endif
+        if (!use_sse42) crc32c_init_tables();
+        crc32c_use_sse42 = use_sse42;
+    }
+#if defined(__x86_64__)
+    if (crc32c_use_sse42) return ~crc32c_sse42(0xFFFFFFFF, data, size);
+#endif
+    return ~crc32c_table(0xFFFFFFFF, data, size);
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*
+64 bit fingerprints of data blocks for deduplication, the xxHash64 algorithm with seed 0
+
+Four independent lanes consume 32 bytes per round, their multiply-rotate chains have no dependencies
+between each other, so they run in parallel and compilers keep them in vector registers.
+A fingerprint match is only a hint, contents are compared before blocks are shared.
+*/
+#ifndef __FINGERPRINT_H_
+#define __FINGERPRINT_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define FP_PRIME1 0x9E3779B185EBCA87ULL
+#define FP_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define FP_PRIME3 0x165667B19E3779F9ULL
+#define FP_PRIME4 0x85EBCA77C2B2AE63ULL
+#define FP_PRIME5 0x27D4EB2F165667C5ULL
+#define FP_STRIPE_SIZE 32 // bytes consumed per round, 8 per lane
+
+uint64_t fp_rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t fp_round(uint64_t acc, uint64_t input) {
+    acc += input * FP_PRIME2;
+    acc = fp_rotl(acc, 31);
+    return acc * FP_PRIME1;
+}
+
+uint64_t fp_merge_round(uint64_t acc, uint64_t lane) {
+    acc ^= fp_round(0, lane);
+    return acc * FP_PRIME1 + FP_PRIME4;
+}
+
+// fingerprint of size bytes, size is a multiple of FP_STRIPE_SIZE (e.g. a block)
+uint64_t fingerprint(const char* data, int size) {
+    uint64_t lanes[4] = { FP_PRIME1 + FP_PRIME2, FP_PRIME2, 0, -FP_PRIME1 };
+    for (int pos = 0; pos < size; pos += FP_STRIPE_SIZE) {
+        uint64_t words[4];
+        memcpy(words, data + pos, sizeof(words));
+        for (int i = 0; i < 4; i++) lanes[i] = fp_round(lanes[i], words[i]);
+    }
+
+    uint64_t hash = fp_rotl(lanes[0], 1) + fp_rotl(lanes[1], 7) + fp_rotl(lanes[2], 12) + fp_rotl(lanes[3], 18);
+    for (int i = 0; i < 4; i++) hash = fp_merge_round(hash, lanes[i]);
+    hash += size;
+
+    // avalanche, every input bit affects every output bit
+    hash ^= hash >> 33;
+    hash *= FP_PRIME2;
+    hash ^= hash >> 29;
+    hash *= FP_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+#endif
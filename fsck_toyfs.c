@@ -0,0 +1,1125 @@
+/*
+fsck.toyfs: offline consistency check of toyfs, the device must not be mounted
+
+Usage: fsck.toyfs [options] device
+    -y           repair problems found
+    -T threads   threads walking inodes and directories
+    -v           print every problem, not only the first FSCK_MAX_REPORTS
+
+Bitmaps and inode table are read into memory with large sequential reads,
+inodes and directories are then checked in parallel, block ownership is
+cross-checked against an in-memory bitmap.
+
+Passes:
+    1. inodes: type, size against number of blocks, block pointers inside data region, blocks claimed twice
+       (written data blocks may be shared by clones on devices with the reflink feature, pointer blocks never)
+       (pointers to compressed clusters only in regular files flagged compressed)
+    2. directories: entries point to allocated inodes, a directory has one parent
+    3. connectivity and link counts: orphans are reconnected to the root directory as "#<inode number>"
+    4. bitmaps: inode and data block bitmaps agree with what inodes use, block reference counts with the
+       number of inodes sharing each block, the dedup map only marks written data blocks of regular files
+    5. checksums: metadata as read and data blocks in use match their recorded checksums, on devices with the
+       checksum feature (repair drops the checksum, the block content cannot be restored)
+Blocks written by repair get new checksums.
+
+Exit code: 0 no problem, 1 problems repaired, 4 problems left, 8 operational error
+*/
+#include "layout.h"
+#include "mkfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#define FSCK_MAX_REPORTS 100 // problems printed without -v
+#define FSCK_CHUNK_INODES 1024 // inodes taken by a thread at a time
+#define FSCK_READ_SIZE (4 << 20) // bytes per metadata read request
+
+#define FSCK_EXIT_OK 0
+#define FSCK_EXIT_REPAIRED 1
+#define FSCK_EXIT_UNREPAIRED 4
+#define FSCK_EXIT_ERROR 8
+
+// inode states after pass 1
+#define INODE_STATE_FREE 0
+#define INODE_STATE_OK 1
+#define INODE_STATE_BAD 2 // unusable, released on repair
+
+#define NO_PARENT -1
+
+int dev_fd = -1;
+bool repair = false;
+bool verbose = false;
+int num_threads = 1;
+long long num_usable_blks;
+
+char* meta; // inode bitmap, data block bitmap and inode table, read in one piece
+char* imap;
+char* dmap;
+char* inode_table;
+char* meta_dirty; // per metadata block, written back on repair
+unsigned char* refcount; // reference count table, with the reflink feature
+char* refcount_dirty; // per reference count block, written back on repair
+unsigned char* dedup_map; // data blocks shareable by content, with the dedup feature
+char* dedup_map_dirty; // per dedup map block, written back on repair
+unsigned int* csums; // checksum table, with the checksum feature
+char* csums_dirty; // per checksum table block, written back on repair
+
+uint64_t* owned_bits; // data blocks used by inodes
+uint64_t* dup_bits; // data blocks used more than once
+uint16_t* claims; // inodes sharing each written data block, with the reflink feature
+char* inode_state;
+bool* size_mismatch; // size does not match number of blocks
+bool* unwritten_meta; // directory or symlink has unwritten blocks
+bool* bad_entries; // directory has entries to drop
+int* refs; // directory entries pointing to a file
+int* subdirs; // subdirectories of a directory
+int* parents; // parent of a directory
+
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+long long num_problems = 0;
+long long num_unrepaired = 0; // problems -y cannot repair
+long long num_fixed = 0;
+long long num_files = 0;
+long long num_dirs = 0;
+long long num_symlinks = 0;
+long long num_used_blks = 0;
+
+void report(bool repairable, const char* fmt, va_list args) {
+    pthread_mutex_lock(&report_lock);
+    num_problems++;
+    if (!repairable) num_unrepaired++;
+    if (verbose || num_problems <= FSCK_MAX_REPORTS) {
+        printf("[FSCK]     ");
+        vprintf(fmt, args);
+        printf(repairable ? "\n" : " (not repairable)\n");
+    }
+    else if (num_problems == FSCK_MAX_REPORTS + 1) printf("[FSCK]     more problems not shown, use -v to show all\n");
+    pthread_mutex_unlock(&report_lock);
+}
+
+// problem repaired by -y
+void problem(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    report(true, fmt, args);
+    va_end(args);
+}
+
+// problem left as it is even with -y
+void unrepairable(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    report(false, fmt, args);
+    va_end(args);
+}
+
+void fixed(long long count) {
+    pthread_mutex_lock(&report_lock);
+    num_fixed += count;
+    pthread_mutex_unlock(&report_lock);
+}
+
+// record checksums of blocks about to be written
+void record_checksums(const char* buffer, long long size, off_t offset) {
+    for (long long pos = 0; csums != NULL && pos < size; pos += SIZE_BLOCK) {
+        long long block_id = (offset + pos) / SIZE_BLOCK;
+        if (!has_checksum(block_id)) continue;
+        csums[block_id] = block_checksum(buffer + pos);
+        csums_dirty[block_id / CSUM_PER_BLK] = 1;
+    }
+}
+
+// read or write a byte range of the device with requests of at most FSCK_READ_SIZE
+int device_io(bool write, char* buffer, long long size, off_t offset) {
+    if (write) record_checksums(buffer, size, offset);
+    while (size > 0) {
+        size_t chunk = size < FSCK_READ_SIZE ? size : FSCK_READ_SIZE;
+        ssize_t done = write ? pwrite(dev_fd, buffer, chunk, offset) : pread(dev_fd, buffer, chunk, offset);
+        if (done <= 0) return done < 0 ? -errno : -EIO;
+        buffer += done;
+        offset += done;
+        size -= done;
+    }
+    return 0;
+}
+
+bool test_map_bit(const char* map, long long bit) {
+    return (map[bit / 8] & (1 << (bit % 8))) != 0;
+}
+
+// set bit of inode or data block bitmap and mark its metadata block dirty
+void set_map_bit(char* map, long long bit, int value) {
+    if (value) map[bit / 8] |= 1 << (bit % 8);
+    else map[bit / 8] &= ~(1 << (bit % 8));
+    meta_dirty[(map - meta + bit / 8) / SIZE_BLOCK] = 1;
+}
+
+// atomically set bit, return its previous value
+bool claim_bit(uint64_t* bits, long long bit) {
+    uint64_t mask = 1ull << (bit % 64);
+    return (__atomic_fetch_or(&bits[bit / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+bool test_bit(const uint64_t* bits, long long bit) {
+    return (bits[bit / 64] & (1ull << (bit % 64))) != 0;
+}
+
+int* inode_at(int ino_num) {
+    return (int*) (inode_table + (long long) ino_num * SIZE_INODE);
+}
+
+void mark_inode_dirty(int ino_num) {
+    meta_dirty[(inode_table - meta + (long long) ino_num * SIZE_INODE) / SIZE_BLOCK] = 1;
+}
+
+// block pointer ptr_idx of an inode, direct pointers first and then the roots of the pointer tiers
+long long inode_ptr(int ino_num, int ptr_idx) {
+    return decode_blk_ptr((char*) inode_at(ino_num) + INODE_BLK_PTR_POS + ptr_idx * SIZE_DATA_BLK_PTR);
+}
+
+void set_inode_ptr(int ino_num, int ptr_idx, long long ptr) {
+    encode_blk_ptr((char*) inode_at(ino_num) + INODE_BLK_PTR_POS + ptr_idx * SIZE_DATA_BLK_PTR, ptr);
+}
+
+// used size of an inode, with the 64bit feature its high 32 bits follow the inode fields
+long long inode_size(int ino_num) {
+    int* inode = inode_at(ino_num);
+    long long size_hi = (superblock.features & FEATURE_64BIT) ? (unsigned int) inode[INODE_SIZE_HI_OFF] : 0;
+    return size_hi << 32 | (unsigned int) inode[INODE_USED_SIZE_OFF];
+}
+
+void set_inode_size(int ino_num, long long size) {
+    int* inode = inode_at(ino_num);
+    inode[INODE_USED_SIZE_OFF] = (unsigned int) size;
+    if (superblock.features & FEATURE_64BIT) inode[INODE_SIZE_HI_OFF] = (unsigned int) (size >> 32);
+}
+
+bool valid_data_blk(long long data_reg_idx) {
+    return data_reg_idx >= 0 && data_reg_idx < num_usable_blks;
+}
+
+int read_data_blk(long long data_reg_idx, void* buffer) {
+    return device_io(false, (char*) buffer, SIZE_BLOCK, (off_t) (DATA_REG_START_BLK + data_reg_idx) * SIZE_BLOCK);
+}
+
+int write_data_blk(long long data_reg_idx, const void* buffer) {
+    return device_io(true, (char*) buffer, SIZE_BLOCK, (off_t) (DATA_REG_START_BLK + data_reg_idx) * SIZE_BLOCK);
+}
+
+// read or write the NUM_PTR_PER_BLK pointers of a pointer block
+int read_ptr_blk(long long data_reg_idx, long long* ptrs) {
+    char block[SIZE_BLOCK];
+    int result = read_data_blk(data_reg_idx, block);
+    for (int i = 0; result == 0 && i < NUM_PTR_PER_BLK; i++) ptrs[i] = decode_blk_ptr(block + i * SIZE_DATA_BLK_PTR);
+    return result;
+}
+
+int write_ptr_blk(long long data_reg_idx, const long long* ptrs) {
+    char block[SIZE_BLOCK];
+    for (int i = 0; i < NUM_PTR_PER_BLK; i++) encode_blk_ptr(block + i * SIZE_DATA_BLK_PTR, ptrs[i]);
+    return write_data_blk(data_reg_idx, block);
+}
+
+// data blocks and pointer blocks of an inode
+struct BlockList {
+    int num_data;
+    long long* data; // data block of each file block, BLK_PTR_HOLE for holes, -1 if its pointer block is unreadable
+    bool* unwritten; // data block is reserved but never written, it reads as zeros
+    int num_holes; // with tails of compressed clusters
+    int num_unwritten;
+    int num_compressed; // data blocks of compressed clusters
+    int num_ptrs;
+    long long* ptrs; // pointer blocks
+    int* ptr_first_idx; // first file block served by each pointer block
+    bool bad; // a pointer is outside the data region
+};
+
+// record pointer block and read its pointers, return false if it cannot be read
+bool add_ptr_block(struct BlockList* list, long long data_reg_idx, int first_idx, long long* ptrs) {
+    list->ptrs[list->num_ptrs] = data_reg_idx;
+    list->ptr_first_idx[list->num_ptrs] = first_idx;
+    list->num_ptrs++;
+    if (!valid_data_blk(data_reg_idx)) {
+        list->bad = true;
+        return false;
+    }
+    if (read_ptr_blk(data_reg_idx, ptrs) < 0) {
+        list->bad = true;
+        return false;
+    }
+    return true;
+}
+
+// pointers under pointer block ptr_blk of a tier, level is 1 for a pointer block of data block pointers,
+// first_idx is the file block its first entry leads to, a hole pointer block makes all its file blocks holes
+void collect_ptr_blocks(struct BlockList* list, long long ptr_blk, int level, int first_idx) {
+    long long entry_span = ptr_tier_span(level - 1);
+    long long ptrs[NUM_PTR_PER_BLK_MAX];
+    if (ptr_blk == BLK_PTR_HOLE) {
+        for (long long i = first_idx; i < list->num_data && i < first_idx + entry_span * NUM_PTR_PER_BLK; i++) list->data[i] = BLK_PTR_HOLE;
+        return;
+    }
+    if (!add_ptr_block(list, ptr_blk, first_idx, ptrs)) return;
+    for (int i = 0; i < NUM_PTR_PER_BLK && first_idx + i * entry_span < list->num_data; i++) {
+        if (level == 1) list->data[first_idx + i] = ptrs[i];
+        else collect_ptr_blocks(list, ptrs[i], level - 1, first_idx + i * entry_span);
+    }
+}
+
+void collect_blocks(int ino_num, struct BlockList* list) {
+    int* inode = inode_at(ino_num);
+    int num_blks = inode[INODE_NUM_BLKS_OFF];
+    list->num_data = num_blks;
+    list->data = (long long*) malloc((num_blks + 1) * sizeof(long long));
+    list->unwritten = (bool*) calloc(num_blks + 1, sizeof(bool));
+    // a pointer block per NUM_PTR_PER_BLK file blocks and level
+    int max_ptrs = NUM_PTR_TIERS * (num_blks / NUM_PTR_PER_BLK + 2);
+    list->ptrs = (long long*) malloc(max_ptrs * sizeof(long long));
+    list->ptr_first_idx = (int*) malloc(max_ptrs * sizeof(int));
+    list->num_ptrs = 0;
+    list->num_holes = 0;
+    list->num_unwritten = 0;
+    list->num_compressed = 0;
+    list->bad = false;
+    for (int i = 0; i < num_blks; i++) list->data[i] = -1;
+
+    // direct
+    for (int i = 0; i < num_blks && i < NUM_FIRST_LEV_PTR_PER_INODE; i++) list->data[i] = inode_ptr(ino_num, i);
+    // indirect tiers
+    for (int tier = 1; tier <= NUM_PTR_TIERS && ptr_tier_start(tier) < num_blks; tier++) {
+        collect_ptr_blocks(list, inode_ptr(ino_num, NUM_FIRST_LEV_PTR_PER_INODE + tier - 1), tier, ptr_tier_start(tier));
+    }
+
+    for (int i = 0; i < num_blks; i++) {
+        if (list->data[i] == BLK_PTR_HOLE || ((superblock.features & FEATURE_COMPRESS) && list->data[i] == BLK_PTR_CLUSTER_TAIL)) {
+            list->data[i] = BLK_PTR_HOLE;
+            list->num_holes++;
+            continue;
+        }
+        if (list->data[i] >= 0 && BLK_PTR_IS_COMPRESSED(list->data[i])) {
+            list->data[i] = BLK_PTR_IDX(list->data[i]);
+            list->num_compressed++;
+        }
+        else if (list->data[i] >= 0 && (list->data[i] & BLK_PTR_UNWRITTEN) != 0) {
+            list->data[i] = BLK_PTR_IDX(list->data[i]);
+            list->unwritten[i] = true;
+            list->num_unwritten++;
+        }
+        if (!valid_data_blk(list->data[i])) list->bad = true;
+    }
+}
+
+void free_block_list(struct BlockList* list) {
+    free(list->data);
+    free(list->unwritten);
+    free(list->ptrs);
+    free(list->ptr_first_idx);
+}
+
+// read or write file blocks [first, first + count), merging runs of adjacent data blocks into one request
+// holes and unwritten blocks read as zeros, they are never written
+int file_blocks_io(bool write, struct BlockList* list, int first, int count, char* buffer) {
+    int i = first;
+    while (i < first + count) {
+        if (list->data[i] == BLK_PTR_HOLE || list->unwritten[i]) {
+            if (write) return -EIO;
+            memset(buffer + (long long) (i - first) * SIZE_BLOCK, 0, SIZE_BLOCK);
+            i++;
+            continue;
+        }
+        int run = 1;
+        while (i + run < first + count && list->data[i + run] == list->data[i] + run && !list->unwritten[i + run]) run++;
+        off_t offset = (off_t) (DATA_REG_START_BLK + (long long) list->data[i]) * SIZE_BLOCK;
+        int result = device_io(write, buffer + (long long) (i - first) * SIZE_BLOCK, (long long) run * SIZE_BLOCK, offset);
+        if (result < 0) return result;
+        i += run;
+    }
+    return 0;
+}
+
+int expected_num_blks(long long size) {
+    return (size + SIZE_BLOCK - 1) / SIZE_BLOCK;
+}
+
+// run check on every inode, inode ranges are shared among threads
+void (*pass_func)(int ino_num);
+int next_ino_num;
+
+void* pass_thread(void* arg) {
+    while (true) {
+        int start = __atomic_fetch_add(&next_ino_num, FSCK_CHUNK_INODES, __ATOMIC_RELAXED);
+        if (start >= NUM_INODE) break;
+        int end = start + FSCK_CHUNK_INODES < NUM_INODE ? start + FSCK_CHUNK_INODES : NUM_INODE;
+        for (int ino_num = start; ino_num < end; ino_num++) pass_func(ino_num);
+    }
+    return NULL;
+}
+
+void run_pass(void (*func)(int ino_num)) {
+    pass_func = func;
+    next_ino_num = 0;
+    pthread_t* tids = (pthread_t*) calloc(num_threads, sizeof(pthread_t));
+    int num_started = 0;
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&tids[num_started], NULL, pass_thread, NULL) == 0) num_started++;
+    }
+    if (num_started == 0) pass_thread(NULL);
+    for (int i = 0; i < num_started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+// pass 1: inode fields and block pointers
+void check_inode(int ino_num) {
+    if (!test_map_bit(imap, ino_num)) return;
+    int* inode = inode_at(ino_num);
+    int flag = inode[INODE_FLAG_OFF] & INODE_TYPE_MASK;
+    int num_blks = inode[INODE_NUM_BLKS_OFF];
+    long long size = inode_size(ino_num);
+    bool is_inline = (inode[INODE_FLAG_OFF] & INODE_FLAG_INLINE) != 0;
+
+    inode_state[ino_num] = INODE_STATE_OK;
+    bool is_compressed = (inode[INODE_FLAG_OFF] & INODE_FLAG_COMPRESS) != 0;
+    if (flag > 2 || (inode[INODE_FLAG_OFF] & ~(INODE_TYPE_MASK | INODE_FLAG_INLINE | INODE_FLAG_COMPRESS)) != 0 || (is_inline && (flag == 1 || !(superblock.features & FEATURE_INLINE_DATA)))
+        || (is_compressed && (flag != 0 || !(superblock.features & FEATURE_COMPRESS)))) {
+        problem("inode %d: unknown type %d", ino_num, inode[INODE_FLAG_OFF]);
+        inode_state[ino_num] = INODE_STATE_BAD;
+        return;
+    }
+    if (num_blks < 0 || num_blks > NUM_ALL_LEV_PTR_PER_INODE || size < 0 || (is_inline && num_blks != 0)) {
+        problem("inode %d: bad number of blocks %d or size %lld", ino_num, num_blks, size);
+        inode_state[ino_num] = INODE_STATE_BAD;
+        return;
+    }
+    if (is_inline) {
+        // inline data past the size reads as zeros once the file grows
+        char* data = (char*) inode + INODE_INLINE_DATA_POS;
+        bool tail_zeroed = true;
+        for (long long i = size; i < INODE_INLINE_CAPACITY && tail_zeroed; i++) tail_zeroed = data[i] == 0;
+        if (size > INODE_INLINE_CAPACITY || !tail_zeroed) {
+            problem("inode %d: inline data size %lld does not match its content", ino_num, size);
+            size_mismatch[ino_num] = true;
+        }
+        if (flag == 0) __atomic_fetch_add(&num_files, 1, __ATOMIC_RELAXED);
+        else __atomic_fetch_add(&num_symlinks, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct BlockList list;
+    collect_blocks(ino_num, &list);
+    if (list.bad || (flag != 0 && list.num_holes > 0) || (!is_compressed && list.num_compressed > 0)) {
+        problem("inode %d: block pointer outside data region", ino_num);
+        inode_state[ino_num] = INODE_STATE_BAD;
+        free_block_list(&list);
+        return;
+    }
+    int num_claimed = 0;
+    for (int i = 0; i < list.num_ptrs + list.num_data; i++) {
+        long long data_reg_idx = i < list.num_ptrs ? list.ptrs[i] : list.data[i - list.num_ptrs];
+        if (data_reg_idx == BLK_PTR_HOLE) continue;
+        // a written block of a regular file may be shared, the first inode claims it as owned
+        bool shareable = claims != NULL && flag == 0 && i >= list.num_ptrs && !list.unwritten[i - list.num_ptrs];
+        if (shareable && __atomic_fetch_add(&claims[data_reg_idx], 1, __ATOMIC_RELAXED) > 0) continue;
+        num_claimed++;
+        if (claim_bit(owned_bits, data_reg_idx)) {
+            claim_bit(dup_bits, data_reg_idx);
+            unrepairable("inode %d: data block %lld is used more than once", ino_num, data_reg_idx);
+        }
+    }
+    __atomic_fetch_add(&num_used_blks, num_claimed, __ATOMIC_RELAXED);
+    // only regular files reserve blocks, a directory or symlink block left unwritten lost its content
+    if (flag != 0 && list.num_unwritten > 0) {
+        problem("inode %d: %d blocks of directory or symlink are unwritten", ino_num, list.num_unwritten);
+        unwritten_meta[ino_num] = true;
+    }
+    free_block_list(&list);
+
+    // regular files may keep blocks reserved past their size
+    if ((flag == 0 ? expected_num_blks(size) > num_blks : expected_num_blks(size) != num_blks) || (flag == 1 && size % SIZE_DIR_ITEM != 0)) {
+        problem("inode %d: size %lld does not match %d blocks", ino_num, size, num_blks);
+        size_mismatch[ino_num] = true;
+    }
+    if (flag == 0) __atomic_fetch_add(&num_files, 1, __ATOMIC_RELAXED);
+    else if (flag == 1) __atomic_fetch_add(&num_dirs, 1, __ATOMIC_RELAXED);
+    else __atomic_fetch_add(&num_symlinks, 1, __ATOMIC_RELAXED);
+}
+
+// entry target is an allocated, usable inode other than root and the directory itself
+bool entry_target_ok(int dir_ino_num, int sub_ino_num, const char* name) {
+    return sub_ino_num < NUM_INODE && inode_state[sub_ino_num] == INODE_STATE_OK && sub_ino_num != ROOT_INUM && sub_ino_num != dir_ino_num && name[0] != 0;
+}
+
+// number of directory entries readable from a directory
+int num_dir_entries(int ino_num) {
+    int* inode = inode_at(ino_num);
+    long long size = inode_size(ino_num);
+    long long max_size = (long long) inode[INODE_NUM_BLKS_OFF] * SIZE_BLOCK;
+    return (size < max_size ? size : max_size) / SIZE_DIR_ITEM;
+}
+
+// read directory entries into a buffer of whole blocks, NULL on error
+char* read_dir(int ino_num, struct BlockList* list) {
+    collect_blocks(ino_num, list);
+    char* buffer = (char*) malloc((long long) (list->num_data + 1) * SIZE_BLOCK);
+    if (file_blocks_io(false, list, 0, list->num_data, buffer) < 0) {
+        unrepairable("directory %d: cannot read its blocks", ino_num);
+        free(buffer);
+        free_block_list(list);
+        return NULL;
+    }
+    return buffer;
+}
+
+// pass 2: directory entries
+void check_dir(int ino_num) {
+    if (inode_state[ino_num] != INODE_STATE_OK || inode_at(ino_num)[INODE_FLAG_OFF] != 1) return;
+
+    struct BlockList list;
+    char* buffer = read_dir(ino_num, &list);
+    if (buffer == NULL) return;
+    int num_entries = num_dir_entries(ino_num);
+    char name[SIZE_FILENAME + 1];
+    name[SIZE_FILENAME] = 0;
+    for (int i = 0; i < num_entries; i++) {
+        int sub_ino_num = -1;
+        memcpy(&sub_ino_num, buffer + i * SIZE_DIR_ITEM, sizeof(sub_ino_num));
+        memcpy(name, buffer + i * SIZE_DIR_ITEM + sizeof(sub_ino_num), SIZE_FILENAME);
+        if (sub_ino_num < 0) continue; // free slot
+
+        if (!entry_target_ok(ino_num, sub_ino_num, name)) {
+            problem("directory %d: entry \"%s\" points to %s inode %d", ino_num, name,
+                sub_ino_num < NUM_INODE && inode_state[sub_ino_num] == INODE_STATE_FREE ? "free" : "bad", sub_ino_num);
+            bad_entries[ino_num] = true;
+            continue;
+        }
+        if (inode_at(sub_ino_num)[INODE_FLAG_OFF] == 1) {
+            int no_parent = NO_PARENT;
+            if (!__atomic_compare_exchange_n(&parents[sub_ino_num], &no_parent, ino_num, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                problem("directory %d: entry \"%s\" links directory %d which already has parent %d", ino_num, name, sub_ino_num, no_parent);
+                bad_entries[ino_num] = true;
+                continue;
+            }
+            __atomic_fetch_add(&subdirs[ino_num], 1, __ATOMIC_RELAXED);
+        }
+        else __atomic_fetch_add(&refs[sub_ino_num], 1, __ATOMIC_RELAXED);
+    }
+    free(buffer);
+    free_block_list(&list);
+}
+
+// allocate a data block not used by any inode, bitmaps are reconciled in pass 4
+long long alloc_data_blk() {
+    static long long next = 0;
+    for (long long i = 0; i < num_usable_blks; i++) {
+        long long data_reg_idx = (next + i) % num_usable_blks;
+        if (!claim_bit(owned_bits, data_reg_idx)) {
+            next = data_reg_idx + 1;
+            return data_reg_idx;
+        }
+    }
+    return -ENOSPC;
+}
+
+// release one owner of a data block, a shared block stays owned by the others
+void release_data_blk(long long data_reg_idx) {
+    if (!valid_data_blk(data_reg_idx) || test_bit(dup_bits, data_reg_idx)) return;
+    if (claims != NULL && claims[data_reg_idx] > 1) {
+        claims[data_reg_idx]--;
+        return;
+    }
+    if (claims != NULL) claims[data_reg_idx] = 0;
+    owned_bits[data_reg_idx / 64] &= ~(1ull << (data_reg_idx % 64));
+}
+
+// allocate a pointer block with all entries holes
+long long alloc_ptr_blk() {
+    long long data_reg_idx = alloc_data_blk();
+    if (data_reg_idx < 0) return data_reg_idx;
+    char holes[SIZE_BLOCK];
+    memset(holes, 0xff, SIZE_BLOCK);
+    int result = write_data_blk(data_reg_idx, holes);
+    return result < 0 ? result : data_reg_idx;
+}
+
+// zero unwritten blocks among count pointers on device and clear their flags, return number cleared
+int clear_unwritten_ptrs(long long* ptrs, int count) {
+    char zeros[SIZE_BLOCK];
+    memset(zeros, 0, SIZE_BLOCK);
+    int num_cleared = 0;
+    for (int i = 0; i < count; i++) {
+        if (ptrs[i] == BLK_PTR_HOLE || (ptrs[i] & BLK_PTR_UNWRITTEN) == 0) continue;
+        ptrs[i] = BLK_PTR_IDX(ptrs[i]);
+        if (write_data_blk(ptrs[i], zeros) < 0) return -EIO;
+        num_cleared++;
+    }
+    return num_cleared;
+}
+
+// clear unwritten blocks under pointer block ptr_blk, level and first_idx as in collect_ptr_blocks
+int fix_unwritten_ptr_blk(long long ptr_blk, int level, int first_idx, int num_blks) {
+    if (ptr_blk == BLK_PTR_HOLE) return 0;
+    long long ptrs[NUM_PTR_PER_BLK_MAX];
+    if (read_ptr_blk(ptr_blk, ptrs) < 0) return -EIO;
+    long long entry_span = ptr_tier_span(level - 1);
+    int count = 0;
+    while (count < NUM_PTR_PER_BLK && first_idx + count * entry_span < num_blks) count++;
+    if (level > 1) {
+        for (int i = 0; i < count; i++) {
+            if (fix_unwritten_ptr_blk(ptrs[i], level - 1, first_idx + i * entry_span, num_blks) < 0) return -EIO;
+        }
+        return 0;
+    }
+    int result = clear_unwritten_ptrs(ptrs, count);
+    if (result < 0 || (result > 0 && write_ptr_blk(ptr_blk, ptrs) < 0)) return -EIO;
+    return 0;
+}
+
+// write unwritten blocks of a directory or symlink as the zeros they read as, so toyfs and pass 2 agree
+int fix_unwritten(int ino_num) {
+    int num_blks = inode_at(ino_num)[INODE_NUM_BLKS_OFF];
+    // direct
+    long long ptrs[NUM_PTR_PER_BLK_MAX];
+    int count = num_blks < NUM_FIRST_LEV_PTR_PER_INODE ? num_blks : NUM_FIRST_LEV_PTR_PER_INODE;
+    for (int i = 0; i < count; i++) ptrs[i] = inode_ptr(ino_num, i);
+    if (clear_unwritten_ptrs(ptrs, count) < 0) return -EIO;
+    for (int i = 0; i < count; i++) set_inode_ptr(ino_num, i, ptrs[i]);
+    mark_inode_dirty(ino_num);
+    // indirect tiers
+    for (int tier = 1; tier <= NUM_PTR_TIERS && ptr_tier_start(tier) < num_blks; tier++) {
+        long long ptr_blk = inode_ptr(ino_num, NUM_FIRST_LEV_PTR_PER_INODE + tier - 1);
+        if (fix_unwritten_ptr_blk(ptr_blk, tier, ptr_tier_start(tier), num_blks) < 0) return -EIO;
+    }
+    return 0;
+}
+
+// append a new data block to an inode, allocating pointer blocks on the way like set_block_ptr of toyfs
+long long append_file_blk(int ino_num) {
+    int* inode = inode_at(ino_num);
+    int blk_idx = inode[INODE_NUM_BLKS_OFF];
+    if (blk_idx >= NUM_ALL_LEV_PTR_PER_INODE) return -EFBIG;
+    long long data_reg_idx = alloc_data_blk();
+    if (data_reg_idx < 0) return data_reg_idx;
+
+    if (blk_idx < NUM_FIRST_LEV_PTR_PER_INODE) set_inode_ptr(ino_num, blk_idx, data_reg_idx);
+    else {
+        int tier = 1;
+        while (tier < NUM_PTR_TIERS && blk_idx >= ptr_tier_start(tier + 1)) tier++;
+        long long rel = blk_idx - ptr_tier_start(tier);
+        // pointer blocks first used by blk_idx are undefined past the old end, they are allocated
+        long long ptr_blk = inode_ptr(ino_num, NUM_FIRST_LEV_PTR_PER_INODE + tier - 1);
+        if (rel == 0 || ptr_blk == BLK_PTR_HOLE) {
+            ptr_blk = alloc_ptr_blk();
+            if (ptr_blk < 0) return ptr_blk;
+            set_inode_ptr(ino_num, NUM_FIRST_LEV_PTR_PER_INODE + tier - 1, ptr_blk);
+        }
+        long long ptrs[NUM_PTR_PER_BLK_MAX];
+        for (long long span = ptr_tier_span(tier - 1); span > 1; span /= NUM_PTR_PER_BLK) {
+            int result = read_ptr_blk(ptr_blk, ptrs);
+            if (result < 0) return result;
+            int offset = rel / span % NUM_PTR_PER_BLK;
+            if (rel % span == 0 || ptrs[offset] == BLK_PTR_HOLE) {
+                long long new_blk = alloc_ptr_blk();
+                if (new_blk < 0) return new_blk;
+                ptrs[offset] = new_blk;
+                result = write_ptr_blk(ptr_blk, ptrs);
+                if (result < 0) return result;
+            }
+            ptr_blk = ptrs[offset];
+        }
+        int result = read_ptr_blk(ptr_blk, ptrs);
+        if (result < 0) return result;
+        ptrs[rel % NUM_PTR_PER_BLK] = data_reg_idx;
+        result = write_ptr_blk(ptr_blk, ptrs);
+        if (result < 0) return result;
+    }
+
+    inode[INODE_NUM_BLKS_OFF] = blk_idx + 1;
+    mark_inode_dirty(ino_num);
+    return data_reg_idx;
+}
+
+// release file blocks from num_blks on, and pointer blocks only serving them
+void release_tail(int ino_num, struct BlockList* list, int num_blks) {
+    for (int i = num_blks; i < list->num_data; i++) release_data_blk(list->data[i]);
+    for (int i = 0; i < list->num_ptrs; i++) {
+        if (list->ptr_first_idx[i] >= num_blks) release_data_blk(list->ptrs[i]);
+    }
+    inode_at(ino_num)[INODE_NUM_BLKS_OFF] = num_blks;
+    mark_inode_dirty(ino_num);
+}
+
+// make size and number of blocks agree, keeping the blocks both describe
+void fix_size(int ino_num) {
+    int* inode = inode_at(ino_num);
+    int num_blks = inode[INODE_NUM_BLKS_OFF];
+    long long size = inode_size(ino_num);
+    if (inode[INODE_FLAG_OFF] & INODE_FLAG_INLINE) {
+        if (size > INODE_INLINE_CAPACITY) size = INODE_INLINE_CAPACITY;
+        memset((char*) inode + INODE_INLINE_DATA_POS + size, 0, INODE_INLINE_CAPACITY - size);
+        set_inode_size(ino_num, size);
+        mark_inode_dirty(ino_num);
+        return;
+    }
+    if (size > (long long) num_blks * SIZE_BLOCK) size = (long long) num_blks * SIZE_BLOCK;
+    if (inode[INODE_FLAG_OFF] == 1) size -= size % SIZE_DIR_ITEM;
+    if (expected_num_blks(size) < num_blks) {
+        struct BlockList list;
+        collect_blocks(ino_num, &list);
+        release_tail(ino_num, &list, expected_num_blks(size));
+        free_block_list(&list);
+    }
+    set_inode_size(ino_num, size);
+    mark_inode_dirty(ino_num);
+}
+
+// drop entries found bad in pass 2 and compact the directory
+int fix_dir_entries(int ino_num) {
+    struct BlockList list;
+    char* buffer = read_dir(ino_num, &list);
+    if (buffer == NULL) return -EIO;
+    int num_entries = num_dir_entries(ino_num);
+    int num_kept = 0;
+    char name[SIZE_FILENAME + 1];
+    name[SIZE_FILENAME] = 0;
+    for (int i = 0; i < num_entries; i++) {
+        int sub_ino_num = -1;
+        memcpy(&sub_ino_num, buffer + i * SIZE_DIR_ITEM, sizeof(sub_ino_num));
+        memcpy(name, buffer + i * SIZE_DIR_ITEM + sizeof(sub_ino_num), SIZE_FILENAME);
+        if (sub_ino_num < 0 || !entry_target_ok(ino_num, sub_ino_num, name)) continue;
+        if (inode_at(sub_ino_num)[INODE_FLAG_OFF] == 1) {
+            // keep the entry that made this directory the parent, once
+            if (parents[sub_ino_num] != ino_num) continue;
+            bool kept = false;
+            for (int j = 0; j < num_kept && !kept; j++) kept = memcmp(buffer + j * SIZE_DIR_ITEM, &sub_ino_num, sizeof(sub_ino_num)) == 0;
+            if (kept) continue;
+        }
+        memmove(buffer + num_kept * SIZE_DIR_ITEM, buffer + i * SIZE_DIR_ITEM, SIZE_DIR_ITEM);
+        num_kept++;
+    }
+
+    int size = num_kept * SIZE_DIR_ITEM;
+    int num_blks = expected_num_blks(size);
+    memset(buffer + size, 0, (long long) num_blks * SIZE_BLOCK - size);
+    int result = file_blocks_io(true, &list, 0, num_blks, buffer);
+    if (result == 0) {
+        release_tail(ino_num, &list, num_blks);
+        set_inode_size(ino_num, size);
+        mark_inode_dirty(ino_num);
+        fixed(num_entries - num_kept);
+    }
+    free(buffer);
+    free_block_list(&list);
+    return result;
+}
+
+// add an entry to a directory, appending a block when the last one is full
+int append_dir_entry(int dir_ino_num, const char* name, int sub_ino_num) {
+    int size = inode_size(dir_ino_num);
+    char block[SIZE_BLOCK];
+    long long data_reg_idx;
+    if (size % SIZE_BLOCK == 0) {
+        data_reg_idx = append_file_blk(dir_ino_num);
+        if (data_reg_idx < 0) return data_reg_idx;
+        memset(block, 0, SIZE_BLOCK);
+    }
+    else {
+        struct BlockList list;
+        collect_blocks(dir_ino_num, &list);
+        data_reg_idx = list.data[size / SIZE_BLOCK];
+        free_block_list(&list);
+        int result = read_data_blk(data_reg_idx, block);
+        if (result < 0) return result;
+    }
+
+    char* entry = block + size % SIZE_BLOCK;
+    memset(entry, 0, SIZE_DIR_ITEM);
+    memcpy(entry, &sub_ino_num, sizeof(sub_ino_num));
+    strncpy(entry + sizeof(sub_ino_num), name, SIZE_FILENAME);
+    int result = write_data_blk(data_reg_idx, block);
+    if (result < 0) return result;
+    set_inode_size(dir_ino_num, size + SIZE_DIR_ITEM);
+    mark_inode_dirty(dir_ino_num);
+    return 0;
+}
+
+// reconnect an orphan inode to the root directory
+void reconnect(int ino_num) {
+    char name[SIZE_FILENAME + 1];
+    snprintf(name, sizeof(name), "#%d", ino_num);
+    int result = append_dir_entry(ROOT_INUM, name, ino_num);
+    if (result < 0) {
+        unrepairable("inode %d: reconnecting failed: %s", ino_num, strerror(-result));
+        return;
+    }
+    if (inode_at(ino_num)[INODE_FLAG_OFF] == 1) {
+        parents[ino_num] = ROOT_INUM;
+        subdirs[ROOT_INUM]++;
+    }
+    else refs[ino_num]++;
+    fixed(1);
+}
+
+// pass 3: orphans, directories unreachable from root and link counts
+void check_connectivity() {
+    for (int ino_num = 0; ino_num < NUM_INODE; ino_num++) {
+        if (inode_state[ino_num] != INODE_STATE_OK || ino_num == ROOT_INUM) continue;
+        bool is_dir = inode_at(ino_num)[INODE_FLAG_OFF] == 1;
+        if ((is_dir && parents[ino_num] == NO_PARENT) || (!is_dir && refs[ino_num] == 0)) {
+            problem("inode %d: not linked from any directory", ino_num);
+            if (repair) reconnect(ino_num);
+        }
+    }
+
+    // follow parents up to root, a chain not reaching root is a directory cycle
+    // reach: 0 unknown, 1 reachable, 2 unreachable, 3 on current chain
+    char* reach = (char*) calloc(NUM_INODE, 1);
+    int* chain = (int*) malloc(NUM_INODE * sizeof(int));
+    reach[ROOT_INUM] = 1;
+    for (int ino_num = 0; ino_num < NUM_INODE; ino_num++) {
+        if (inode_state[ino_num] != INODE_STATE_OK || inode_at(ino_num)[INODE_FLAG_OFF] != 1 || reach[ino_num] != 0) continue;
+        int length = 0;
+        int cur = ino_num;
+        while (cur != NO_PARENT && reach[cur] == 0) {
+            reach[cur] = 3;
+            chain[length++] = cur;
+            cur = parents[cur];
+        }
+        char result = (cur != NO_PARENT && reach[cur] == 1) ? 1 : 2;
+        if (cur != NO_PARENT && reach[cur] == 3) unrepairable("directory %d: not reachable from root, it is part of a directory cycle", ino_num);
+        for (int i = 0; i < length; i++) reach[chain[i]] = result;
+    }
+    free(reach);
+    free(chain);
+
+    for (int ino_num = 0; ino_num < NUM_INODE; ino_num++) {
+        if (inode_state[ino_num] != INODE_STATE_OK) continue;
+        int* inode = inode_at(ino_num);
+        int expected = inode[INODE_FLAG_OFF] == 1 ? 2 + subdirs[ino_num] : refs[ino_num]; // directory has "." and ".." of each subdirectory
+        if (expected == 0) continue; // orphan left unrepaired
+        if (inode[INODE_LINKS_COUNT_OFF] != expected) {
+            problem("inode %d: links count %d, should be %d", ino_num, inode[INODE_LINKS_COUNT_OFF], expected);
+            if (repair) {
+                inode[INODE_LINKS_COUNT_OFF] = expected;
+                mark_inode_dirty(ino_num);
+                fixed(1);
+            }
+        }
+    }
+}
+
+// pass 4: bitmaps against inode states and block ownership
+void check_bitmaps() {
+    long long num_free_marked_used = 0, num_used_marked_free = 0;
+    for (int ino_num = 0; ino_num < NUM_INODE; ino_num++) {
+        if (inode_state[ino_num] == INODE_STATE_BAD && repair) {
+            set_map_bit(imap, ino_num, 0); // entries pointing to it were dropped in pass 2
+            fixed(1);
+        }
+    }
+
+    for (long long data_reg_idx = 0; data_reg_idx < NUM_DATA_BLKS; data_reg_idx++) {
+        bool used = data_reg_idx >= num_usable_blks || test_bit(owned_bits, data_reg_idx); // bits beyond device stay set
+        bool marked = test_map_bit(dmap, data_reg_idx);
+        if (used == marked) continue;
+        if (used) num_used_marked_free++;
+        else num_free_marked_used++;
+        if (repair) set_map_bit(dmap, data_reg_idx, used);
+    }
+    if (num_used_marked_free > 0) problem("%lld data blocks in use are marked free", num_used_marked_free);
+    if (num_free_marked_used > 0) problem("%lld free data blocks are marked used", num_free_marked_used);
+    if (repair) fixed((num_used_marked_free > 0) + (num_free_marked_used > 0));
+
+    // a reference count is the number of owners besides the first
+    if (claims == NULL) return;
+    long long num_bad_refcounts = 0;
+    for (long long data_reg_idx = 0; data_reg_idx < NUM_DATA_BLKS; data_reg_idx++) {
+        int expected = data_reg_idx < num_usable_blks && claims[data_reg_idx] > 0 ? claims[data_reg_idx] - 1 : 0;
+        if (expected > REFCOUNT_MAX) {
+            unrepairable("data block %lld is shared by %d inodes", data_reg_idx, expected + 1);
+            continue;
+        }
+        if (refcount[data_reg_idx] == expected) continue;
+        num_bad_refcounts++;
+        if (!repair) continue;
+        refcount[data_reg_idx] = expected;
+        refcount_dirty[data_reg_idx / SIZE_BLOCK] = 1;
+    }
+    if (num_bad_refcounts > 0) problem("%lld data blocks have wrong reference counts", num_bad_refcounts);
+    if (repair && num_bad_refcounts > 0) fixed(1);
+
+    // a block marked in the dedup map is shared by content, it has to hold data of regular files
+    if (dedup_map == NULL) return;
+    long long num_bad_dedup_bits = 0;
+    for (long long data_reg_idx = 0; data_reg_idx < NUM_DATA_BLKS; data_reg_idx++) {
+        if (!test_map_bit((const char*) dedup_map, data_reg_idx)) continue;
+        if (data_reg_idx < num_usable_blks && claims[data_reg_idx] > 0 && !test_bit(dup_bits, data_reg_idx)) continue;
+        num_bad_dedup_bits++;
+        if (!repair) continue;
+        dedup_map[data_reg_idx / 8] &= ~(1 << (data_reg_idx % 8));
+        dedup_map_dirty[data_reg_idx / (SIZE_BLOCK * 8)] = 1;
+    }
+    if (num_bad_dedup_bits > 0) problem("%lld data blocks marked in the dedup map hold no file data", num_bad_dedup_bits);
+    if (repair && num_bad_dedup_bits > 0) fixed(1);
+}
+
+// compare blocks read from device with their recorded checksums, drop mismatching checksums on repair
+void verify_checksums(const char* buffer, long long num_blks, long long start_blk) {
+    for (long long i = 0; csums != NULL && i < num_blks; i++) {
+        long long block_id = start_blk + i;
+        if (!has_checksum(block_id) || csums[block_id] == CSUM_NONE) continue;
+        if (csums[block_id] == block_checksum(buffer + i * SIZE_BLOCK)) continue;
+        problem("block %lld does not match its checksum, it is torn or corrupted", block_id);
+        if (!repair) continue;
+        csums[block_id] = CSUM_NONE;
+        csums_dirty[block_id / CSUM_PER_BLK] = 1;
+        fixed(1);
+    }
+}
+
+// read data blocks in use in runs of consecutive blocks and verify them
+void check_checksums() {
+    char* buffer = (char*) malloc(FSCK_READ_SIZE);
+    long long max_run = FSCK_READ_SIZE / SIZE_BLOCK;
+    long long data_reg_idx = 0;
+    while (data_reg_idx < num_usable_blks) {
+        if (!test_bit(owned_bits, data_reg_idx)) {
+            data_reg_idx++;
+            continue;
+        }
+        long long run = 1;
+        while (run < max_run && data_reg_idx + run < num_usable_blks && test_bit(owned_bits, data_reg_idx + run)) run++;
+        if (device_io(false, buffer, run * SIZE_BLOCK, (off_t) (DATA_REG_START_BLK + data_reg_idx) * SIZE_BLOCK) < 0) {
+            unrepairable("reading data blocks %lld to %lld failed", data_reg_idx, data_reg_idx + run - 1);
+        }
+        else verify_checksums(buffer, run, DATA_REG_START_BLK + data_reg_idx);
+        data_reg_idx += run;
+    }
+    free(buffer);
+}
+
+// write blocks of a table outside the bitmaps and inode table changed by repair
+int write_table(const unsigned char* table, const char* dirty, long long num_blks, long long start_blk) {
+    for (long long i = 0; i < num_blks; i++) {
+        if (!dirty[i]) continue;
+        int result = device_io(true, (char*) table + i * SIZE_BLOCK, SIZE_BLOCK, (off_t) (start_blk + i) * SIZE_BLOCK);
+        if (result < 0) return result;
+    }
+    return 0;
+}
+
+// write metadata blocks changed by repair, merging adjacent blocks into one request
+int write_meta(long long num_meta_blks) {
+    long long i = 0;
+    while (i < num_meta_blks) {
+        if (!meta_dirty[i]) {
+            i++;
+            continue;
+        }
+        long long run = 1;
+        while (i + run < num_meta_blks && meta_dirty[i + run]) run++;
+        int result = device_io(true, meta + i * SIZE_BLOCK, run * SIZE_BLOCK, (off_t) (IMAP_START_BLK + i) * SIZE_BLOCK);
+        if (result < 0) return result;
+        i += run;
+    }
+    return fdatasync(dev_fd) < 0 ? -errno : 0;
+}
+
+struct ReadTask {
+    char* buffer;
+    long long size;
+    off_t offset;
+    int result;
+};
+
+void* read_meta_thread(void* arg) {
+    struct ReadTask* task = (struct ReadTask*) arg;
+    task->result = device_io(false, task->buffer, task->size, task->offset);
+    return NULL;
+}
+
+// read bitmaps and inode table, split across threads in large sequential requests
+int read_meta(long long num_meta_blks) {
+    long long size = num_meta_blks * SIZE_BLOCK;
+    long long per_thread = (size + num_threads - 1) / num_threads;
+    per_thread = (per_thread + FSCK_READ_SIZE - 1) / FSCK_READ_SIZE * FSCK_READ_SIZE;
+    struct ReadTask* tasks = (struct ReadTask*) calloc(num_threads, sizeof(struct ReadTask));
+    pthread_t* tids = (pthread_t*) calloc(num_threads, sizeof(pthread_t));
+    int num_started = 0, num_tasks = 0;
+    int result = 0;
+    for (long long start = 0; start < size; start += per_thread) {
+        struct ReadTask* task = &tasks[num_tasks++];
+        task->buffer = meta + start;
+        task->size = size - start < per_thread ? size - start : per_thread;
+        task->offset = (off_t) IMAP_START_BLK * SIZE_BLOCK + start;
+        if (pthread_create(&tids[num_started], NULL, read_meta_thread, task) == 0) num_started++;
+        else read_meta_thread(task);
+    }
+    for (int i = 0; i < num_started; i++) pthread_join(tids[i], NULL);
+    for (int i = 0; i < num_tasks; i++) {
+        if (tasks[i].result < 0) result = tasks[i].result;
+    }
+    free(tasks);
+    free(tids);
+    return result;
+}
+
+void usage(const char* prog) {
+    printf("Usage: %s [-y] [-T threads] [-v] device\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = num_cpus > 0 ? num_cpus : 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "yT:vh")) != -1) {
+        switch (opt) {
+            case 'y': repair = true; break;
+            case 'T': num_threads = atoi(optarg); break;
+            case 'v': verbose = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? FSCK_EXIT_OK : FSCK_EXIT_ERROR;
+        }
+    }
+    if (optind != argc - 1 || num_threads < 1) {
+        usage(argv[0]);
+        return FSCK_EXIT_ERROR;
+    }
+    const char* path = argv[optind];
+
+    dev_fd = open(path, repair ? O_RDWR : O_RDONLY);
+    if (dev_fd < 0) {
+        perror(path);
+        return FSCK_EXIT_ERROR;
+    }
+    char block[SIZE_BLOCK];
+    if (device_io(false, block, SIZE_BLOCK, (off_t) SUPERBLOCK_START_BLK * SIZE_BLOCK) < 0 || !decode_superblock(block)) {
+        printf("[FSCK] %s is not of toyfs format\n", path);
+        return FSCK_EXIT_ERROR;
+    }
+    if (superblock.block_size != SIZE_BLOCK || (superblock.features & ~SUPPORTED_FEATURES) != 0
+        || ((superblock.features & FEATURE_DEDUP) && !(superblock.features & FEATURE_REFLINK))) {
+        printf("[FSCK] block size %u or features 0x%x of %s are not supported\n", superblock.block_size, superblock.features, path);
+        return FSCK_EXIT_ERROR;
+    }
+    num_usable_blks = num_usable_data_blks();
+    long long device_blks = get_device_size(dev_fd) / SIZE_BLOCK;
+    if (device_blks < DATA_REG_START_BLK + num_usable_blks) {
+        printf("[FSCK] %s has %lld blocks, toyfs needs %lld\n", path, device_blks, DATA_REG_START_BLK + num_usable_blks);
+        return FSCK_EXIT_ERROR;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    printf("[FSCK] checking %s: %d inodes, %lld data blocks, %d threads%s\n", path, NUM_INODE, num_usable_blks, num_threads, repair ? ", repairing" : "");
+
+    long long num_meta_blks = JOURNAL_START_BLK - IMAP_START_BLK;
+    meta = (char*) malloc(num_meta_blks * SIZE_BLOCK);
+    meta_dirty = (char*) calloc(num_meta_blks, 1);
+    imap = meta;
+    dmap = imap + SIZE_IBMAP;
+    inode_table = dmap + SIZE_DBMAP;
+    owned_bits = (uint64_t*) calloc(NUM_DATA_BLKS / 64 + 1, sizeof(uint64_t));
+    dup_bits = (uint64_t*) calloc(NUM_DATA_BLKS / 64 + 1, sizeof(uint64_t));
+    inode_state = (char*) calloc(NUM_INODE, 1);
+    size_mismatch = (bool*) calloc(NUM_INODE, sizeof(bool));
+    unwritten_meta = (bool*) calloc(NUM_INODE, sizeof(bool));
+    bad_entries = (bool*) calloc(NUM_INODE, sizeof(bool));
+    refs = (int*) calloc(NUM_INODE, sizeof(int));
+    subdirs = (int*) calloc(NUM_INODE, sizeof(int));
+    parents = (int*) malloc(NUM_INODE * sizeof(int));
+    for (int i = 0; i < NUM_INODE; i++) parents[i] = NO_PARENT;
+    if (read_meta(num_meta_blks) < 0) {
+        printf("[FSCK] reading metadata of %s failed\n", path);
+        return FSCK_EXIT_ERROR;
+    }
+    if (superblock.features & FEATURE_CHECKSUM) {
+        csums = (unsigned int*) malloc((long long) NUM_BLKS_CSUM * SIZE_BLOCK);
+        csums_dirty = (char*) calloc(NUM_BLKS_CSUM, 1);
+        if (device_io(false, (char*) csums, (long long) NUM_BLKS_CSUM * SIZE_BLOCK, (off_t) CSUM_START_BLK * SIZE_BLOCK) < 0) {
+            printf("[FSCK] reading checksums of %s failed\n", path);
+            return FSCK_EXIT_ERROR;
+        }
+        // metadata as read, before repairs change it in memory
+        verify_checksums(meta, num_meta_blks, IMAP_START_BLK);
+    }
+    if (superblock.features & FEATURE_REFLINK) {
+        refcount = (unsigned char*) malloc((long long) NUM_BLKS_REFCOUNT * SIZE_BLOCK);
+        refcount_dirty = (char*) calloc(NUM_BLKS_REFCOUNT, 1);
+        claims = (uint16_t*) calloc(NUM_DATA_BLKS, sizeof(uint16_t));
+        if (device_io(false, (char*) refcount, (long long) NUM_BLKS_REFCOUNT * SIZE_BLOCK, (off_t) REFCOUNT_START_BLK * SIZE_BLOCK) < 0) {
+            printf("[FSCK] reading reference counts of %s failed\n", path);
+            return FSCK_EXIT_ERROR;
+        }
+        verify_checksums((const char*) refcount, NUM_BLKS_REFCOUNT, REFCOUNT_START_BLK);
+    }
+    if (superblock.features & FEATURE_DEDUP) {
+        dedup_map = (unsigned char*) malloc((long long) NUM_BLKS_DEDUP_MAP * SIZE_BLOCK);
+        dedup_map_dirty = (char*) calloc(NUM_BLKS_DEDUP_MAP, 1);
+        if (device_io(false, (char*) dedup_map, (long long) NUM_BLKS_DEDUP_MAP * SIZE_BLOCK, (off_t) DEDUP_MAP_START_BLK * SIZE_BLOCK) < 0) {
+            printf("[FSCK] reading dedup map of %s failed\n", path);
+            return FSCK_EXIT_ERROR;
+        }
+        verify_checksums((const char*) dedup_map, NUM_BLKS_DEDUP_MAP, DEDUP_MAP_START_BLK);
+    }
+
+    printf("[FSCK] pass 1: inodes and block pointers\n");
+    run_pass(check_inode);
+    if (inode_state[ROOT_INUM] != INODE_STATE_OK || inode_at(ROOT_INUM)[INODE_FLAG_OFF] != 1) {
+        unrepairable("root inode %d is not a usable directory", ROOT_INUM);
+        printf("[FSCK] cannot continue without root directory\n");
+        return FSCK_EXIT_UNREPAIRED;
+    }
+    if (repair) {
+        for (int ino_num = 0; ino_num < NUM_INODE; ino_num++) {
+            if (unwritten_meta[ino_num]) {
+                if (fix_unwritten(ino_num) < 0) unrepairable("inode %d: writing unwritten blocks failed", ino_num);
+                else fixed(1);
+            }
+            if (!size_mismatch[ino_num]) continue;
+            fix_size(ino_num);
+            fixed(1);
+        }
+    }
+
+    printf("[FSCK] pass 2: directories\n");
+    run_pass(check_dir);
+    if (repair) {
+        for (int ino_num = 0; ino_num < NUM_INODE; ino_num++) {
+            if (bad_entries[ino_num] && fix_dir_entries(ino_num) < 0) unrepairable("directory %d: rewriting entries failed", ino_num);
+        }
+    }
+
+    printf("[FSCK] pass 3: connectivity and link counts\n");
+    check_connectivity();
+
+    printf("[FSCK] pass 4: bitmaps\n");
+    check_bitmaps();
+
+    if (csums != NULL) {
+        printf("[FSCK] pass 5: checksums\n");
+        check_checksums();
+    }
+
+    int exit_code = FSCK_EXIT_OK;
+    if (repair && num_fixed > 0) {
+        if ((claims != NULL && write_table(refcount, refcount_dirty, NUM_BLKS_REFCOUNT, REFCOUNT_START_BLK) < 0)
+            || (dedup_map != NULL && write_table(dedup_map, dedup_map_dirty, NUM_BLKS_DEDUP_MAP, DEDUP_MAP_START_BLK) < 0)
+            || write_meta(num_meta_blks) < 0
+            || (csums != NULL && (write_table((const unsigned char*) csums, csums_dirty, NUM_BLKS_CSUM, CSUM_START_BLK) < 0 || fdatasync(dev_fd) < 0))) {
+            printf("[FSCK] writing repaired metadata of %s failed\n", path);
+            return FSCK_EXIT_ERROR;
+        }
+    }
+    if (num_problems > 0) exit_code = (repair && num_unrepaired == 0) ? FSCK_EXIT_REPAIRED : FSCK_EXIT_UNREPAIRED;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("[FSCK] %lld files, %lld directories, %lld symlinks, %lld of %lld data blocks used\n", num_files, num_dirs, num_symlinks, num_used_blks, num_usable_blks);
+    printf("[FSCK] %lld problems, %lld repairs, %lld not repairable, %.3f s\n", num_problems, num_fixed, num_unrepaired, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    close(dev_fd);
+
+    return exit_code;
+}
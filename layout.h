@@ -0,0 +1,267 @@
+/*
+Authors:
+Zheng Zhong
+
+On-disk layout of toyfs, shared by toyfs, mkfs.toyfs and fsck.toyfs
+
+    | superblock | inode bitmap | data block bitmap | inode table | journal | refcount table | dedup index | dedup map | checksum table | data region |
+*/
+#ifndef __LAYOUT_H_
+#define __LAYOUT_H_
+
+#include "checksum.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define SIZE_BLOCK 512 // 512 bytes per block
+
+const char* magic_string = "zz_toyfs"; // magic string to identify toyfs
+
+struct SuperBlock {
+    unsigned int size_ibmap;
+    unsigned int size_dbmap;
+    unsigned int size_inode;
+    unsigned int size_filename;
+    unsigned int root_inum;
+    unsigned int num_disk_ptrs_per_inode;
+    // extended fields, valid when written by mkfs.toyfs (see SUPERBLOCK_EXT_MAGIC)
+    unsigned int block_size;
+    unsigned int num_journal_blks; // blocks reserved for journal between inode table and data region
+    unsigned int features; // FEATURE_* flags
+    unsigned long long num_blks; // device size in blocks, 0 if unknown
+} superblock;
+
+#define SUPERBLOCK_EXT_MAGIC 0x32796f74 // "toy2", marks extended superblock fields as valid
+
+// feature flags, a device with unknown features is not mounted
+#define FEATURE_JOURNAL (1 << 0) // journal region reserved
+#define FEATURE_INLINE_DATA (1 << 1) // small files and symlink targets are stored in their inode
+#define FEATURE_REFLINK (1 << 2) // data blocks are shared between cloned files, refcount table reserved
+#define FEATURE_COMPRESS (1 << 3) // regular files are stored in compressed clusters
+#define FEATURE_DEDUP (1 << 4) // written blocks of equal content are shared, needs FEATURE_REFLINK, dedup index and map reserved
+#define FEATURE_CHECKSUM (1 << 5) // blocks are verified against CRC32C checksums when read, checksum table reserved
+#define FEATURE_64BIT (1 << 6) // 8 byte block pointers and file sizes, four levels of indirect pointers
+#define SUPPORTED_FEATURES (FEATURE_JOURNAL | FEATURE_INLINE_DATA | FEATURE_REFLINK | FEATURE_COMPRESS | FEATURE_DEDUP | FEATURE_CHECKSUM | FEATURE_64BIT)
+
+struct FeatureName {
+    unsigned int flag;
+    const char* name;
+};
+
+const struct FeatureName feature_names[] = {
+    { FEATURE_JOURNAL, "journal" },
+    { FEATURE_INLINE_DATA, "inline_data" },
+    { FEATURE_REFLINK, "reflink" },
+    { FEATURE_COMPRESS, "compress" },
+    { FEATURE_DEDUP, "dedup" },
+    { FEATURE_CHECKSUM, "checksum" },
+    { FEATURE_64BIT, "64bit" },
+};
+#define NUM_FEATURE_NAMES ((int) (sizeof(feature_names) / sizeof(feature_names[0])))
+
+#define SIZE_IBMAP ((int)superblock.size_ibmap)
+#define SIZE_DBMAP ((long long)superblock.size_dbmap)
+#define SIZE_INODE ((int)superblock.size_inode)
+#define SIZE_FILENAME ((int)superblock.size_filename)
+#define ROOT_INUM ((int)superblock.root_inum)
+#define NUM_DISK_PTRS_PER_INODE ((int)superblock.num_disk_ptrs_per_inode)
+
+#define NUM_INODE (SIZE_IBMAP * 8)
+#define NUM_DATA_BLKS (SIZE_DBMAP * 8)
+
+#define NUM_BLKS_SUPERBLOCK 8 // set to 1 page = 8 blocks
+#define NUM_BLKS_IMAP (SIZE_IBMAP / SIZE_BLOCK)
+#define NUM_BLKS_DMAP (SIZE_DBMAP / SIZE_BLOCK)
+#define NUM_BLKS_INODE_TABLE ((long long) SIZE_INODE * NUM_INODE / SIZE_BLOCK)
+#define NUM_BLKS_JOURNAL ((int)superblock.num_journal_blks)
+#define NUM_BLKS_REFCOUNT ((superblock.features & FEATURE_REFLINK) ? NUM_DATA_BLKS / SIZE_BLOCK : 0) // a byte per data block
+#define NUM_BLKS_DEDUP_INDEX ((superblock.features & FEATURE_DEDUP) ? NUM_DATA_BLKS / DEDUP_ENTRIES_PER_BLK : 0) // an entry per data block
+#define NUM_BLKS_DEDUP_MAP ((superblock.features & FEATURE_DEDUP) ? NUM_DATA_BLKS / (SIZE_BLOCK * 8) : 0) // a bit per data block
+#define NUM_BLKS_CSUM ((superblock.features & FEATURE_CHECKSUM) ? (long long) ((superblock.num_blks + CSUM_PER_BLK - 1) / CSUM_PER_BLK) : 0) // an entry per device block
+
+#define SUPERBLOCK_START_BLK 0
+#define IMAP_START_BLK NUM_BLKS_SUPERBLOCK
+#define DMAP_START_BLK (IMAP_START_BLK + NUM_BLKS_IMAP)
+#define INODE_TABLE_START_BLK (DMAP_START_BLK + NUM_BLKS_DMAP)
+#define JOURNAL_START_BLK (INODE_TABLE_START_BLK + NUM_BLKS_INODE_TABLE)
+#define REFCOUNT_START_BLK (JOURNAL_START_BLK + NUM_BLKS_JOURNAL)
+#define DEDUP_INDEX_START_BLK (REFCOUNT_START_BLK + NUM_BLKS_REFCOUNT)
+#define DEDUP_MAP_START_BLK (DEDUP_INDEX_START_BLK + NUM_BLKS_DEDUP_INDEX)
+#define CSUM_START_BLK (DEDUP_MAP_START_BLK + NUM_BLKS_DEDUP_MAP)
+#define DATA_REG_START_BLK (CSUM_START_BLK + NUM_BLKS_CSUM)
+
+// device block of an inode and its byte offset in the block
+#define INODE_BLK(ino_num) (INODE_TABLE_START_BLK + (long long) (ino_num) * SIZE_INODE / SIZE_BLOCK)
+#define INODE_BLK_OFFSET(ino_num) ((int) ((long long) (ino_num) * SIZE_INODE % SIZE_BLOCK))
+
+// reference count of a data block: number of owners besides the first, a shared block is copied before it is written
+#define REFCOUNT_MAX 255
+
+// dedup index: hash table of data block fingerprints, one block per bucket chosen by fingerprint % NUM_BLKS_DEDUP_INDEX
+//     an entry is the high 32 bits of the fingerprint and the data region index + 1, 0 for an empty entry
+//     so the data region is limited to 2^32 - 1 blocks with this feature
+// dedup map: bit set for data blocks written to regular files since they were allocated, only those are shared
+// entries are hints, the block may have been rewritten in place since, its content is compared before it is shared
+#define DEDUP_ENTRY_SIZE 8
+#define DEDUP_ENTRIES_PER_BLK (SIZE_BLOCK / DEDUP_ENTRY_SIZE)
+
+// checksum table: CRC32C of every device block as last written back, indexed by block id
+//     0 if none is recorded (e.g. blocks written by mkfs.toyfs or repaired by fsck.toyfs), a checksum of 0 is stored as 1
+//     the superblock and the checksum table itself have no checksums
+#define CSUM_SIZE 4
+#define CSUM_PER_BLK (SIZE_BLOCK / CSUM_SIZE)
+#define CSUM_NONE 0
+
+// inode data offset, in ints:
+//     0 for flag, 1 for number blocks assigned
+//     2 for used size, 3 for links count
+//     with the 64bit feature, 4 for the high 32 bits of the used size and 5 reserved
+// block pointers follow from byte INODE_BLK_PTR_POS, SIZE_DATA_BLK_PTR bytes each
+#define INODE_FLAG_OFF 0
+#define INODE_NUM_BLKS_OFF 1
+#define INODE_USED_SIZE_OFF 2
+#define INODE_LINKS_COUNT_OFF 3
+#define INODE_SIZE_HI_OFF 4
+#define INODE_BLK_PTR_POS ((superblock.features & FEATURE_64BIT) ? 24 : 16)
+
+// inode flag: file type (0 regular, 1 directory, 2 soft link) in the low byte, and flag bits
+// an inline inode keeps its data in place of the block pointers, up to the end of the inode, and has no blocks
+// a compressed regular file may store its clusters compressed
+#define INODE_TYPE_MASK 0xff
+#define INODE_FLAG_INLINE 0x100
+#define INODE_FLAG_COMPRESS 0x200
+#define INODE_INLINE_DATA_POS INODE_BLK_PTR_POS // byte offset of inline data in the inode
+#define INODE_INLINE_CAPACITY (SIZE_INODE - INODE_INLINE_DATA_POS)
+
+#define SIZE_DIR_ITEM (SIZE_FILENAME + 4) // size of directory item, 4 bytes for inode number
+#define SIZE_DATA_BLK_PTR ((superblock.features & FEATURE_64BIT) ? 8 : 4) // size of data block pointers
+
+// block pointer values:
+//     BLK_PTR_HOLE for a file block with no data block, it reads as zeros
+//     data region index, with BLK_PTR_UNWRITTEN set for a reserved block never written, it reads as zeros
+//     data region index with BLK_PTR_COMPRESSED set, or BLK_PTR_CLUSTER_TAIL, for blocks of a compressed cluster
+// pointers of file blocks past the inode's block count are undefined, new pointer blocks are all holes
+// pointers are long long in memory, 4 byte pointers on disk are sign extended (see decode_blk_ptr)
+#define BLK_PTR_HOLE -1
+#define BLK_PTR_UNWRITTEN ((superblock.features & FEATURE_64BIT) ? (1LL << 62) : (1LL << 30))
+#define BLK_PTR_COMPRESSED ((superblock.features & FEATURE_64BIT) ? (1LL << 61) : (1LL << 29)) // only with the compress feature, data blocks are then indexed below it
+#define BLK_PTR_FLAGS ((superblock.features & FEATURE_COMPRESS) ? (BLK_PTR_UNWRITTEN | BLK_PTR_COMPRESSED) : BLK_PTR_UNWRITTEN)
+#define BLK_PTR_IDX(ptr) ((ptr) & ~BLK_PTR_FLAGS)
+#define BLK_PTR_IS_COMPRESSED(ptr) ((superblock.features & FEATURE_COMPRESS) && (ptr) != BLK_PTR_HOLE && ((ptr) & BLK_PTR_COMPRESSED) != 0)
+
+// compressed clusters: a cluster of COMPRESS_CLUSTER_BLKS file blocks, aligned in the file and all below
+// its block count, is stored in fewer data blocks when it compresses to them
+//     the first pointers point to the data blocks of the compressed stream, flagged BLK_PTR_COMPRESSED
+//     the rest are BLK_PTR_CLUSTER_TAIL, no data block, their content is in the stream
+// the stream starts with its length as int, followed by the LZ4 block of the whole cluster
+#define COMPRESS_CLUSTER_BLKS 8
+#define COMPRESS_CLUSTER_SIZE (COMPRESS_CLUSTER_BLKS * SIZE_BLOCK)
+#define BLK_PTR_CLUSTER_TAIL (BLK_PTR_COMPRESSED | (BLK_PTR_COMPRESSED - 1))
+
+// pointer tiers: the first pointers of an inode are direct, each of the last NUM_PTR_TIERS points to a tree of pointer blocks,
+// tier t has t levels and serves NUM_PTR_PER_BLK^t file blocks, following the file blocks of tier t - 1
+// (indirect and double indirect, and with the 64bit feature also triple and quadruple indirect)
+// the leaf pointer blocks of all tiers start at NUM_FIRST_LEV_PTR_PER_INODE + a multiple of NUM_PTR_PER_BLK
+#define NUM_PTR_TIERS ((superblock.features & FEATURE_64BIT) ? 4 : 2)
+#define NUM_PTR_PER_BLK (SIZE_BLOCK / SIZE_DATA_BLK_PTR)
+#define NUM_PTR_PER_BLK_MAX (SIZE_BLOCK / 4) // for arrays of pointers of any size
+#define NUM_FIRST_LEV_PTR_PER_INODE (NUM_DISK_PTRS_PER_INODE - NUM_PTR_TIERS)
+#define NUM_ALL_LEV_PTR_PER_INODE ((int) ptr_tier_start(NUM_PTR_TIERS + 1)) // largest number of blocks of a file
+
+// number of file blocks served by a pointer of tier tier, 1 for direct pointers (tier 0)
+long long ptr_tier_span(int tier) {
+    long long span = 1;
+    for (int i = 0; i < tier; i++) span *= NUM_PTR_PER_BLK;
+    return span;
+}
+
+// first file block of tier tier
+long long ptr_tier_start(int tier) {
+    long long start = tier > 0 ? NUM_FIRST_LEV_PTR_PER_INODE : 0;
+    for (int i = 1; i < tier; i++) start += ptr_tier_span(i);
+    return start;
+}
+
+// block pointer stored at pos, 4 byte pointers are sign extended so BLK_PTR_HOLE reads the same
+long long decode_blk_ptr(const char* pos) {
+    if (superblock.features & FEATURE_64BIT) {
+        long long ptr;
+        memcpy(&ptr, pos, sizeof(ptr));
+        return ptr;
+    }
+    int ptr;
+    memcpy(&ptr, pos, sizeof(ptr));
+    return ptr;
+}
+
+void encode_blk_ptr(char* pos, long long ptr) {
+    if (superblock.features & FEATURE_64BIT) memcpy(pos, &ptr, sizeof(ptr));
+    else {
+        int narrow = ptr;
+        memcpy(pos, &narrow, sizeof(narrow));
+    }
+}
+
+// superblock block content:
+//     magic string, 6 basic fields, extension magic, extended fields
+void encode_superblock(char* block) {
+    memset(block, 0, SIZE_BLOCK);
+    int magic_str_len = strlen(magic_string); // magic string len toyfs
+    unsigned int ext_magic = SUPERBLOCK_EXT_MAGIC;
+    char* pos = block;
+    memcpy(pos, magic_string, magic_str_len); pos += magic_str_len;
+    memcpy(pos, &superblock.size_ibmap, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(pos, &superblock.size_dbmap, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(pos, &superblock.size_inode, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(pos, &superblock.size_filename, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(pos, &superblock.root_inum, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(pos, &superblock.num_disk_ptrs_per_inode, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(pos, &ext_magic, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(pos, &superblock.block_size, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(pos, &superblock.num_journal_blks, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(pos, &superblock.features, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(pos, &superblock.num_blks, sizeof(unsigned long long));
+}
+
+// return false if block is not a toyfs superblock
+// devices formatted before mkfs.toyfs only have the basic fields, the rest of their block is undefined
+bool decode_superblock(const char* block) {
+    int magic_str_len = strlen(magic_string); // magic string len toyfs
+    if (memcmp(block, magic_string, magic_str_len) != 0) return false;
+
+    unsigned int ext_magic = 0;
+    const char* pos = block + magic_str_len;
+    memcpy(&superblock.size_ibmap, pos, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(&superblock.size_dbmap, pos, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(&superblock.size_inode, pos, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(&superblock.size_filename, pos, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(&superblock.root_inum, pos, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(&superblock.num_disk_ptrs_per_inode, pos, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    memcpy(&ext_magic, pos, sizeof(unsigned int)); pos += sizeof(unsigned int);
+    if (ext_magic == SUPERBLOCK_EXT_MAGIC) {
+        memcpy(&superblock.block_size, pos, sizeof(unsigned int)); pos += sizeof(unsigned int);
+        memcpy(&superblock.num_journal_blks, pos, sizeof(unsigned int)); pos += sizeof(unsigned int);
+        memcpy(&superblock.features, pos, sizeof(unsigned int)); pos += sizeof(unsigned int);
+        memcpy(&superblock.num_blks, pos, sizeof(unsigned long long));
+    }
+    else {
+        superblock.block_size = SIZE_BLOCK;
+        superblock.num_journal_blks = 0;
+        superblock.features = 0;
+        superblock.num_blks = 0;
+    }
+
+    return true;
+}
+
+bool has_checksum(long long block_id) {
+    return block_id >= NUM_BLKS_SUPERBLOCK && (block_id < CSUM_START_BLK || block_id >= DATA_REG_START_BLK) && block_id < (long long) superblock.num_blks;
+}
+
+// checksum table entry of a block with data
+unsigned int block_checksum(const char* data) {
+    unsigned int csum = crc32c(data, SIZE_BLOCK);
+    return csum == CSUM_NONE ? 1 : csum;
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*
+LZ4 block format codec, bundled so compression needs no external library
+
+A compressed block is a list of sequences: a token (literal length << 4 | match length - 4),
+extra literal length bytes, the literals, a 2 byte little endian match offset and extra match length bytes.
+Lengths of 15 and more continue in following bytes of 255 until one below 255.
+The last sequence has literals only, matches end at least LZ4_LAST_LITERALS bytes before the end.
+*/
+#ifndef __LZ4_H_
+#define __LZ4_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // bytes at the end always stored as literals
+#define LZ4_MF_LIMIT 12 // a match starts at least this many bytes before the end
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+uint32_t lz4_read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+int lz4_hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// write a length continuation, return NULL if it does not fit
+unsigned char* lz4_write_length(unsigned char* op, const unsigned char* op_end, int length) {
+    while (length >= 255) {
+        if (op >= op_end) return NULL;
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op >= op_end) return NULL;
+    *op++ = length;
+    return op;
+}
+
+// compress src_size bytes with greedy hash matching, return compressed size or -1 if it exceeds dst_cap
+int lz4_compress(const char* src, int src_size, char* dst, int dst_cap) {
+    const unsigned char* base = (const unsigned char*) src;
+    const unsigned char* ip = base;
+    const unsigned char* anchor = base;
+    const unsigned char* end = base + src_size;
+    unsigned char* op = (unsigned char*) dst;
+    const unsigned char* op_end = op + dst_cap;
+    int table[1 << LZ4_HASH_BITS]; // last position of each hashed 4 byte sequence
+
+    if (src_size >= LZ4_MF_LIMIT) {
+        const unsigned char* mf_limit = end - LZ4_MF_LIMIT;
+        const unsigned char* match_limit = end - LZ4_LAST_LITERALS;
+        memset(table, 0, sizeof(table));
+        ip++;
+        while (ip < mf_limit) {
+            int h = lz4_hash(lz4_read32(ip));
+            const unsigned char* ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != lz4_read32(ip)) {
+                ip++;
+                continue;
+            }
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char* match_end = ip + LZ4_MIN_MATCH;
+            const unsigned char* ref_end = ref + LZ4_MIN_MATCH;
+            while (match_end < match_limit && *match_end == *ref_end) {
+                match_end++;
+                ref_end++;
+            }
+
+            int literal_length = ip - anchor;
+            int match_length = match_end - ip - LZ4_MIN_MATCH;
+            if (op + 1 + literal_length + 2 > op_end) return -1;
+            unsigned char* token = op++;
+            *token = (literal_length < 15 ? literal_length : 15) << 4;
+            if (literal_length >= 15 && (op = lz4_write_length(op, op_end, literal_length - 15)) == NULL) return -1;
+            if (op + literal_length + 2 > op_end) return -1;
+            memcpy(op, anchor, literal_length);
+            op += literal_length;
+            int offset = ip - ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            *token |= match_length < 15 ? match_length : 15;
+            if (match_length >= 15 && (op = lz4_write_length(op, op_end, match_length - 15)) == NULL) return -1;
+
+            ip = match_end;
+            anchor = ip;
+            if (ip < mf_limit) table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - base;
+        }
+    }
+
+    int literal_length = end - anchor;
+    if (op + 1 > op_end) return -1;
+    unsigned char* token = op++;
+    *token = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15 && (op = lz4_write_length(op, op_end, literal_length - 15)) == NULL) return -1;
+    if (op + literal_length > op_end) return -1;
+    memcpy(op, anchor, literal_length);
+    op += literal_length;
+
+    return op - (unsigned char*) dst;
+}
+
+// decompress src_size bytes, return decompressed size or -1 if the input is corrupt or exceeds dst_cap
+int lz4_decompress(const char* src, int src_size, char* dst, int dst_cap) {
+    const unsigned char* ip = (const unsigned char*) src;
+    const unsigned char* end = ip + src_size;
+    unsigned char* op = (unsigned char*) dst;
+    unsigned char* op_end = op + dst_cap;
+
+    while (ip < end) {
+        int token = *ip++;
+        int literal_length = token >> 4;
+        if (literal_length == 15) {
+            int byte;
+            do {
+                if (ip >= end) return -1;
+                byte = *ip++;
+                literal_length += byte;
+            } while (byte == 255);
+        }
+        if (literal_length > end - ip || literal_length > op_end - op) return -1;
+        memcpy(op, ip, literal_length);
+        op += literal_length;
+        ip += literal_length;
+        if (ip == end) break; // last sequence
+
+        if (end - ip < 2) return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - (unsigned char*) dst) return -1;
+        int match_length = token & 15;
+        if (match_length == 15) {
+            int byte;
+            do {
+                if (ip >= end) return -1;
+                byte = *ip++;
+                match_length += byte;
+            } while (byte == 255);
+        }
+        match_length += LZ4_MIN_MATCH;
+        if (match_length > op_end - op) return -1;
+        // byte by byte, the match may overlap the bytes it produces
+        const unsigned char* ref = op - offset;
+        for (int i = 0; i < match_length; i++) op[i] = ref[i];
+        op += match_length;
+    }
+
+    return op - (unsigned char*) dst;
+}
+
+#endif
@@ -0,0 +1,339 @@
+/*
+Formatting toyfs: layout computation and bulk zeroing of metadata regions,
+used by mkfs.toyfs and by toyfs when it mounts an unformatted device
+
+Reference:
+    [1] BLKZEROOUT: https://man7.org/linux/man-pages/man8/blkdiscard.8.html
+    [2] fallocate: https://man7.org/linux/man-pages/man2/fallocate.2.html
+*/
+#ifndef __MKFS_H_
+#define __MKFS_H_
+
+#include "layout.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+#define MKFS_DEFAULT_BLKS_PER_INODE 8 // one inode per 4 KiB of device
+#define MKFS_MIN_INODES (SIZE_BLOCK * 8) // one inode bitmap block
+#define MKFS_MAX_INODES (1 << 25) // of default size, inode table offsets are int
+#define MKFS_MAX_INODES_64BIT (1 << 30) // inode numbers are int
+#define MKFS_MAX_DATA_BLKS (1 << 30) // block pointers are int
+#define MKFS_MAX_DATA_BLKS_64BIT ((1LL << 35) - SIZE_BLOCK * 8) // data block bitmap size is an unsigned int of bytes
+#define MKFS_MAX_COMPRESS_DATA_BLKS (BLK_PTR_COMPRESSED - SIZE_BLOCK * 8) // below the compressed flag and BLK_PTR_CLUSTER_TAIL
+#define MKFS_MAX_DEDUP_DATA_BLKS ((1LL << 32) - SIZE_BLOCK * 8) // dedup index entries keep 32 bit data region indexes
+#define MKFS_DEFAULT_JOURNAL_SIZE (4 << 20)
+#define MKFS_ZERO_CHUNK_SIZE (1 << 20) // bytes zeroed per request when falling back to writes
+#define MKFS_DEFAULT_INODE_SIZE 32
+#define MKFS_INLINE_INODE_SIZE 128 // default with inline_data, 112 bytes of data in the inode (104 with 64bit)
+#define MKFS_64BIT_INODE_SIZE 64 // default and minimum with 64bit, 24 bytes of fields and 5 block pointers
+
+struct MkfsOptions {
+    long long size; // bytes to format, 0 for whole device
+    int block_size;
+    long long num_inodes; // 0 for one inode per MKFS_DEFAULT_BLKS_PER_INODE blocks
+    int inode_size; // bytes, 0 for default
+    long long journal_size; // bytes
+    long long max_file_size; // bytes the largest file is expected to reach, 0 for no check
+    unsigned int features;
+    int num_threads; // threads zeroing metadata regions
+};
+
+void default_mkfs_options(struct MkfsOptions* options) {
+    options->size = 0;
+    options->block_size = SIZE_BLOCK;
+    options->num_inodes = 0;
+    options->inode_size = 0;
+    options->journal_size = 0;
+    options->max_file_size = 0;
+    options->features = 0;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    options->num_threads = num_cpus > 0 ? (num_cpus < 8 ? num_cpus : 8) : 1;
+}
+
+// size in bytes of a block device or a regular (image) file, negative on error
+long long get_device_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -errno;
+    if (S_ISBLK(st.st_mode)) {
+        unsigned long long size = 0;
+        if (ioctl(fd, BLKGETSIZE64, &size) < 0) return -errno;
+        return size;
+    }
+    return st.st_size;
+}
+
+// fill superblock for a device of num_blks blocks, return negative if it does not fit
+int compute_layout(struct MkfsOptions* options, long long num_blks) {
+    if (options->block_size != SIZE_BLOCK) {
+        printf("[MKFS] block size %d is not supported, toyfs uses %d byte blocks\n", options->block_size, SIZE_BLOCK);
+        return -EINVAL;
+    }
+
+    bool is_64bit = (options->features & FEATURE_64BIT) != 0;
+    int min_inode_size = is_64bit ? MKFS_64BIT_INODE_SIZE : MKFS_DEFAULT_INODE_SIZE;
+    int inode_size = options->inode_size;
+    if (inode_size == 0) inode_size = (options->features & FEATURE_INLINE_DATA) ? MKFS_INLINE_INODE_SIZE : min_inode_size;
+    if (inode_size < min_inode_size || inode_size > SIZE_BLOCK || (inode_size & (inode_size - 1)) != 0) {
+        printf("[MKFS] inode size %d is not a power of 2 between %d and %d\n", inode_size, min_inode_size, SIZE_BLOCK);
+        return -EINVAL;
+    }
+
+    long long num_inodes = options->num_inodes;
+    if (num_inodes <= 0) num_inodes = num_blks / MKFS_DEFAULT_BLKS_PER_INODE;
+    num_inodes = (num_inodes + MKFS_MIN_INODES - 1) / MKFS_MIN_INODES * MKFS_MIN_INODES;
+    if (num_inodes < MKFS_MIN_INODES) num_inodes = MKFS_MIN_INODES;
+    long long max_inodes = is_64bit ? MKFS_MAX_INODES_64BIT : (long long) MKFS_MAX_INODES * MKFS_DEFAULT_INODE_SIZE / inode_size;
+    if (num_inodes > max_inodes) num_inodes = max_inodes;
+
+    if ((options->features & FEATURE_JOURNAL) && options->journal_size <= 0) options->journal_size = MKFS_DEFAULT_JOURNAL_SIZE;
+    if (options->journal_size > 0) options->features |= FEATURE_JOURNAL;
+    if (options->features & FEATURE_DEDUP) options->features |= FEATURE_REFLINK; // blocks shared by content are counted
+
+    superblock.size_ibmap = num_inodes / 8;
+    superblock.size_inode = inode_size;
+    superblock.size_filename = 12; // 12 byes
+    superblock.root_inum = 0;
+    superblock.num_disk_ptrs_per_inode = is_64bit ? 5 : 4; // a direct pointer and the roots of four pointer tiers with 64bit
+    superblock.block_size = options->block_size;
+    superblock.num_journal_blks = (options->journal_size + SIZE_BLOCK - 1) / SIZE_BLOCK;
+    superblock.features = options->features;
+    superblock.num_blks = num_blks;
+
+    // data block bitmap covers the blocks left after it, iterate until its own size is stable
+    superblock.size_dbmap = 0;
+    long long num_avail_blks = 0;
+    for (int i = 0; i < 8; i++) {
+        num_avail_blks = num_blks - DATA_REG_START_BLK;
+        if (num_avail_blks <= 0) break;
+        if (num_avail_blks > (is_64bit ? MKFS_MAX_DATA_BLKS_64BIT : MKFS_MAX_DATA_BLKS)) num_avail_blks = is_64bit ? MKFS_MAX_DATA_BLKS_64BIT : MKFS_MAX_DATA_BLKS;
+        if ((options->features & FEATURE_COMPRESS) && num_avail_blks > MKFS_MAX_COMPRESS_DATA_BLKS) num_avail_blks = MKFS_MAX_COMPRESS_DATA_BLKS;
+        if ((options->features & FEATURE_DEDUP) && num_avail_blks > MKFS_MAX_DEDUP_DATA_BLKS) num_avail_blks = MKFS_MAX_DEDUP_DATA_BLKS;
+        long long num_dmap_blks = (num_avail_blks + SIZE_BLOCK * 8 - 1) / (SIZE_BLOCK * 8);
+        if (num_dmap_blks * SIZE_BLOCK == superblock.size_dbmap) break;
+        superblock.size_dbmap = num_dmap_blks * SIZE_BLOCK;
+    }
+    num_avail_blks = num_blks - DATA_REG_START_BLK;
+    if (num_avail_blks <= 0) {
+        printf("[MKFS] %lld blocks are too few for %lld inodes\n", num_blks, num_inodes);
+        return -ENOSPC;
+    }
+
+    // the pointer tiers cap a file at about 8 MiB, with 64bit at about 8 GiB (a direct pointer and 4 tiers of 64 pointer blocks)
+    long long max_file_size = (long long) NUM_ALL_LEV_PTR_PER_INODE * SIZE_BLOCK;
+    if (options->max_file_size > max_file_size) {
+        printf("[MKFS] files of %lld bytes do not fit, the format caps a file at %lld bytes\n", options->max_file_size, max_file_size);
+        return -EFBIG;
+    }
+    if (is_64bit && options->max_file_size == 0 && num_avail_blks > NUM_ALL_LEV_PTR_PER_INODE) {
+        printf("[MKFS] warning: a file holds at most %lld bytes, less than the data region\n", max_file_size);
+    }
+
+    return 0;
+}
+
+// number of data blocks backed by the device, bitmap bits beyond it are marked used
+long long num_usable_data_blks() {
+    if (superblock.num_blks == 0) return NUM_DATA_BLKS; // formatted before the device size was recorded
+    long long num_avail_blks = (long long) superblock.num_blks - DATA_REG_START_BLK;
+    return num_avail_blks < NUM_DATA_BLKS ? num_avail_blks : NUM_DATA_BLKS;
+}
+
+void print_layout(const char* path) {
+    printf("[MKFS] %s: %llu blocks of %u bytes, features 0x%x\n", path, superblock.num_blks, superblock.block_size, superblock.features);
+    printf("[MKFS]     superblock    %10d blocks at %d\n", NUM_BLKS_SUPERBLOCK, SUPERBLOCK_START_BLK);
+    printf("[MKFS]     inode bitmap  %10d blocks at %d (%d inodes)\n", NUM_BLKS_IMAP, IMAP_START_BLK, NUM_INODE);
+    printf("[MKFS]     data bitmap   %10lld blocks at %d (%lld data blocks)\n", NUM_BLKS_DMAP, DMAP_START_BLK, num_usable_data_blks());
+    printf("[MKFS]     inode table   %10lld blocks at %lld (%d bytes per inode)\n", NUM_BLKS_INODE_TABLE, INODE_TABLE_START_BLK, SIZE_INODE);
+    printf("[MKFS]     journal       %10d blocks at %lld\n", NUM_BLKS_JOURNAL, JOURNAL_START_BLK);
+    printf("[MKFS]     refcount      %10lld blocks at %lld\n", NUM_BLKS_REFCOUNT, REFCOUNT_START_BLK);
+    printf("[MKFS]     dedup index   %10lld blocks at %lld\n", NUM_BLKS_DEDUP_INDEX, DEDUP_INDEX_START_BLK);
+    printf("[MKFS]     dedup map     %10lld blocks at %lld\n", NUM_BLKS_DEDUP_MAP, DEDUP_MAP_START_BLK);
+    printf("[MKFS]     checksums     %10lld blocks at %lld\n", NUM_BLKS_CSUM, CSUM_START_BLK);
+    printf("[MKFS]     data region   %10lld blocks at %lld\n", num_usable_data_blks(), DATA_REG_START_BLK);
+}
+
+// zero a range of blocks: discard-style zeroing first [1] [2], large aligned writes as fallback
+int zero_blocks(int fd, bool is_block_device, long long start_blk, long long num_blks) {
+    off_t offset = (off_t) start_blk * SIZE_BLOCK;
+    off_t length = (off_t) num_blks * SIZE_BLOCK;
+    if (length == 0) return 0;
+
+    if (is_block_device) {
+        uint64_t range[2] = { offset, length };
+        if (ioctl(fd, BLKZEROOUT, range) == 0) return 0;
+    }
+    else {
+        // punching keeps image files sparse, zero range also works where punching does not
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) return 0;
+        if (fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, length) == 0) return 0;
+    }
+
+    char* zeros;
+    if (posix_memalign((void**) &zeros, SIZE_BLOCK, MKFS_ZERO_CHUNK_SIZE) != 0) return -ENOMEM;
+    memset(zeros, 0, MKFS_ZERO_CHUNK_SIZE);
+    while (length > 0) {
+        size_t chunk = length < MKFS_ZERO_CHUNK_SIZE ? length : MKFS_ZERO_CHUNK_SIZE;
+        ssize_t written = pwrite(fd, zeros, chunk, offset);
+        if (written <= 0) {
+            free(zeros);
+            return written < 0 ? -errno : -EIO;
+        }
+        offset += written;
+        length -= written;
+    }
+    free(zeros);
+    return 0;
+}
+
+struct ZeroTask {
+    int fd;
+    bool is_block_device;
+    long long start_blk;
+    long long num_blks;
+    int result;
+};
+
+void* zero_blocks_thread(void* arg) {
+    struct ZeroTask* task = (struct ZeroTask*) arg;
+    task->result = zero_blocks(task->fd, task->is_block_device, task->start_blk, task->num_blks);
+    return NULL;
+}
+
+// zero a range of blocks split across num_threads threads
+int zero_blocks_parallel(int fd, bool is_block_device, long long start_blk, long long num_blks, int num_threads) {
+    if (num_threads < 1) num_threads = 1;
+    long long per_thread = (num_blks + num_threads - 1) / num_threads;
+    per_thread = (per_thread + 2047) / 2048 * 2048; // 1 MiB aligned slices
+    struct ZeroTask* tasks = (struct ZeroTask*) calloc(num_threads, sizeof(struct ZeroTask));
+    pthread_t* tids = (pthread_t*) calloc(num_threads, sizeof(pthread_t));
+
+    int num_started = 0;
+    for (long long blk = start_blk; blk < start_blk + num_blks; blk += per_thread) {
+        struct ZeroTask* task = &tasks[num_started];
+        task->fd = fd;
+        task->is_block_device = is_block_device;
+        task->start_blk = blk;
+        task->num_blks = (start_blk + num_blks - blk < per_thread) ? start_blk + num_blks - blk : per_thread;
+        if (pthread_create(&tids[num_started], NULL, zero_blocks_thread, task) != 0) zero_blocks_thread(task);
+        else num_started++;
+    }
+
+    int result = 0;
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(tids[i], NULL);
+        if (tasks[i].result < 0) result = tasks[i].result;
+    }
+    free(tasks);
+    free(tids);
+    return result;
+}
+
+// write whole blocks at a block index with one request
+int write_blocks(int fd, const char* buffer, long long start_blk, long long num_blks) {
+    ssize_t size = num_blks * SIZE_BLOCK;
+    ssize_t written = pwrite(fd, buffer, size, (off_t) start_blk * SIZE_BLOCK);
+    if (written < 0) return -errno;
+    return written == size ? 0 : -EIO;
+}
+
+// format device at path, return 0 on success and negative errno if not success
+int format_toyfs(const char* path, struct MkfsOptions* options) {
+    // image files are created or extended when a size is given
+    int fd = options->size > 0 ? open(path, O_RDWR | O_DIRECT | O_CREAT, 0644) : open(path, O_RDWR | O_DIRECT);
+    if (fd < 0) return -errno;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -errno;
+    }
+    bool is_block_device = S_ISBLK(st.st_mode);
+    if (S_ISREG(st.st_mode) && st.st_size < options->size && ftruncate(fd, options->size) < 0) {
+        close(fd);
+        return -errno;
+    }
+
+    long long size = options->size;
+    if (size <= 0) size = get_device_size(fd);
+    if (size <= 0) {
+        printf("[MKFS] cannot get size of %s, give it with -s\n", path);
+        close(fd);
+        return size < 0 ? size : -EINVAL;
+    }
+    int result = compute_layout(options, size / SIZE_BLOCK);
+    if (result < 0) {
+        close(fd);
+        return result;
+    }
+
+    // superblock, bitmaps, inode table, journal, refcount table, dedup regions and checksum table start zeroed, superblock is written last
+    result = zero_blocks_parallel(fd, is_block_device, SUPERBLOCK_START_BLK, DATA_REG_START_BLK, options->num_threads);
+    if (result < 0) {
+        close(fd);
+        return result;
+    }
+
+    // data block bitmap bits beyond the device are marked used
+    long long num_usable = num_usable_data_blks();
+    if (num_usable < NUM_DATA_BLKS) {
+        long long first_blk = num_usable / (SIZE_BLOCK * 8);
+        long long num_blks = NUM_BLKS_DMAP - first_blk;
+        char* dmap;
+        if (posix_memalign((void**) &dmap, SIZE_BLOCK, num_blks * SIZE_BLOCK) != 0) {
+            close(fd);
+            return -ENOMEM;
+        }
+        memset(dmap, 0xff, num_blks * SIZE_BLOCK);
+        long long first_bit = num_usable - first_blk * SIZE_BLOCK * 8;
+        for (long long bit = 0; bit < first_bit; bit++) dmap[bit / 8] &= ~(1 << (bit % 8));
+        result = write_blocks(fd, dmap, DMAP_START_BLK + first_blk, num_blks);
+        free(dmap);
+        if (result < 0) {
+            close(fd);
+            return result;
+        }
+    }
+
+    // root directory
+    char* block;
+    if (posix_memalign((void**) &block, SIZE_BLOCK, SIZE_BLOCK) != 0) {
+        close(fd);
+        return -ENOMEM;
+    }
+    memset(block, 0, SIZE_BLOCK);
+    block[ROOT_INUM / 8] |= 1 << (ROOT_INUM % 8);
+    result = write_blocks(fd, block, IMAP_START_BLK + ROOT_INUM / (SIZE_BLOCK * 8), 1);
+    if (result == 0) {
+        memset(block, 0, SIZE_BLOCK);
+        int root_inode[4];
+        root_inode[INODE_FLAG_OFF] = 1; // directory
+        root_inode[INODE_NUM_BLKS_OFF] = 0;
+        root_inode[INODE_USED_SIZE_OFF] = 0;
+        root_inode[INODE_LINKS_COUNT_OFF] = 2; // direcotry has another "." file pointing to itself
+        memcpy(block + INODE_BLK_OFFSET(ROOT_INUM), root_inode, sizeof(root_inode));
+        result = write_blocks(fd, block, INODE_BLK(ROOT_INUM), 1);
+    }
+    if (result == 0 && fdatasync(fd) < 0) result = -errno;
+
+    // superblock makes the device recognized, so it goes last
+    if (result == 0) {
+        encode_superblock(block);
+        result = write_blocks(fd, block, SUPERBLOCK_START_BLK, 1);
+    }
+    if (result == 0 && fdatasync(fd) < 0) result = -errno;
+
+    free(block);
+    close(fd);
+    return result;
+}
+
+#endif
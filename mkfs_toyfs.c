@@ -0,0 +1,119 @@
+/*
+mkfs.toyfs: format a block device or an image file as toyfs
+
+Usage: mkfs.toyfs [options] device
+    -s size      bytes to format, default whole device, K/M/G/T suffixes accepted
+    -b size      block size, only 512 is supported
+    -N inodes    number of inodes, rounded up to a multiple of 4096
+    -I size      inode size in bytes, a power of 2, default 32, 64 with 64bit or 128 with inline_data
+    -J size      journal region size, reserved between inode table and data region
+    -O features  comma separated feature list, e.g. journal,inline_data,reflink,compress,dedup,checksum,64bit
+    -F size      largest file expected, formatting fails if the format cannot hold it
+    -T threads   threads zeroing metadata regions
+    -n           print layout without writing anything
+*/
+#include "mkfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+// parse size with optional K/M/G/T suffix, return negative on error
+long long parse_size(const char* str) {
+    char* end;
+    long long size = strtoll(str, &end, 10);
+    if (end == str || size < 0) return -1;
+    switch (*end) {
+        case 0: return size;
+        case 'k': case 'K': size <<= 10; break;
+        case 'm': case 'M': size <<= 20; break;
+        case 'g': case 'G': size <<= 30; break;
+        case 't': case 'T': size <<= 40; break;
+        default: return -1;
+    }
+    return end[1] == 0 ? size : -1;
+}
+
+// parse comma separated feature names, return negative on unknown feature
+int parse_features(const char* str, unsigned int* features) {
+    char* list = strdup(str);
+    char* save;
+    int result = 0;
+    for (char* name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        int i = 0;
+        while (i < NUM_FEATURE_NAMES && strcmp(feature_names[i].name, name) != 0) i++;
+        if (i == NUM_FEATURE_NAMES) {
+            printf("[MKFS] unknown feature %s\n", name);
+            result = -1;
+            break;
+        }
+        *features |= feature_names[i].flag;
+    }
+    free(list);
+    return result;
+}
+
+void usage(const char* prog) {
+    printf("Usage: %s [-s size] [-b block size] [-N inodes] [-I inode size] [-J journal size] [-O features] [-F max file size] [-T threads] [-n] device\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    struct MkfsOptions options;
+    default_mkfs_options(&options);
+    bool dry_run = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:N:I:J:O:F:T:nh")) != -1) {
+        switch (opt) {
+            case 's': options.size = parse_size(optarg); break;
+            case 'b': options.block_size = atoi(optarg); break;
+            case 'N': options.num_inodes = atoll(optarg); break;
+            case 'I': options.inode_size = atoi(optarg); break;
+            case 'J': options.journal_size = parse_size(optarg); break;
+            case 'O':
+                if (parse_features(optarg, &options.features) < 0) return 1;
+                break;
+            case 'F': options.max_file_size = parse_size(optarg); break;
+            case 'T': options.num_threads = atoi(optarg); break;
+            case 'n': dry_run = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1 || options.size < 0 || options.journal_size < 0 || options.max_file_size < 0 || options.num_threads < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* path = argv[optind];
+
+    if (dry_run) {
+        long long size = options.size;
+        if (size == 0) {
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) {
+                perror(path);
+                return 1;
+            }
+            size = get_device_size(fd);
+            close(fd);
+        }
+        if (size <= 0 || compute_layout(&options, size / SIZE_BLOCK) < 0) return 1;
+        print_layout(path);
+        return 0;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = format_toyfs(path, &options);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (result < 0) {
+        printf("[MKFS] formatting %s failed: %s\n", path, strerror(-result));
+        return 1;
+    }
+    print_layout(path);
+    printf("[MKFS] done in %.3f s with %d threads\n", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, options.num_threads);
+
+    return 0;
+}
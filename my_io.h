@@ -1,23 +1,50 @@
 #include <unistd.h>
+#include <sys/uio.h>
 #include <assert.h>
 #include <stdio.h>
+#include <errno.h>
+#include "stats.h"
 
 const char* device_path = "/dev/sdb1";
 
-unsigned int num_read_requests = 0;
-unsigned int num_write_requests = 0;
 size_t block_size = 512; // block size in bytes
 
-void io_read(int fd, void* buf, int index) {
-    off_t offset = index * block_size;
+void io_read(int fd, void* buf, long long index) {
+    uint64_t start = stats_now_ns();
+    off_t offset = (off_t) index * block_size;
     ssize_t read_bytes = pread(fd, buf, block_size, offset);
     assert(read_bytes == block_size);
-    num_read_requests++;
+    stats_record(STAT_OP_DEV_READ, stats_now_ns() - start);
 }
 
-void io_write(int fd, void* buf, int index) {
-    off_t offset = index * block_size;
+// read count consecutive blocks starting at index with one request
+void io_read_run(int fd, void* buf, long long index, int count) {
+    uint64_t start = stats_now_ns();
+    off_t offset = (off_t) index * block_size;
+    ssize_t read_bytes = pread(fd, buf, block_size * count, offset);
+    assert(read_bytes == block_size * count);
+    stats_record(STAT_OP_DEV_READ, stats_now_ns() - start);
+}
+
+// device writes return 0 on success and -EIO if the device failed, the caller keeps the blocks dirty
+int io_write(int fd, void* buf, long long index) {
+    uint64_t start = stats_now_ns();
+    off_t offset = (off_t) index * block_size;
     ssize_t write_bytes = pwrite(fd, buf, block_size, offset);
-    assert(write_bytes == block_size);
-    num_write_requests++;
+    stats_record(STAT_OP_DEV_WRITE, stats_now_ns() - start);
+    return write_bytes == block_size ? 0 : -EIO; // input/output error [4]
+}
+
+// write count consecutive blocks starting at index with one request, gathered from the aligned buffers in iov
+int io_write_run(int fd, const struct iovec* iov, long long index, int count) {
+    uint64_t start = stats_now_ns();
+    off_t offset = (off_t) index * block_size;
+    ssize_t write_bytes = pwritev(fd, iov, count, offset);
+    stats_record(STAT_OP_DEV_WRITE, stats_now_ns() - start);
+    return write_bytes == block_size * count ? 0 : -EIO; // input/output error [4]
+}
+
+// flush device write cache so blocks written by io_write are durable
+int io_flush(int fd) {
+    return fdatasync(fd) == 0 ? 0 : -EIO; // input/output error [4]
 }
@@ -0,0 +1,288 @@
+/*
+Runtime statistics: per-thread counters and log-linear latency histograms
+
+Reference:
+    [1] HdrHistogram: http://hdrhistogram.org/
+*/
+#ifndef __STATS_H_
+#define __STATS_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// timed operations: fuse calls and device requests
+enum StatOp {
+    STAT_OP_GETATTR,
+    STAT_OP_READDIR,
+    STAT_OP_OPEN,
+    STAT_OP_READ,
+    STAT_OP_WRITE,
+    STAT_OP_MKDIR,
+    STAT_OP_MKNOD,
+    STAT_OP_UNLINK,
+    STAT_OP_RMDIR,
+    STAT_OP_RENAME,
+    STAT_OP_LINK,
+    STAT_OP_SYMLINK,
+    STAT_OP_READLINK,
+    STAT_OP_UTIMENS,
+    STAT_OP_TRUNCATE,
+    STAT_OP_FALLOCATE,
+    STAT_OP_FLUSH,
+    STAT_OP_RELEASE,
+    STAT_OP_FSYNC,
+    STAT_OP_FSYNCDIR,
+    STAT_OP_OPENDIR,
+    STAT_OP_RELEASEDIR,
+    STAT_OP_IOCTL,
+    STAT_OP_DEV_READ,
+    STAT_OP_DEV_WRITE,
+    NUM_STAT_OPS
+};
+
+const char* stat_op_names[NUM_STAT_OPS] = {
+    "getattr", "readdir", "open", "read", "write", "mkdir", "mknod", "unlink", "rmdir", "rename",
+    "link", "symlink", "readlink", "utimens", "truncate", "fallocate", "flush", "release", "fsync", "fsyncdir",
+    "opendir", "releasedir", "ioctl", "dev_read", "dev_write",
+};
+
+// event counters
+enum StatCounter {
+    STAT_CACHE_HIT,
+    STAT_CACHE_MISS,
+    STAT_CACHE_EVICT,
+    STAT_CACHE_EVICT_DIRTY, // evictions that had to write the victim back
+    STAT_CACHE_WRITE_BACK, // dirty blocks written back by any path
+    STAT_CACHE_PREFETCH, // blocks brought to cache ahead of use
+    STAT_CACHE_CLEAN, // dirty blocks written back by the cache cleaner
+    STAT_BLOCK_READ_NO_CACHE, // block accesses that would be device reads without cache (theoretically)
+    STAT_BLOCK_WRITE_NO_CACHE, // block accesses that would be device writes without cache (theoretically)
+    STAT_ALLOC_INODE,
+    STAT_FREE_INODE,
+    STAT_ALLOC_BLOCK,
+    STAT_FREE_BLOCK,
+    STAT_ALLOC_BITS_SCANNED, // bitmap bits tested while searching for free inodes and blocks
+    STAT_CLONE_BLOCK, // data blocks shared by clones instead of copied
+    STAT_COW_BLOCK, // shared data blocks copied on write
+    STAT_CLUSTER_COMPRESS, // clusters written compressed
+    STAT_CLUSTER_DECOMPRESS, // compressed clusters read from device and decompressed
+    STAT_CLUSTER_CACHE_HIT, // compressed clusters found decompressed in memory
+    STAT_DEDUP_BLOCK, // written blocks shared with a data block of the same content instead of written
+    STAT_FINGERPRINT_CACHE_HIT, // fingerprints found in memory without reading the dedup index
+    STAT_CHECKSUM_VERIFY, // blocks read from device and compared with their recorded checksum
+    STAT_CHECKSUM_ERROR, // blocks read from device not matching their recorded checksum
+    STAT_INODE_LOCK_WAIT, // inode locks that were held by another thread when taken
+    STAT_LOOKUP_RETRY, // path lookups repeated as an inode on the way was freed before it was locked
+    STAT_DIRTY_THROTTLE, // writes paused with dirty blocks above the background threshold
+    NUM_STAT_COUNTERS
+};
+
+const char* stat_counter_names[NUM_STAT_COUNTERS] = {
+    "cache_hit", "cache_miss", "cache_evict", "cache_evict_dirty", "cache_write_back", "cache_prefetch", "cache_clean",
+    "block_read_no_cache", "block_write_no_cache",
+    "alloc_inode", "free_inode", "alloc_block", "free_block", "alloc_bits_scanned",
+    "clone_block", "cow_block", "cluster_compress", "cluster_decompress", "cluster_cache_hit",
+    "dedup_block", "fingerprint_cache_hit", "checksum_verify", "checksum_error",
+    "inode_lock_wait", "lookup_retry", "dirty_throttle",
+};
+
+// log-linear histogram of nanoseconds: 16 sub-buckets per power of two,
+// so every recorded value is within 1/16 (6.25%) of its bucket [1]
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_MAGNITUDE 40 // 2^40 ns ~ 18 minutes, larger values fall in the last bucket
+#define HIST_NUM_BUCKETS ((HIST_MAX_MAGNITUDE - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+
+struct Histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_NUM_BUCKETS];
+};
+
+// statistics of one thread, only written by its owner thread
+struct ThreadStats {
+    uint64_t counters[NUM_STAT_COUNTERS];
+    struct Histogram hists[NUM_STAT_OPS];
+    struct ThreadStats* next; // next thread in registry
+};
+
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // protects the thread registry
+struct ThreadStats* stats_threads = NULL; // registry of all threads that recorded statistics
+__thread struct ThreadStats* my_stats = NULL;
+
+struct ThreadStats* get_thread_stats() {
+    if (my_stats != NULL) return my_stats;
+
+    struct ThreadStats* stats = (struct ThreadStats*) calloc(1, sizeof(struct ThreadStats));
+    pthread_mutex_lock(&stats_lock);
+    stats->next = stats_threads;
+    stats_threads = stats;
+    pthread_mutex_unlock(&stats_lock);
+    my_stats = stats;
+
+    return my_stats;
+}
+
+uint64_t stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int hist_bucket_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) return value;
+    int magnitude = 63 - __builtin_clzll(value);
+    if (magnitude > HIST_MAX_MAGNITUDE) return HIST_NUM_BUCKETS - 1;
+    int sub_bucket = (value >> (magnitude - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (magnitude - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub_bucket;
+}
+
+// smallest value falling in a bucket
+uint64_t hist_bucket_value(int index) {
+    if (index < HIST_SUB_BUCKETS) return index;
+    int magnitude = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t sub_bucket = index % HIST_SUB_BUCKETS;
+    return (1ull << magnitude) + (sub_bucket << (magnitude - HIST_SUB_BITS));
+}
+
+// counters are read by other threads while the owner updates them, relaxed atomics keep reads untorn
+void stats_add(enum StatCounter counter, uint64_t delta) {
+    struct ThreadStats* stats = get_thread_stats();
+    __atomic_fetch_add(&stats->counters[counter], delta, __ATOMIC_RELAXED);
+}
+
+void stats_record(enum StatOp op, uint64_t latency_ns) {
+    struct Histogram* hist = &get_thread_stats()->hists[op];
+    __atomic_fetch_add(&hist->buckets[hist_bucket_index(latency_ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, latency_ns, __ATOMIC_RELAXED);
+    if (latency_ns > hist->max) __atomic_store_n(&hist->max, latency_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+}
+
+// merge statistics of all threads into snapshot
+void stats_snapshot(struct ThreadStats* snapshot) {
+    memset(snapshot, 0, sizeof(struct ThreadStats));
+    pthread_mutex_lock(&stats_lock);
+    for (struct ThreadStats* stats = stats_threads; stats != NULL; stats = stats->next) {
+        for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+            snapshot->counters[i] += __atomic_load_n(&stats->counters[i], __ATOMIC_RELAXED);
+        }
+        for (int op = 0; op < NUM_STAT_OPS; op++) {
+            struct Histogram* from = &stats->hists[op];
+            struct Histogram* to = &snapshot->hists[op];
+            to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+            to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+            if (max > to->max) to->max = max;
+            for (int i = 0; i < HIST_NUM_BUCKETS; i++) {
+                to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+uint64_t stats_counter_total(enum StatCounter counter) {
+    uint64_t total = 0;
+    pthread_mutex_lock(&stats_lock);
+    for (struct ThreadStats* stats = stats_threads; stats != NULL; stats = stats->next) {
+        total += __atomic_load_n(&stats->counters[counter], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return total;
+}
+
+uint64_t stats_op_count(enum StatOp op) {
+    uint64_t total = 0;
+    pthread_mutex_lock(&stats_lock);
+    for (struct ThreadStats* stats = stats_threads; stats != NULL; stats = stats->next) {
+        total += __atomic_load_n(&stats->hists[op].count, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return total;
+}
+
+// value at percentile (0 - 100), reported as the middle of its bucket
+uint64_t hist_percentile(struct Histogram* hist, double percentile) {
+    if (hist->count == 0) return 0;
+    uint64_t rank = (uint64_t) (percentile / 100 * hist->count + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_NUM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t low = hist_bucket_value(i);
+            uint64_t high = (i + 1 < HIST_NUM_BUCKETS) ? hist_bucket_value(i + 1) : hist->max + 1;
+            uint64_t value = low + (high - low) / 2;
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+// gauges sampled from the cache and allocator when a report is generated
+struct StatGauges {
+    uint64_t cache_blocks;
+    uint64_t cache_capacity;
+    uint64_t cache_dirty_blocks;
+    uint64_t meta_cache_blocks; // metadata blocks cached apart from data blocks, pinned bitmaps included
+    uint64_t meta_cache_capacity;
+};
+
+// text report, returns number of bytes written (truncated at size like snprintf)
+int stats_format_text(char* buffer, int size, struct ThreadStats* snapshot, struct StatGauges* gauges) {
+    int len = 0;
+    #define APPEND(...) len += snprintf(buffer + len, len < size ? size - len : 0, __VA_ARGS__)
+    APPEND("%-12s %10s %10s %10s %10s %10s %10s\n", "op", "count", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for (int op = 0; op < NUM_STAT_OPS; op++) {
+        struct Histogram* hist = &snapshot->hists[op];
+        if (hist->count == 0) continue;
+        APPEND("%-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", stat_op_names[op], (unsigned long long) hist->count,
+            hist->sum / 1000.0 / hist->count, hist_percentile(hist, 50) / 1000.0, hist_percentile(hist, 90) / 1000.0,
+            hist_percentile(hist, 99) / 1000.0, hist->max / 1000.0);
+    }
+    APPEND("\n");
+    for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+        APPEND("%-24s %llu\n", stat_counter_names[i], (unsigned long long) snapshot->counters[i]);
+    }
+    APPEND("%-24s %llu\n", "cache_blocks", (unsigned long long) gauges->cache_blocks);
+    APPEND("%-24s %llu\n", "cache_capacity", (unsigned long long) gauges->cache_capacity);
+    APPEND("%-24s %llu\n", "cache_dirty_blocks", (unsigned long long) gauges->cache_dirty_blocks);
+    APPEND("%-24s %llu\n", "meta_cache_blocks", (unsigned long long) gauges->meta_cache_blocks);
+    APPEND("%-24s %llu\n", "meta_cache_capacity", (unsigned long long) gauges->meta_cache_capacity);
+    #undef APPEND
+    return len;
+}
+
+// json report, returns number of bytes written (truncated at size like snprintf)
+int stats_format_json(char* buffer, int size, struct ThreadStats* snapshot, struct StatGauges* gauges) {
+    int len = 0;
+    #define APPEND(...) len += snprintf(buffer + len, len < size ? size - len : 0, __VA_ARGS__)
+    APPEND("{\"ops\":{");
+    for (int op = 0; op < NUM_STAT_OPS; op++) {
+        struct Histogram* hist = &snapshot->hists[op];
+        APPEND("%s\"%s\":{\"count\":%llu,\"sum_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+            op == 0 ? "" : ",", stat_op_names[op], (unsigned long long) hist->count, (unsigned long long) hist->sum,
+            (unsigned long long) hist_percentile(hist, 50), (unsigned long long) hist_percentile(hist, 90),
+            (unsigned long long) hist_percentile(hist, 99), (unsigned long long) hist_percentile(hist, 99.9),
+            (unsigned long long) hist->max);
+    }
+    APPEND("},\"counters\":{");
+    for (int i = 0; i < NUM_STAT_COUNTERS; i++) {
+        APPEND("%s\"%s\":%llu", i == 0 ? "" : ",", stat_counter_names[i], (unsigned long long) snapshot->counters[i]);
+    }
+    APPEND("},\"gauges\":{\"cache_blocks\":%llu,\"cache_capacity\":%llu,\"cache_dirty_blocks\":%llu,"
+        "\"meta_cache_blocks\":%llu,\"meta_cache_capacity\":%llu}}\n",
+        (unsigned long long) gauges->cache_blocks, (unsigned long long) gauges->cache_capacity,
+        (unsigned long long) gauges->cache_dirty_blocks, (unsigned long long) gauges->meta_cache_blocks,
+        (unsigned long long) gauges->meta_cache_capacity);
+    #undef APPEND
+    return len;
+}
+
+#endif
@@ -0,0 +1,65 @@
+#include "test_util.h"
+
+// with 64bit a file gets blocks in every pointer tier up to quadruple indirect, and a size past 4 GiB
+void test_quadruple_indirect() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_64BIT);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(NUM_PTR_TIERS == 4 && NUM_PTR_PER_BLK == 64 && NUM_FIRST_LEV_PTR_PER_INODE == 1);
+    int ino_num = create_test_file("f");
+    long long used = count_used_data_blocks();
+
+    long long last_blk = NUM_ALL_LEV_PTR_PER_INODE - 1;
+    long long file_blks[] = { 0, ptr_tier_start(1), ptr_tier_start(2), ptr_tier_start(3), ptr_tier_start(4), ptr_tier_start(4) + ptr_tier_span(3) + 5, last_blk };
+    int num_blks = sizeof(file_blks) / sizeof(file_blks[0]);
+    char buffer[SIZE_BLOCK];
+    for (int i = 0; i < num_blks; i++) {
+        memset(buffer, 'a' + i, sizeof(buffer));
+        assert(write_(ino_num, buffer, SIZE_BLOCK, file_blks[i] * SIZE_BLOCK) == SIZE_BLOCK);
+    }
+    off_t size = (last_blk + 1) * SIZE_BLOCK;
+    assert(size > (4LL << 30));
+    assert(get_file_size(ino_num) == size);
+    memset(buffer, 'z', sizeof(buffer));
+    assert(write_(ino_num, buffer, 1, size) == -EFBIG);
+    unmount_test_image();
+
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(get_file_size(ino_num) == size);
+    struct stat st;
+    assert(getattr_(ino_num, &st) == 0 && st.st_size == size);
+    for (int i = 0; i < num_blks; i++) {
+        assert(read_(ino_num, buffer, SIZE_BLOCK, file_blks[i] * SIZE_BLOCK) == SIZE_BLOCK);
+        for (int j = 0; j < SIZE_BLOCK; j++) assert(buffer[j] == 'a' + i);
+    }
+    // holes between them read as zeros
+    assert(read_(ino_num, buffer, SIZE_BLOCK, (ptr_tier_start(4) + 1) * SIZE_BLOCK) == SIZE_BLOCK);
+    for (int j = 0; j < SIZE_BLOCK; j++) assert(buffer[j] == 0);
+
+    // truncating frees the data blocks and the pointer blocks of every tier
+    assert(truncate_(ino_num, 0) == 0);
+    assert(count_used_data_blocks() == used);
+    unmount_test_image();
+}
+
+// without 64bit files stop at double indirect pointers
+void test_narrow_pointers() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(NUM_PTR_TIERS == 2 && NUM_PTR_PER_BLK == 128);
+    int ino_num = create_test_file("f");
+    long long last_blk = NUM_ALL_LEV_PTR_PER_INODE - 1;
+    char buffer[SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    assert(write_(ino_num, buffer, SIZE_BLOCK, last_blk * SIZE_BLOCK) == SIZE_BLOCK);
+    assert(write_(ino_num, buffer, SIZE_BLOCK, (last_blk + 1) * SIZE_BLOCK) == -EFBIG);
+    assert(get_file_size(ino_num) == (last_blk + 1) * SIZE_BLOCK);
+    unmount_test_image();
+}
+
+int main() {
+    test_quadruple_indirect();
+    test_narrow_pointers();
+    unlink(TEST_IMAGE);
+    printf("test_64bit passed\n");
+    return 0;
+}
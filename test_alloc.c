@@ -0,0 +1,106 @@
+#include "test_util.h"
+
+// a large write gets contiguous data blocks, and goes to the device in few requests
+void test_contiguous() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    int num_blks = 1024;
+    char* buffer = (char*) malloc(num_blks * SIZE_BLOCK);
+    for (int i = 0; i < num_blks * SIZE_BLOCK; i++) buffer[i] = i % 251;
+    assert(write_(ino_num, buffer, num_blks * SIZE_BLOCK, 0) == num_blks * SIZE_BLOCK);
+
+    // runs break only where a pointer block is taken from the same region
+    long long ptrs[1024];
+    int num_runs = 1;
+    for (int i = 0; i < num_blks; i++) {
+        assert(get_block_ptr(ino_num, i, &ptrs[i]) == 0 && ptrs[i] >= 0 && (ptrs[i] & BLK_PTR_UNWRITTEN) == 0);
+        if (i > 0 && ptrs[i] != ptrs[i - 1] + 1) num_runs++;
+    }
+    assert(num_runs <= 2 + num_blks / NUM_PTR_PER_BLK);
+
+    uint64_t writes = stats_op_count(STAT_OP_DEV_WRITE);
+    assert(write_dirty_blocks_back() == 0);
+    assert(stats_op_count(STAT_OP_DEV_WRITE) - writes < (uint64_t) num_blks / 8);
+
+    unmount_test_image();
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    char* out = (char*) malloc(num_blks * SIZE_BLOCK);
+    assert(read_(ino_num, out, num_blks * SIZE_BLOCK, 0) == num_blks * SIZE_BLOCK);
+    assert(memcmp(out, buffer, num_blks * SIZE_BLOCK) == 0);
+    free(out);
+    free(buffer);
+    unmount_test_image();
+}
+
+// running out of space part way keeps the blocks assigned so far, unless their pointer block cannot be allocated
+void test_no_space() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int f = create_test_file("f");
+    int g = create_test_file("g");
+    char buffer[SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    assert(write_(g, buffer, SIZE_BLOCK, 4 * SIZE_BLOCK) == SIZE_BLOCK); // g has its pointer block
+    fill_data_blocks(3);
+    long long used = count_used_data_blocks();
+
+    // no pointer block for f
+    assert(fallocate_(f, 0, 4 * SIZE_BLOCK, 16 * SIZE_BLOCK) == -ENOSPC);
+    assert(count_used_data_blocks() == used);
+    long long ptr = 0;
+    assert(get_block_ptr(f, 4, &ptr) == 0 && ptr == BLK_PTR_HOLE);
+
+    assert(fallocate_(g, FALLOC_FL_KEEP_SIZE, 5 * SIZE_BLOCK, 16 * SIZE_BLOCK) == -ENOSPC);
+    assert(count_used_data_blocks() == used + 3);
+    for (int i = 5; i < 8; i++) assert(get_block_ptr(g, i, &ptr) == 0 && (ptr & BLK_PTR_UNWRITTEN) != 0);
+    assert(get_block_ptr(g, 8, &ptr) == 0 && ptr == BLK_PTR_HOLE);
+
+    unmount_test_image();
+}
+
+// one write crossing from direct pointers into the indirect and double indirect tiers takes one pointer block per
+// indirect block, truncating frees each tree when its last block goes
+void test_indirect_tiers() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    long long used = count_used_data_blocks();
+
+    long long first_blk = ptr_tier_start(1) - 1; // the last direct pointer
+    long long end_blk = ptr_tier_start(2) + NUM_PTR_PER_BLK + 2; // 2 leaves below the double indirect block
+    int num_blks = end_blk - first_blk;
+    char* buffer = (char*) malloc(num_blks * SIZE_BLOCK);
+    for (int i = 0; i < num_blks * SIZE_BLOCK; i++) buffer[i] = i % 253;
+    assert(write_(ino_num, buffer, num_blks * SIZE_BLOCK, first_blk * SIZE_BLOCK) == num_blks * SIZE_BLOCK);
+    assert(count_used_data_blocks() == used + num_blks + 1 + 1 + 2);
+    for (long long i = first_blk; i < end_blk; i++) {
+        long long ptr = BLK_PTR_HOLE;
+        assert(get_block_ptr(ino_num, i, &ptr) == 0 && ptr >= 0);
+    }
+    unmount_test_image();
+
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    char* out = (char*) malloc(num_blks * SIZE_BLOCK);
+    assert(read_(ino_num, out, num_blks * SIZE_BLOCK, first_blk * SIZE_BLOCK) == num_blks * SIZE_BLOCK);
+    assert(memcmp(out, buffer, num_blks * SIZE_BLOCK) == 0);
+    assert(first_blk > 0 && read_(ino_num, out, SIZE_BLOCK, 0) == SIZE_BLOCK); // a hole before the first block
+    for (int i = 0; i < SIZE_BLOCK; i++) assert(out[i] == 0);
+
+    assert(truncate_(ino_num, ptr_tier_start(2) * SIZE_BLOCK) == 0);
+    assert(count_used_data_blocks() == used + (ptr_tier_start(2) - first_blk) + 1);
+    assert(truncate_(ino_num, 0) == 0);
+    assert(count_used_data_blocks() == used);
+    free(out);
+    free(buffer);
+    unmount_test_image();
+}
+
+int main() {
+    test_contiguous();
+    test_no_space();
+    test_indirect_tiers();
+    unlink(TEST_IMAGE);
+    printf("test_alloc passed\n");
+    return 0;
+}
@@ -1,59 +1,280 @@
-#include "cache.h"
-
-void display(struct CacheQueue* queue, struct Hash* hash) {
-    printf("lru queue id in order / reverse order):\n");
-    struct CacheNode* traverse = queue->front;
-    while(traverse != NULL) {
-        printf("%d ", traverse->block_id);
-        traverse = traverse->queue_next;
-    }
-    printf("\n");
-    traverse = queue->rear;
-    while(traverse != NULL) {
-        printf("%d ", traverse->block_id);
-        traverse = traverse->queue_prev;
-    }
-    printf("\n"); 
-    for (int i = 0; i < hash->hash_capacity; i++) {
-        printf("hash bucket %d id in order / reverse order:\n", i);
-        traverse = hash->buckets[i];
-        while(traverse != NULL) {
-            printf("%d ", traverse->block_id);
-            traverse = traverse->hash_next;
-        }
-        printf("\n");
-        traverse = hash->buckets[i];
-        while(traverse != NULL && traverse->hash_next != NULL) {
-            traverse = traverse->hash_next;
-        }
-        while(traverse != NULL) {
-            printf("%d ", traverse->block_id);
-            traverse = traverse->hash_prev;
-        }
-        printf("\n");
-    }
+#include "test_util.h"
+
+// block ids from the front to the rear of a cache queue
+int queue_block_ids(struct CacheQueue* queue, long long* block_ids) {
+    int count = 0;
+    for (struct CacheNode* node = queue->front; node != NULL; node = node->queue_next) block_ids[count++] = node->block_id;
+    return count;
 }
 
-int main() {
+// a full cache evicts its least recently used block
+void test_lru_order() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
     struct CacheQueue* queue = create_cache_queue(4);
+    struct Hash* hash = create_hash_table(10);
+
+    long long accesses[] = { 0, 0, 1, 2, 3, 0, 12, 13, 3, 12, 0, 22 };
+    for (int i = 0; i < (int) (sizeof(accesses) / sizeof(accesses[0])); i++) assert(get_block_cache(queue, hash, accesses[i]) != NULL);
+    long long block_ids[8];
+    assert(queue_block_ids(queue, block_ids) == 4);
+    assert(block_ids[0] == 22 && block_ids[1] == 0 && block_ids[2] == 12 && block_ids[3] == 3);
+    assert(find_block_cache(hash, 13) == NULL && find_block_cache(hash, 1) == NULL);
 
+    while (!is_queue_empty(queue)) dequeue(queue, hash);
+    free(queue);
+    free(hash->buckets);
+    free(hash);
+    unmount_test_image();
+}
+
+// a pinned block stays cached, the queue grows past its capacity while every block it could evict is pinned
+void test_pinned_not_evicted() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    struct CacheQueue* queue = create_cache_queue(4);
     struct Hash* hash = create_hash_table(10);
 
-    get_block_cache(queue, hash, 0);
-    get_block_cache(queue, hash, 0);
-    get_block_cache(queue, hash, 1);
-    get_block_cache(queue, hash, 2);
-    get_block_cache(queue, hash, 3);
-    get_block_cache(queue, hash, 0);
-    get_block_cache(queue, hash, 12);
-    get_block_cache(queue, hash, 13);
-    get_block_cache(queue, hash, 3);
-    get_block_cache(queue, hash, 12);
-    get_block_cache(queue, hash, 0);
-    get_block_cache(queue, hash, 22);
-    // get_block_cache(queue, hash, 103);
-
-    display(queue, hash);
-
-    return 0; 
-}
\ No newline at end of file
+    struct CacheNode* pinned = pin_block_cache(queue, hash, 0, true);
+    assert(pinned != NULL);
+    for (int i = 1; i <= 8; i++) assert(get_block_cache(queue, hash, i) != NULL);
+    assert(queue->count == 4 && find_block_cache(hash, 0) == pinned);
+
+    struct CacheNode* nodes[3];
+    for (int i = 0; i < 3; i++) nodes[i] = pin_block_cache(queue, hash, 6 + i, true);
+    assert(get_block_cache(queue, hash, 9) != NULL);
+    assert(queue->count == 5);
+    for (int i = 0; i < 3; i++) assert(find_block_cache(hash, 6 + i) == nodes[i]);
+
+    unpin_block_cache(pinned);
+    for (int i = 0; i < 3; i++) unpin_block_cache(nodes[i]);
+    for (int i = 10; i <= 14; i++) assert(get_block_cache(queue, hash, i) != NULL);
+    assert(find_block_cache(hash, 0) == NULL);
+
+    while (!is_queue_empty(queue)) dequeue(queue, hash);
+    free(queue);
+    free(hash->buckets);
+    free(hash);
+    unmount_test_image();
+}
+
+bool looked_up;
+
+struct CacheQueue* pinned_queue;
+struct Hash* pinned_hash;
+
+void* pinned_lookup_thread(void* arg) {
+    pthread_mutex_lock(&cache_lock);
+    assert(get_block_cache(pinned_queue, pinned_hash, 100) != NULL);
+    pthread_mutex_unlock(&cache_lock);
+    __atomic_store_n(&looked_up, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// with every node pinned a cache grows up to its hard limit, a miss past it waits for a pin to be released
+void test_pinned_hard_limit() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    struct CacheQueue* queue = create_cache_queue(16);
+    struct Hash* hash = create_hash_table(32);
+    unsigned limit = queue_hard_limit(queue);
+    assert(limit > 16);
+
+    struct CacheNode* nodes[64];
+    pthread_mutex_lock(&cache_lock);
+    for (unsigned i = 0; i < limit; i++) assert((nodes[i] = pin_block_cache(queue, hash, i, true)) != NULL);
+    assert(queue->count == limit);
+    // nothing to evict, the miss fails once it waited long enough
+    assert(get_block_cache(queue, hash, 99) == NULL);
+    assert(queue->count == limit);
+    pthread_mutex_unlock(&cache_lock);
+
+    looked_up = false;
+    pinned_queue = queue;
+    pinned_hash = hash;
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, pinned_lookup_thread, NULL) == 0);
+    usleep(100000);
+    assert(!__atomic_load_n(&looked_up, __ATOMIC_ACQUIRE));
+    unpin_block_cache(nodes[0]);
+    assert(pthread_join(tid, NULL) == 0);
+    assert(looked_up && queue->count == limit);
+    pthread_mutex_lock(&cache_lock);
+    assert(find_block_cache(hash, 0) == NULL && find_block_cache(hash, 100) != NULL);
+    pthread_mutex_unlock(&cache_lock);
+
+    for (unsigned i = 1; i < limit; i++) unpin_block_cache(nodes[i]);
+    while (!is_queue_empty(queue) && dequeue(queue, hash) == 0);
+    free(queue);
+    free(hash->buckets);
+    free(hash);
+    unmount_test_image();
+}
+
+int reject_block_id;
+
+bool reject_one_block(long long block_id, const char* data) {
+    return block_id != reject_block_id;
+}
+
+// prefetch counts the blocks it cached, not a block failing verification
+void test_prefetch_counts() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    struct CacheQueue* queue = create_cache_queue(64);
+    struct Hash* hash = create_hash_table(64);
+    long long block_ids[16];
+    for (int i = 0; i < 16; i++) block_ids[i] = 1000 + i;
+    reject_block_id = 1005;
+    verify_block_hook = reject_one_block;
+
+    pthread_mutex_lock(&cache_lock);
+    uint64_t prefetched = stats_counter_total(STAT_CACHE_PREFETCH);
+    assert(prefetch_block_cache(queue, hash, block_ids, 16) == 15);
+    assert(stats_counter_total(STAT_CACHE_PREFETCH) - prefetched == 15);
+    assert(queue->count == 15 && find_block_cache(hash, 1005) == NULL);
+    pthread_mutex_unlock(&cache_lock);
+
+    verify_block_hook = NULL;
+    while (!is_queue_empty(queue) && dequeue(queue, hash) == 0);
+    free(queue);
+    free(hash->buckets);
+    free(hash);
+    unmount_test_image();
+}
+
+void* lookup_thread(void* arg) {
+    pthread_mutex_lock(&cache_lock);
+    assert(get_block_cache(queue, hash, DATA_REG_START_BLK + 1) != NULL);
+    pthread_mutex_unlock(&cache_lock);
+    __atomic_store_n(&looked_up, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// block data is copied under the content lock of a pinned node, other threads look blocks up meanwhile
+void test_copy_outside_cache_lock() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    char buffer[SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    assert(set_data_block_data(DIRTY_OWNER_NONE, 0, buffer, SIZE_BLOCK, 0) == SIZE_BLOCK);
+
+    pthread_mutex_lock(&cache_lock);
+    struct CacheNode* node = find_block_cache(hash, DATA_REG_START_BLK);
+    assert(node != NULL && node->pins == 0);
+    pthread_mutex_unlock(&cache_lock);
+    // a writer copying into the block holds its content lock for long
+    pthread_rwlock_wrlock(&node->content_lock);
+    looked_up = false;
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, lookup_thread, NULL) == 0);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 5;
+    assert(pthread_timedjoin_np(tid, NULL, &deadline) == 0);
+    assert(looked_up);
+    pthread_rwlock_unlock(&node->content_lock);
+
+    memset(buffer, 0, sizeof(buffer));
+    assert(get_data_block_data(0, buffer, SIZE_BLOCK, 0) == SIZE_BLOCK);
+    for (int i = 0; i < SIZE_BLOCK; i++) assert(buffer[i] == 'a');
+    assert(node->pins == 0);
+    unmount_test_image();
+}
+
+// metadata blocks go to the metadata cache, bitmaps to their own when pinned, data blocks to the data cache
+void test_meta_routing() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    long long meta_blocks[] = { 0, IMAP_START_BLK, DMAP_START_BLK, INODE_TABLE_START_BLK, DATA_REG_START_BLK - 1 };
+    for (int i = 0; i < 5; i++) assert(queue_of(meta_blocks[i]) == meta_queue && hash_of(meta_blocks[i]) == meta_hash);
+    assert(queue_of(DATA_REG_START_BLK) == queue && hash_of(DATA_REG_START_BLK) == hash);
+
+    destroy_meta_caches();
+    assert(create_meta_caches(TEST_META_CACHE_BLKS, true) == 0);
+    assert(bitmap_queue->count == INODE_TABLE_START_BLK - IMAP_START_BLK);
+    assert(queue_of(IMAP_START_BLK) == bitmap_queue && hash_of(IMAP_START_BLK) == bitmap_hash);
+    assert(queue_of(INODE_TABLE_START_BLK - 1) == bitmap_queue);
+    assert(queue_of(0) == meta_queue && queue_of(INODE_TABLE_START_BLK) == meta_queue);
+    assert(queue_of(DATA_REG_START_BLK) == queue);
+
+    // without metadata caches everything is cached with data blocks
+    destroy_meta_caches();
+    assert(queue_of(INODE_TABLE_START_BLK) == queue && hash_of(IMAP_START_BLK) == hash);
+    assert(create_meta_caches(TEST_META_CACHE_BLKS, false) == 0);
+    unmount_test_image();
+}
+
+// reading and writing a file far larger than the data cache leaves the metadata blocks it used cached
+void test_data_traffic_keeps_metadata() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, 64);
+    int ino_num = create_test_file("f");
+    char buffer[64 * SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    for (int i = 0; i < 32; i++) assert(write_(ino_num, buffer, sizeof(buffer), i * sizeof(buffer)) == sizeof(buffer));
+    for (int i = 0; i < 32; i++) assert(read_(ino_num, buffer, sizeof(buffer), i * sizeof(buffer)) == sizeof(buffer));
+
+    assert(queue->count <= 64);
+    assert(find_block_cache(meta_hash, INODE_BLK(ino_num)) != NULL);
+    assert(find_block_cache(meta_hash, IMAP_START_BLK) != NULL);
+    assert(find_block_cache(meta_hash, DMAP_START_BLK) != NULL);
+    for (struct CacheNode* node = meta_queue->front; node != NULL; node = node->queue_next) assert(node->block_id < DATA_REG_START_BLK);
+    for (struct CacheNode* node = queue->front; node != NULL; node = node->queue_next) assert(node->block_id >= DATA_REG_START_BLK);
+    unmount_test_image();
+}
+
+bool balanced;
+
+void* balance_thread(void* arg) {
+    balance_dirty_blocks(1);
+    __atomic_store_n(&balanced, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// dirty metadata blocks count against the thresholds of neither cache, and are written back when their cache is dropped
+void test_dirty_metadata_not_throttled() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, 64);
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < 32; i++) mark_block_dirty(dirty_table, get_meta_block_cache(INODE_TABLE_START_BLK + i), DIRTY_OWNER_NONE);
+    assert(meta_queue->num_dirty == 32 && queue->num_dirty == 0);
+    assert(meta_queue->num_dirty > dirty_limit_blocks(queue));
+    cleaner_running = true; // no cleaner thread, a throttled writer would wait for good
+    pthread_mutex_unlock(&cache_lock);
+
+    uint64_t throttled = stats_counter_total(STAT_DIRTY_THROTTLE);
+    balanced = false;
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, balance_thread, NULL) == 0);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 5;
+    assert(pthread_timedjoin_np(tid, NULL, &deadline) == 0);
+    assert(balanced && stats_counter_total(STAT_DIRTY_THROTTLE) == throttled);
+    pthread_mutex_lock(&cache_lock);
+    cleaner_running = false;
+    pthread_mutex_unlock(&cache_lock);
+
+    uint64_t written = stats_counter_total(STAT_CACHE_WRITE_BACK), requests = stats_op_count(STAT_OP_DEV_WRITE);
+    destroy_meta_caches();
+    assert(stats_counter_total(STAT_CACHE_WRITE_BACK) - written == 32);
+    assert(stats_op_count(STAT_OP_DEV_WRITE) - requests == 1); // consecutive blocks, one request
+    assert(num_dirty_blocks == queue->num_dirty);
+    assert(create_meta_caches(TEST_META_CACHE_BLKS, false) == 0);
+    unmount_test_image();
+}
+
+int main() {
+    test_lru_order();
+    test_pinned_not_evicted();
+    test_pinned_hard_limit();
+    test_prefetch_counts();
+    test_copy_outside_cache_lock();
+    test_meta_routing();
+    test_data_traffic_keeps_metadata();
+    test_dirty_metadata_not_throttled();
+    unlink(TEST_IMAGE);
+    printf("test_cache passed\n");
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include "test_util.h"
+
+// CRC32C of the check string of the Castagnoli polynomial, the instruction and table implementations agree
+void test_crc32c() {
+    assert(crc32c("123456789", 9) == 0xE3069283);
+    crc32c_init_tables();
+    char buffer[3 * SIZE_BLOCK + 7];
+    unsigned seed = 1;
+    for (int i = 0; i < (int) sizeof(buffer); i++) buffer[i] = rand_r(&seed);
+    int sizes[] = { 0, 1, 7, 8, 100, SIZE_BLOCK, 3 * SIZE_BLOCK + 7 };
+    for (int i = 0; i < 7; i++) assert(crc32c(buffer, sizes[i]) == ~crc32c_table(0xFFFFFFFF, buffer, sizes[i]));
+}
+
+// overwrite block block_id of the image behind the back of toyfs
+void corrupt_block(long long block_id) {
+    int fd = open(TEST_IMAGE, O_WRONLY);
+    assert(fd >= 0);
+    char byte = 'x';
+    assert(pwrite(fd, &byte, 1, block_id * SIZE_BLOCK + 100) == 1);
+    assert(fsync(fd) == 0);
+    close(fd);
+}
+
+// a data block changed on the device fails its checksum when read, until it is overwritten whole
+void test_corrupted_data_block() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_CHECKSUM);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    char buffer[4 * SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    assert(write_(ino_num, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    long long ptr = BLK_PTR_HOLE;
+    assert(get_block_ptr(ino_num, 1, &ptr) == 0 && ptr >= 0);
+    unmount_test_image();
+
+    corrupt_block(DATA_REG_START_BLK + ptr);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    uint64_t errors = stats_counter_total(STAT_CHECKSUM_ERROR);
+    assert(read_(ino_num, buffer, SIZE_BLOCK, 0) == SIZE_BLOCK);
+    assert(read_(ino_num, buffer, SIZE_BLOCK, SIZE_BLOCK) == -1);
+    assert(read_(ino_num, buffer, SIZE_BLOCK, SIZE_BLOCK) == -1); // not cached
+    assert(stats_counter_total(STAT_CHECKSUM_ERROR) == errors + 2);
+    assert(read_(ino_num, buffer, SIZE_BLOCK, 2 * SIZE_BLOCK) == SIZE_BLOCK);
+
+    memset(buffer, 'b', SIZE_BLOCK);
+    assert(write_(ino_num, buffer, SIZE_BLOCK, SIZE_BLOCK) == SIZE_BLOCK);
+    unmount_test_image();
+
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(read_(ino_num, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    for (int i = 0; i < (int) sizeof(buffer); i++) assert(buffer[i] == (i / SIZE_BLOCK == 1 ? 'b' : 'a'));
+    unmount_test_image();
+}
+
+// metadata blocks are checked as well, a corrupted inode table block fails the operations reading it
+void test_corrupted_inode_block() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_CHECKSUM);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    unmount_test_image();
+
+    corrupt_block(INODE_BLK(ino_num));
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(get_file_size(ino_num) < 0);
+    unmount_test_image();
+}
+
+int main() {
+    test_crc32c();
+    test_corrupted_data_block();
+    test_corrupted_inode_block();
+    unlink(TEST_IMAGE);
+    printf("test_checksum passed\n");
+    return 0;
+}
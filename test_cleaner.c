@@ -0,0 +1,174 @@
+#include "test_util.h"
+
+#define SMALL_CACHE_BLKS 1024
+
+bool writer_done;
+
+void* throttled_writer(void* arg) {
+    balance_dirty_blocks(1);
+    __atomic_store_n(&writer_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// dirty more data blocks than dirty_ratio allows, with no cleaner writing them back
+int dirty_past_limit() {
+    int ino_num = create_test_file("f");
+    char buffer[64 * SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    for (int i = 0; i < 6; i++) assert(write_(ino_num, buffer, sizeof(buffer), i * sizeof(buffer)) == sizeof(buffer));
+    assert(queue->num_dirty >= dirty_limit_blocks(queue));
+    return ino_num;
+}
+
+// start a writer waiting at the hard limit, as if the cleaner were running but made no progress
+void start_waiting_writer(pthread_t* tid) {
+    pthread_mutex_lock(&cache_lock);
+    cleaner_running = true;
+    pthread_mutex_unlock(&cache_lock);
+    writer_done = false;
+    assert(pthread_create(tid, NULL, throttled_writer, NULL) == 0);
+    usleep(100000);
+    assert(!__atomic_load_n(&writer_done, __ATOMIC_ACQUIRE));
+}
+
+// the writer returns within a few seconds
+void join_woken_writer(pthread_t tid) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 5;
+    assert(pthread_timedjoin_np(tid, NULL, &deadline) == 0);
+    pthread_mutex_lock(&cache_lock);
+    cleaner_running = false;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// a writer waiting for dirty blocks to drop below the limit is woken by write-backs other than the cleaner's
+void test_write_back_wakes_writer() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, SMALL_CACHE_BLKS);
+    dirty_past_limit();
+    pthread_t tid;
+    start_waiting_writer(&tid);
+    assert(write_dirty_blocks_back() == 0);
+    join_woken_writer(tid);
+    unmount_test_image();
+}
+
+void test_sync_inode_wakes_writer() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, SMALL_CACHE_BLKS);
+    int ino_num = dirty_past_limit();
+    pthread_t tid;
+    start_waiting_writer(&tid);
+    assert(sync_inode(ino_num, 0) == 0);
+    join_woken_writer(tid);
+    unmount_test_image();
+}
+
+// with the cleaner running, writes larger than the cache keep dirty blocks near the limit and read back after a remount
+void test_cleaner_bounds_dirty_blocks() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, SMALL_CACHE_BLKS);
+    assert(start_cache_cleaner(64) == 0);
+    uint64_t cleaned = stats_counter_total(STAT_CACHE_CLEAN), throttled = stats_counter_total(STAT_DIRTY_THROTTLE);
+    int ino_num = create_test_file("f");
+    char buffer[64 * SIZE_BLOCK];
+    unsigned max_dirty = 0;
+    for (int i = 0; i < 64; i++) {
+        memset(buffer, 'a' + i % 26, sizeof(buffer));
+        assert(write_(ino_num, buffer, sizeof(buffer), i * sizeof(buffer)) == sizeof(buffer));
+        pthread_mutex_lock(&cache_lock);
+        if (queue->num_dirty > max_dirty) max_dirty = queue->num_dirty;
+        pthread_mutex_unlock(&cache_lock);
+    }
+    assert(stats_counter_total(STAT_CACHE_CLEAN) > cleaned);
+    assert(stats_counter_total(STAT_DIRTY_THROTTLE) > throttled);
+    assert(max_dirty <= dirty_limit_blocks(queue) + 64);
+    unmount_test_image();
+
+    mount_test_image(TEST_IMAGE, SMALL_CACHE_BLKS);
+    for (int i = 0; i < 64; i++) {
+        assert(read_(ino_num, buffer, sizeof(buffer), i * sizeof(buffer)) == sizeof(buffer));
+        for (int j = 0; j < (int) sizeof(buffer); j++) assert(buffer[j] == 'a' + i % 26);
+    }
+    unmount_test_image();
+}
+
+// clean_lru_tail writes back the dirty blocks at the lru end, so the evictions that follow write nothing
+void test_clean_lru_tail() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, SMALL_CACHE_BLKS);
+    clean_frames_low = 64;
+    int ino_num = create_test_file("f");
+    char buffer[64 * SIZE_BLOCK];
+    for (int i = 0; i < 2; i++) {
+        memset(buffer, 'a' + i, sizeof(buffer));
+        assert(write_(ino_num, buffer, sizeof(buffer), i * sizeof(buffer)) == sizeof(buffer));
+    }
+    unsigned dirty = queue->num_dirty;
+    assert(dirty >= 128);
+
+    char* clean_buffer = NULL;
+    assert(posix_memalign((void**) &clean_buffer, SIZE_BLOCK, 2 * clean_frames_low * SIZE_BLOCK) == 0);
+    struct CacheNode* nodes[128];
+    int owners[128];
+    pthread_mutex_lock(&cache_lock);
+    int result = clean_lru_tail(queue, clean_buffer, nodes, owners, false);
+    assert(result > 0 && queue->num_dirty == dirty - result);
+    int num_seen = 0;
+    for (struct CacheNode* node = queue->rear; node != NULL && num_seen < 2 * 64; node = node->queue_prev, num_seen++) {
+        assert(!node->dirty && node->pins == 0);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(clean_buffer);
+
+    // the cleaned blocks are evicted without write-back
+    uint64_t evict_dirty = stats_counter_total(STAT_CACHE_EVICT_DIRTY);
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < result; i++) assert(dequeue(queue, hash) == 0);
+    pthread_mutex_unlock(&cache_lock);
+    assert(stats_counter_total(STAT_CACHE_EVICT_DIRTY) == evict_dirty);
+    unmount_test_image();
+
+    mount_test_image(TEST_IMAGE, SMALL_CACHE_BLKS);
+    for (int i = 0; i < 2; i++) {
+        assert(read_(ino_num, buffer, sizeof(buffer), i * sizeof(buffer)) == sizeof(buffer));
+        for (int j = 0; j < (int) sizeof(buffer); j++) assert(buffer[j] == 'a' + i);
+    }
+    unmount_test_image();
+}
+
+// a cache full of dirty blocks is written back by the cleaner in the background, so the misses that follow evict
+// clean blocks
+void test_cleaner_keeps_tail_clean() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, SMALL_CACHE_BLKS);
+    int a = create_test_file("a"), b = create_test_file("b");
+    char buffer[64 * SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    for (int i = 0; i < 16; i++) assert(write_(a, buffer, sizeof(buffer), i * sizeof(buffer)) == sizeof(buffer));
+    assert(write_dirty_blocks_back() == 0);
+    for (int i = 0; i < 16; i++) assert(write_(b, buffer, sizeof(buffer), i * sizeof(buffer)) == sizeof(buffer));
+    assert(queue->num_dirty > SMALL_CACHE_BLKS * 3 / 4);
+
+    assert(start_cache_cleaner(64) == 0);
+    for (int i = 0; i < 100 && queue->num_dirty > dirty_background_blocks(queue); i++) usleep(10000);
+    uint64_t evicted = stats_counter_total(STAT_CACHE_EVICT), evict_dirty = stats_counter_total(STAT_CACHE_EVICT_DIRTY);
+    for (int i = 0; i < 16; i++) assert(read_(a, buffer, sizeof(buffer), i * sizeof(buffer)) == sizeof(buffer));
+    evicted = stats_counter_total(STAT_CACHE_EVICT) - evicted;
+    evict_dirty = stats_counter_total(STAT_CACHE_EVICT_DIRTY) - evict_dirty;
+    assert(evicted >= 512 && evict_dirty == 0);
+    assert(stats_counter_total(STAT_CACHE_CLEAN) > 0);
+    unmount_test_image();
+}
+
+int main() {
+    test_write_back_wakes_writer();
+    test_sync_inode_wakes_writer();
+    test_cleaner_bounds_dirty_blocks();
+    test_clean_lru_tail();
+    test_cleaner_keeps_tail_clean();
+    unlink(TEST_IMAGE);
+    printf("test_cleaner passed\n");
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include "test_util.h"
+
+#define CLONE_BLKS 20
+
+void fill_file(int ino_num, int num_blks) {
+    char buffer[SIZE_BLOCK];
+    for (int i = 0; i < num_blks; i++) {
+        memset(buffer, 'a' + i, sizeof(buffer));
+        assert(write_(ino_num, buffer, SIZE_BLOCK, i * SIZE_BLOCK) == SIZE_BLOCK);
+    }
+}
+
+// block blk_idx of a file holds byte value
+void check_block(int ino_num, int blk_idx, char value) {
+    char buffer[SIZE_BLOCK];
+    assert(read_(ino_num, buffer, SIZE_BLOCK, blk_idx * SIZE_BLOCK) == SIZE_BLOCK);
+    for (int i = 0; i < SIZE_BLOCK; i++) assert(buffer[i] == value);
+}
+
+// a clone shares the data blocks of its source, a write to either copies the block written
+void test_clone_and_copy_on_write() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_REFLINK);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int src = create_test_file("src"), dst = create_test_file("dst");
+    long long used = count_used_data_blocks();
+    fill_file(src, CLONE_BLKS);
+    long long src_used = count_used_data_blocks();
+
+    assert(clone_(src, dst) == 0);
+    assert(get_file_size(dst) == CLONE_BLKS * SIZE_BLOCK);
+    assert(count_used_data_blocks() == src_used + 1); // the pointer block of the clone
+    long long src_ptr = BLK_PTR_HOLE, dst_ptr = BLK_PTR_HOLE;
+    for (int i = 0; i < CLONE_BLKS; i++) {
+        assert(get_block_ptr(src, i, &src_ptr) == 0 && get_block_ptr(dst, i, &dst_ptr) == 0);
+        assert(src_ptr == dst_ptr && get_block_refcount(src_ptr) == 1);
+        check_block(dst, i, 'a' + i);
+    }
+
+    char buffer[SIZE_BLOCK];
+    memset(buffer, 'z', sizeof(buffer));
+    assert(write_(dst, buffer, 10, 5 * SIZE_BLOCK) == 10);
+    assert(get_block_ptr(src, 5, &src_ptr) == 0 && get_block_ptr(dst, 5, &dst_ptr) == 0);
+    assert(src_ptr != dst_ptr && get_block_refcount(src_ptr) == 0 && get_block_refcount(dst_ptr) == 0);
+    check_block(src, 5, 'a' + 5);
+    assert(read_(dst, buffer, SIZE_BLOCK, 5 * SIZE_BLOCK) == SIZE_BLOCK);
+    for (int i = 0; i < SIZE_BLOCK; i++) assert(buffer[i] == (i < 10 ? 'z' : 'a' + 5));
+    memset(buffer, 'y', sizeof(buffer));
+    assert(write_(src, buffer, SIZE_BLOCK, 6 * SIZE_BLOCK) == SIZE_BLOCK);
+    check_block(dst, 6, 'a' + 6);
+    check_block(src, 6, 'y');
+    assert(count_used_data_blocks() == src_used + 1 + 2);
+
+    // shared blocks are freed with their last file
+    assert(truncate_(src, 0) == 0);
+    for (int i = 0; i < CLONE_BLKS; i++) {
+        if (i != 5) check_block(dst, i, 'a' + i);
+    }
+    assert(truncate_(dst, 0) == 0);
+    assert(count_used_data_blocks() == used);
+    unmount_test_image();
+}
+
+// holes and unwritten blocks of the source are holes of the clone
+void test_clone_holes() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_REFLINK);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int src = create_test_file("src"), dst = create_test_file("dst");
+    char buffer[SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    assert(write_(src, buffer, SIZE_BLOCK, 300 * SIZE_BLOCK) == SIZE_BLOCK);
+    assert(fallocate_(src, 0, 0, 4 * SIZE_BLOCK) == 0);
+    assert(clone_(src, dst) == 0);
+    long long ptr = 0;
+    assert(get_block_ptr(dst, 0, &ptr) == 0 && ptr == BLK_PTR_HOLE);
+    assert(get_block_ptr(dst, 100, &ptr) == 0 && ptr == BLK_PTR_HOLE);
+    check_block(dst, 0, 0);
+    check_block(dst, 300, 'a');
+    assert(get_file_size(dst) == 301 * SIZE_BLOCK);
+    unmount_test_image();
+}
+
+// a clone writes nothing to device, the shared blocks dirty in cache are written back by the fsync of the clone
+void test_clone_dirty_blocks() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_REFLINK);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int src = create_test_file("src"), dst = create_test_file("dst");
+    fill_file(src, CLONE_BLKS);
+
+    uint64_t writes = stats_op_count(STAT_OP_DEV_WRITE);
+    assert(clone_(src, dst) == 0);
+    assert(stats_op_count(STAT_OP_DEV_WRITE) == writes);
+    long long ptr = BLK_PTR_HOLE;
+    assert(get_block_ptr(dst, 0, &ptr) == 0);
+    struct CacheNode* node = find_block_cache(hash, DATA_REG_START_BLK + ptr);
+    assert(node != NULL && node->dirty && node->dirty_list->ino_num == DIRTY_OWNER_ALLOC);
+
+    assert(sync_inode(dst, 0) == 0);
+    assert(!node->dirty);
+    int fd = open(TEST_IMAGE, O_RDONLY);
+    char buffer[SIZE_BLOCK];
+    assert(pread(fd, buffer, SIZE_BLOCK, (DATA_REG_START_BLK + ptr) * SIZE_BLOCK) == SIZE_BLOCK);
+    close(fd);
+    for (int i = 0; i < SIZE_BLOCK; i++) assert(buffer[i] == 'a');
+    unmount_test_image();
+}
+
+// clones need the reflink feature, and are made between distinct regular files
+void test_clone_errors() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int src = create_test_file("src"), dst = create_test_file("dst");
+    assert(clone_(src, dst) == -EOPNOTSUPP);
+    unmount_test_image();
+
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_REFLINK);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    src = create_test_file("src");
+    assert(do_mkdir("/d", 0755) == 0);
+    assert(clone_(src, src) == -EINVAL);
+    assert(clone_(src, path_inode_number("/d")) == -EINVAL);
+    unmount_test_image();
+}
+
+int main() {
+    test_clone_and_copy_on_write();
+    test_clone_holes();
+    test_clone_dirty_blocks();
+    test_clone_errors();
+    unlink(TEST_IMAGE);
+    printf("test_clone passed\n");
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include "test_util.h"
+
+#define FILE_SIZE (10 * COMPRESS_CLUSTER_SIZE + 1000) // ends in a short cluster
+
+char content[FILE_SIZE + COMPRESS_CLUSTER_SIZE];
+
+void fill_compressible(char* buffer, int size, int seed) {
+    for (int i = 0; i < size; i++) buffer[i] = 'a' + (i / 64 + seed) % 7;
+}
+
+void fill_random(char* buffer, int size, unsigned seed) {
+    for (int i = 0; i < size; i++) buffer[i] = rand_r(&seed);
+}
+
+void check_content(int ino_num, int size) {
+    static char buffer[FILE_SIZE + COMPRESS_CLUSTER_SIZE];
+    assert(get_file_size(ino_num) == size);
+    assert(read_(ino_num, buffer, sizeof(buffer), 0) == size);
+    assert(memcmp(buffer, content, size) == 0);
+}
+
+// pointers of a cluster stored compressed in num_cblks data blocks, or 0 if stored block by block
+int cluster_blocks(int ino_num, int cluster_idx) {
+    long long ptrs[COMPRESS_CLUSTER_BLKS];
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) assert(get_block_ptr(ino_num, cluster_idx * COMPRESS_CLUSTER_BLKS + i, &ptrs[i]) == 0);
+    if (!BLK_PTR_IS_COMPRESSED(ptrs[0])) {
+        for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) assert(!BLK_PTR_IS_COMPRESSED(ptrs[i]));
+        return 0;
+    }
+    int num_cblks = 0;
+    while (num_cblks < COMPRESS_CLUSTER_BLKS && ptrs[num_cblks] != BLK_PTR_CLUSTER_TAIL) num_cblks++;
+    for (int i = num_cblks; i < COMPRESS_CLUSTER_BLKS; i++) assert(ptrs[i] == BLK_PTR_CLUSTER_TAIL);
+    assert(num_cblks > 0 && num_cblks < COMPRESS_CLUSTER_BLKS);
+    return num_cblks;
+}
+
+// whole clusters are compressed, the short last one is not, the tail pointers of a cluster have no data blocks
+void test_roundtrip() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_COMPRESS);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    long long used = count_used_data_blocks();
+
+    fill_compressible(content, FILE_SIZE, 0);
+    assert(write_(ino_num, content, FILE_SIZE, 0) == FILE_SIZE);
+    check_content(ino_num, FILE_SIZE);
+    int num_blks = 0;
+    for (int i = 0; i < 10; i++) {
+        int num_cblks = cluster_blocks(ino_num, i);
+        assert(num_cblks > 0);
+        num_blks += num_cblks;
+    }
+    assert(cluster_blocks(ino_num, 10) == 0);
+    assert(count_used_data_blocks() == used + num_blks + 2 + 1); // the short cluster and a pointer block
+
+    // read from the device, not the cluster cache
+    unmount_test_image();
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    check_content(ino_num, FILE_SIZE);
+
+    // the short cluster is compressed once the file grows past it
+    fill_compressible(content + FILE_SIZE, COMPRESS_CLUSTER_SIZE, 3);
+    assert(write_(ino_num, content + FILE_SIZE, COMPRESS_CLUSTER_SIZE, FILE_SIZE) == COMPRESS_CLUSTER_SIZE);
+    assert(cluster_blocks(ino_num, 10) > 0 && cluster_blocks(ino_num, 11) == 0);
+    check_content(ino_num, FILE_SIZE + COMPRESS_CLUSTER_SIZE);
+
+    assert(truncate_(ino_num, 0) == 0);
+    assert(count_used_data_blocks() == used);
+    unmount_test_image();
+}
+
+// writing part of a compressed cluster rewrites it, a cluster not compressing is stored block by block
+void test_overwrite() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_COMPRESS);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    long long used = count_used_data_blocks();
+    fill_compressible(content, FILE_SIZE, 0);
+    assert(write_(ino_num, content, FILE_SIZE, 0) == FILE_SIZE);
+
+    // part of a block, and a range across two clusters
+    fill_compressible(content + 2 * SIZE_BLOCK + 300, 100, 5);
+    assert(write_(ino_num, content + 2 * SIZE_BLOCK + 300, 100, 2 * SIZE_BLOCK + 300) == 100);
+    fill_compressible(content + 2 * COMPRESS_CLUSTER_SIZE - 700, 1500, 2);
+    assert(write_(ino_num, content + 2 * COMPRESS_CLUSTER_SIZE - 700, 1500, 2 * COMPRESS_CLUSTER_SIZE - 700) == 1500);
+    assert(cluster_blocks(ino_num, 0) > 0 && cluster_blocks(ino_num, 1) > 0 && cluster_blocks(ino_num, 2) > 0);
+    check_content(ino_num, FILE_SIZE);
+
+    // a compressed cluster turning incompressible, by a whole and by a partial write, and back
+    fill_random(content + 3 * COMPRESS_CLUSTER_SIZE, COMPRESS_CLUSTER_SIZE, 1);
+    assert(write_(ino_num, content + 3 * COMPRESS_CLUSTER_SIZE, COMPRESS_CLUSTER_SIZE, 3 * COMPRESS_CLUSTER_SIZE) == COMPRESS_CLUSTER_SIZE);
+    assert(cluster_blocks(ino_num, 3) == 0);
+    fill_random(content + 4 * COMPRESS_CLUSTER_SIZE + 100, COMPRESS_CLUSTER_SIZE - 200, 2);
+    assert(write_(ino_num, content + 4 * COMPRESS_CLUSTER_SIZE + 100, COMPRESS_CLUSTER_SIZE - 200, 4 * COMPRESS_CLUSTER_SIZE + 100) == COMPRESS_CLUSTER_SIZE - 200);
+    assert(cluster_blocks(ino_num, 4) == 0);
+    check_content(ino_num, FILE_SIZE);
+    fill_compressible(content + 3 * COMPRESS_CLUSTER_SIZE, COMPRESS_CLUSTER_SIZE, 4);
+    assert(write_(ino_num, content + 3 * COMPRESS_CLUSTER_SIZE, COMPRESS_CLUSTER_SIZE, 3 * COMPRESS_CLUSTER_SIZE) == COMPRESS_CLUSTER_SIZE);
+    assert(cluster_blocks(ino_num, 3) > 0);
+    check_content(ino_num, FILE_SIZE);
+
+    unmount_test_image();
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    check_content(ino_num, FILE_SIZE);
+    assert(truncate_(ino_num, 0) == 0);
+    assert(count_used_data_blocks() == used);
+    unmount_test_image();
+}
+
+// cutting a compressed cluster stores it block by block first, the cut off part reads as zeros when grown again
+void test_truncate_cluster() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_COMPRESS);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    fill_compressible(content, FILE_SIZE, 0);
+    assert(write_(ino_num, content, FILE_SIZE, 0) == FILE_SIZE);
+
+    int size = 5 * COMPRESS_CLUSTER_SIZE + 3 * SIZE_BLOCK + 17;
+    assert(truncate_(ino_num, size) == 0);
+    check_content(ino_num, size);
+    assert(cluster_blocks(ino_num, 4) > 0 && cluster_blocks(ino_num, 5) == 0);
+    assert(truncate_(ino_num, FILE_SIZE) == 0);
+    memset(content + size, 0, FILE_SIZE - size);
+    check_content(ino_num, FILE_SIZE);
+
+    // punching a hole in a compressed cluster
+    assert(fallocate_(ino_num, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, SIZE_BLOCK, 2 * SIZE_BLOCK) == 0);
+    memset(content + SIZE_BLOCK, 0, 2 * SIZE_BLOCK);
+    check_content(ino_num, FILE_SIZE);
+
+    unmount_test_image();
+}
+
+// a compressed cluster whose pointer block cannot be allocated frees its new blocks and leaves the holes
+void test_cluster_without_space() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_COMPRESS);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int g = create_test_file("g");
+    fill_compressible(content, COMPRESS_CLUSTER_SIZE, 0);
+    assert(write_(g, content, COMPRESS_CLUSTER_SIZE, 0) == COMPRESS_CLUSTER_SIZE);
+    int num_cblks = cluster_blocks(g, 0);
+    assert(num_cblks > 0);
+
+    // room for the compressed blocks of the second cluster, not for the pointer block it needs
+    int ino_num = create_test_file("f");
+    assert(COMPRESS_CLUSTER_BLKS >= ptr_tier_start(1));
+    assert(truncate_(ino_num, 2 * COMPRESS_CLUSTER_SIZE) == 0);
+    fill_data_blocks(num_cblks);
+    long long used = count_used_data_blocks();
+    assert(write_(ino_num, content, COMPRESS_CLUSTER_SIZE, COMPRESS_CLUSTER_SIZE) < 0);
+    assert(count_used_data_blocks() == used);
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+        long long ptr = 0;
+        assert(get_block_ptr(ino_num, COMPRESS_CLUSTER_BLKS + i, &ptr) == 0 && ptr == BLK_PTR_HOLE);
+    }
+
+    unmount_test_image();
+}
+
+int main() {
+    test_roundtrip();
+    test_overwrite();
+    test_truncate_cluster();
+    test_cluster_without_space();
+    unlink(TEST_IMAGE);
+    printf("test_compress passed\n");
+    return 0;
+}
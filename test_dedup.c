@@ -0,0 +1,71 @@
+#include "test_util.h"
+
+#define NUM_BLKS 32
+
+// blocks written with the content of a written block share it, a shared block is copied when written
+void test_share() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_DEDUP | FEATURE_REFLINK);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int f = create_test_file("f");
+    int g = create_test_file("g");
+    long long used = count_used_data_blocks();
+
+    char buffer[NUM_BLKS * SIZE_BLOCK], out[NUM_BLKS * SIZE_BLOCK];
+    for (int i = 0; i < NUM_BLKS; i++) memset(buffer + i * SIZE_BLOCK, 'a' + i % 4, SIZE_BLOCK);
+    assert(write_(f, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    assert(count_used_data_blocks() == used + 4 + 1); // 4 contents and a pointer block
+    assert(write_(g, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    assert(count_used_data_blocks() == used + 4 + 2);
+    long long ptr = 0, other_ptr = 0;
+    assert(get_block_ptr(f, 1, &ptr) == 0 && get_block_ptr(g, 5, &other_ptr) == 0 && ptr == other_ptr);
+    assert(get_block_refcount(ptr) == 2 * NUM_BLKS / 4 - 1);
+
+    // copy on write, the other owners keep the content
+    memset(buffer + SIZE_BLOCK + 10, 'z', 20);
+    assert(write_(f, buffer + SIZE_BLOCK + 10, 20, SIZE_BLOCK + 10) == 20);
+    assert(get_block_refcount(ptr) == 2 * NUM_BLKS / 4 - 2);
+    assert(read_(f, out, sizeof(out), 0) == sizeof(out) && memcmp(out, buffer, sizeof(out)) == 0);
+    memset(buffer + SIZE_BLOCK + 10, 'b', 20);
+    assert(read_(g, out, sizeof(out), 0) == sizeof(out) && memcmp(out, buffer, sizeof(out)) == 0);
+
+    unmount_test_image();
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(read_(g, out, sizeof(out), 0) == sizeof(out) && memcmp(out, buffer, sizeof(out)) == 0);
+    assert(truncate_(f, 0) == 0);
+    assert(truncate_(g, 0) == 0);
+    assert(count_used_data_blocks() == used);
+    unmount_test_image();
+}
+
+// a block shared by content whose pointer cannot be set does not keep the reference
+void test_share_without_space() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_DEDUP | FEATURE_REFLINK);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int f = create_test_file("f");
+    int g = create_test_file("g");
+    char buffer[SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    assert(write_(f, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    long long ptr = 0;
+    assert(get_block_ptr(f, 0, &ptr) == 0 && get_block_refcount(ptr) == 0);
+    assert(truncate_(g, 64 * SIZE_BLOCK) == 0); // holes, no pointer block
+    fill_data_blocks(0);
+
+    assert(write_(g, buffer, sizeof(buffer), 40 * SIZE_BLOCK) < 0);
+    assert(get_block_refcount(ptr) == 0);
+    long long other_ptr = 0;
+    assert(get_block_ptr(g, 40, &other_ptr) == 0 && other_ptr == BLK_PTR_HOLE);
+    // a direct pointer needs no pointer block
+    assert(write_(g, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    assert(get_block_refcount(ptr) == 1);
+
+    unmount_test_image();
+}
+
+int main() {
+    test_share();
+    test_share_without_space();
+    unlink(TEST_IMAGE);
+    printf("test_dedup passed\n");
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "test_util.h"
+#define main bench_main
+#include "bench.c"
+#undef main
+
+#define RAW_IMAGE "test_raw.img"
+
+// mkfs.toyfs leaves the image file sparse, only metadata takes space until toyfs writes data
+void test_sparse_image() {
+    long long size = 1LL << 30;
+    format_test_image(TEST_IMAGE, size, 0);
+    struct stat st;
+    assert(stat(TEST_IMAGE, &st) == 0);
+    assert(st.st_size == size);
+    assert((long long) st.st_blocks * 512 < size / 16);
+
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    char data[SIZE_BLOCK];
+    memset(data, 'a', sizeof(data));
+    assert(write_(ino_num, data, sizeof(data), 0) == sizeof(data));
+    unmount_test_image();
+
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    ino_num = path_inode_number("/f");
+    assert(ino_num > 0);
+    char buffer[SIZE_BLOCK];
+    assert(read_(ino_num, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    assert(memcmp(buffer, data, sizeof(data)) == 0);
+    unmount_test_image();
+}
+
+// a run of blocks is one device request, in both directions
+void test_request_counts() {
+    unlink(RAW_IMAGE);
+    int fd = open(RAW_IMAGE, O_RDWR | O_CREAT, 0644);
+    assert(fd >= 0 && ftruncate(fd, 64 * block_size) == 0);
+
+    char* blocks[8];
+    struct iovec iov[8];
+    for (int i = 0; i < 8; i++) {
+        assert(posix_memalign((void**) &blocks[i], block_size, block_size) == 0);
+        memset(blocks[i], 'a' + i, block_size);
+        iov[i].iov_base = blocks[i];
+        iov[i].iov_len = block_size;
+    }
+    uint64_t writes = stats_op_count(STAT_OP_DEV_WRITE);
+    assert(io_write_run(fd, iov, 16, 8) == 0);
+    assert(stats_op_count(STAT_OP_DEV_WRITE) == writes + 1);
+    assert(io_write(fd, blocks[0], 40) == 0);
+    assert(stats_op_count(STAT_OP_DEV_WRITE) == writes + 2);
+
+    char* buffer;
+    assert(posix_memalign((void**) &buffer, block_size, 8 * block_size) == 0);
+    uint64_t reads = stats_op_count(STAT_OP_DEV_READ);
+    io_read_run(fd, buffer, 16, 8);
+    assert(stats_op_count(STAT_OP_DEV_READ) == reads + 1);
+    for (int i = 0; i < 8; i++) assert(memcmp(buffer + i * block_size, blocks[i], block_size) == 0);
+    io_read(fd, buffer, 40);
+    assert(stats_op_count(STAT_OP_DEV_READ) == reads + 2);
+    assert(memcmp(buffer, blocks[0], block_size) == 0);
+
+    for (int i = 0; i < 8; i++) free(blocks[i]);
+    free(buffer);
+    close(fd);
+    unlink(RAW_IMAGE);
+}
+
+// the benchmark takes device request counts from the json report and latency percentiles from sorted samples
+void test_bench_counts() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    create_test_file("f");
+    char data[64 * SIZE_BLOCK];
+    memset(data, 'a', sizeof(data));
+    assert(do_write("/f", data, sizeof(data), 0, NULL) == sizeof(data));
+    write_dirty_blocks_back();
+
+    struct StatsReport* report = render_stats_report(STATS_JSON_PATH);
+    assert(json_op_count(report->data, "dev_read") == (long long) stats_op_count(STAT_OP_DEV_READ));
+    assert(json_op_count(report->data, "dev_write") == (long long) stats_op_count(STAT_OP_DEV_WRITE));
+    assert(json_op_count(report->data, "dev_write") > 0);
+    assert(json_op_count(report->data, "no_such_op") == -1);
+    free(report);
+
+    struct Samples samples = { NULL, 0, 0 };
+    for (int i = 100; i >= 1; i--) add_sample(&samples, i);
+    qsort(samples.values, samples.count, sizeof(uint64_t), compare_u64);
+    assert(percentile(&samples, 50) == 50);
+    assert(percentile(&samples, 99) == 99);
+    assert(percentile(&samples, 100) == 100);
+    assert(percentile(&samples, 0) == 1);
+    free(samples.values);
+
+    unmount_test_image();
+}
+
+int main() {
+    test_sparse_image();
+    test_request_counts();
+    test_bench_counts();
+    unlink(TEST_IMAGE);
+    printf("test_device passed\n");
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include "test_util.h"
+
+// reserved blocks read as zeros, keep the size with FALLOC_FL_KEEP_SIZE and become holes again when punched
+void test_reserve_and_punch() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    long long used = count_used_data_blocks();
+
+    assert(fallocate_(ino_num, 0, 0, 16 * SIZE_BLOCK) == 0);
+    assert(get_file_size(ino_num) == 16 * SIZE_BLOCK);
+    assert(count_used_data_blocks() == used + 16 + 1); // and a pointer block
+    char buffer[16 * SIZE_BLOCK];
+    memset(buffer, 'x', sizeof(buffer));
+    assert(read_(ino_num, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    for (int i = 0; i < (int) sizeof(buffer); i++) assert(buffer[i] == 0);
+    long long ptr = BLK_PTR_HOLE;
+    assert(get_block_ptr(ino_num, 5, &ptr) == 0 && (ptr & BLK_PTR_UNWRITTEN) != 0);
+
+    // writing a reserved block allocates nothing
+    memset(buffer, 'a', SIZE_BLOCK);
+    assert(write_(ino_num, buffer, SIZE_BLOCK, 5 * SIZE_BLOCK) == SIZE_BLOCK);
+    assert(count_used_data_blocks() == used + 17);
+    assert(get_block_ptr(ino_num, 5, &ptr) == 0 && (ptr & BLK_PTR_UNWRITTEN) == 0);
+
+    assert(fallocate_(ino_num, FALLOC_FL_KEEP_SIZE, 16 * SIZE_BLOCK, 4 * SIZE_BLOCK) == 0);
+    assert(get_file_size(ino_num) == 16 * SIZE_BLOCK);
+    assert(count_used_data_blocks() == used + 21);
+
+    // whole blocks of the range are freed, the partial ones zeroed
+    assert(fallocate_(ino_num, FALLOC_FL_PUNCH_HOLE, 5 * SIZE_BLOCK, SIZE_BLOCK) == -EOPNOTSUPP);
+    assert(fallocate_(ino_num, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 5 * SIZE_BLOCK - 10, SIZE_BLOCK + 20) == 0);
+    assert(get_block_ptr(ino_num, 5, &ptr) == 0 && ptr == BLK_PTR_HOLE);
+    assert(count_used_data_blocks() == used + 20);
+    assert(read_(ino_num, buffer, 3 * SIZE_BLOCK, 4 * SIZE_BLOCK) == 3 * SIZE_BLOCK);
+    for (int i = 0; i < 3 * SIZE_BLOCK; i++) assert(buffer[i] == 0);
+    assert(get_file_size(ino_num) == 16 * SIZE_BLOCK);
+
+    unmount_test_image();
+}
+
+// a hole written with the last free data block and no space left for the pointer block keeps the block free
+void test_hole_write_without_space() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    assert(truncate_(ino_num, 64 * SIZE_BLOCK) == 0); // holes, no pointer block
+    fill_data_blocks(1);
+    long long used = count_used_data_blocks();
+
+    char buffer[SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    assert(write_(ino_num, buffer, SIZE_BLOCK, 40 * SIZE_BLOCK) < 0);
+    assert(count_used_data_blocks() == used);
+    long long ptr = 0;
+    assert(get_block_ptr(ino_num, 40, &ptr) == 0 && ptr == BLK_PTR_HOLE);
+
+    unmount_test_image();
+}
+
+int main() {
+    test_reserve_and_punch();
+    test_hole_write_without_space();
+    unlink(TEST_IMAGE);
+    printf("test_fallocate passed\n");
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include "test_util.h"
+#include <sys/wait.h>
+
+// exit code of fsck.toyfs on the test image, built next to the tests
+int run_fsck(bool repair) {
+    char command[128];
+    snprintf(command, sizeof(command), "./fsck.toyfs %s %s > /dev/null", repair ? "-y" : "", TEST_IMAGE);
+    int status = system(command);
+    assert(status != -1 && WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+// files, directories, links and clones made by toyfs pass the check
+void populate(unsigned int features) {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, features);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(do_mkdir("/d", 0755) == 0);
+    assert(do_mkdir("/d/e", 0755) == 0);
+    char buffer[300 * SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    assert(do_mknod("/d/big", 0644, 0) == 0);
+    assert(do_write("/d/big", buffer, sizeof(buffer), 0, NULL) == sizeof(buffer));
+    assert(do_mknod("/d/e/sparse", 0644, 0) == 0);
+    assert(do_write("/d/e/sparse", buffer, SIZE_BLOCK, 1000 * SIZE_BLOCK, NULL) == SIZE_BLOCK);
+    assert(do_link("/d/big", "/hard") == 0);
+    assert(do_symlink("/d/big", "/soft") == 0);
+    if (features & FEATURE_REFLINK) {
+        assert(do_mknod("/clone", 0644, 0) == 0);
+        assert(clone_(path_inode_number("/d/big"), path_inode_number("/clone")) == 0);
+    }
+    unmount_test_image();
+}
+
+void test_consistent_image() {
+    populate(0);
+    assert(run_fsck(false) == 0);
+    populate(FEATURE_REFLINK | FEATURE_CHECKSUM | FEATURE_INLINE_DATA);
+    assert(run_fsck(false) == 0);
+    populate(FEATURE_64BIT);
+    assert(run_fsck(false) == 0);
+}
+
+// a leaked data block, a wrong links count and an orphan inode are found, repaired, and the repaired image is clean
+void test_repair() {
+    populate(0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(get_dmap_bit(num_usable_data_blks() - 1) == 0);
+    assert(set_dmap_bit(num_usable_data_blks() - 1, 1) >= 0);
+    int dir_ino_num = path_inode_number("/d");
+    assert(add_links_count(dir_ino_num, 1) >= 0);
+    int orphan = path_inode_number("/d/e/sparse");
+    assert(remove_dir_entry(path_inode_number("/d/e"), "sparse") == 0);
+    unmount_test_image();
+
+    assert(run_fsck(false) == 4);
+    assert(run_fsck(true) == 1);
+    assert(run_fsck(false) == 0);
+
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    char path[32];
+    sprintf(path, "/#%d", orphan);
+    assert(path_inode_number(path) == orphan);
+    char buffer[SIZE_BLOCK];
+    assert(do_read(path, buffer, SIZE_BLOCK, 1000 * SIZE_BLOCK, NULL) == SIZE_BLOCK && buffer[0] == 'a');
+    assert(get_dmap_bit(num_usable_data_blks() - 1) == 0);
+    unmount_test_image();
+}
+
+// a rename cut short between its two entry writes leaves a file under both names, fsck counts both links
+void test_rename_crash() {
+    populate(0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = path_inode_number("/d/big");
+    char name[SIZE_FILENAME];
+    memset(name, 0, sizeof(name));
+    strcpy(name, "moved");
+    assert(add_dir_entry(path_inode_number("/d/e"), name, ino_num) == 0);
+    unmount_test_image();
+
+    assert(run_fsck(false) == 4);
+    assert(run_fsck(true) == 1);
+    assert(run_fsck(false) == 0);
+
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(path_inode_number("/d/big") == ino_num && path_inode_number("/d/e/moved") == ino_num);
+    struct stat st;
+    assert(do_getattr("/d/big", &st) == 0 && st.st_nlink == 3); // with the hard link of populate
+    unmount_test_image();
+}
+
+int main() {
+    test_consistent_image();
+    test_repair();
+    test_rename_crash();
+    unlink(TEST_IMAGE);
+    printf("test_fsck passed\n");
+    return 0;
+}
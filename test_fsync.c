@@ -0,0 +1,143 @@
+#include <signal.h>
+#include <sys/resource.h>
+#include "test_util.h"
+
+#define FILE_BLKS 8
+
+// whether a cached block has changes not written to device
+bool is_block_dirty(long long block_id) {
+    struct CacheNode* node = find_block_cache(hash_of(block_id), block_id);
+    return node != NULL && node->dirty;
+}
+
+// device block of a file block
+long long file_block_id(int ino_num, long long blk_idx) {
+    long long ptr = BLK_PTR_HOLE;
+    assert(get_block_ptr(ino_num, blk_idx, &ptr) == 0 && ptr != BLK_PTR_HOLE);
+    return DATA_REG_START_BLK + ptr;
+}
+
+// whether all blocks of a file on device hold c, read past the cache
+bool file_on_device(int ino_num, char c) {
+    int fd = open(TEST_IMAGE, O_RDONLY);
+    assert(fd >= 0);
+    bool same = true;
+    for (int i = 0; i < FILE_BLKS; i++) {
+        char block[SIZE_BLOCK];
+        assert(pread(fd, block, SIZE_BLOCK, file_block_id(ino_num, i) * SIZE_BLOCK) == SIZE_BLOCK);
+        for (int j = 0; j < SIZE_BLOCK; j++) same = same && block[j] == c;
+    }
+    close(fd);
+    return same;
+}
+
+void write_test_file(const char* path, char c) {
+    char data[FILE_BLKS * SIZE_BLOCK];
+    memset(data, c, sizeof(data));
+    assert(do_write(path, data, sizeof(data), 0, NULL) == sizeof(data));
+}
+
+// fsync writes back the blocks of one file with its inode and allocation bitmaps, other files stay dirty
+void test_fsync_one_file() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int a = create_test_file("a");
+    int b = create_test_file("b");
+    assert(INODE_BLK(a) == INODE_BLK(b)); // the inode table block is shared
+    write_test_file("/a", 'a');
+    write_test_file("/b", 'b');
+    assert(is_block_dirty(file_block_id(a, 0)) && is_block_dirty(INODE_BLK(a)));
+
+    uint64_t writes = stats_op_count(STAT_OP_DEV_WRITE);
+    assert(do_fsync("/a", 0, NULL) == 0);
+    for (int i = 0; i < FILE_BLKS; i++) assert(!is_block_dirty(file_block_id(a, i)));
+    assert(!is_block_dirty(INODE_BLK(a)));
+    assert(!is_block_dirty(DMAP_START_BLK));
+    assert(file_on_device(a, 'a'));
+    for (int i = 0; i < FILE_BLKS; i++) assert(is_block_dirty(file_block_id(b, i)));
+    assert(!file_on_device(b, 'b'));
+    // the data blocks are consecutive, a few requests write back everything
+    assert(stats_op_count(STAT_OP_DEV_WRITE) - writes <= 4);
+
+    assert(do_flush("/a", NULL) == 0);
+    assert(do_fsync("/missing", 0, NULL) == -ENOENT);
+    unmount_test_image();
+}
+
+// fdatasync skips the inode table block when size and block pointers of the file are unchanged
+void test_fdatasync() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int a = create_test_file("a");
+    create_test_file("b");
+    write_test_file("/a", 'a');
+    assert(do_fsync("/a", 1, NULL) == 0); // size changed
+    assert(!is_block_dirty(INODE_BLK(a)));
+
+    // b dirties the inode table block a shares, overwriting a changes no inode field
+    write_test_file("/b", 'b');
+    write_test_file("/a", 'c');
+    assert(do_fsync("/a", 1, NULL) == 0);
+    assert(file_on_device(a, 'c'));
+    assert(is_block_dirty(INODE_BLK(a)));
+    assert(do_fsync("/a", 0, NULL) == 0);
+    assert(!is_block_dirty(INODE_BLK(a)));
+
+    unmount_test_image();
+}
+
+// fsyncdir writes back the entries of a directory
+void test_fsyncdir() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(do_mkdir("/d", 0755) == 0);
+    assert(do_mknod("/d/f", S_IFREG | 0644, 0) == 0);
+    int d = path_inode_number("/d");
+    long long dir_block_id = DATA_REG_START_BLK;
+    long long ptr = BLK_PTR_HOLE;
+    assert(get_block_ptr(d, 0, &ptr) == 0 && ptr != BLK_PTR_HOLE);
+    dir_block_id += ptr;
+    assert(is_block_dirty(dir_block_id));
+
+    assert(do_fsyncdir("/d", 0, NULL) == 0);
+    assert(!is_block_dirty(dir_block_id) && !is_block_dirty(INODE_BLK(d)));
+    assert(do_fsyncdir("/d/f", 0, NULL) == -ENOTDIR);
+
+    unmount_test_image();
+}
+
+// a device write that fails makes fsync return -EIO and keeps the blocks dirty for the next fsync
+void test_fsync_error() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int a = create_test_file("a");
+    write_test_file("/a", 'a');
+
+    // the image file cannot grow past the data blocks of the file, writes to them fail
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    struct rlimit lower = limit;
+    lower.rlim_cur = file_block_id(a, 0) * SIZE_BLOCK;
+    signal(SIGXFSZ, SIG_IGN);
+    assert(setrlimit(RLIMIT_FSIZE, &lower) == 0);
+    assert(do_fsync("/a", 0, NULL) == -EIO);
+    for (int i = 0; i < FILE_BLKS; i++) assert(is_block_dirty(file_block_id(a, i)));
+    assert(get_dirty_list(dirty_table, a, false) != NULL);
+
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    assert(do_fsync("/a", 0, NULL) == 0);
+    for (int i = 0; i < FILE_BLKS; i++) assert(!is_block_dirty(file_block_id(a, i)));
+    assert(file_on_device(a, 'a'));
+
+    unmount_test_image();
+}
+
+int main() {
+    test_fsync_one_file();
+    test_fdatasync();
+    test_fsyncdir();
+    test_fsync_error();
+    unlink(TEST_IMAGE);
+    printf("test_fsync passed\n");
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "test_util.h"
+
+// small files live in their inode, and move to data blocks when they grow past it
+void test_inline_file() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_INLINE_DATA);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(SIZE_INODE == 128 && INODE_INLINE_CAPACITY == 112);
+    int ino_num = create_test_file("f");
+    long long used = count_used_data_blocks();
+
+    char buffer[SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    assert(write_(ino_num, buffer, 50, 0) == 50);
+    assert(write_(ino_num, buffer, 10, 100) == 10); // zeros in between
+    assert(is_inline(ino_num) && get_file_size(ino_num) == 110);
+    assert(count_used_data_blocks() == used);
+    unmount_test_image();
+
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    uint64_t reads = stats_op_count(STAT_OP_DEV_READ);
+    assert(read_(ino_num, buffer, sizeof(buffer), 0) == 110);
+    assert(stats_op_count(STAT_OP_DEV_READ) - reads <= 1); // the inode table block only
+    for (int i = 0; i < 110; i++) assert(buffer[i] == (i < 50 || i >= 100 ? 'a' : 0));
+
+    memset(buffer, 'b', sizeof(buffer));
+    assert(write_(ino_num, buffer, 10, 110) == 10);
+    assert(!is_inline(ino_num) && get_file_size(ino_num) == 120);
+    assert(count_used_data_blocks() == used + 1);
+    assert(read_(ino_num, buffer, sizeof(buffer), 0) == 120);
+    for (int i = 0; i < 120; i++) assert(buffer[i] == (i >= 110 ? 'b' : i < 50 || i >= 100 ? 'a' : 0));
+
+    // truncated to zero it starts inline again
+    assert(truncate_(ino_num, 0) == 0);
+    assert(is_inline(ino_num) && count_used_data_blocks() == used);
+    assert(write_(ino_num, buffer, 5, 0) == 5 && is_inline(ino_num));
+    unmount_test_image();
+}
+
+// symlink targets that fit are kept in the inode as well
+void test_inline_symlink() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, FEATURE_INLINE_DATA);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    create_test_file("f"); // the first block of the root directory
+    long long used = count_used_data_blocks();
+    assert(do_symlink("/some/target", "/l") == 0);
+    char target[200];
+    memset(target, 't', sizeof(target));
+    target[150] = 0;
+    assert(do_symlink(target, "/long") == 0);
+    assert(is_inline(path_inode_number("/l")) && !is_inline(path_inode_number("/long")));
+    assert(count_used_data_blocks() == used + 1);
+    char buffer[256];
+    assert(do_readlink("/l", buffer, sizeof(buffer)) == 0 && strcmp(buffer, "/some/target") == 0);
+    assert(do_readlink("/long", buffer, sizeof(buffer)) == 0 && strcmp(buffer, target) == 0);
+    unmount_test_image();
+}
+
+// without the feature files start with data blocks
+void test_without_feature() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    long long used = count_used_data_blocks();
+    assert(write_(ino_num, "abc", 3, 0) == 3);
+    assert(!is_inline(ino_num) && count_used_data_blocks() == used + 1);
+    unmount_test_image();
+}
+
+int main() {
+    test_inline_file();
+    test_inline_symlink();
+    test_without_feature();
+    unlink(TEST_IMAGE);
+    printf("test_inline passed\n");
+    return 0;
+}
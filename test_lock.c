@@ -0,0 +1,119 @@
+#include "test_util.h"
+
+// an inode found by a lookup, then freed and its number reused by another file, is not locked for the old path
+void test_reused_inode() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(do_mkdir("/d", 0755) == 0);
+    assert(do_mkdir("/e", 0755) == 0);
+    assert(do_mknod("/d/f", 0644, 0) == 0);
+
+    unsigned int generation = 0;
+    int ino_num = get_inode_number("/d/f", &generation);
+    assert(ino_num >= 0);
+    assert(do_unlink("/d/f") == 0);
+    assert(do_mknod("/e/g", 0644, 0) == 0);
+    assert(path_inode_number("/e/g") == ino_num); // the number is reused
+    assert(lock_found_inode(ino_num, generation, true) == -ESTALE);
+    assert(lock_path("/d/f", false) == -ENOENT);
+    assert(lock_path("/e/g", false) == ino_num);
+    unlock_inode(ino_num);
+
+    // a directory on the way, its entries found in the dentry cache
+    assert(do_mkdir("/y", 0755) == 0);
+    int dir_ino_num = get_inode_number("/y", &generation);
+    assert(dir_ino_num >= 0);
+    insert_dentry(dir_ino_num, "g", ino_num);
+    unsigned int entry_generation = 0;
+    assert(lookup_path_dentry(dir_ino_num, generation, "g", &entry_generation) == ino_num);
+    assert(do_rmdir("/y") == 0);
+    assert(do_mkdir("/z", 0755) == 0);
+    assert(path_inode_number("/z") == dir_ino_num);
+    insert_dentry(dir_ino_num, "g", ino_num);
+    assert(lookup_path_dentry(dir_ino_num, generation, "g", &entry_generation) == -ENOENT);
+    assert(lock_found_inode(dir_ino_num, generation, false) == -ESTALE);
+    assert(path_inode_number("/y/g") == -ENOENT);
+
+    unmount_test_image();
+}
+
+#define NUM_THREADS 8
+#define NUM_ITERS 2000
+#define NUM_NAMES 16
+
+// files hold their name repeated, so a read through a path can tell whether it reached another file
+void fill_path_content(const char* path, char* buffer, int size) {
+    const char* name = strrchr(path, '/') + 1;
+    int len = strlen(name);
+    for (int i = 0; i < size; i++) buffer[i] = name[i % len];
+}
+
+void* churn_thread(void* arg) {
+    long id = (long) arg;
+    unsigned seed = id * 7919 + 1;
+    char path[32], other_path[32], buffer[4096], expected[4096];
+    for (int i = 0; i < NUM_ITERS; i++) {
+        int op = rand_r(&seed) % 8;
+        sprintf(path, "/d%d/f%d", rand_r(&seed) % 2, rand_r(&seed) % NUM_NAMES);
+        if (op < 2) {
+            // files of this thread are created, written and removed by it only
+            sprintf(path, "/d%d/t%ld_%d", rand_r(&seed) % 2, id, rand_r(&seed) % 4);
+            int size = 1 + rand_r(&seed) % sizeof(buffer);
+            fill_path_content(path, expected, size);
+            do_unlink(path);
+            assert(do_mknod(path, 0644, 0) == 0);
+            assert(do_write(path, expected, size, 0, NULL) == size);
+            assert(do_read(path, buffer, sizeof(buffer), 0, NULL) == size);
+            assert(memcmp(buffer, expected, size) == 0);
+        }
+        else if (op < 5) {
+            // files of all threads, whatever a read finds must be the file of its path
+            int result = do_read(path, buffer, sizeof(buffer), 0, NULL);
+            if (result > 0) {
+                fill_path_content(path, expected, result);
+                assert(memcmp(buffer, expected, result) == 0);
+            }
+        }
+        else if (op < 6) {
+            int size = 1 + rand_r(&seed) % sizeof(buffer);
+            fill_path_content(path, expected, size);
+            if (do_mknod(path, 0644, 0) == 0) do_write(path, expected, size, 0, NULL);
+            else do_unlink(path);
+        }
+        else if (op < 7) {
+            // a file renamed between directories keeps its name, so its content stays that of its path
+            sprintf(other_path, "/d%d%s", path[2] == '0' ? 1 : 0, path + 3);
+            do_rename(path, other_path);
+            do_read(other_path, buffer, sizeof(buffer), 0, NULL);
+        }
+        else {
+            struct stat st;
+            do_getattr(path, &st);
+            list_dir(path[2] == '0' ? "/d0" : "/d1");
+        }
+    }
+    return NULL;
+}
+
+// operations on few names in two directories, run by several threads with files removed and created all along
+void test_churn() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(do_mkdir("/d0", 0755) == 0);
+    assert(do_mkdir("/d1", 0755) == 0);
+    pthread_t tids[NUM_THREADS];
+    for (long i = 0; i < NUM_THREADS; i++) assert(pthread_create(&tids[i], NULL, churn_thread, (void*) i) == 0);
+    for (int i = 0; i < NUM_THREADS; i++) pthread_join(tids[i], NULL);
+
+    // nothing is left locked
+    for (int i = 0; i < INODE_LOCK_BUCKETS; i++) assert(inode_lock_buckets[i] == NULL);
+    unmount_test_image();
+}
+
+int main() {
+    test_reused_inode();
+    test_churn();
+    unlink(TEST_IMAGE);
+    printf("test_lock passed\n");
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "test_util.h"
+
+// layout of size bytes formatted with features, result of compute_layout
+int layout(long long size, unsigned int features, long long num_inodes, int inode_size, long long journal_size) {
+    struct MkfsOptions options;
+    default_mkfs_options(&options);
+    options.features = features;
+    options.num_inodes = num_inodes;
+    options.inode_size = inode_size;
+    options.journal_size = journal_size;
+    return compute_layout(&options, size / SIZE_BLOCK);
+}
+
+// regions follow each other in order and the data region ends within the device
+void check_regions(long long size) {
+    assert(IMAP_START_BLK == NUM_BLKS_SUPERBLOCK);
+    assert(IMAP_START_BLK < DMAP_START_BLK && DMAP_START_BLK < INODE_TABLE_START_BLK);
+    assert(INODE_TABLE_START_BLK + (long long) NUM_INODE * SIZE_INODE / SIZE_BLOCK == JOURNAL_START_BLK);
+    assert(JOURNAL_START_BLK <= REFCOUNT_START_BLK && REFCOUNT_START_BLK <= DEDUP_INDEX_START_BLK);
+    assert(DEDUP_INDEX_START_BLK <= DEDUP_MAP_START_BLK && DEDUP_MAP_START_BLK <= CSUM_START_BLK);
+    assert(CSUM_START_BLK <= DATA_REG_START_BLK);
+    assert(DATA_REG_START_BLK + num_usable_data_blks() <= size / SIZE_BLOCK);
+    assert(num_usable_data_blks() <= NUM_DATA_BLKS);
+}
+
+void test_compute_layout() {
+    assert(layout(1LL << 30, 0, 0, 0, 0) == 0);
+    check_regions(1LL << 30);
+    assert(NUM_INODE == (1LL << 30) / 4096 && SIZE_INODE == 32 && NUM_BLKS_JOURNAL == 0);
+
+    // inode counts are rounded up to whole bitmap blocks
+    assert(layout(64LL << 20, 0, 5000, 0, 0) == 0);
+    assert(NUM_INODE == 2 * 8 * SIZE_BLOCK);
+    assert(layout(64LL << 20, 0, 5000, 256, 0) == 0 && SIZE_INODE == 256);
+    check_regions(64LL << 20);
+
+    // a journal size turns on the journal feature, dedup turns on reflink
+    assert(layout(64LL << 20, 0, 0, 0, 1 << 20) == 0);
+    assert((superblock.features & FEATURE_JOURNAL) && NUM_BLKS_JOURNAL == (1 << 20) / SIZE_BLOCK);
+    assert(layout(64LL << 20, FEATURE_JOURNAL, 0, 0, 0) == 0 && NUM_BLKS_JOURNAL == MKFS_DEFAULT_JOURNAL_SIZE / SIZE_BLOCK);
+    assert(layout(64LL << 20, FEATURE_DEDUP | FEATURE_CHECKSUM, 0, 0, 0) == 0);
+    assert(superblock.features & FEATURE_REFLINK);
+    check_regions(64LL << 20);
+
+    // inode sizes by feature
+    assert(layout(64LL << 20, FEATURE_INLINE_DATA, 0, 0, 0) == 0 && SIZE_INODE == MKFS_INLINE_INODE_SIZE);
+    assert(layout(64LL << 20, FEATURE_64BIT, 0, 0, 0) == 0 && SIZE_INODE == MKFS_64BIT_INODE_SIZE);
+    assert(layout(64LL << 20, FEATURE_64BIT, 0, 32, 0) == -EINVAL);
+    assert(layout(64LL << 20, 0, 0, 48, 0) == -EINVAL);
+    assert(layout(64LL << 20, 0, 0, 1024, 0) == -EINVAL);
+
+    // files are capped by the pointer tiers, about 8 MiB and with 64bit about 8 GiB
+    struct MkfsOptions options;
+    default_mkfs_options(&options);
+    options.max_file_size = 8LL << 30;
+    assert(compute_layout(&options, (64LL << 30) / SIZE_BLOCK) == -EFBIG);
+    options.features = FEATURE_64BIT;
+    assert(compute_layout(&options, (64LL << 30) / SIZE_BLOCK) == 0);
+    assert((long long) NUM_ALL_LEV_PTR_PER_INODE * SIZE_BLOCK == (1 + 64 + 64 * 64 + 64 * 64 * 64 + 64 * 64 * 64 * 64LL) * SIZE_BLOCK);
+    options.max_file_size = 9LL << 30;
+    assert(compute_layout(&options, (64LL << 30) / SIZE_BLOCK) == -EFBIG);
+
+    // too small for its metadata
+    assert(layout(64 * SIZE_BLOCK, 0, 0, 0, 0) == -ENOSPC);
+}
+
+// formatting over old content leaves the root directory only, and bitmap bits beyond the device set
+void test_format_over_garbage() {
+    unlink(TEST_IMAGE);
+    int fd = open(TEST_IMAGE, O_WRONLY | O_CREAT, 0644);
+    assert(fd >= 0);
+    char garbage[1 << 16];
+    memset(garbage, 0xab, sizeof(garbage));
+    for (int i = 0; i < 64; i++) assert(write(fd, garbage, sizeof(garbage)) == sizeof(garbage));
+    close(fd);
+
+    struct MkfsOptions options;
+    default_mkfs_options(&options);
+    options.size = TEST_IMAGE_SIZE;
+    options.num_threads = 4;
+    assert(format_toyfs(TEST_IMAGE, &options) == 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(count_used_inodes() == 1 && get_imap_bit(ROOT_INUM) == 1);
+    assert(count_used_data_blocks() == 0);
+    assert(get_inode_type(ROOT_INUM) == 1 && get_file_size(ROOT_INUM) == 0);
+    assert(get_inode_type(1) == 0 && get_file_size(1) == 0);
+    assert(num_usable_data_blks() < NUM_DATA_BLKS && get_dmap_bit(num_usable_data_blks()) == 1);
+    assert(list_dir("/") == 0);
+    unmount_test_image();
+}
+
+// the metadata regions are the same whatever the number of threads zeroing them
+void test_threads_same_image() {
+    char* images[2];
+    long long meta_size = 0;
+    int threads[2] = { 1, 8 };
+    for (int i = 0; i < 2; i++) {
+        struct MkfsOptions options;
+        default_mkfs_options(&options);
+        options.size = TEST_IMAGE_SIZE;
+        options.features = FEATURE_REFLINK | FEATURE_CHECKSUM;
+        options.num_threads = threads[i];
+        unlink(TEST_IMAGE);
+        assert(format_toyfs(TEST_IMAGE, &options) == 0);
+        meta_size = DATA_REG_START_BLK * SIZE_BLOCK;
+        images[i] = (char*) malloc(meta_size);
+        int fd = open(TEST_IMAGE, O_RDONLY);
+        assert(fd >= 0 && pread(fd, images[i], meta_size, 0) == meta_size);
+        close(fd);
+    }
+    assert(memcmp(images[0], images[1], meta_size) == 0);
+    free(images[0]);
+    free(images[1]);
+}
+
+int main() {
+    test_compute_layout();
+    test_format_over_garbage();
+    test_threads_same_image();
+    unlink(TEST_IMAGE);
+    printf("test_mkfs passed\n");
+    return 0;
+}
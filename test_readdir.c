@@ -0,0 +1,130 @@
+#include "test_util.h"
+
+#define NUM_FILES 600
+#define PAGE_ENTRIES 50
+
+int page_entries;
+off_t last_offset;
+int seen[NUM_FILES + 2];
+
+// filler of a reply buffer holding PAGE_ENTRIES entries
+int page_filler(void* buffer, const char* name, const struct stat* st, off_t offset) {
+    if (page_entries == PAGE_ENTRIES) return 1;
+    page_entries++;
+    last_offset = offset;
+    if (strcmp(name, ".") == 0) seen[NUM_FILES]++;
+    else if (strcmp(name, "..") == 0) seen[NUM_FILES + 1]++;
+    else seen[atoi(name + 1)]++;
+    return 0;
+}
+
+void create_files(const char* dir) {
+    assert(do_mkdir(dir, 0755) == 0);
+    char path[32];
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(path, "%s/f%d", dir, i);
+        assert(do_mknod(path, 0644, 0) == 0);
+    }
+}
+
+// a listing resumed from the offset of its last entry lists every entry once, also with entries removed in between
+void test_resume_listing() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    create_files("/d");
+    memset(seen, 0, sizeof(seen));
+    last_offset = 0;
+    int num_pages = 0;
+    while (true) {
+        page_entries = 0;
+        assert(do_readdir("/d", NULL, page_filler, last_offset, NULL) == 0);
+        if (page_entries == 0) break;
+        num_pages++;
+        if (num_pages == 3) {
+            // files already listed and not yet listed
+            assert(do_unlink("/d/f0") == 0);
+            assert(do_unlink("/d/f599") == 0);
+        }
+    }
+    assert(num_pages == (NUM_FILES + 2 + PAGE_ENTRIES - 1) / PAGE_ENTRIES);
+    assert(seen[NUM_FILES] == 1 && seen[NUM_FILES + 1] == 1);
+    for (int i = 0; i < NUM_FILES - 1; i++) assert(seen[i] == 1);
+    assert(seen[NUM_FILES - 1] == 0);
+    assert(list_dir("/d") == NUM_FILES - 2);
+    unmount_test_image();
+}
+
+// removing most entries while a listing is open compacts the directory only once it is released,
+// so the offsets of the listing still lead to the entries not yet listed
+void test_unlink_while_open() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    create_files("/d");
+    int ino_num = path_inode_number("/d");
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    assert(do_opendir("/d", &fi) == 0);
+
+    memset(seen, 0, sizeof(seen));
+    last_offset = 0;
+    for (int page = 0; page < 2; page++) {
+        page_entries = 0;
+        assert(do_readdir("/d", NULL, page_filler, last_offset, &fi) == 0);
+    }
+    int size = get_file_size(ino_num);
+    char path[32];
+    for (int i = 0; i < 2 * NUM_FILES / 3; i++) {
+        sprintf(path, "/d/f%d", i);
+        assert(do_unlink(path) == 0);
+    }
+    assert(get_file_size(ino_num) == size);
+    do {
+        page_entries = 0;
+        assert(do_readdir("/d", NULL, page_filler, last_offset, &fi) == 0);
+    } while (page_entries > 0);
+    for (int i = 0; i < NUM_FILES; i++) assert(seen[i] == (i < 2 * PAGE_ENTRIES - 2 || i >= 2 * NUM_FILES / 3));
+    assert(do_releasedir("/d", &fi) == 0);
+
+    // the next removal compacts
+    sprintf(path, "/d/f%d", NUM_FILES - 1);
+    assert(do_unlink(path) == 0);
+    assert(get_file_size(ino_num) == (NUM_FILES / 3 - 1) * SIZE_DIR_ITEM);
+    assert(list_dir("/d") == NUM_FILES / 3 - 1);
+    assert(do_opendir("/d/f400", &fi) == -ENOTDIR);
+    unmount_test_image();
+}
+
+// listing a directory reads its inode table blocks ahead, the getattr calls of ls -l that follow need no device reads
+void test_getattr_after_listing() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    create_files("/d");
+    unmount_test_image();
+
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    uint64_t reads = stats_op_count(STAT_OP_DEV_READ);
+    assert(list_dir("/d") == NUM_FILES);
+    int dir_blks = NUM_FILES * SIZE_DIR_ITEM / SIZE_BLOCK, inode_blks = NUM_FILES * SIZE_INODE / SIZE_BLOCK;
+    // runs of inode table blocks are read with one request each
+    assert(stats_op_count(STAT_OP_DEV_READ) - reads < (uint64_t) (dir_blks + inode_blks / 2));
+
+    reads = stats_op_count(STAT_OP_DEV_READ);
+    struct stat st;
+    char path[80];
+    for (int i = 0; i < num_listed; i++) {
+        strcpy(path, "/d/");
+        strcat(path, listed_names[i]);
+        assert(do_getattr(path, &st) == 0 && S_ISREG(st.st_mode));
+    }
+    assert(stats_op_count(STAT_OP_DEV_READ) == reads);
+    unmount_test_image();
+}
+
+int main() {
+    test_resume_listing();
+    test_unlink_while_open();
+    test_getattr_after_listing();
+    unlink(TEST_IMAGE);
+    printf("test_readdir passed\n");
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "test_util.h"
+
+void write_test_file(const char* path, const char* content) {
+    assert(do_mknod(path, 0644, 0) == 0);
+    assert(do_write(path, content, strlen(content), 0, NULL) == (int) strlen(content));
+}
+
+void check_test_file(const char* path, const char* content) {
+    char buffer[64];
+    assert(do_read(path, buffer, sizeof(buffer), 0, NULL) == (int) strlen(content));
+    assert(memcmp(buffer, content, strlen(content)) == 0);
+}
+
+int links_count(const char* path) {
+    struct stat st;
+    assert(do_getattr(path, &st) == 0);
+    return st.st_nlink;
+}
+
+// plain renames move the entry, replace files and empty directories, and move the ".." links of directories
+void test_rename() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(do_mkdir("/a", 0755) == 0);
+    assert(do_mkdir("/b", 0755) == 0);
+    write_test_file("/a/f", "file f");
+    write_test_file("/a/g", "file g");
+    int f = path_inode_number("/a/f");
+
+    assert(do_rename("/a/f", "/a/h") == 0);
+    assert(path_inode_number("/a/h") == f && path_inode_number("/a/f") == -ENOENT);
+    check_test_file("/a/h", "file f");
+
+    int used_inodes = count_used_inodes();
+    assert(do_rename("/a/h", "/a/g") == 0); // replaced
+    check_test_file("/a/g", "file f");
+    assert(count_used_inodes() == used_inodes - 1);
+    assert(list_dir("/a") == 1);
+
+    assert(do_mkdir("/a/d", 0755) == 0);
+    assert(do_mkdir("/a/d/e", 0755) == 0);
+    assert(links_count("/a") == 3 && links_count("/b") == 2);
+    assert(do_rename("/a/d", "/b/d") == 0);
+    assert(links_count("/a") == 2 && links_count("/b") == 3);
+    assert(list_dir("/b/d") == 1);
+
+    assert(do_rename("/b/d", "/b/d/e/x") == -EINVAL); // below itself
+    assert(do_mkdir("/a/empty", 0755) == 0);
+    assert(do_rename("/b/d/e", "/a/empty") == 0);
+    assert(links_count("/a") == 3 && links_count("/b/d") == 2);
+    assert(do_rename("/a/g", "/b/d") == -EISDIR);
+    assert(do_mknod("/b/d/f", 0644, 0) == 0);
+    assert(do_rename("/a/empty", "/b/d") == -ENOTEMPTY);
+    assert(do_rename("/a/empty", "/a/g") == -ENOTDIR);
+    assert(do_rename("/a/missing", "/a/x") == -ENOENT);
+
+    unmount_test_image();
+}
+
+// RENAME_NOREPLACE and RENAME_EXCHANGE, reached through rename_() only as FUSE 2 passes no flags
+void test_rename_flags() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(do_mkdir("/a", 0755) == 0);
+    assert(do_mkdir("/b", 0755) == 0);
+    write_test_file("/a/f", "file f");
+    write_test_file("/b/g", "file g");
+
+    assert(rename_("/a/f", "/b/g", RENAME_NOREPLACE) == -EEXIST);
+    check_test_file("/a/f", "file f");
+    check_test_file("/b/g", "file g");
+    assert(rename_("/a/f", "/b/h", RENAME_NOREPLACE) == 0);
+    check_test_file("/b/h", "file f");
+    assert(rename_("/b/h", "/a/f", RENAME_NOREPLACE | RENAME_EXCHANGE) == -EINVAL);
+    assert(rename_("/b/h", "/a/f", 1 << 2) == -EINVAL);
+
+    // two files swap entries
+    assert(rename_("/b/h", "/b/g", RENAME_EXCHANGE) == 0);
+    check_test_file("/b/g", "file f");
+    check_test_file("/b/h", "file g");
+    assert(rename_("/b/h", "/a/missing", RENAME_EXCHANGE) == -ENOENT);
+
+    // a directory and a file of different parents swap, the ".." link moves with the directory
+    assert(do_mkdir("/a/d", 0755) == 0);
+    assert(do_mknod("/a/d/x", 0644, 0) == 0);
+    assert(links_count("/a") == 3 && links_count("/b") == 2);
+    assert(rename_("/a/d", "/b/g", RENAME_EXCHANGE) == 0);
+    assert(links_count("/a") == 2 && links_count("/b") == 3);
+    check_test_file("/a/d", "file f");
+    assert(list_dir("/b/g") == 1);
+
+    // a directory cannot be exchanged with an entry below it, either way round
+    assert(rename_("/b/g", "/b/g/x", RENAME_EXCHANGE) == -EINVAL);
+    assert(rename_("/b/g/x", "/b/g", RENAME_EXCHANGE) == -EINVAL);
+    assert(list_dir("/b/g") == 1);
+
+    unmount_test_image();
+}
+
+// a move whose source entry cannot be removed puts the target entry back
+void test_rename_rollback() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    write_test_file("/a", "aaa");
+    write_test_file("/b", "bbb");
+    int a = path_inode_number("/a"), b = path_inode_number("/b");
+
+    // the source name is missing, as if removing its entry failed
+    assert(rename_entry_(ROOT_INUM, "missing", ROOT_INUM, "new", a, -1, 0) == -ENOENT);
+    assert(path_inode_number("/new") == -ENOENT);
+    assert(rename_entry_(ROOT_INUM, "missing", ROOT_INUM, "b", a, b, 0) == -ENOENT);
+    assert(path_inode_number("/b") == b);
+    check_test_file("/b", "bbb");
+    check_test_file("/a", "aaa");
+    assert(links_count("/a") == 1 && links_count("/b") == 1);
+    assert(list_dir("/") == 2);
+
+    unmount_test_image();
+}
+
+int main() {
+    test_rename();
+    test_rename_flags();
+    test_rename_rollback();
+    unlink(TEST_IMAGE);
+    printf("test_rename passed\n");
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "test_util.h"
+
+// a tree is removed with all its blocks and inodes
+void test_remove_tree() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(do_mknod("/x", 0644, 0) == 0); // the root directory block
+    long long used_blks = count_used_data_blocks();
+    int used_inodes = count_used_inodes();
+
+    char buffer[3000];
+    memset(buffer, 'a', sizeof(buffer));
+    assert(do_mkdir("/d", 0755) == 0);
+    assert(do_mkdir("/d/s", 0755) == 0);
+    for (int i = 0; i < 100; i++) {
+        char path[32];
+        sprintf(path, i % 2 ? "/d/f%d" : "/d/s/f%d", i);
+        assert(do_mknod(path, 0644, 0) == 0);
+        assert(do_write(path, buffer, sizeof(buffer), 0, NULL) == sizeof(buffer));
+    }
+    assert(do_symlink("/d/f1", "/d/s/l") == 0);
+    assert(do_link("/d/f1", "/h") == 0);
+    struct stat st;
+    assert(do_getattr("/d", &st) == 0 && st.st_nlink == 3);
+
+    assert(do_rmdir("/d") == 0);
+    assert(list_dir("/") == 2);
+    assert(do_getattr("/d/f1", &st) == -ENOENT);
+    assert(do_getattr("/h", &st) == 0 && st.st_nlink == 1);
+    assert(do_read("/h", buffer, sizeof(buffer), 0, NULL) == sizeof(buffer) && buffer[0] == 'a');
+    assert(do_unlink("/h") == 0);
+    assert(count_used_data_blocks() == used_blks);
+    assert(count_used_inodes() == used_inodes);
+
+    unmount_test_image();
+}
+
+// a directory with a wrong links count is left whole
+void test_bad_links_count() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(do_mkdir("/d", 0755) == 0);
+    assert(do_mknod("/d/f", 0644, 0) == 0);
+    assert(do_mkdir("/d/s", 0755) == 0);
+    int ino_num = path_inode_number("/d");
+    assert(ino_num >= 0);
+    assert(set_inode_data(ino_num, 2, INODE_LINKS_COUNT_OFF) == 0);
+    int used_inodes = count_used_inodes();
+
+    assert(do_rmdir("/d") < 0);
+    assert(count_used_inodes() == used_inodes);
+    assert(list_dir("/d") == 2);
+
+    unmount_test_image();
+}
+
+// children removed before a failure below a later child lose their entries, the directory stays consistent
+void test_failure_part_way() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(do_mkdir("/d", 0755) == 0);
+    assert(do_mknod("/d/f1", 0644, 0) == 0);
+    assert(do_mkdir("/d/s1", 0755) == 0);
+    assert(do_mknod("/d/f2", 0644, 0) == 0);
+    assert(do_mkdir("/d/s2", 0755) == 0);
+    assert(do_mknod("/d/s2/f", 0644, 0) == 0);
+    int f1 = path_inode_number("/d/f1");
+    int s1 = path_inode_number("/d/s1");
+    int s2 = path_inode_number("/d/s2");
+    assert(f1 >= 0 && s1 >= 0 && s2 >= 0);
+    assert(set_inode_data(s2, 5, INODE_LINKS_COUNT_OFF) == 0);
+
+    assert(do_rmdir("/d") < 0);
+    assert(get_imap_bit(f1) == 0 && get_imap_bit(s1) == 0 && get_imap_bit(s2) == 1);
+    assert(list_dir("/d") == 1 && strcmp(listed_names[0], "s2") == 0);
+    struct stat st;
+    assert(do_getattr("/d", &st) == 0 && st.st_nlink == 3);
+    assert(do_getattr("/d/f1", &st) == -ENOENT);
+
+    // the created file takes a freed inode, and is not reached through an old entry
+    assert(do_mknod("/d/n", 0644, 0) == 0);
+    assert(list_dir("/d") == 2);
+    assert(set_inode_data(s2, 2, INODE_LINKS_COUNT_OFF) == 0);
+    assert(do_rmdir("/d") == 0);
+    assert(list_dir("/") == 0);
+
+    unmount_test_image();
+}
+
+int main() {
+    test_remove_tree();
+    test_bad_links_count();
+    test_failure_part_way();
+    unlink(TEST_IMAGE);
+    printf("test_rmdir passed\n");
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "test_util.h"
+
+// writing past the end of a file allocates only the blocks written, the holes read as zeros without device reads
+void test_write_past_end() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    long long used = count_used_data_blocks();
+
+    char buffer[8 * SIZE_BLOCK];
+    memset(buffer, 'a', SIZE_BLOCK);
+    assert(write_(ino_num, buffer, 10, 0) == 10);
+    assert(write_(ino_num, buffer, SIZE_BLOCK, 1000 * SIZE_BLOCK) == SIZE_BLOCK);
+    assert(get_file_size(ino_num) == 1001 * SIZE_BLOCK);
+    assert(count_used_data_blocks() == used + 2 + 2); // and the indirect and double indirect pointer blocks on the way
+
+    uint64_t reads = stats_op_count(STAT_OP_DEV_READ);
+    memset(buffer, 'x', sizeof(buffer));
+    assert(read_(ino_num, buffer, sizeof(buffer), 500 * SIZE_BLOCK) == sizeof(buffer));
+    for (int i = 0; i < (int) sizeof(buffer); i++) assert(buffer[i] == 0);
+    assert(stats_op_count(STAT_OP_DEV_READ) == reads);
+    // the rest of the first block is zeros as well
+    assert(read_(ino_num, buffer, SIZE_BLOCK, 0) == SIZE_BLOCK);
+    for (int i = 10; i < SIZE_BLOCK; i++) assert(buffer[i] == 0);
+
+    // truncating up adds holes only
+    used = count_used_data_blocks();
+    assert(truncate_(ino_num, 5000 * SIZE_BLOCK) == 0);
+    assert(count_used_data_blocks() == used);
+    assert(get_file_size(ino_num) == 5000 * SIZE_BLOCK);
+    assert(read_(ino_num, buffer, SIZE_BLOCK, 4999 * SIZE_BLOCK) == SIZE_BLOCK);
+    for (int i = 0; i < SIZE_BLOCK; i++) assert(buffer[i] == 0);
+    unmount_test_image();
+}
+
+// SEEK_DATA and SEEK_HOLE find the written blocks, unwritten blocks count as holes
+void test_seek_data_hole() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    char buffer[SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    assert(write_(ino_num, buffer, SIZE_BLOCK, 3 * SIZE_BLOCK) == SIZE_BLOCK);
+    assert(write_(ino_num, buffer, SIZE_BLOCK, 2000 * SIZE_BLOCK) == SIZE_BLOCK);
+    assert(fallocate_(ino_num, FALLOC_FL_KEEP_SIZE, 10 * SIZE_BLOCK, 4 * SIZE_BLOCK) == 0);
+
+    assert(seek_(ino_num, 0, SEEK_DATA) == 3 * SIZE_BLOCK);
+    assert(seek_(ino_num, 3 * SIZE_BLOCK + 7, SEEK_DATA) == 3 * SIZE_BLOCK + 7);
+    assert(seek_(ino_num, 3 * SIZE_BLOCK, SEEK_HOLE) == 4 * SIZE_BLOCK);
+    assert(seek_(ino_num, 4 * SIZE_BLOCK, SEEK_DATA) == 2000 * SIZE_BLOCK);
+    assert(seek_(ino_num, 0, SEEK_HOLE) == 0);
+    assert(seek_(ino_num, 2000 * SIZE_BLOCK, SEEK_HOLE) == 2001 * SIZE_BLOCK);
+    assert(seek_(ino_num, 2001 * SIZE_BLOCK, SEEK_DATA) == -ENXIO);
+    assert(seek_(ino_num, 2001 * SIZE_BLOCK, SEEK_HOLE) == -ENXIO);
+    assert(seek_(ino_num, 0, SEEK_SET) == -EINVAL);
+    unmount_test_image();
+}
+
+int main() {
+    test_write_past_end();
+    test_seek_data_hole();
+    unlink(TEST_IMAGE);
+    printf("test_sparse passed\n");
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "test_util.h"
+
+#define NUM_THREADS 8
+#define ADDS_PER_THREAD 100000
+
+// every value falls in the bucket starting at or below it, and buckets are at most 1/16 wide
+void test_histogram_buckets() {
+    for (uint64_t value = 0; value < (1ull << 42); value = value * 9 / 8 + 1) {
+        int index = hist_bucket_index(value);
+        assert(index >= 0 && index < HIST_NUM_BUCKETS);
+        assert(hist_bucket_value(index) <= value);
+        if (index + 1 < HIST_NUM_BUCKETS) {
+            assert(value < hist_bucket_value(index + 1));
+            assert(hist_bucket_value(index + 1) - hist_bucket_value(index) <= hist_bucket_value(index) / 16 + 1);
+        }
+    }
+
+    // readlink is not called by this test, its histogram only has the latencies recorded here
+    for (int i = 0; i < 990; i++) stats_record(STAT_OP_READLINK, 1000);
+    for (int i = 0; i < 10; i++) stats_record(STAT_OP_READLINK, 1000000);
+    struct ThreadStats* snapshot = (struct ThreadStats*) malloc(sizeof(struct ThreadStats));
+    stats_snapshot(snapshot);
+    struct Histogram* hist = &snapshot->hists[STAT_OP_READLINK];
+    assert(hist->count == 1000 && stats_op_count(STAT_OP_READLINK) == 1000);
+    assert(hist->sum == 990 * 1000ull + 10 * 1000000ull);
+    assert(hist->max == 1000000);
+    assert(hist_percentile(hist, 50) >= 1000 && hist_percentile(hist, 50) < 1000 + 1000 / 16);
+    assert(hist_percentile(hist, 99) >= 1000 && hist_percentile(hist, 99) < 1000 + 1000 / 16);
+    assert(hist_percentile(hist, 99.9) > 1000000 - 1000000 / 16 && hist_percentile(hist, 99.9) <= 1000000);
+    free(snapshot);
+}
+
+void* add_counters(void* arg) {
+    for (int i = 0; i < ADDS_PER_THREAD; i++) stats_add(STAT_LOOKUP_RETRY, 1);
+    return NULL;
+}
+
+// counters of all threads add up, also after the threads exited
+void test_counters_from_threads() {
+    uint64_t before = stats_counter_total(STAT_LOOKUP_RETRY);
+    pthread_t threads[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) pthread_create(&threads[i], NULL, add_counters, NULL);
+    for (int i = 0; i < NUM_THREADS; i++) pthread_join(threads[i], NULL);
+    assert(stats_counter_total(STAT_LOOKUP_RETRY) - before == (uint64_t) NUM_THREADS * ADDS_PER_THREAD);
+}
+
+// read a whole virtual file in small pieces, as cat reading a file of unknown size
+int read_stats_file(const char* path, char* buffer, int size) {
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    assert(do_open(path, &fi) == 0);
+    assert(fi.direct_io == 1);
+    int length = 0;
+    while (true) {
+        int result = do_read(path, buffer + length, 100, length, &fi);
+        assert(result >= 0);
+        if (result == 0) break;
+        length += result;
+        assert(length < size);
+        // reads of one open see the snapshot taken when it was opened
+        stats_record(STAT_OP_DEV_READ, 1000);
+    }
+    buffer[length] = '\0';
+    assert(do_release(path, &fi) == 0);
+    return length;
+}
+
+// the virtual files under /.toyfs report the counters and gauges, and cannot be written
+void test_stats_files() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    create_test_file("f");
+    char data[8 * SIZE_BLOCK];
+    memset(data, 'a', sizeof(data));
+    assert(do_write("/f", data, sizeof(data), 0, NULL) == sizeof(data));
+
+    struct stat st;
+    assert(do_getattr(STATS_DIR_PATH, &st) == 0 && S_ISDIR(st.st_mode));
+    assert(do_getattr(STATS_TEXT_PATH, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0222) == 0);
+    assert(list_dir(STATS_DIR_PATH) == 2);
+    assert(strcmp(listed_names[0], "stats") == 0 && strcmp(listed_names[1], "stats.json") == 0);
+    assert(list_dir("/") == 1); // not stored in the root directory
+
+    static char buffer[65536];
+    uint64_t dev_reads = stats_op_count(STAT_OP_DEV_READ);
+    assert(read_stats_file(STATS_JSON_PATH, buffer, sizeof(buffer)) > 0);
+    char key[64];
+    sprintf(key, "\"dev_read\":{\"count\":%llu,", (unsigned long long) dev_reads);
+    assert(strstr(buffer, key) != NULL);
+    sprintf(key, "\"cache_capacity\":%d,", TEST_CACHE_BLKS);
+    assert(strstr(buffer, key) != NULL);
+    assert(buffer[0] == '{' && strcmp(buffer + strlen(buffer) - 2, "}\n") == 0);
+
+    assert(read_stats_file(STATS_TEXT_PATH, buffer, sizeof(buffer)) > 0);
+    sprintf(key, "\n%-24s %d\n", "cache_capacity", TEST_CACHE_BLKS);
+    assert(strstr(buffer, key) != NULL);
+    assert(strstr(buffer, "\ndev_read ") != NULL);
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    assert(do_open(STATS_TEXT_PATH, &fi) == -EACCES);
+    fi.flags = O_RDWR;
+    assert(do_open(STATS_JSON_PATH, &fi) == -EACCES);
+    assert(do_truncate(STATS_TEXT_PATH, 0) == -EACCES);
+    assert(do_read(STATS_DIR_PATH, buffer, 100, 0, NULL) == -EISDIR);
+
+    unmount_test_image();
+}
+
+int main() {
+    test_histogram_buckets();
+    test_counters_from_threads();
+    test_stats_files();
+    unlink(TEST_IMAGE);
+    printf("test_stats passed\n");
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include "test_util.h"
+
+#define DIR_ENTRIES (2 * SIZE_BLOCK / SIZE_DIR_ITEM) // two directory blocks
+
+void create_dir_files(const char* dir, int count) {
+    assert(do_mkdir(dir, 0755) == 0);
+    char path[32];
+    for (int i = 0; i < count; i++) {
+        sprintf(path, "%s/f%d", dir, i);
+        assert(do_mknod(path, 0644, 0) == 0);
+    }
+}
+
+void remove_dir_files(const char* dir, int from, int to) {
+    char path[32];
+    for (int i = from; i < to; i++) {
+        sprintf(path, "%s/f%d", dir, i);
+        assert(do_unlink(path) == 0);
+    }
+}
+
+// inode number of the entry at index of a directory, -1 for a tombstone
+int entry_ino_num(int dir_ino_num, int index) {
+    int ino_num = 0;
+    assert(read_(dir_ino_num, (char*) &ino_num, sizeof(ino_num), index * SIZE_DIR_ITEM) == sizeof(ino_num));
+    return ino_num;
+}
+
+// a removed entry is tombstoned in place and reused by the next create
+void test_tombstone_reuse() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    create_dir_files("/d", DIR_ENTRIES);
+    int dir_ino_num = path_inode_number("/d");
+    assert(get_file_size(dir_ino_num) == DIR_ENTRIES * SIZE_DIR_ITEM);
+
+    remove_dir_files("/d", 10, 11);
+    assert(get_file_size(dir_ino_num) == DIR_ENTRIES * SIZE_DIR_ITEM);
+    assert(entry_ino_num(dir_ino_num, 10) == -1);
+    assert(do_mknod("/d/g", 0644, 0) == 0);
+    assert(get_file_size(dir_ino_num) == DIR_ENTRIES * SIZE_DIR_ITEM);
+    assert(entry_ino_num(dir_ino_num, 10) == path_inode_number("/d/g"));
+
+    // tombstones are on the device, a directory without hint is scanned for them
+    remove_dir_files("/d", 20, 21);
+    unmount_test_image();
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(list_dir("/d") == DIR_ENTRIES - 1);
+    assert(path_inode_number("/d/f20") == -ENOENT);
+    assert(do_mknod("/d/h", 0644, 0) == 0);
+    assert(entry_ino_num(dir_ino_num, 20) == path_inode_number("/d/h"));
+    assert(get_file_size(dir_ino_num) == DIR_ENTRIES * SIZE_DIR_ITEM);
+    unmount_test_image();
+}
+
+// once a block worth of entries and half of all are free, live entries move to the front and trailing blocks are freed
+void test_compaction() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    create_dir_files("/d", DIR_ENTRIES);
+    int dir_ino_num = path_inode_number("/d");
+    long long used = count_used_data_blocks();
+
+    remove_dir_files("/d", 0, DIR_ENTRIES / 4);
+    // the free slot counts of directories are in memory only, they are counted again
+    memset(dir_hints, 0, sizeof(dir_hints));
+    remove_dir_files("/d", DIR_ENTRIES / 4, DIR_ENTRIES / 2 - 1);
+    assert(get_file_size(dir_ino_num) == DIR_ENTRIES * SIZE_DIR_ITEM);
+    remove_dir_files("/d", DIR_ENTRIES / 2 - 1, DIR_ENTRIES / 2);
+    assert(get_file_size(dir_ino_num) == DIR_ENTRIES / 2 * SIZE_DIR_ITEM);
+    assert(count_used_data_blocks() == used - 1);
+
+    assert(list_dir("/d") == DIR_ENTRIES / 2);
+    char path[32];
+    for (int i = DIR_ENTRIES / 2; i < DIR_ENTRIES; i++) {
+        sprintf(path, "/d/f%d", i);
+        assert(path_inode_number(path) >= 0);
+        assert(entry_ino_num(dir_ino_num, i - DIR_ENTRIES / 2) == path_inode_number(path));
+    }
+    // an emptied directory releases all its blocks
+    remove_dir_files("/d", DIR_ENTRIES / 2, DIR_ENTRIES);
+    assert(get_file_size(dir_ino_num) == 0);
+    assert(count_used_data_blocks() == used - 2);
+    assert(do_rmdir("/d") == 0);
+    unmount_test_image();
+}
+
+int main() {
+    test_tombstone_reuse();
+    test_compaction();
+    unlink(TEST_IMAGE);
+    printf("test_tombstone passed\n");
+    return 0;
+}
@@ -0,0 +1,133 @@
+#define TOYFS_TRACE_LEVEL 3 // TRACE_LEVEL_DEBUG, as built by make trace
+#include "test_util.h"
+
+#define TEST_TRACE "test.trace"
+
+int num_records;
+struct TraceRecord* records;
+
+// read the records of a trace file written by trace_stop
+void load_trace(const char* path) {
+    FILE* file = fopen(path, "rb");
+    assert(file != NULL);
+    char magic[sizeof(TRACE_FILE_MAGIC)];
+    assert(fread(magic, 1, strlen(TRACE_FILE_MAGIC), file) == strlen(TRACE_FILE_MAGIC));
+    assert(memcmp(magic, TRACE_FILE_MAGIC, strlen(TRACE_FILE_MAGIC)) == 0);
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file) - strlen(TRACE_FILE_MAGIC);
+    assert(size % sizeof(struct TraceRecord) == 0);
+    num_records = size / sizeof(struct TraceRecord);
+    free(records);
+    records = (struct TraceRecord*) malloc(size + 1);
+    fseek(file, strlen(TRACE_FILE_MAGIC), SEEK_SET);
+    assert(fread(records, sizeof(struct TraceRecord), num_records, file) == num_records);
+    fclose(file);
+}
+
+void* record_until_full(void* arg) {
+    for (int i = 0; i < TRACE_RING_SIZE + 10; i++) TRACE_DEBUG(TRACE_READ_BLOCK, NULL, 1, i, 0);
+    return NULL;
+}
+
+// a full ring drops new records and keeps the old ones, a long path keeps its tail
+void test_full_ring() {
+    // recorded before the drain thread starts, nothing empties the ring
+    pthread_t thread;
+    pthread_create(&thread, NULL, record_until_full, NULL);
+    pthread_join(thread, NULL);
+    const char* path = "/a/long/path/to/some/directory/file";
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_OPEN, 0, 0);
+
+    assert(trace_start(TEST_TRACE) == 0);
+    assert(trace_stop() == 10);
+    load_trace(TEST_TRACE);
+    assert(num_records == TRACE_RING_SIZE + 1);
+    int next_blk_idx = 0;
+    for (int i = 0; i < num_records; i++) {
+        if (records[i].event != TRACE_READ_BLOCK) continue;
+        assert(records[i].args[1] == next_blk_idx++);
+        assert(records[i].level == TRACE_LEVEL_DEBUG);
+    }
+    assert(next_blk_idx == TRACE_RING_SIZE);
+    for (int i = 0; i < num_records; i++) {
+        if (records[i].event != TRACE_FUSE_CALL) continue;
+        assert(strcmp(records[i].str, path + strlen(path) - (TRACE_STR_SIZE - 1)) == 0);
+        assert(records[i].args[0] == STAT_OP_OPEN && records[i].level == TRACE_LEVEL_INFO);
+    }
+}
+
+// fuse calls and block writes are traced in order, while the drain thread empties the rings
+void test_trace_write() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(trace_start(TEST_TRACE) == 0);
+
+    assert(do_mknod("/f", S_IFREG | 0644, 0) == 0);
+    int ino_num = path_inode_number("/f");
+    char data[4 * SIZE_BLOCK];
+    memset(data, 'a', sizeof(data));
+    // more records than a ring holds, the drain thread empties the ring between batches
+    for (int batch = 0; batch < 16; batch++) {
+        for (int i = 0; i < 256; i++) assert(do_write("/f", data, sizeof(data), 0, NULL) == sizeof(data));
+        usleep(5 * TRACE_DRAIN_INTERVAL_US);
+    }
+    assert(trace_stop() == 10); // only the drops of test_full_ring
+    load_trace(TEST_TRACE);
+    assert(num_records > TRACE_RING_SIZE);
+
+    int num_calls = 0;
+    int num_block_writes = 0;
+    for (int i = 0; i < num_records; i++) {
+        struct TraceRecord* record = &records[i];
+        assert(record->event < NUM_TRACE_EVENTS && record->level <= TRACE_LEVEL_DEBUG);
+        if (i > 0 && record->thread_id == records[i - 1].thread_id) assert(record->time_ns >= records[i - 1].time_ns);
+        if (record->event == TRACE_FUSE_CALL && record->args[0] == STAT_OP_WRITE) {
+            assert(strcmp(record->str, "/f") == 0);
+            assert(record->args[1] == sizeof(data) && record->args[2] == 0);
+            num_calls++;
+        }
+        if (record->event == TRACE_WRITE_BLOCK && record->args[0] == ino_num) {
+            assert(record->args[1] >= 0 && record->args[1] < 4);
+            num_block_writes++;
+        }
+    }
+    assert(num_calls == 4096);
+    assert(num_block_writes == 4 * 4096);
+
+    unmount_test_image();
+}
+
+// the decoder prints the events with their argument names
+void test_decoder() {
+    assert(system("./toyfs-trace " TEST_TRACE " > " TEST_TRACE ".txt") == 0);
+    FILE* file = fopen(TEST_TRACE ".txt", "r");
+    assert(file != NULL);
+    char call[128];
+    sprintf(call, " INFO  fuse_call: \"/f\" op = write size = %d offset = 0", 4 * SIZE_BLOCK);
+    char line[256];
+    bool found_call = false;
+    bool found_block = false;
+    char last[256] = "";
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strstr(line, call) != NULL) found_call = true;
+        if (strstr(line, " DEBUG write_block: ino_num = ") != NULL) found_block = true;
+        strcpy(last, line);
+    }
+    fclose(file);
+    assert(found_call && found_block);
+    char summary[64];
+    sprintf(summary, "%d records\n", num_records);
+    assert(strcmp(last, summary) == 0);
+    unlink(TEST_TRACE ".txt");
+}
+
+int main() {
+    test_full_ring();
+    test_trace_write();
+    test_decoder();
+    free(records);
+    unlink(TEST_TRACE);
+    unlink(TEST_IMAGE);
+    printf("test_trace passed\n");
+    return 0;
+}
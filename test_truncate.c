@@ -0,0 +1,62 @@
+#include "test_util.h"
+
+#define FILE_BLKS 2000
+
+// truncating frees the data blocks past the new size and the pointer blocks left empty, without reading the data
+void test_shrink() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    int ino_num = create_test_file("f");
+    long long used = count_used_data_blocks();
+    char buffer[100 * SIZE_BLOCK];
+    memset(buffer, 'a', sizeof(buffer));
+    for (int i = 0; i < FILE_BLKS / 100; i++) assert(write_(ino_num, buffer, sizeof(buffer), i * sizeof(buffer)) == sizeof(buffer));
+    // 2 direct blocks, an indirect pointer block of 128 and a double indirect one with 15 leaves
+    int ptr_blks = 1 + 1 + (FILE_BLKS - 130 + 127) / 128;
+    assert(count_used_data_blocks() == used + FILE_BLKS + ptr_blks);
+    assert(write_dirty_blocks_back() == 0);
+
+    uint64_t reads = stats_op_count(STAT_OP_DEV_READ), freed = stats_counter_total(STAT_FREE_BLOCK);
+    assert(truncate_(ino_num, 10 * SIZE_BLOCK + 7) == 0);
+    assert(get_file_size(ino_num) == 10 * SIZE_BLOCK + 7);
+    assert(count_used_data_blocks() == used + 11 + 1);
+    assert(stats_counter_total(STAT_FREE_BLOCK) - freed == FILE_BLKS - 11 + ptr_blks - 1);
+    assert(stats_op_count(STAT_OP_DEV_READ) == reads); // all cached, no data read back
+    unmount_test_image();
+
+    // the tail of the last block is zeroed, growing the file again reads zeros
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(truncate_(ino_num, 12 * SIZE_BLOCK) == 0);
+    assert(count_used_data_blocks() == used + 11 + 1);
+    assert(read_(ino_num, buffer, 12 * SIZE_BLOCK, 0) == 12 * SIZE_BLOCK);
+    for (int i = 0; i < 12 * SIZE_BLOCK; i++) assert(buffer[i] == (i < 10 * SIZE_BLOCK + 7 ? 'a' : 0));
+
+    assert(truncate_(ino_num, 0) == 0);
+    assert(get_file_size(ino_num) == 0 && count_used_data_blocks() == used);
+    assert(truncate_(ino_num, -1) == -EINVAL);
+    assert(truncate_(ino_num, (off_t) NUM_ALL_LEV_PTR_PER_INODE * SIZE_BLOCK + 1) == -EFBIG);
+    unmount_test_image();
+}
+
+// truncate through the path checks the file type
+void test_truncate_path() {
+    format_test_image(TEST_IMAGE, TEST_IMAGE_SIZE, 0);
+    mount_test_image(TEST_IMAGE, TEST_CACHE_BLKS);
+    assert(do_mkdir("/d", 0755) == 0);
+    assert(do_mknod("/f", 0644, 0) == 0);
+    assert(do_write("/f", "abcdef", 6, 0, NULL) == 6);
+    assert(do_truncate("/d", 0) == -EISDIR);
+    assert(do_truncate("/x", 0) == -ENOENT);
+    assert(do_ftruncate("/f", 3, NULL) == 0);
+    char buffer[8];
+    assert(do_read("/f", buffer, sizeof(buffer), 0, NULL) == 3 && memcmp(buffer, "abc", 3) == 0);
+    unmount_test_image();
+}
+
+int main() {
+    test_shrink();
+    test_truncate_path();
+    unlink(TEST_IMAGE);
+    printf("test_truncate passed\n");
+    return 0;
+}
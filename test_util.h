@@ -0,0 +1,147 @@
+/*
+Utilities of the tests calling toyfs operations directly on an image file, without fuse
+
+A test includes this header in place of toyfs.c, formats an image with format_test_image and mounts it with
+mount_test_image. The image file has to be on a file system supporting O_DIRECT (not tmpfs).
+*/
+#ifndef __TEST_UTIL_H_
+#define __TEST_UTIL_H_
+
+#define main toyfs_main
+#include "toyfs.c"
+#undef main
+#include <assert.h>
+
+#define TEST_IMAGE "test.img"
+#define TEST_IMAGE_SIZE (64LL << 20)
+#define TEST_CACHE_BLKS 83568 // as mounted by toyfs
+#define TEST_META_CACHE_BLKS 8192
+
+// format an image file of size bytes with FEATURE_* flags
+void format_test_image(const char* path, long long size, unsigned int features) {
+    unlink(path);
+    struct MkfsOptions options;
+    default_mkfs_options(&options);
+    options.size = size;
+    options.features = features;
+    int result = format_toyfs(path, &options);
+    assert(result == 0);
+}
+
+// set up the caches as toyfs does before fuse_main, a data cache of cache_blks blocks
+void mount_test_image(const char* path, int cache_blks) {
+    device_path = path;
+    queue = create_cache_queue(cache_blks);
+    hash = create_hash_table(100);
+    dirty_table = create_dirty_table(1024);
+    int result = get_superblock();
+    assert(result == 0);
+    result = create_meta_caches(TEST_META_CACHE_BLKS, false);
+    assert(result == 0);
+}
+
+// write everything back and free the caches, as toyfs does after fuse_main
+void unmount_test_image() {
+    stop_cache_cleaner();
+    write_dirty_blocks_back();
+    destroy_meta_caches();
+    while (!is_queue_empty(queue) && dequeue(queue, hash) == 0);
+    free(queue);
+    free(hash->buckets);
+    free(hash);
+    clear_dirty_table(dirty_table);
+    free(dirty_table->buckets);
+    free(dirty_table);
+    // the in-memory tables of toyfs.c live as long as the process, the next image starts without them
+    memset(cluster_cache, 0, sizeof(cluster_cache));
+    memset(fingerprint_cache, 0, sizeof(fingerprint_cache));
+    memset(dir_hints, 0, sizeof(dir_hints));
+    memset(dentry_cache, 0, sizeof(dentry_cache));
+    // checksum tables, get_superblock sets them up again for an image with checksums
+    for (long long i = 0; csum_blocks != NULL && i < NUM_BLKS_CSUM; i++) free(csum_blocks[i]);
+    free(csum_blocks);
+    free(csum_dirty);
+    csum_blocks = NULL;
+    csum_dirty = NULL;
+    verify_block_hook = NULL;
+    record_block_hook = NULL;
+}
+
+// create regular file name in the root directory, return its inode number
+int create_test_file(const char* name) {
+    char padded[SIZE_FILENAME]; // mknod_ copies a whole entry name
+    memset(padded, 0, SIZE_FILENAME);
+    strncpy(padded, name, SIZE_FILENAME - 1);
+    name = padded;
+    int result = mknod_(ROOT_INUM, name);
+    assert(result >= 0);
+    int ino_num = find_dir_entry_ino(ROOT_INUM, name);
+    assert(ino_num >= 0);
+    return ino_num;
+}
+
+// inode number of an absolute path, negative if not found
+int path_inode_number(const char* path) {
+    unsigned int generation = 0;
+    return get_inode_number(path, &generation);
+}
+
+// data blocks in use, to find blocks leaked or freed twice
+long long count_used_data_blocks() {
+    long long used = 0;
+    for (long long i = 0; i < num_usable_data_blks(); i++) {
+        int bit = get_dmap_bit(i);
+        assert(bit >= 0);
+        used += bit;
+    }
+    return used;
+}
+
+// inodes in use
+int count_used_inodes() {
+    int used = 0;
+    for (int i = 0; i < NUM_INODE; i++) {
+        int bit = get_imap_bit(i);
+        assert(bit >= 0);
+        used += bit;
+    }
+    return used;
+}
+
+int num_listed;
+char listed_names[1024][64];
+
+int list_filler(void* buffer, const char* name, const struct stat* st, off_t offset) {
+    if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && num_listed < 1024) strcpy(listed_names[num_listed++], name);
+    return 0;
+}
+
+// number of entries of a directory, their names are left in listed_names
+int list_dir(const char* path) {
+    num_listed = 0;
+    int result = do_readdir(path, NULL, list_filler, 0, NULL);
+    assert(result == 0);
+    return num_listed;
+}
+
+// allocate all free data blocks but the last keep ones of the data region, return the first kept one
+long long fill_data_blocks(int keep) {
+    long long hint = 0;
+    while (true) {
+        int got = 0;
+        long long data_reg_idx = alloc_data_blocks(hint, 1024, &got);
+        if (data_reg_idx == -ENOSPC) break;
+        assert(data_reg_idx >= 0);
+        hint = data_reg_idx + got;
+    }
+    long long kept = -1;
+    for (long long i = num_usable_data_blks() - 1; i >= 0 && keep > 0; i--) {
+        int result = set_dmap_bit(i, 0);
+        assert(result >= 0);
+        kept = i;
+        keep--;
+    }
+    return kept;
+}
+
+#endif
@@ -10,17 +10,11 @@ Reference:
 */
 #define FUSE_USE_VERSION 29
 
-#define SIZE_DIR_ITEM (SIZE_FILENAME + 4) // size of directory item, 4 bytes for inode number
-#define SIZE_DATA_BLK_PTR 4 // size of data block pointers
-
-#define NUM_PTR_PER_BLK (SIZE_BLOCK / SIZE_DATA_BLK_PTR)
-#define NUM_FIRST_LEV_PTR_PER_INODE (NUM_DISK_PTRS_PER_INODE - 2)
-#define NUM_SECOND_LEV_PTR_PER_INODE NUM_PTR_PER_BLK
-#define NUM_THIRD_LEV_PTR_PER_INODE NUM_PTR_PER_BLK * NUM_PTR_PER_BLK
-#define NUM_FIRST_TWO_LEV_PTR_PER_INODE (NUM_FIRST_LEV_PTR_PER_INODE + NUM_SECOND_LEV_PTR_PER_INODE)
-#define NUM_ALL_LEV_PTR_PER_INODE (NUM_FIRST_LEV_PTR_PER_INODE + NUM_SECOND_LEV_PTR_PER_INODE + NUM_THIRD_LEV_PTR_PER_INODE)
-
 #include "util.h"
+#include "trace.h"
+#include "toyfs_ioctl.h"
+#include "lz4.h"
+#include "fingerprint.h"
 #include <fuse.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -30,423 +24,882 @@ Reference:
 #include <stdlib.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <linux/falloc.h>
 
+// renameat2 flags, only reachable through rename_() as FUSE 2 passes no flags
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
 
-int read_block(int ino_num, int blk_idx, char* buffer) {
-    if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
-    
-    // direct
-    if (blk_idx < NUM_FIRST_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] read_block {direct block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        
-        // first level block
-        int first_level_data_reg_idx = get_inode_data(ino_num, INODE_BLK_PTR_OFF + blk_idx);
-        if (first_level_data_reg_idx < 0 || first_level_data_reg_idx >= NUM_DATA_BLKS) return -1;        
-        printf("[DBUG INFO] read_block {first level}: first_level_data_reg_idx = %d\n", first_level_data_reg_idx);
 
-        int result = get_data_block_data(first_level_data_reg_idx, buffer, SIZE_BLOCK, 0);
-        if (result < 0) return result;
+int get_new_inode() {
+    static int ino_num = 0; // search hint, a stale value from a concurrent create only costs a longer scan
+    int scanned = 0;
+    int new_inode = alloc_inode(__atomic_load_n(&ino_num, __ATOMIC_RELAXED), &scanned);
+    stats_add(STAT_ALLOC_BITS_SCANNED, scanned);
+    if (new_inode < 0) {
+        if (new_inode == -ENOSPC) TRACE_ERROR(TRACE_NO_SPACE, "inode", 0, 0, 0);
+        return new_inode;
+    }
+    stats_add(STAT_ALLOC_INODE, 1);
+    __atomic_store_n(&ino_num, new_inode, __ATOMIC_RELAXED);
 
-        return SIZE_BLOCK;
+    return new_inode;
+}
+
+// allocate up to want contiguous data blocks, the number allocated is returned in *got
+// blocks are not initialized
+long long get_new_blocks(int want, int* got) {
+    static long long block_idx = 0; // search hint as in get_new_inode
+    long long new_block = alloc_data_blocks(__atomic_load_n(&block_idx, __ATOMIC_RELAXED), want, got);
+    if (new_block < 0) {
+        if (new_block == -ENOSPC) TRACE_ERROR(TRACE_NO_SPACE, "block", 0, 0, 0);
+        return new_block;
     }
-    // indirect
-    if (blk_idx >= NUM_FIRST_LEV_PTR_PER_INODE && blk_idx < NUM_FIRST_TWO_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] read_block {indirect block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        
-        // first level block
-        int first_level_data_reg_idx = get_inode_data(ino_num, INODE_BLK_PTR_OFF + NUM_DISK_PTRS_PER_INODE - 2);
-        if (first_level_data_reg_idx < 0 || first_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        printf("[DBUG INFO] read_block {first level}: first_level_data_reg_idx = %d\n", first_level_data_reg_idx);
-
-        // second level block
-        int first_level_offset = blk_idx - NUM_FIRST_LEV_PTR_PER_INODE;
-        int second_level_data_reg_idx = -1;
-        int result = get_data_block_data(first_level_data_reg_idx, (char*) &second_level_data_reg_idx, sizeof(second_level_data_reg_idx), first_level_offset * SIZE_DATA_BLK_PTR);
-        if (result < 0) return result;
-        if (second_level_data_reg_idx < 0 || second_level_data_reg_idx >= NUM_DATA_BLKS) return -1;       
-        printf("[DBUG INFO] read_block {second level}: second_level_data_reg_idx = %d\n", second_level_data_reg_idx);
-        
-        result = get_data_block_data(second_level_data_reg_idx, buffer, SIZE_BLOCK, 0);
+    __atomic_store_n(&block_idx, new_block + *got, __ATOMIC_RELAXED);
+
+    return new_block;
+}
+
+// pointer block with all entries holes
+long long get_new_ptr_block() {
+    int got = 0;
+    long long new_block = get_new_blocks(1, &got);
+    if (new_block < 0) return new_block;
+    int result = initialize_block(DATA_REG_START_BLK + new_block, 0xff);
+    if (result < 0) return result;
+
+    return new_block;
+}
+
+#define PTR_BLK_INODE -2 // block pointer kept in the inode, ptr_off is the index of the inode block pointer
+
+// read a block pointer kept in the inode (ptr_blk PTR_BLK_INODE) or in pointer block ptr_blk
+int read_block_ptr(int ino_num, long long ptr_blk, int ptr_off, long long* ptr) {
+    if (ptr_blk == PTR_BLK_INODE) return get_inode_ptr(ino_num, ptr_off, ptr);
+    int result = get_ptr_block_data(ptr_blk, ptr, 1, ptr_off);
+    return result < 0 ? result : 0;
+}
+
+int write_block_ptr(int ino_num, long long ptr_blk, int ptr_off, long long ptr) {
+    if (ptr_blk == PTR_BLK_INODE) return set_inode_ptr(ino_num, ptr_off, ptr);
+    int result = set_ptr_block_data(ino_num, ptr_blk, &ptr, 1, ptr_off);
+    return result < 0 ? result : 0;
+}
+
+// pointer block referenced from (parent_blk, parent_off), allocated when it is a hole and create is set
+// *ptr_blk is BLK_PTR_HOLE if it does not exist
+int get_ptr_block(int ino_num, int blk_idx, long long parent_blk, int parent_off, bool create, long long* ptr_blk) {
+    int result = read_block_ptr(ino_num, parent_blk, parent_off, ptr_blk);
+    if (result < 0) return result;
+    if (*ptr_blk == BLK_PTR_HOLE && create) {
+        long long new_ptr_blk = get_new_ptr_block();
+        if (new_ptr_blk < 0) return new_ptr_blk;
+        result = write_block_ptr(ino_num, parent_blk, parent_off, new_ptr_blk);
         if (result < 0) return result;
+        TRACE_DEBUG(TRACE_ASSIGN_PTR_BLOCK, NULL, ino_num, blk_idx, new_ptr_blk);
+        *ptr_blk = new_ptr_blk;
+    }
+    if (*ptr_blk != BLK_PTR_HOLE && (*ptr_blk < 0 || *ptr_blk >= NUM_DATA_BLKS)) return -1;
+    return 0;
+}
 
-        return SIZE_BLOCK;
+// find where the pointer to file block blk_idx is kept, see read_block_ptr
+// missing pointer blocks are allocated if create is set, otherwise *ptr_blk is BLK_PTR_HOLE
+int locate_block_ptr(int ino_num, int blk_idx, bool create, long long* ptr_blk, int* ptr_off) {
+    if (ino_num < 0 || ino_num >= NUM_INODE || blk_idx < 0) return -1;
+    // direct
+    if (blk_idx < NUM_FIRST_LEV_PTR_PER_INODE) {
+        *ptr_blk = PTR_BLK_INODE;
+        *ptr_off = blk_idx;
+        return 0;
+    }
+    // walk down the tree of the tier holding blk_idx, a level at a time
+    for (int tier = 1; tier <= NUM_PTR_TIERS; tier++) {
+        if (blk_idx >= ptr_tier_start(tier + 1)) continue;
+        long long rel = blk_idx - ptr_tier_start(tier);
+        long long parent_blk = PTR_BLK_INODE;
+        int parent_off = NUM_FIRST_LEV_PTR_PER_INODE + tier - 1;
+        for (long long span = ptr_tier_span(tier - 1); ; span /= NUM_PTR_PER_BLK) {
+            int result = get_ptr_block(ino_num, blk_idx, parent_blk, parent_off, create, ptr_blk);
+            if (result < 0) return result;
+            *ptr_off = rel % NUM_PTR_PER_BLK;
+            if (*ptr_blk == BLK_PTR_HOLE || span == 1) return 0;
+            parent_blk = *ptr_blk;
+            parent_off = rel / span % NUM_PTR_PER_BLK;
+        }
     }
-    // double indirect
-    if (blk_idx >= NUM_FIRST_TWO_LEV_PTR_PER_INODE && blk_idx < NUM_ALL_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] read_block {double indirect block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        
-        // first level block
-        int first_level_data_reg_idx = get_inode_data(ino_num, INODE_BLK_PTR_OFF + NUM_DISK_PTRS_PER_INODE - 1);
-        if (first_level_data_reg_idx < 0 || first_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        printf("[DBUG INFO] read_block {first level}: first_level_data_reg_idx = %d\n", first_level_data_reg_idx);
-
-        // second level block
-        int first_level_offset = (blk_idx - NUM_FIRST_TWO_LEV_PTR_PER_INODE) / NUM_PTR_PER_BLK;
-        int second_level_data_reg_idx = -1;
-        int result = get_data_block_data(first_level_data_reg_idx, (char*) &second_level_data_reg_idx, sizeof(second_level_data_reg_idx), first_level_offset * SIZE_DATA_BLK_PTR);
-        if (result < 0) return result;
-        if (second_level_data_reg_idx < 0 || second_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        printf("[DBUG INFO] read_block {second level}: second_level_data_reg_idx = %d\n", second_level_data_reg_idx);
 
-        // third level block
-        int second_level_offset = (blk_idx - NUM_FIRST_TWO_LEV_PTR_PER_INODE) % NUM_PTR_PER_BLK;
-        int third_level_data_reg_idx = -1;
-        result = get_data_block_data(second_level_data_reg_idx, (char*) &third_level_data_reg_idx, sizeof(third_level_data_reg_idx), second_level_offset * SIZE_DATA_BLK_PTR);
-        if (result < 0) return result;
-        if (third_level_data_reg_idx < 0 || third_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        printf("[DBUG INFO] read_block {third level}: data_reg_idx = %d\n", third_level_data_reg_idx);
+    TRACE_ERROR(TRACE_BAD_BLOCK_INDEX, NULL, ino_num, blk_idx, 0);
+    return -EFBIG; // file too large [4]
+}
+
+// pointer to file block blk_idx, BLK_PTR_HOLE if no data block is assigned
+int get_block_ptr(int ino_num, int blk_idx, long long* ptr) {
+    long long ptr_blk;
+    int ptr_off;
+    int result = locate_block_ptr(ino_num, blk_idx, false, &ptr_blk, &ptr_off);
+    if (result < 0) return result;
+    if (ptr_blk == BLK_PTR_HOLE) {
+        *ptr = BLK_PTR_HOLE;
+        return 0;
+    }
+    result = read_block_ptr(ino_num, ptr_blk, ptr_off, ptr);
+    if (result < 0) return result;
+    if (*ptr != BLK_PTR_HOLE && *ptr != BLK_PTR_CLUSTER_TAIL && (BLK_PTR_IDX(*ptr) < 0 || BLK_PTR_IDX(*ptr) >= NUM_DATA_BLKS)) return -1;
+    return 0;
+}
+
+int set_block_ptr(int ino_num, int blk_idx, long long ptr) {
+    long long ptr_blk;
+    int ptr_off;
+    int result = locate_block_ptr(ino_num, blk_idx, true, &ptr_blk, &ptr_off);
+    if (result < 0) return result;
+    return write_block_ptr(ino_num, ptr_blk, ptr_off, ptr);
+}
+
+// first file block after blk_idx kept in another pointer block (or in the inode)
+int next_ptr_block_start(int blk_idx) {
+    if (blk_idx < NUM_FIRST_LEV_PTR_PER_INODE) return blk_idx + 1;
+    return NUM_FIRST_LEV_PTR_PER_INODE + ((blk_idx - NUM_FIRST_LEV_PTR_PER_INODE) / NUM_PTR_PER_BLK + 1) * NUM_PTR_PER_BLK;
+}
 
-        result = get_data_block_data(third_level_data_reg_idx, buffer, SIZE_BLOCK, 0);
+// pointers to count file blocks from blk_idx, all kept in the pointer block of blk_idx, with one cache access
+// (see next_ptr_block_start), holes if the pointer block does not exist
+int get_block_ptrs(int ino_num, int blk_idx, int count, long long* ptrs) {
+    long long ptr_blk;
+    int ptr_off;
+    int result = locate_block_ptr(ino_num, blk_idx, false, &ptr_blk, &ptr_off);
+    if (result < 0) return result;
+    if (ptr_blk == BLK_PTR_HOLE || ptr_blk == PTR_BLK_INODE) {
+        for (int i = 0; i < count; i++) {
+            ptrs[i] = BLK_PTR_HOLE;
+            if (ptr_blk == PTR_BLK_INODE && (result = read_block_ptr(ino_num, ptr_blk, ptr_off + i, &ptrs[i])) < 0) return result;
+        }
+    }
+    else {
+        result = get_ptr_block_data(ptr_blk, ptrs, count, ptr_off);
         if (result < 0) return result;
+    }
+    for (int i = 0; i < count; i++) {
+        if (ptrs[i] != BLK_PTR_HOLE && ptrs[i] != BLK_PTR_CLUSTER_TAIL && (BLK_PTR_IDX(ptrs[i]) < 0 || BLK_PTR_IDX(ptrs[i]) >= NUM_DATA_BLKS)) return -1;
+    }
+    return 0;
+}
 
-        return SIZE_BLOCK;
+// set pointers to count file blocks from blk_idx, as get_block_ptrs, the pointer block is allocated if missing
+int set_block_ptrs(int ino_num, int blk_idx, int count, const long long* ptrs) {
+    long long ptr_blk;
+    int ptr_off;
+    int result = locate_block_ptr(ino_num, blk_idx, true, &ptr_blk, &ptr_off);
+    if (result < 0) return result;
+    if (ptr_blk == PTR_BLK_INODE) {
+        for (int i = 0; i < count && result >= 0; i++) result = write_block_ptr(ino_num, ptr_blk, ptr_off + i, ptrs[i]);
+        return result;
     }
+    result = set_ptr_block_data(ino_num, ptr_blk, ptrs, count, ptr_off);
+    return result < 0 ? result : 0;
+}
+
+// decompressed clusters, kept in memory only so hot reads of a compressed file decompress once
+// an entry is tagged with the first pointer of its cluster, a rewritten cluster gets new data blocks
+#define CLUSTER_CACHE_SLOTS 256 // direct mapped
 
-    printf("[ERROR] read_block: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-    return -1;
+struct ClusterCacheEntry {
+    int tag; // inode number + 1, 0 for unused slot
+    int cluster_idx;
+    long long first_ptr;
+    char data[COMPRESS_CLUSTER_SIZE];
+};
+
+struct ClusterCacheEntry cluster_cache[CLUSTER_CACHE_SLOTS];
+pthread_mutex_t cluster_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct ClusterCacheEntry* cluster_slot(int ino_num, int cluster_idx) {
+    return &cluster_cache[(unsigned int) (ino_num * 31 + cluster_idx) % CLUSTER_CACHE_SLOTS];
 }
 
-int write_block(int ino_num, int blk_idx, const char* buffer) {    
-    if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
+bool lookup_cluster(int ino_num, int cluster_idx, long long first_ptr, char* buffer) {
+    pthread_mutex_lock(&cluster_cache_lock);
+    struct ClusterCacheEntry* entry = cluster_slot(ino_num, cluster_idx);
+    bool found = entry->tag == ino_num + 1 && entry->cluster_idx == cluster_idx && entry->first_ptr == first_ptr;
+    if (found) memcpy(buffer, entry->data, COMPRESS_CLUSTER_SIZE);
+    pthread_mutex_unlock(&cluster_cache_lock);
+    if (found) stats_add(STAT_CLUSTER_CACHE_HIT, 1);
+    return found;
+}
 
-    // direct
-    if (blk_idx < NUM_FIRST_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] write_block {direct block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        // first level block
-        int first_level_data_reg_idx = get_inode_data(ino_num, INODE_BLK_PTR_OFF + blk_idx);
-        if (first_level_data_reg_idx < 0 || first_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        printf("[DBUG INFO] write_block {first level}: first_level_data_reg_idx = %d\n", first_level_data_reg_idx);
+void insert_cluster(int ino_num, int cluster_idx, long long first_ptr, const char* buffer) {
+    pthread_mutex_lock(&cluster_cache_lock);
+    struct ClusterCacheEntry* entry = cluster_slot(ino_num, cluster_idx);
+    entry->tag = ino_num + 1;
+    entry->cluster_idx = cluster_idx;
+    entry->first_ptr = first_ptr;
+    memcpy(entry->data, buffer, COMPRESS_CLUSTER_SIZE);
+    pthread_mutex_unlock(&cluster_cache_lock);
+}
 
-        int result = set_data_block_data(first_level_data_reg_idx, buffer, SIZE_BLOCK, 0);
-        if (result < 0) return result;
+void drop_cluster(int ino_num, int cluster_idx) {
+    pthread_mutex_lock(&cluster_cache_lock);
+    struct ClusterCacheEntry* entry = cluster_slot(ino_num, cluster_idx);
+    if (entry->tag == ino_num + 1 && entry->cluster_idx == cluster_idx) entry->tag = 0;
+    pthread_mutex_unlock(&cluster_cache_lock);
+}
 
-        return SIZE_BLOCK;
+// drop cached clusters of a file whose blocks are freed, their data blocks may be reused by the same cluster
+void drop_clusters(int ino_num) {
+    pthread_mutex_lock(&cluster_cache_lock);
+    for (int i = 0; i < CLUSTER_CACHE_SLOTS; i++) {
+        if (cluster_cache[i].tag == ino_num + 1) cluster_cache[i].tag = 0;
     }
-    // indirect
-    if (blk_idx >= NUM_FIRST_LEV_PTR_PER_INODE && blk_idx < NUM_FIRST_TWO_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] write_block {indirect block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        // first level block
-        int first_level_data_reg_idx = get_inode_data(ino_num, INODE_BLK_PTR_OFF + NUM_DISK_PTRS_PER_INODE - 2);
-        if (first_level_data_reg_idx < 0 || first_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        printf("[DBUG INFO] write_block {first level}: first_level_data_reg_idx = %d\n", first_level_data_reg_idx);
-
-        // second level block
-        int first_level_offset = blk_idx - NUM_FIRST_LEV_PTR_PER_INODE;
-        int second_level_data_reg_idx = -1;
-        int result = get_data_block_data(first_level_data_reg_idx, (char*) &second_level_data_reg_idx, sizeof(second_level_data_reg_idx), first_level_offset * SIZE_DATA_BLK_PTR);
+    pthread_mutex_unlock(&cluster_cache_lock);
+}
+
+bool is_compressed(int ino_num) {
+    int flag = get_inode_data(ino_num, INODE_FLAG_OFF);
+    return (superblock.features & FEATURE_COMPRESS) && flag >= 0 && (flag & INODE_FLAG_COMPRESS) != 0;
+}
+
+// read and decompress a compressed cluster, its data blocks are brought to cache in one request per run
+int read_cluster(int ino_num, int cluster_idx, char* buffer) {
+    int first_blk = cluster_idx * COMPRESS_CLUSTER_BLKS;
+    long long ptrs[COMPRESS_CLUSTER_BLKS];
+    int num_cblks = 0;
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+        int result = get_block_ptr(ino_num, first_blk + i, &ptrs[i]);
         if (result < 0) return result;
-        if (second_level_data_reg_idx < 0 || second_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        printf("[DBUG INFO] write_block {second level}: second_level_data_reg_idx = %d\n", second_level_data_reg_idx);
-        
-        result = set_data_block_data(second_level_data_reg_idx, buffer, SIZE_BLOCK, 0);
+        if (!BLK_PTR_IS_COMPRESSED(ptrs[i])) return -1;
+        if (ptrs[i] != BLK_PTR_CLUSTER_TAIL) num_cblks = i + 1;
+    }
+    if (num_cblks == 0) return -1;
+    if (lookup_cluster(ino_num, cluster_idx, ptrs[0], buffer)) return 0;
 
-        return SIZE_BLOCK;
+    long long block_ids[COMPRESS_CLUSTER_BLKS] = { 0 };
+    for (int i = 0; i < num_cblks; i++) {
+        if (ptrs[i] == BLK_PTR_CLUSTER_TAIL) return -1;
+        block_ids[i] = DATA_REG_START_BLK + BLK_PTR_IDX(ptrs[i]);
     }
-    // double indirect
-    if (blk_idx >= NUM_FIRST_TWO_LEV_PTR_PER_INODE && blk_idx < NUM_ALL_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] write_block {double indirect block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        // first level block
-        int first_level_data_reg_idx = get_inode_data(ino_num, INODE_BLK_PTR_OFF + NUM_DISK_PTRS_PER_INODE - 1);
-        if (first_level_data_reg_idx < 0 || first_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        printf("[DBUG INFO] write_block {first level}: first_level_data_reg_idx = %d\n", first_level_data_reg_idx);
-
-        // second level block
-        int first_level_offset = (blk_idx - NUM_FIRST_TWO_LEV_PTR_PER_INODE) / NUM_PTR_PER_BLK;
-        int second_level_data_reg_idx = -1;
-        int result = get_data_block_data(first_level_data_reg_idx, (char*) &second_level_data_reg_idx, sizeof(second_level_data_reg_idx), first_level_offset * SIZE_DATA_BLK_PTR);
+    pthread_mutex_lock(&cache_lock);
+    prefetch_block_cache(queue, hash, block_ids, num_cblks);
+    pthread_mutex_unlock(&cache_lock);
+    char stream[COMPRESS_CLUSTER_SIZE];
+    for (int i = 0; i < num_cblks; i++) {
+        int result = get_data_block_data(BLK_PTR_IDX(ptrs[i]), stream + i * SIZE_BLOCK, SIZE_BLOCK, 0);
         if (result < 0) return result;
-        if (second_level_data_reg_idx < 0 || second_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        printf("[DBUG INFO] write_block {second level}: second_level_data_reg_idx = %d\n", second_level_data_reg_idx);
+    }
+    int stream_size;
+    memcpy(&stream_size, stream, sizeof(stream_size));
+    if (stream_size <= 0 || stream_size > num_cblks * SIZE_BLOCK - (int) sizeof(stream_size)) return -1;
+    if (lz4_decompress(stream + sizeof(stream_size), stream_size, buffer, COMPRESS_CLUSTER_SIZE) != COMPRESS_CLUSTER_SIZE) return -1;
+    stats_add(STAT_CLUSTER_DECOMPRESS, 1);
+    insert_cluster(ino_num, cluster_idx, ptrs[0], buffer);
 
-        // third level block
-        int second_level_offset = (blk_idx - NUM_FIRST_TWO_LEV_PTR_PER_INODE) % NUM_PTR_PER_BLK;
-        int third_level_data_reg_idx = -1;
-        result = get_data_block_data(second_level_data_reg_idx, (char*) &third_level_data_reg_idx, sizeof(third_level_data_reg_idx), second_level_offset * SIZE_DATA_BLK_PTR);
-        if (result < 0) return result;
-        if (third_level_data_reg_idx < 0 || third_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        printf("[DBUG INFO] write_block {third level}: third_level_data_reg_idx = %d\n", third_level_data_reg_idx);
+    return 0;
+}
 
-        result = set_data_block_data(third_level_data_reg_idx, buffer, SIZE_BLOCK, 0);
-        if (result < 0) return result;
+// holes and unwritten blocks read as zeros without device io
+int read_block(int ino_num, int blk_idx, char* buffer) {
+    long long ptr = BLK_PTR_HOLE;
+    int result = get_block_ptr(ino_num, blk_idx, &ptr);
+    if (result < 0) return -1;
 
+    TRACE_DEBUG(TRACE_READ_BLOCK, NULL, ino_num, blk_idx, ptr);
+    if (BLK_PTR_IS_COMPRESSED(ptr)) {
+        char cluster[COMPRESS_CLUSTER_SIZE];
+        result = read_cluster(ino_num, blk_idx / COMPRESS_CLUSTER_BLKS, cluster);
+        if (result < 0) return result;
+        memcpy(buffer, cluster + (blk_idx % COMPRESS_CLUSTER_BLKS) * SIZE_BLOCK, SIZE_BLOCK);
+        return SIZE_BLOCK;
+    }
+    if (ptr == BLK_PTR_HOLE || (ptr & BLK_PTR_UNWRITTEN) != 0) {
+        memset(buffer, 0, SIZE_BLOCK);
         return SIZE_BLOCK;
     }
+    result = get_data_block_data(ptr, buffer, SIZE_BLOCK, 0);
+    if (result < 0) return result;
 
-    printf("[DBUG INFO] write_block: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-    return -1;
+    return SIZE_BLOCK;
 }
 
-int get_new_inode() {
-    static int ino_num = 0;
-    for (int i = 0; i < NUM_INODE; i ++) {
-        int new_inode = (ino_num + i) % NUM_INODE;
-        if (!get_imap_bit(new_inode)) {
-            int result = set_imap_bit(new_inode, 1);
-            if (result < 0) return result;
-            
-            ino_num = new_inode;
-            
-            return ino_num;
-        }
+// recent fingerprints of written blocks, kept in memory so repeated contents skip the dedup index
+#define FINGERPRINT_CACHE_SLOTS 4096 // direct mapped, power of 2
+
+struct FingerprintCacheEntry {
+    uint64_t fingerprint;
+    long long data_reg_idx; // data region index + 1, 0 for unused slot
+};
+
+struct FingerprintCacheEntry fingerprint_cache[FINGERPRINT_CACHE_SLOTS];
+pthread_mutex_t fingerprint_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+long long lookup_fingerprint(uint64_t fingerprint) {
+    pthread_mutex_lock(&fingerprint_cache_lock);
+    struct FingerprintCacheEntry* entry = &fingerprint_cache[fingerprint % FINGERPRINT_CACHE_SLOTS];
+    long long data_reg_idx = entry->fingerprint == fingerprint ? entry->data_reg_idx - 1 : -1;
+    pthread_mutex_unlock(&fingerprint_cache_lock);
+    if (data_reg_idx >= 0 && get_dedup_map_bit(data_reg_idx) == 1) {
+        stats_add(STAT_FINGERPRINT_CACHE_HIT, 1);
+        return data_reg_idx;
     }
-    
-    printf("[DBUG INFO] get_new_inode: inodes are used up\n");
-    return -ENOSPC; // no space left on device [4]
+    return lookup_dedup_index(fingerprint);
 }
 
-int get_new_block() {
-    static int block_idx = 0;
-    for (int i = 0; i < NUM_DATA_BLKS; i ++) {
-        int new_block = (block_idx + i) % NUM_DATA_BLKS;
-        if (!get_dmap_bit(new_block)) {
-            int result = set_dmap_bit(new_block, 1);
-            if (result < 0) return result;
-            
-            result = initialize_block(DATA_REG_START_BLK + new_block);
-            if (result < 0) return result;
+int insert_fingerprint(uint64_t fingerprint, long long data_reg_idx) {
+    pthread_mutex_lock(&fingerprint_cache_lock);
+    struct FingerprintCacheEntry* entry = &fingerprint_cache[fingerprint % FINGERPRINT_CACHE_SLOTS];
+    entry->fingerprint = fingerprint;
+    entry->data_reg_idx = data_reg_idx + 1;
+    pthread_mutex_unlock(&fingerprint_cache_lock);
+    return insert_dedup_index(fingerprint, data_reg_idx);
+}
 
-            block_idx = new_block;
-            
-            return block_idx;
-        }
-    }
-    
-    printf("[DBUG INFO] get_new_block: blocks are used up\n");
-    return -ENOSPC; // no space left on device [4]
+// a file writing a data block in place holds it shared from the reference count check to the write,
+// dedup holds it exclusively to add an owner to a block of another file, which is not locked
+pthread_rwlock_t share_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+bool is_dedup(int ino_num) {
+    return (superblock.features & FEATURE_DEDUP) && (superblock.features & FEATURE_REFLINK) && get_inode_type(ino_num) == 0;
 }
 
-int assign_block(int ino_num, int blk_idx) {
-    if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
-    
-    int num_blocks = get_inode_data(ino_num, INODE_NUM_BLKS_OFF);
-    if (blk_idx != num_blocks) return -1;
-    // direct
-    if (blk_idx < NUM_FIRST_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] assign_block {direct block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        // first level pointer
-        int first_level_data_reg_idx = get_new_block();
-        if (first_level_data_reg_idx < 0) return first_level_data_reg_idx;
-        int result = set_inode_data(ino_num, first_level_data_reg_idx, INODE_BLK_PTR_OFF + blk_idx);
+// point file block blk_idx, currently ptr, at a written data block holding the content of buffer instead of writing it
+// return 1 if shared or already holding it, 0 if no block matches or the match is at the maximum reference count
+int dedup_block(int ino_num, int blk_idx, long long ptr, const char* buffer, uint64_t fingerprint) {
+    long long data_reg_idx = lookup_fingerprint(fingerprint);
+    if (data_reg_idx < 0) return 0;
+    if (ptr == data_reg_idx) {
+        char data[SIZE_BLOCK];
+        int result = get_data_block_data(data_reg_idx, data, SIZE_BLOCK, 0);
         if (result < 0) return result;
-        printf("[DBUG INFO] assign_block {direct data block}: %d\n", first_level_data_reg_idx);
-        
-        result = set_inode_data(ino_num, num_blocks + 1, INODE_NUM_BLKS_OFF);
+        return memcmp(data, buffer, SIZE_BLOCK) == 0 ? 1 : 0; // rewritten with the content it has
+    }
+
+    pthread_rwlock_wrlock(&share_lock);
+    int result = share_data_block(data_reg_idx, buffer);
+    pthread_rwlock_unlock(&share_lock);
+    if (result == -EMLINK || result == 0) return 0;
+    if (result < 0) return result;
+    result = set_block_ptr(ino_num, blk_idx, data_reg_idx);
+    if (result < 0) {
+        // the file did not become an owner of the block
+        add_block_refcount(data_reg_idx, -1);
+        return result;
+    }
+    share_dirty_block(data_reg_idx);
+    TRACE_DEBUG(TRACE_DEDUP_BLOCK, NULL, ino_num, blk_idx, data_reg_idx);
+    stats_add(STAT_DEDUP_BLOCK, 1);
+    // the old block, written or reserved, loses this file as owner
+    if (ptr != BLK_PTR_HOLE) {
+        long long old_data_reg_idx = BLK_PTR_IDX(ptr);
+        result = free_data_blocks(&old_data_reg_idx, 1);
         if (result < 0) return result;
-        
-        return 0;
     }
-    // indirect
-    if (blk_idx >= NUM_FIRST_LEV_PTR_PER_INODE && blk_idx < NUM_FIRST_TWO_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] assign_block {indirect block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        // first level pointer
-        int first_level_data_reg_idx = -1;
-        if (blk_idx == NUM_FIRST_LEV_PTR_PER_INODE) {
-            first_level_data_reg_idx = get_new_block();
-            if (first_level_data_reg_idx < 0) return first_level_data_reg_idx;
-            int result = set_inode_data(ino_num, first_level_data_reg_idx, INODE_BLK_PTR_OFF + NUM_DISK_PTRS_PER_INODE - 2);
-            if (result < 0) return result;
-            printf("[DBUG INFO] assign_block {direct pointer block}: %d\n", first_level_data_reg_idx);
-        }
-        else {
-            first_level_data_reg_idx = get_inode_data(ino_num, INODE_BLK_PTR_OFF + NUM_DISK_PTRS_PER_INODE - 2);
-            if (first_level_data_reg_idx < 0) return first_level_data_reg_idx;
+    return 1;
+}
+
+int write_cluster(int ino_num, int cluster_idx, const char* buffer);
+
+// write the data block of file block blk_idx, currently ptr, in place unless it is a hole or shared
+// return the data block written, *shared is set when the old block was shared and a new one was taken
+long long write_block_data(int ino_num, int blk_idx, long long ptr, const char* buffer, bool* shared) {
+    long long data_reg_idx = BLK_PTR_IDX(ptr);
+    if (ptr != BLK_PTR_HOLE && (ptr & BLK_PTR_UNWRITTEN) == 0) {
+        int refcount = get_block_refcount(data_reg_idx);
+        if (refcount < 0) return refcount;
+        *shared = refcount > 0;
+    }
+    if (ptr == BLK_PTR_HOLE || *shared) {
+        int got = 0;
+        data_reg_idx = get_new_blocks(1, &got);
+        if (data_reg_idx < 0) return data_reg_idx;
+        if (*shared) {
+            TRACE_DEBUG(TRACE_COW_BLOCK, NULL, ino_num, blk_idx, data_reg_idx);
+            stats_add(STAT_COW_BLOCK, 1);
         }
+        else TRACE_DEBUG(TRACE_ASSIGN_BLOCK, NULL, ino_num, blk_idx, data_reg_idx);
+    }
+    // data first, so the block is never pointed to as written before it is
+    TRACE_DEBUG(TRACE_WRITE_BLOCK, NULL, ino_num, blk_idx, data_reg_idx);
+    int result = set_data_block_data(ino_num, data_reg_idx, buffer, SIZE_BLOCK, 0);
+    if (result < 0) {
+        if (ptr == BLK_PTR_HOLE || *shared) free_data_blocks(&data_reg_idx, 1);
+        return result;
+    }
 
-        // second level pointer
-        if (first_level_data_reg_idx < 0 || first_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        int first_level_offset = blk_idx - NUM_FIRST_LEV_PTR_PER_INODE;
-        int second_level_data_reg_idx = get_new_block();
-        if (second_level_data_reg_idx < 0) return second_level_data_reg_idx;
-        int result = set_data_block_data(first_level_data_reg_idx, (char*) &second_level_data_reg_idx, sizeof(second_level_data_reg_idx), first_level_offset * SIZE_DATA_BLK_PTR);
-        if (result < 0) return result;
-        printf("[DBUG INFO] assign_block {indirect data block}: %d\n", second_level_data_reg_idx);
-        
-        result = set_inode_data(ino_num, num_blocks + 1, INODE_NUM_BLKS_OFF);
+    return data_reg_idx;
+}
+
+// a hole gets a data block, an unwritten block becomes written
+// a block shared with a clone is copied on write, the file drops its reference to the old block
+// a block of a compressed cluster rewrites the cluster
+// with dedup, a block of a regular file is shared with a data block of the same content, or indexed once written
+int write_block(int ino_num, int blk_idx, const char* buffer) {
+    long long ptr = BLK_PTR_HOLE;
+    int result = get_block_ptr(ino_num, blk_idx, &ptr);
+    if (result < 0) return -1;
+
+    if (BLK_PTR_IS_COMPRESSED(ptr)) {
+        char cluster[COMPRESS_CLUSTER_SIZE];
+        result = read_cluster(ino_num, blk_idx / COMPRESS_CLUSTER_BLKS, cluster);
         if (result < 0) return result;
-        
-        return 0;
+        memcpy(cluster + (blk_idx % COMPRESS_CLUSTER_BLKS) * SIZE_BLOCK, buffer, SIZE_BLOCK);
+        result = write_cluster(ino_num, blk_idx / COMPRESS_CLUSTER_BLKS, cluster);
+        return result < 0 ? result : SIZE_BLOCK;
     }
-    // double indirect
-    if (blk_idx >= NUM_FIRST_TWO_LEV_PTR_PER_INODE && blk_idx < NUM_ALL_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] assign_block {double indirect block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        // first level pointer
-        int first_level_data_reg_idx = -1;
-        if (blk_idx == NUM_FIRST_TWO_LEV_PTR_PER_INODE) {
-            first_level_data_reg_idx = get_new_block();
-            if (first_level_data_reg_idx < 0) return first_level_data_reg_idx;
-            int result = set_inode_data(ino_num, first_level_data_reg_idx, INODE_BLK_PTR_OFF + NUM_DISK_PTRS_PER_INODE - 1);
-            if (result < 0) return result;
-            printf("[DBUG INFO] assign_block {direct pointer block}: %d\n", first_level_data_reg_idx);
-        }
-        else {
-            first_level_data_reg_idx = get_inode_data(ino_num, INODE_BLK_PTR_OFF + NUM_DISK_PTRS_PER_INODE - 1);
-            if (first_level_data_reg_idx < 0) return first_level_data_reg_idx;
+    bool dedup = is_dedup(ino_num);
+    uint64_t block_fingerprint = 0;
+    if (dedup) {
+        block_fingerprint = fingerprint(buffer, SIZE_BLOCK);
+        result = dedup_block(ino_num, blk_idx, ptr, buffer, block_fingerprint);
+        if (result != 0) return result < 0 ? result : SIZE_BLOCK;
+    }
+    bool shared = false;
+    if (dedup) pthread_rwlock_rdlock(&share_lock);
+    long long data_reg_idx = write_block_data(ino_num, blk_idx, ptr, buffer, &shared);
+    if (dedup) pthread_rwlock_unlock(&share_lock);
+    if (data_reg_idx < 0) return data_reg_idx;
+    if (ptr != data_reg_idx) {
+        result = set_block_ptr(ino_num, blk_idx, data_reg_idx);
+        if (result < 0) {
+            // a new block no pointer leads to is freed, the file keeps its old block
+            if (ptr == BLK_PTR_HOLE || shared) free_data_blocks(&data_reg_idx, 1);
+            return result;
         }
+    }
+    if (shared) {
+        long long old_data_reg_idx = BLK_PTR_IDX(ptr);
+        result = free_data_blocks(&old_data_reg_idx, 1);
+        if (result < 0) return result;
+    }
+    if (dedup) {
+        result = insert_fingerprint(block_fingerprint, data_reg_idx);
+        if (result < 0) return result;
+    }
 
-        // second level pointer
-        if (first_level_data_reg_idx < 0 || first_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        int first_level_offset = (blk_idx - NUM_FIRST_TWO_LEV_PTR_PER_INODE) / NUM_PTR_PER_BLK;
-        int second_level_offset = (blk_idx - NUM_FIRST_TWO_LEV_PTR_PER_INODE) % NUM_PTR_PER_BLK;
-        int second_level_data_reg_idx = -1;
-        if (second_level_offset == 0) {
-            second_level_data_reg_idx = get_new_block();
-            if (second_level_data_reg_idx < 0) return second_level_data_reg_idx;
-            int result = set_data_block_data(first_level_data_reg_idx, (char*) &second_level_data_reg_idx, sizeof(second_level_data_reg_idx), first_level_offset * SIZE_DATA_BLK_PTR);
-            if (result < 0) return result;
-            printf("[DBUG INFO] assign_block {indirect pointer block}: %d\n", second_level_data_reg_idx);
-        }
-        else {
-            int result = get_data_block_data(first_level_data_reg_idx, (char*) &second_level_data_reg_idx, sizeof(second_level_data_reg_idx), first_level_offset * SIZE_DATA_BLK_PTR);
-            if (result < 0) return result;
-        }
+    return SIZE_BLOCK;
+}
 
-        // third level pointer
-        if (second_level_data_reg_idx < 0 || second_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        int third_level_data_reg_idx = get_new_block();
-        if (third_level_data_reg_idx < 0) return third_level_data_reg_idx;
-        int result = set_data_block_data(second_level_data_reg_idx, (char*) &third_level_data_reg_idx, sizeof(third_level_data_reg_idx), second_level_offset * SIZE_DATA_BLK_PTR);
-        if (result < 0) return result;
-        printf("[DBUG INFO] assign_block {double indirect data block}: %d\n", third_level_data_reg_idx);
-        
-        result = set_inode_data(ino_num, num_blocks + 1, INODE_NUM_BLKS_OFF);
+// write a whole cluster, compressed to new data blocks when that saves at least one block, otherwise block by block
+// the old data blocks of the cluster are freed, or lose a reference when shared
+int write_cluster(int ino_num, int cluster_idx, const char* buffer) {
+    int first_blk = cluster_idx * COMPRESS_CLUSTER_BLKS;
+    long long old_ptrs[COMPRESS_CLUSTER_BLKS];
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+        int result = get_block_ptr(ino_num, first_blk + i, &old_ptrs[i]);
         if (result < 0) return result;
+    }
+    bool was_compressed = BLK_PTR_IS_COMPRESSED(old_ptrs[0]);
+
+    char stream[COMPRESS_CLUSTER_SIZE];
+    int stream_size = lz4_compress(buffer, COMPRESS_CLUSTER_SIZE, stream + sizeof(stream_size), COMPRESS_CLUSTER_SIZE - SIZE_BLOCK - sizeof(stream_size));
+    long long new_ptrs[COMPRESS_CLUSTER_BLKS];
+    int num_cblks = 0;
+    if (stream_size > 0) {
+        memcpy(stream, &stream_size, sizeof(stream_size));
+        int stream_end = sizeof(stream_size) + stream_size;
+        num_cblks = (stream_end + SIZE_BLOCK - 1) / SIZE_BLOCK;
+        memset(stream + stream_end, 0, num_cblks * SIZE_BLOCK - stream_end);
+        int num_new = 0;
+        while (num_new < num_cblks) {
+            int got = 0;
+            long long data_reg_idx = get_new_blocks(num_cblks - num_new, &got);
+            if (data_reg_idx < 0) {
+                if (num_new > 0) free_data_blocks(new_ptrs, num_new);
+                return data_reg_idx;
+            }
+            for (int i = 0; i < got; i++) new_ptrs[num_new++] = data_reg_idx + i;
+        }
+        for (int i = 0; i < num_cblks; i++) {
+            int result = set_data_block_data(ino_num, new_ptrs[i], stream + i * SIZE_BLOCK, SIZE_BLOCK, 0);
+            if (result < 0) {
+                free_data_blocks(new_ptrs, num_cblks);
+                return result;
+            }
+        }
+        TRACE_DEBUG(TRACE_COMPRESS_CLUSTER, NULL, ino_num, cluster_idx, num_cblks);
+        stats_add(STAT_CLUSTER_COMPRESS, 1);
+    }
+    else if (!was_compressed) {
+        // raw blocks are rewritten in place by write_block
+        for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+            if (write_block(ino_num, first_blk + i, buffer + i * SIZE_BLOCK) != SIZE_BLOCK) return -1;
+        }
+        return 0;
+    }
 
+    // data first, the pointers are switched to the new blocks before the old ones are freed
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+        long long ptr = num_cblks == 0 ? BLK_PTR_HOLE : (i < num_cblks ? new_ptrs[i] | BLK_PTR_COMPRESSED : BLK_PTR_CLUSTER_TAIL);
+        int result = set_block_ptr(ino_num, first_blk + i, ptr);
+        if (result < 0) {
+            // no pointer leads to the new blocks, the cluster keeps its old blocks
+            for (int j = 0; j < i; j++) set_block_ptr(ino_num, first_blk + j, old_ptrs[j]);
+            if (num_cblks > 0) free_data_blocks(new_ptrs, num_cblks);
+            return result;
+        }
+    }
+    long long freed[COMPRESS_CLUSTER_BLKS];
+    int num_freed = 0;
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+        if (old_ptrs[i] != BLK_PTR_HOLE && old_ptrs[i] != BLK_PTR_CLUSTER_TAIL) freed[num_freed++] = BLK_PTR_IDX(old_ptrs[i]);
+    }
+    int result = num_freed > 0 ? free_data_blocks(freed, num_freed) : 0;
+    if (result < 0) return result;
+    if (num_cblks > 0) {
+        insert_cluster(ino_num, cluster_idx, new_ptrs[0] | BLK_PTR_COMPRESSED, buffer);
         return 0;
     }
-    // file too large
-    if (blk_idx >= NUM_ALL_LEV_PTR_PER_INODE) {
-        return -EFBIG; // file too large [4]
+    drop_cluster(ino_num, cluster_idx);
+
+    // a compressed cluster that no longer compresses is written to fresh blocks
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+        if (write_block(ino_num, first_blk + i, buffer + i * SIZE_BLOCK) != SIZE_BLOCK) return -1;
     }
+    return 0;
+}
 
-    return -1;
+// read a cluster, compressed or not
+int load_cluster(int ino_num, int cluster_idx, char* buffer) {
+    long long ptr = BLK_PTR_HOLE;
+    int result = get_block_ptr(ino_num, cluster_idx * COMPRESS_CLUSTER_BLKS, &ptr);
+    if (result < 0) return result;
+    if (BLK_PTR_IS_COMPRESSED(ptr)) return read_cluster(ino_num, cluster_idx, buffer);
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+        if (read_block(ino_num, cluster_idx * COMPRESS_CLUSTER_BLKS + i, buffer + i * SIZE_BLOCK) != SIZE_BLOCK) return -1;
+    }
+    return 0;
 }
 
-int reclaim_block(int ino_num, int blk_idx) {
-    if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
+// store a compressed cluster block by block, before part of it is freed or the block count cuts it
+int expand_cluster(int ino_num, int cluster_idx) {
+    long long ptr = BLK_PTR_HOLE;
+    int result = get_block_ptr(ino_num, cluster_idx * COMPRESS_CLUSTER_BLKS, &ptr);
+    if (result < 0 || !BLK_PTR_IS_COMPRESSED(ptr)) return result;
 
-    int num_blocks = get_inode_data(ino_num, INODE_NUM_BLKS_OFF);
-    if (blk_idx != num_blocks - 1) return -1;
-    // direct
-    if (blk_idx < NUM_FIRST_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] reclaim_block {direct block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        // get first level block index
-        int first_level_data_reg_idx = get_inode_data(ino_num, INODE_BLK_PTR_OFF + blk_idx);
-        if (first_level_data_reg_idx < 0 || first_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        
-        // reclaim first level block
-        int result = set_dmap_bit(first_level_data_reg_idx, 0);
+    char cluster[COMPRESS_CLUSTER_SIZE];
+    result = read_cluster(ino_num, cluster_idx, cluster);
+    if (result < 0) return result;
+    int first_blk = cluster_idx * COMPRESS_CLUSTER_BLKS;
+    long long freed[COMPRESS_CLUSTER_BLKS];
+    int num_freed = 0;
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+        result = get_block_ptr(ino_num, first_blk + i, &ptr);
         if (result < 0) return result;
-        printf("[DBUG INFO] reclaim_block {direct data block}: %d\n", first_level_data_reg_idx);
-
-        result = set_inode_data(ino_num, num_blocks - 1, INODE_NUM_BLKS_OFF);
+        if (ptr != BLK_PTR_CLUSTER_TAIL) freed[num_freed++] = BLK_PTR_IDX(ptr);
+        result = set_block_ptr(ino_num, first_blk + i, BLK_PTR_HOLE);
         if (result < 0) return result;
-        
-        return 0;
     }
-    // indirect
-    if (blk_idx >= NUM_FIRST_LEV_PTR_PER_INODE && blk_idx < NUM_FIRST_TWO_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] reclaim_block {indirect block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        // get first level block index
-        int first_level_data_reg_idx = get_inode_data(ino_num, INODE_BLK_PTR_OFF + NUM_DISK_PTRS_PER_INODE - 2);
-        if (first_level_data_reg_idx < 0 || first_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-
-        // get second level block index
-        int first_level_offset = blk_idx - NUM_FIRST_LEV_PTR_PER_INODE;
-        int second_level_data_reg_idx = -1;
-        int result = get_data_block_data(first_level_data_reg_idx, (char*) &second_level_data_reg_idx, sizeof(second_level_data_reg_idx), first_level_offset * SIZE_DATA_BLK_PTR);
-        if (result < 0) return result;
-        if (second_level_data_reg_idx < 0 || second_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        
-        // reclaim second level block
-        result = set_dmap_bit(second_level_data_reg_idx, 0);
-        if (result < 0) return result;
-        printf("[DBUG INFO] reclaim_block {indirect data block}: %d\n", second_level_data_reg_idx);
+    result = free_data_blocks(freed, num_freed);
+    if (result < 0) return result;
+    drop_cluster(ino_num, cluster_idx);
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+        if (write_block(ino_num, first_blk + i, cluster + i * SIZE_BLOCK) != SIZE_BLOCK) return -1;
+    }
+    return 0;
+}
 
-        // reclaim first level block
-        if(blk_idx == NUM_FIRST_LEV_PTR_PER_INODE) {
-            int result = set_dmap_bit(first_level_data_reg_idx, 0);
-            if (result < 0) return result;            
-            printf("[DBUG INFO] reclaim_block {direct pointer block}: %d\n", first_level_data_reg_idx);
+// mark file blocks [from, to) as holes, from is the current block count so their pointers are undefined
+// a pointer block not in use yet is marked as a hole in its parent instead of entry by entry
+int init_block_slots(int ino_num, int from, int to) {
+    int result = 0;
+    int blk_idx = from;
+    while (result >= 0 && blk_idx < to) {
+        // direct
+        if (blk_idx < NUM_FIRST_LEV_PTR_PER_INODE) {
+            result = set_inode_ptr(ino_num, blk_idx, BLK_PTR_HOLE);
+            blk_idx++;
+            continue;
+        }
+        int tier = 1;
+        while (tier < NUM_PTR_TIERS && blk_idx >= ptr_tier_start(tier + 1)) tier++;
+        // walk down to the pointer block covering blk_idx, sub_first is the first file block under (parent_blk, parent_off)
+        long long parent_blk = PTR_BLK_INODE;
+        int parent_off = NUM_FIRST_LEV_PTR_PER_INODE + tier - 1;
+        long long sub_first = ptr_tier_start(tier);
+        long long span = ptr_tier_span(tier);
+        while (true) {
+            int end = sub_first + span < to ? sub_first + span : to;
+            if (from <= sub_first) {
+                result = write_block_ptr(ino_num, parent_blk, parent_off, BLK_PTR_HOLE);
+                blk_idx = end;
+                break;
+            }
+            long long ptr_blk = BLK_PTR_HOLE;
+            result = get_ptr_block(ino_num, blk_idx, parent_blk, parent_off, false, &ptr_blk);
+            if (result < 0 || ptr_blk == BLK_PTR_HOLE) {
+                blk_idx = end;
+                break;
+            }
+            if (span == NUM_PTR_PER_BLK) {
+                long long holes[NUM_PTR_PER_BLK_MAX];
+                memset(holes, 0xff, sizeof(holes));
+                result = set_ptr_block_data(ino_num, ptr_blk, holes, end - blk_idx, blk_idx - sub_first);
+                blk_idx = end;
+                break;
+            }
+            span /= NUM_PTR_PER_BLK;
+            parent_blk = ptr_blk;
+            parent_off = (blk_idx - sub_first) / span;
+            sub_first += parent_off * span;
         }
-        
-        result = set_inode_data(ino_num, num_blocks - 1, INODE_NUM_BLKS_OFF);
-        if (result < 0) return result;
-        
-        return 0;
     }
-    // double indirect
-    if (blk_idx >= NUM_FIRST_TWO_LEV_PTR_PER_INODE && blk_idx < NUM_ALL_LEV_PTR_PER_INODE) {
-        printf("[DBUG INFO] reclaim_block {double indirect block}: ino_num = %d, blk_idx = %d\n", ino_num, blk_idx);
-        // get first level block index
-        int first_level_data_reg_idx = get_inode_data(ino_num, INODE_BLK_PTR_OFF + NUM_DISK_PTRS_PER_INODE - 1);
-        if (first_level_data_reg_idx < 0 || first_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-
-        // get second level block index
-        int first_level_offset = (blk_idx - NUM_FIRST_TWO_LEV_PTR_PER_INODE) / NUM_PTR_PER_BLK;
-        int second_level_data_reg_idx = -1;
-        int result = get_data_block_data(first_level_data_reg_idx, (char*) &second_level_data_reg_idx, sizeof(second_level_data_reg_idx), first_level_offset * SIZE_DATA_BLK_PTR);
-        if (result < 0) return result;
-        if (second_level_data_reg_idx < 0 || second_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
 
-        // third level block
-        int second_level_offset = (blk_idx - NUM_FIRST_TWO_LEV_PTR_PER_INODE) % NUM_PTR_PER_BLK;
-        int third_level_data_reg_idx = -1;
-        result = get_data_block_data(second_level_data_reg_idx, (char*) &third_level_data_reg_idx, sizeof(third_level_data_reg_idx), second_level_offset * SIZE_DATA_BLK_PTR);
+    return result < 0 ? result : 0;
+}
+
+// grow the block count to to, the new file blocks are holes and cost no data blocks
+int extend_blocks(int ino_num, int to) {
+    if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
+    if (to > NUM_ALL_LEV_PTR_PER_INODE) return -EFBIG; // file too large [4]
+
+    int num_blks = get_inode_data(ino_num, INODE_NUM_BLKS_OFF);
+    if (num_blks < 0) return num_blks;
+    if (to <= num_blks) return 0;
+    int result = init_block_slots(ino_num, num_blks, to);
+    if (result < 0) return result;
+    return set_inode_data(ino_num, to, INODE_NUM_BLKS_OFF);
+}
+
+// give the holes among file blocks [from, to) unwritten data blocks, allocated in contiguous runs
+// the block count grows to cover the range, so writing it later allocates nothing
+int assign_blocks(int ino_num, int from, int to) {
+    if (ino_num < 0 || ino_num >= NUM_INODE || from < 0) return -1;
+    int result = extend_blocks(ino_num, to);
+    if (result < 0) return result;
+
+    // the pointers kept in one pointer block are read, filled and written together
+    int blk_idx = from;
+    while (blk_idx < to) {
+        int count = next_ptr_block_start(blk_idx) < to ? next_ptr_block_start(blk_idx) - blk_idx : to - blk_idx;
+        long long ptrs[NUM_PTR_PER_BLK_MAX];
+        result = get_block_ptrs(ino_num, blk_idx, count, ptrs);
         if (result < 0) return result;
-        if (third_level_data_reg_idx < 0 || third_level_data_reg_idx >= NUM_DATA_BLKS) return -1;
-        
-        // reclaim third level block
-        result = set_dmap_bit(third_level_data_reg_idx, 0);
+        long long assigned[NUM_PTR_PER_BLK_MAX];
+        int num_assigned = 0;
+        int i = 0;
+        while (i < count) {
+            // length of the hole run starting at i
+            int run = 0;
+            while (i + run < count && ptrs[i + run] == BLK_PTR_HOLE) run++;
+            if (run == 0) {
+                i++;
+                continue;
+            }
+            int got = 0;
+            long long data_reg_idx = get_new_blocks(run, &got);
+            if (data_reg_idx < 0) {
+                result = data_reg_idx;
+                break;
+            }
+            for (int j = 0; j < got; j++) {
+                TRACE_DEBUG(TRACE_ASSIGN_BLOCK, NULL, ino_num, blk_idx + i + j, data_reg_idx + j);
+                ptrs[i + j] = (data_reg_idx + j) | BLK_PTR_UNWRITTEN;
+                assigned[num_assigned++] = data_reg_idx + j;
+            }
+            i += got;
+        }
+        // blocks given before running out of space are kept, blocks no pointer could be set for are freed
+        if (num_assigned > 0) {
+            int set_result = set_block_ptrs(ino_num, blk_idx, count, ptrs);
+            if (set_result < 0) {
+                free_data_blocks(assigned, num_assigned);
+                return set_result;
+            }
+        }
         if (result < 0) return result;
-        printf("[DBUG INFO] reclaim_block {double indirect data block}: %d\n", third_level_data_reg_idx);
+        blk_idx += count;
+    }
 
-        // reclaim second level block
-        if (second_level_offset == 0) {
-            int result = set_dmap_bit(second_level_data_reg_idx, 0);
-            if (result < 0) return result;
-            printf("[DBUG INFO] reclaim_block {indirect pointer block}: %d\n", second_level_data_reg_idx);
-        }
+    return 0;
+}
 
-        // reclaim first level block
-        if(blk_idx == NUM_FIRST_TWO_LEV_PTR_PER_INODE) {
-            int result = set_dmap_bit(first_level_data_reg_idx, 0);
+// collect data blocks of file blocks [from, to) under pointer block ptr_blk, level is 1 for a pointer block of data
+// block pointers and one more for each level of pointer blocks below it, first_idx is the file block its first entry
+// leads to, and ptr_blk itself once nothing below the block count is left under it
+// unless shrinking, collected entries of a kept pointer block become holes
+// return 1 if ptr_blk is collected
+int collect_ptr_block(int ino_num, long long ptr_blk, int level, long long first_idx, int from, int to, int num_blks, bool shrink, long long* freed, int* num_freed) {
+    if (ptr_blk == BLK_PTR_HOLE) return 0;
+    if (ptr_blk < 0 || ptr_blk >= NUM_DATA_BLKS) return -1;
+    long long ptrs[NUM_PTR_PER_BLK_MAX];
+    int result = get_ptr_block_data(ptr_blk, ptrs, NUM_PTR_PER_BLK, 0);
+    if (result < 0) return result;
+
+    long long entry_span = ptr_tier_span(level - 1);
+    long long blk_span = entry_span * NUM_PTR_PER_BLK;
+    int start = from > first_idx ? (from - first_idx) / entry_span : 0;
+    int end = to < first_idx + blk_span ? (to - first_idx + entry_span - 1) / entry_span : NUM_PTR_PER_BLK;
+    bool changed = false;
+    for (int i = start; i < end; i++) {
+        long long ptr = ptrs[i];
+        if (ptr == BLK_PTR_HOLE) continue;
+        if (level > 1) {
+            result = collect_ptr_block(ino_num, ptr, level - 1, first_idx + i * entry_span, from, to, num_blks, shrink, freed, num_freed);
             if (result < 0) return result;
-            printf("[DBUG INFO] reclaim_block {direct pointer block}: %d\n", first_level_data_reg_idx);
-        }        
-        
-        result = set_inode_data(ino_num, num_blocks - 1, INODE_NUM_BLKS_OFF);
+            if (result == 0) continue;
+        }
+        else if (ptr != BLK_PTR_CLUSTER_TAIL) {
+            long long data_reg_idx = BLK_PTR_IDX(ptr);
+            if (data_reg_idx < 0 || data_reg_idx >= NUM_DATA_BLKS) return -1;
+            TRACE_DEBUG(TRACE_RECLAIM_BLOCK, NULL, ino_num, first_idx + i, data_reg_idx);
+            freed[(*num_freed)++] = data_reg_idx;
+        }
+        ptrs[i] = BLK_PTR_HOLE;
+        changed = true;
+    }
+    long long span_end = first_idx + blk_span < num_blks ? first_idx + blk_span : num_blks;
+    if (from <= first_idx && span_end <= to) {
+        TRACE_DEBUG(TRACE_RECLAIM_PTR_BLOCK, NULL, ino_num, first_idx, ptr_blk);
+        freed[(*num_freed)++] = ptr_blk;
+        return 1;
+    }
+    if (!shrink && changed) {
+        result = set_ptr_block_data(ino_num, ptr_blk, ptrs + start, end - start, start);
         if (result < 0) return result;
-
-        return 0;
     }
 
-    return -1;
+    return 0;
 }
 
-int read_(int ino_num, char* buffer, size_t size, off_t offset) {
-    if (offset < 0 || size < 0) return -1;
-    if (size == 0) return 0;
-    int read_size = 0;
-    int cur_offset = offset;
+// free data blocks of file blocks [from, to) and the pointer blocks left with nothing under them
+// shrinking drops the block count to from, otherwise the range becomes holes
+// pointer blocks are read once each, subtrees are freed whole and the bitmap is updated in one pass
+int reclaim_blocks(int ino_num, int from, int to, bool shrink) {
     if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
-    int file_size = get_inode_data(ino_num, INODE_USED_SIZE_OFF);
-    if (file_size < 0) return file_size;
-    char blk_buff[SIZE_BLOCK];
-    while (cur_offset < file_size && read_size < size) {
-        int blk_idx = cur_offset / SIZE_BLOCK;
-        int blk_offset = cur_offset % SIZE_BLOCK;
-        int read_bytes = read_block(ino_num, blk_idx, blk_buff);
-        if (read_bytes != SIZE_BLOCK) return -1;
-        // increment should be the minimun of (read_bytes - blk_offset, file_size - cur_offset, size - read_size)
-        int increment = (read_bytes - blk_offset < file_size - cur_offset) ? read_bytes - blk_offset : file_size - cur_offset;
-        increment = (increment < size -  read_size) ? increment : size - read_size;
-        memcpy(buffer + read_size, blk_buff + blk_offset, increment);
-        cur_offset += increment;
-        read_size += increment;
+
+    int num_blks = get_inode_data(ino_num, INODE_NUM_BLKS_OFF);
+    if (num_blks < 0) return num_blks;
+    if (from < 0) return -1;
+    if (to > num_blks || shrink) to = num_blks;
+    if (from >= to) return 0;
+    if (shrink) TRACE_DEBUG(TRACE_TRUNCATE, NULL, ino_num, num_blks, from);
+    else TRACE_DEBUG(TRACE_PUNCH_HOLE, NULL, ino_num, from, to);
+    // compressed clusters cut by the range are stored block by block first, whole ones are freed as they are
+    if (is_compressed(ino_num)) {
+        int result = 0;
+        if (from % COMPRESS_CLUSTER_BLKS != 0) result = expand_cluster(ino_num, from / COMPRESS_CLUSTER_BLKS);
+        if (result >= 0 && to % COMPRESS_CLUSTER_BLKS != 0 && to < num_blks) result = expand_cluster(ino_num, to / COMPRESS_CLUSTER_BLKS);
+        if (result < 0) return result;
+        drop_clusters(ino_num);
     }
-    
-    return read_size;
-}
+
+    // data blocks, and a pointer block per level above each pointer block of data block pointers in the range
+    long long* freed = (long long*) malloc(((to - from) + NUM_PTR_TIERS * ((to - from) / NUM_PTR_PER_BLK + 2)) * sizeof(long long));
+    int num_freed = 0;
+    int result = 0;
+    // direct
+    for (int blk_idx = from; blk_idx < to && blk_idx < NUM_FIRST_LEV_PTR_PER_INODE; blk_idx++) {
+        long long ptr = BLK_PTR_HOLE;
+        result = get_inode_ptr(ino_num, blk_idx, &ptr);
+        if (result < 0) break;
+        if (ptr == BLK_PTR_HOLE) continue;
+        long long data_reg_idx = BLK_PTR_IDX(ptr);
+        if (ptr != BLK_PTR_CLUSTER_TAIL && (data_reg_idx < 0 || data_reg_idx >= NUM_DATA_BLKS)) {
+            result = -1;
+            break;
+        }
+        TRACE_DEBUG(TRACE_RECLAIM_BLOCK, NULL, ino_num, blk_idx, data_reg_idx);
+        if (ptr != BLK_PTR_CLUSTER_TAIL) freed[num_freed++] = data_reg_idx;
+        if (!shrink) result = set_inode_ptr(ino_num, blk_idx, BLK_PTR_HOLE);
+        if (result < 0) break;
+    }
+    // indirect tiers, each from the pointer block in the inode
+    for (int tier = 1; result >= 0 && tier <= NUM_PTR_TIERS; tier++) {
+        if (ptr_tier_start(tier) >= to) break;
+        if (ptr_tier_start(tier + 1) <= from) continue; // tier kept
+        long long root_blk = BLK_PTR_HOLE;
+        result = get_inode_ptr(ino_num, NUM_FIRST_LEV_PTR_PER_INODE + tier - 1, &root_blk);
+        if (result < 0) break;
+        result = collect_ptr_block(ino_num, root_blk, tier, ptr_tier_start(tier), from, to, num_blks, shrink, freed, &num_freed);
+        if (result == 1 && !shrink) result = set_inode_ptr(ino_num, NUM_FIRST_LEV_PTR_PER_INODE + tier - 1, BLK_PTR_HOLE);
+    }
+    if (result < 0) {
+        free(freed);
+        return result;
+    }
+
+    // inode stops pointing to the blocks before they are freed
+    if (shrink) result = set_inode_data(ino_num, from, INODE_NUM_BLKS_OFF);
+    if (result >= 0) result = free_data_blocks(freed, num_freed);
+    free(freed);
+
+    return result < 0 ? result : 0;
+}
+
+// free blocks of a file from block num_blks on
+int truncate_blocks(int ino_num, int num_blks) {
+    return reclaim_blocks(ino_num, num_blks, INT_MAX, true);
+}
+
+bool is_inline(int ino_num) {
+    int flag = get_inode_data(ino_num, INODE_FLAG_OFF);
+    return flag >= 0 && (flag & INODE_FLAG_INLINE) != 0;
+}
+
+// flag bits of a new regular file or soft link, inline when the device has the feature
+// the inline data starts zeroed, so writing past the end leaves zeros in between
+int new_file_flag_bits(int ino_num) {
+    if (!(superblock.features & FEATURE_INLINE_DATA) || INODE_INLINE_CAPACITY <= 0) return 0;
+    int result = set_inode_inline_data(ino_num, NULL, INODE_INLINE_CAPACITY, 0);
+    return result < 0 ? result : INODE_FLAG_INLINE;
+}
+
+int write_(int ino_num, const char* buffer, size_t size, off_t offset);
+
+// move inline data of a file to data blocks when it outgrows the inode
+int uninline_(int ino_num) {
+    int file_size = get_file_size(ino_num);
+    if (file_size < 0) return file_size;
+    int flag = get_inode_data(ino_num, INODE_FLAG_OFF);
+    if (flag < 0) return flag;
+    char buffer[SIZE_BLOCK];
+    int result = get_inode_inline_data(ino_num, buffer, file_size, 0);
+    if (result < 0) return result;
+
+    // block pointers overlap the inline data, they are undefined while the inode has no blocks
+    result = set_inode_data(ino_num, flag & ~INODE_FLAG_INLINE, INODE_FLAG_OFF);
+    if (result < 0) return result;
+    result = set_inode_data(ino_num, 0, INODE_NUM_BLKS_OFF);
+    if (result < 0) return result;
+    result = set_file_size(ino_num, 0);
+    if (result < 0) return result;
+    if (file_size == 0) return 0;
+    result = write_(ino_num, buffer, file_size, 0);
+    return result == file_size ? 0 : (result < 0 ? result : -1);
+}
+
+int read_(int ino_num, char* buffer, size_t size, off_t offset) {
+    if (offset < 0 || size < 0) return -1;
+    if (size == 0) return 0;
+    int read_size = 0;
+    off_t cur_offset = offset;
+    if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
+    off_t file_size = get_file_size(ino_num);
+    if (file_size < 0) return file_size;
+    if (is_inline(ino_num)) {
+        if (offset >= file_size) return 0;
+        read_size = (size < file_size - offset) ? size : file_size - offset;
+        return get_inode_inline_data(ino_num, buffer, read_size, offset);
+    }
+    char blk_buff[SIZE_BLOCK];
+    while (cur_offset < file_size && read_size < size) {
+        int blk_idx = cur_offset / SIZE_BLOCK;
+        int blk_offset = cur_offset % SIZE_BLOCK;
+        int read_bytes = read_block(ino_num, blk_idx, blk_buff);
+        if (read_bytes != SIZE_BLOCK) return -1;
+        // increment should be the minimun of (read_bytes - blk_offset, file_size - cur_offset, size - read_size)
+        int increment = (read_bytes - blk_offset < file_size - cur_offset) ? read_bytes - blk_offset : file_size - cur_offset;
+        increment = (increment < size -  read_size) ? increment : size - read_size;
+        memcpy(buffer + read_size, blk_buff + blk_offset, increment);
+        cur_offset += increment;
+        read_size += increment;
+    }
+    
+    return read_size;
+}
 
 int write_(int ino_num, const char* buffer, size_t size, off_t offset) {
     if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
@@ -455,22 +908,54 @@ int write_(int ino_num, const char* buffer, size_t size, off_t offset) {
     if (cur_block_num < 0) return cur_block_num;
     if (offset < 0 || size < 0) return -1;
     if (size == 0) return 0;
+    if (offset + size > (off_t) NUM_ALL_LEV_PTR_PER_INODE * SIZE_BLOCK) return -EFBIG; // file too large [4]
+    if (is_inline(ino_num)) {
+        if (offset + size <= INODE_INLINE_CAPACITY) {
+            int result = set_inode_inline_data(ino_num, buffer, size, offset);
+            if (result < 0) return result;
+            off_t file_size = get_file_size(ino_num);
+            if (file_size < 0) return file_size;
+            if (offset + size > file_size) result = set_file_size(ino_num, offset + size);
+            return result < 0 ? result : size;
+        }
+        int result = uninline_(ino_num);
+        if (result < 0) return result;
+    }
+    // blocks between the old end and a write past it stay holes
     int end_block_num = (offset + size - 1) / SIZE_BLOCK + 1;
-    for (int i = cur_block_num; i < end_block_num; i++) {
-        int result = assign_block(ino_num, i);
+    balance_dirty_blocks(end_block_num - offset / SIZE_BLOCK);
+    if (end_block_num > cur_block_num) {
+        int first_block = offset / SIZE_BLOCK > cur_block_num ? offset / SIZE_BLOCK : cur_block_num;
+        int result = assign_blocks(ino_num, first_block, end_block_num);
         if (result < 0) return result;
     }
     
     int write_size = 0;
-    int cur_offset = offset;
+    off_t cur_offset = offset;
     char blk_buff[SIZE_BLOCK];
+    bool compressed = is_compressed(ino_num);
+    int num_blks = get_inode_data(ino_num, INODE_NUM_BLKS_OFF);
+    if (num_blks < 0) return num_blks;
     while (write_size < size) {
         int blk_idx = cur_offset / SIZE_BLOCK;
         int blk_offset = cur_offset % SIZE_BLOCK;
-        int read_bytes = read_block(ino_num, blk_idx, blk_buff);
-        if (read_bytes != SIZE_BLOCK) return -1;
+        // whole clusters below the block count are compressed, a cluster is written once per call
+        int cluster_idx = blk_idx / COMPRESS_CLUSTER_BLKS;
+        if (compressed && (cluster_idx + 1) * COMPRESS_CLUSTER_BLKS <= num_blks) {
+            char cluster[COMPRESS_CLUSTER_SIZE];
+            int cluster_offset = cur_offset - cluster_idx * COMPRESS_CLUSTER_SIZE;
+            int increment = COMPRESS_CLUSTER_SIZE - cluster_offset < size - write_size ? COMPRESS_CLUSTER_SIZE - cluster_offset : size - write_size;
+            if (increment < COMPRESS_CLUSTER_SIZE && load_cluster(ino_num, cluster_idx, cluster) < 0) return -1;
+            memcpy(cluster + cluster_offset, buffer + write_size, increment);
+            if (write_cluster(ino_num, cluster_idx, cluster) < 0) return -1;
+            cur_offset += increment;
+            write_size += increment;
+            continue;
+        }
         // increment should be the minimun of (SIZE_BLOCK - blk_offset, size - write_size)
         int increment = SIZE_BLOCK - blk_offset < size - write_size ? SIZE_BLOCK - blk_offset : size - write_size;
+        // a block written whole is not read first, so a block failing its checksum can be overwritten
+        if (increment < SIZE_BLOCK && read_block(ino_num, blk_idx, blk_buff) != SIZE_BLOCK) return -1;
         memcpy(blk_buff + blk_offset, buffer + write_size, increment);
         int write_bytes = write_block(ino_num, blk_idx, blk_buff);
         if (write_bytes != SIZE_BLOCK) return -1;
@@ -478,103 +963,615 @@ int write_(int ino_num, const char* buffer, size_t size, off_t offset) {
         write_size += increment;
     }
     
-    int file_size = get_inode_data(ino_num, INODE_USED_SIZE_OFF);
+    off_t file_size = get_file_size(ino_num);
     if (file_size < 0) return file_size;
-    int result = set_inode_data(ino_num, (file_size > offset + size) ? file_size : offset + size, INODE_USED_SIZE_OFF);
-    if (result < 0) return result;
-        
+    // an overwrite leaves the inode clean, so fdatasync does not write the inode table block for it
+    if (offset + size > file_size) {
+        int result = set_file_size(ino_num, offset + size);
+        if (result < 0) return result;
+    }
+
     return write_size;
 }
 
-int remove_file_blocks(int ino_num) {
+// zero bytes [from, to) of file block blk_idx, holes and unwritten blocks already read as zeros
+int zero_block_range(int ino_num, int blk_idx, int from, int to) {
+    int num_blks = get_inode_data(ino_num, INODE_NUM_BLKS_OFF);
+    if (num_blks < 0) return num_blks;
+    if (blk_idx >= num_blks) return 0;
+    long long ptr = BLK_PTR_HOLE;
+    int result = get_block_ptr(ino_num, blk_idx, &ptr);
+    if (result < 0) return result;
+    if (ptr == BLK_PTR_HOLE || (ptr & BLK_PTR_UNWRITTEN) != 0) return 0;
+
+    char blk_buff[SIZE_BLOCK];
+    if (read_block(ino_num, blk_idx, blk_buff) != SIZE_BLOCK) return -1;
+    memset(blk_buff + from, 0, to - from);
+    if (write_block(ino_num, blk_idx, blk_buff) != SIZE_BLOCK) return -1;
+
+    return 0;
+}
+
+// set file size, freeing blocks past the new end or assigning unwritten blocks up to it
+int truncate_(int ino_num, off_t size) {
     if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
+    if (size < 0) return -EINVAL; // invalid argument [4]
+    if (size > (off_t) NUM_ALL_LEV_PTR_PER_INODE * SIZE_BLOCK) return -EFBIG; // file too large [4]
 
-    int cur_block_num = get_inode_data(ino_num, INODE_NUM_BLKS_OFF);
-    for (int i = cur_block_num - 1; i >=0; i--) {
-        int result = reclaim_block(ino_num, i);
+    off_t file_size = get_file_size(ino_num);
+    if (file_size < 0) return file_size;
+    if (is_inline(ino_num)) {
+        if (size <= INODE_INLINE_CAPACITY) {
+            // zero the cut off bytes, so growing the file again reads zeros
+            if (size < file_size) {
+                int result = set_inode_inline_data(ino_num, NULL, file_size - size, size);
+                if (result < 0) return result;
+            }
+            return set_file_size(ino_num, size);
+        }
+        int result = uninline_(ino_num);
         if (result < 0) return result;
     }
-    
+    int num_blks = (size + SIZE_BLOCK - 1) / SIZE_BLOCK;
+    if (size < file_size) {
+        // zero the rest of the new last block, so growing the file again reads zeros
+        if (size % SIZE_BLOCK != 0) {
+            int result = zero_block_range(ino_num, size / SIZE_BLOCK, size % SIZE_BLOCK, SIZE_BLOCK);
+            if (result < 0) return result;
+        }
+        int result = truncate_blocks(ino_num, num_blks);
+        if (result < 0) return result;
+        // an emptied file is rewritten in place, as by "echo string > file", it starts inline again
+        if (size == 0) {
+            int flag_bits = new_file_flag_bits(ino_num);
+            if (flag_bits < 0) return flag_bits;
+            if (flag_bits != 0) result = set_inode_data(ino_num, get_inode_data(ino_num, INODE_FLAG_OFF) | flag_bits, INODE_FLAG_OFF);
+            if (result < 0) return result;
+        }
+    }
+    else {
+        // the file grows by holes, fallocate reserves blocks
+        int result = extend_blocks(ino_num, num_blks);
+        if (result < 0) return result;
+    }
+
+    return set_file_size(ino_num, size);
+}
+
+// reserve or release file space, modes as in fallocate(2):
+//     0 reserves unwritten blocks for [offset, offset + len) and grows the size to cover it
+//     FALLOC_FL_KEEP_SIZE reserves without changing the size, blocks past the size stay until truncated
+//     FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE frees whole blocks in the range and zeros partial ones
+int fallocate_(int ino_num, int mode, off_t offset, off_t len) {
+    if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
+    if (offset < 0 || len <= 0) return -EINVAL; // invalid argument [4]
+    if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0) return -EOPNOTSUPP; // operation not supported [4]
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP; // operation not supported [4]
+    off_t end = offset + len;
+    if (end > (off_t) NUM_ALL_LEV_PTR_PER_INODE * SIZE_BLOCK) return -EFBIG; // file too large [4]
+
+    if (is_inline(ino_num)) {
+        off_t file_size = get_file_size(ino_num);
+        if (file_size < 0) return file_size;
+        // inline data past the size is kept zeroed
+        if (mode & FALLOC_FL_PUNCH_HOLE) {
+            if (offset >= file_size) return 0;
+            int result = set_inode_inline_data(ino_num, NULL, (end < file_size ? end : file_size) - offset, offset);
+            return result < 0 ? result : 0;
+        }
+        if (end <= INODE_INLINE_CAPACITY) {
+            if (!(mode & FALLOC_FL_KEEP_SIZE) && end > file_size) return set_file_size(ino_num, end);
+            return 0;
+        }
+        int result = uninline_(ino_num);
+        if (result < 0) return result;
+    }
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        int first_blk = offset / SIZE_BLOCK;
+        int last_blk = (end - 1) / SIZE_BLOCK;
+        int first_whole = (offset + SIZE_BLOCK - 1) / SIZE_BLOCK;
+        int end_whole = end / SIZE_BLOCK;
+        int result = 0;
+        if (first_blk == last_blk && first_whole > end_whole) {
+            result = zero_block_range(ino_num, first_blk, offset % SIZE_BLOCK, (end - 1) % SIZE_BLOCK + 1);
+        }
+        else {
+            if (offset % SIZE_BLOCK != 0) result = zero_block_range(ino_num, first_blk, offset % SIZE_BLOCK, SIZE_BLOCK);
+            if (result >= 0 && end % SIZE_BLOCK != 0) result = zero_block_range(ino_num, last_blk, 0, end % SIZE_BLOCK);
+        }
+        if (result >= 0) result = reclaim_blocks(ino_num, first_whole, end_whole, false);
+
+        return result;
+    }
+
+    int result = assign_blocks(ino_num, offset / SIZE_BLOCK, (end + SIZE_BLOCK - 1) / SIZE_BLOCK);
+    if (result < 0) return result;
+    if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+        off_t file_size = get_file_size(ino_num);
+        if (file_size < 0) return file_size;
+        if (end > file_size) return set_file_size(ino_num, end);
+    }
+
+    return 0;
+}
+
+// offset of the next data (SEEK_DATA) or hole (SEEK_HOLE) at or after offset, as lseek(2)
+// holes and unwritten blocks are holes, the end of the file is a hole, a missing pointer block is skipped whole
+off_t seek_(int ino_num, off_t offset, int whence) {
+    if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) return -EINVAL; // invalid argument [4]
+    off_t file_size = get_file_size(ino_num);
+    if (file_size < 0) return file_size;
+    if (offset < 0 || offset >= file_size) return -ENXIO; // no such device or address [4]
+    if (is_inline(ino_num)) return whence == SEEK_DATA ? offset : file_size;
+
+    int end_blk = (file_size + SIZE_BLOCK - 1) / SIZE_BLOCK;
+    int blk_idx = offset / SIZE_BLOCK;
+    while (blk_idx < end_blk) {
+        long long ptr_blk;
+        int ptr_off;
+        int result = locate_block_ptr(ino_num, blk_idx, false, &ptr_blk, &ptr_off);
+        if (result < 0) return result;
+        bool data = false;
+        if (ptr_blk != BLK_PTR_HOLE) {
+            long long ptr = BLK_PTR_HOLE;
+            result = read_block_ptr(ino_num, ptr_blk, ptr_off, &ptr);
+            if (result < 0) return result;
+            data = ptr != BLK_PTR_HOLE && (ptr & BLK_PTR_UNWRITTEN) == 0;
+        }
+        if (data == (whence == SEEK_DATA)) break;
+        blk_idx = (ptr_blk == BLK_PTR_HOLE) ? next_ptr_block_start(blk_idx) : blk_idx + 1;
+    }
+    if (blk_idx >= end_blk) return whence == SEEK_DATA ? -ENXIO : file_size; // no such device or address [4]
+
+    off_t found = (off_t) blk_idx * SIZE_BLOCK;
+    return found > offset ? found : offset;
+}
+
+int remove_file_blocks(int ino_num) {
+    return truncate_blocks(ino_num, 0);
+}
+
+// per-directory free slot hints, kept in memory only
+// removed entries are tombstoned in place (inode number -1) and reused by creates,
+// a stale or missing hint costs an append or a rescan, never a lost entry
+#define DIR_HINT_SLOTS 1024 // direct mapped by inode number
+#define DIR_COMPACT_MIN_FREE (SIZE_BLOCK / SIZE_DIR_ITEM) // compact once a block worth of entries is free ...
+#define DIR_COMPACT_FREE_RATIO 2 // ... and 1 / DIR_COMPACT_FREE_RATIO of all entries
+
+struct DirHint {
+    int tag; // inode number + 1, 0 for unused slot
+    int num_free; // tombstoned entries in the directory
+    int scan_from; // offset before which no entry is free
+};
+
+struct DirHint dir_hints[DIR_HINT_SLOTS];
+// open handles per slot, readdir offsets are entry positions, so a directory is not compacted while opened,
+// inodes sharing a slot only defer compaction of each other
+int dir_open_counts[DIR_HINT_SLOTS];
+pthread_mutex_t dir_hint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool get_dir_hint(int ino_num, int* num_free, int* scan_from) {
+    pthread_mutex_lock(&dir_hint_lock);
+    struct DirHint* hint = &dir_hints[ino_num % DIR_HINT_SLOTS];
+    bool found = hint->tag == ino_num + 1;
+    if (found) {
+        *num_free = hint->num_free;
+        *scan_from = hint->scan_from;
+    }
+    pthread_mutex_unlock(&dir_hint_lock);
+    return found;
+}
+
+void set_dir_hint(int ino_num, int num_free, int scan_from) {
+    pthread_mutex_lock(&dir_hint_lock);
+    struct DirHint* hint = &dir_hints[ino_num % DIR_HINT_SLOTS];
+    hint->tag = ino_num + 1;
+    hint->num_free = num_free;
+    hint->scan_from = scan_from;
+    pthread_mutex_unlock(&dir_hint_lock);
+}
+
+void drop_dir_hint(int ino_num) {
+    pthread_mutex_lock(&dir_hint_lock);
+    struct DirHint* hint = &dir_hints[ino_num % DIR_HINT_SLOTS];
+    if (hint->tag == ino_num + 1) hint->tag = 0;
+    pthread_mutex_unlock(&dir_hint_lock);
+}
+
+// count an open handle of a directory, delta is 1 on opendir and -1 on releasedir
+void add_dir_open_count(int ino_num, int delta) {
+    pthread_mutex_lock(&dir_hint_lock);
+    dir_open_counts[ino_num % DIR_HINT_SLOTS] += delta;
+    pthread_mutex_unlock(&dir_hint_lock);
+}
+
+bool is_dir_open(int ino_num) {
+    pthread_mutex_lock(&dir_hint_lock);
+    bool open = dir_open_counts[ino_num % DIR_HINT_SLOTS] > 0;
+    pthread_mutex_unlock(&dir_hint_lock);
+    return open;
+}
+
+// dentry cache mapping (parent inode number, name) to inode number, kept in memory only
+// filled by lookups, creates and readdir, entries are dropped when removed from their directory
+#define DENTRY_CACHE_SLOTS 65536 // direct mapped, power of 2
+#define DENTRY_NAME_MAX 16 // longer names are not cached
+
+struct Dentry {
+    int parent_tag; // parent inode number + 1, 0 for unused slot
+    int ino_num;
+    char name[DENTRY_NAME_MAX]; // not nul terminated at full length
+};
+
+struct Dentry dentry_cache[DENTRY_CACHE_SLOTS];
+pthread_mutex_t dentry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// return NULL for names too long to cache
+struct Dentry* dentry_slot(int parent_ino_num, const char* name) {
+    uint32_t h = 2166136261u ^ (uint32_t) parent_ino_num; // FNV-1a
+    int i = 0;
+    for (; i <= DENTRY_NAME_MAX && name[i] != 0; i++) h = (h ^ (uint8_t) name[i]) * 16777619u;
+    return i > DENTRY_NAME_MAX ? NULL : &dentry_cache[h & (DENTRY_CACHE_SLOTS - 1)];
+}
+
+// return inode number of a cached entry, -ENOENT if not cached
+int lookup_dentry(int parent_ino_num, const char* name) {
+    pthread_mutex_lock(&dentry_lock);
+    struct Dentry* dentry = dentry_slot(parent_ino_num, name);
+    int ino_num = dentry != NULL && dentry->parent_tag == parent_ino_num + 1 && strncmp(dentry->name, name, DENTRY_NAME_MAX) == 0 ? dentry->ino_num : -ENOENT;
+    pthread_mutex_unlock(&dentry_lock);
+    return ino_num;
+}
+
+void insert_dentry(int parent_ino_num, const char* name, int ino_num) {
+    pthread_mutex_lock(&dentry_lock);
+    struct Dentry* dentry = dentry_slot(parent_ino_num, name);
+    if (dentry != NULL) {
+        dentry->parent_tag = parent_ino_num + 1;
+        dentry->ino_num = ino_num;
+        strncpy(dentry->name, name, DENTRY_NAME_MAX);
+    }
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+void drop_dentry(int parent_ino_num, const char* name) {
+    pthread_mutex_lock(&dentry_lock);
+    struct Dentry* dentry = dentry_slot(parent_ino_num, name);
+    if (dentry != NULL && dentry->parent_tag == parent_ino_num + 1 && strncmp(dentry->name, name, DENTRY_NAME_MAX) == 0) dentry->parent_tag = 0;
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+// generations of inode numbers, kept in memory only and bumped under dentry_lock when an inode is freed, so a path
+// lookup finds out whether an inode it found was freed, and its number maybe reused, before it locked the inode
+// inode numbers share slots, a slot bumped for another inode only makes a lookup start over
+#define INODE_GENERATION_SLOTS 65536 // power of 2
+
+unsigned int inode_generations[INODE_GENERATION_SLOTS];
+
+unsigned int inode_generation(int ino_num) {
+    pthread_mutex_lock(&dentry_lock);
+    unsigned int generation = inode_generations[ino_num & (INODE_GENERATION_SLOTS - 1)];
+    pthread_mutex_unlock(&dentry_lock);
+    return generation;
+}
+
+// lookup_dentry for a path lookup, an entry counts only while its parent still has generation parent_generation
+// the generation of the inode found is returned in *generation, it is read with the entry, whose dentry is
+// dropped before the inode is freed
+int lookup_path_dentry(int parent_ino_num, unsigned int parent_generation, const char* name, unsigned int* generation) {
+    pthread_mutex_lock(&dentry_lock);
+    struct Dentry* dentry = dentry_slot(parent_ino_num, name);
+    int ino_num = dentry != NULL && dentry->parent_tag == parent_ino_num + 1 && strncmp(dentry->name, name, DENTRY_NAME_MAX) == 0 ? dentry->ino_num : -ENOENT;
+    if (inode_generations[parent_ino_num & (INODE_GENERATION_SLOTS - 1)] != parent_generation) ino_num = -ENOENT;
+    if (ino_num >= 0 && ino_num < NUM_INODE) *generation = inode_generations[ino_num & (INODE_GENERATION_SLOTS - 1)];
+    pthread_mutex_unlock(&dentry_lock);
+    return ino_num;
+}
+
+// free an inode locked exclusively, its entry is removed from the dentry cache and its parent, which is locked
+// exclusively as well, before
+int free_inode(int ino_num) {
+    pthread_mutex_lock(&dentry_lock);
+    inode_generations[ino_num & (INODE_GENERATION_SLOTS - 1)]++;
+    pthread_mutex_unlock(&dentry_lock);
+    return set_imap_bit(ino_num, 0);
+}
+
+// per-inode reader/writer locks held by file operations over all their steps, so fuse may run multithreaded
+// readers of a file share its lock, an entry exists only while threads hold or wait for it, so the locks of
+// different inodes are never shared
+// lock order:
+//     1. rename_lock, taken by renames between directories
+//     2. directories, an ancestor before its descendants, others by ascending inode number
+//     3. other inodes by ascending inode number
+//     4. the locks of in-memory tables and cache_lock
+//     5. content locks of cached blocks, see cache.h
+#define INODE_LOCK_BUCKETS 1024 // power of 2
+
+struct InodeLock {
+    int ino_num;
+    int users; // threads holding or waiting for the lock
+    pthread_rwlock_t rwlock;
+    struct InodeLock* next;
+};
+
+struct InodeLock* inode_lock_buckets[INODE_LOCK_BUCKETS];
+struct InodeLock* free_inode_locks = NULL; // entries without users, kept for reuse
+pthread_mutex_t inode_lock_table_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// entry of an inode under inode_lock_table_lock, created if create is set
+struct InodeLock* find_inode_lock(int ino_num, bool create) {
+    struct InodeLock** bucket = &inode_lock_buckets[ino_num & (INODE_LOCK_BUCKETS - 1)];
+    for (struct InodeLock* lock = *bucket; lock != NULL; lock = lock->next) {
+        if (lock->ino_num == ino_num) return lock;
+    }
+    if (!create) return NULL;
+    struct InodeLock* lock = free_inode_locks;
+    if (lock != NULL) free_inode_locks = lock->next;
+    else {
+        lock = (struct InodeLock*) malloc(sizeof(struct InodeLock));
+        if (lock == NULL) return NULL;
+        pthread_rwlock_init(&lock->rwlock, NULL);
+    }
+    lock->ino_num = ino_num;
+    lock->users = 0;
+    lock->next = *bucket;
+    *bucket = lock;
+    return lock;
+}
+
+// drop a user of an entry under inode_lock_table_lock, the last one returns it to the free list
+void release_inode_lock(struct InodeLock* lock) {
+    if (--lock->users > 0) return;
+    struct InodeLock** prev = &inode_lock_buckets[lock->ino_num & (INODE_LOCK_BUCKETS - 1)];
+    while (*prev != lock) prev = &(*prev)->next;
+    *prev = lock->next;
+    lock->next = free_inode_locks;
+    free_inode_locks = lock;
+}
+
+// take the lock of an inode, shared for operations only reading it
+int lock_inode(int ino_num, bool exclusive) {
+    pthread_mutex_lock(&inode_lock_table_lock);
+    struct InodeLock* lock = find_inode_lock(ino_num, true);
+    if (lock != NULL) lock->users++;
+    pthread_mutex_unlock(&inode_lock_table_lock);
+    if (lock == NULL) return -ENOMEM; // out of memory [4]
+
+    int busy = exclusive ? pthread_rwlock_trywrlock(&lock->rwlock) : pthread_rwlock_tryrdlock(&lock->rwlock);
+    if (busy == 0) return 0;
+    stats_add(STAT_INODE_LOCK_WAIT, 1);
+    if (exclusive) pthread_rwlock_wrlock(&lock->rwlock);
+    else pthread_rwlock_rdlock(&lock->rwlock);
     return 0;
 }
 
+void unlock_inode(int ino_num) {
+    pthread_mutex_lock(&inode_lock_table_lock);
+    struct InodeLock* lock = find_inode_lock(ino_num, false);
+    if (lock != NULL) {
+        pthread_rwlock_unlock(&lock->rwlock);
+        release_inode_lock(lock);
+    }
+    pthread_mutex_unlock(&inode_lock_table_lock);
+}
+
+// lock two inodes of the same rank in the lock order, by ascending inode number
+int lock_inode_pair(int ino_num, int other_ino_num, bool exclusive, bool other_exclusive) {
+    if (ino_num == other_ino_num) return lock_inode(ino_num, exclusive || other_exclusive);
+    bool first = ino_num < other_ino_num;
+    int result = lock_inode(first ? ino_num : other_ino_num, first ? exclusive : other_exclusive);
+    if (result < 0) return result;
+    result = lock_inode(first ? other_ino_num : ino_num, first ? other_exclusive : exclusive);
+    if (result < 0) unlock_inode(first ? ino_num : other_ino_num);
+    return result;
+}
+
+void unlock_inode_pair(int ino_num, int other_ino_num) {
+    unlock_inode(ino_num);
+    if (other_ino_num != ino_num) unlock_inode(other_ino_num);
+}
+
 int find_dir_entry_ino(int ino_num, const char* name) {
     if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
-    if (get_inode_data(ino_num, INODE_FLAG_OFF) != 1 ) return -ENOTDIR; // not a directory [4]
+    if (get_inode_type(ino_num) != 1 ) return -ENOTDIR; // not a directory [4]
+    if (strlen(name) > SIZE_FILENAME) return -ENOENT; // no such file or directory [4]
+    int cached_ino_num = lookup_dentry(ino_num, name);
+    if (cached_ino_num >= 0) return cached_ino_num;
     
-    int file_size = get_inode_data(ino_num, INODE_USED_SIZE_OFF);
+    int file_size = get_file_size(ino_num);
     if (file_size % SIZE_DIR_ITEM != 0) return -1;
-    char* buffer = (char*) malloc(file_size);
-    int read_bytes = read_(ino_num, buffer, file_size, 0);
-    if (read_bytes != file_size) return -1;
-    
+
+    // scan the directory block by block
+    char buffer[SIZE_BLOCK];
     char filename[SIZE_FILENAME + 1];
     memset(filename, 0, SIZE_FILENAME + 1);
+    int num_free = 0;
+    int scan_from = file_size;
     int offset = 0;
     while (offset < file_size) {
-        int sub_ino_num = -1;
-        memcpy(&sub_ino_num, buffer + offset, sizeof(sub_ino_num));
-        memcpy(filename, buffer + offset + sizeof(sub_ino_num), SIZE_FILENAME);
-        if (strcmp(filename, name) == 0 && sub_ino_num >=0) {
-            free(buffer);
-            return sub_ino_num;
+        int len = SIZE_BLOCK < file_size - offset ? SIZE_BLOCK : file_size - offset;
+        int read_bytes = read_(ino_num, buffer, len, offset);
+        if (read_bytes != len) return -1;
+        for (int pos = 0; pos < len; pos += SIZE_DIR_ITEM) {
+            int sub_ino_num = -1;
+            memcpy(&sub_ino_num, buffer + pos, sizeof(sub_ino_num));
+            memcpy(filename, buffer + pos + sizeof(sub_ino_num), SIZE_FILENAME);
+            if (strcmp(filename, name) == 0 && sub_ino_num >=0) {
+                insert_dentry(ino_num, name, sub_ino_num);
+                return sub_ino_num;
+            }
+            if (sub_ino_num < 0 && num_free++ == 0) scan_from = offset + pos;
         }
-        offset += SIZE_DIR_ITEM;
+        offset += len;
     }
 
-    free(buffer);
+    // a miss has seen every entry, let the following create reuse a free slot
+    int hint_num_free, hint_scan_from;
+    if (!get_dir_hint(ino_num, &hint_num_free, &hint_scan_from)) set_dir_hint(ino_num, num_free, scan_from);
     return -ENOENT; // no such file or directory [4]
 }
 
+// find the first tombstoned entry in [from, file_size), return its offset or -ENOENT
+int find_free_dir_slot(int ino_num, int from, int file_size) {
+    char buffer[SIZE_BLOCK];
+    int offset = from - from % SIZE_DIR_ITEM;
+    while (offset < file_size) {
+        int len = SIZE_BLOCK - offset % SIZE_BLOCK;
+        if (len > file_size - offset) len = file_size - offset;
+        int read_bytes = read_(ino_num, buffer, len, offset);
+        if (read_bytes != len) return -1;
+        for (int pos = 0; pos < len; pos += SIZE_DIR_ITEM) {
+            int sub_ino_num = -1;
+            memcpy(&sub_ino_num, buffer + pos, sizeof(sub_ino_num));
+            if (sub_ino_num < 0) return offset + pos;
+        }
+        offset += len;
+    }
+
+    return -ENOENT; // no such file or directory [4]
+}
+
+int add_dir_entry(int ino_num, const char* name, int sub_ino_num) {
+    if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
+    int file_size = get_file_size(ino_num);
+    if (file_size < 0 || file_size % SIZE_DIR_ITEM != 0) return -1;
+
+    // reuse a tombstone if the directory has one, append otherwise
+    int offset = file_size;
+    int num_free = 0;
+    int scan_from = 0;
+    if (get_dir_hint(ino_num, &num_free, &scan_from) && num_free > 0) {
+        int slot = find_free_dir_slot(ino_num, scan_from, file_size);
+        if (slot == -ENOENT) set_dir_hint(ino_num, 0, file_size + SIZE_DIR_ITEM); // stale hint
+        else if (slot < 0) return slot;
+        else {
+            offset = slot;
+            set_dir_hint(ino_num, num_free - 1, slot + SIZE_DIR_ITEM);
+        }
+    }
+
+    char new_dir_entry[SIZE_DIR_ITEM];
+    memset(new_dir_entry, 0, SIZE_DIR_ITEM);
+    memcpy(new_dir_entry, &sub_ino_num, sizeof(sub_ino_num));
+    memcpy(new_dir_entry + sizeof(sub_ino_num), name, SIZE_FILENAME);
+    int write_bytes = write_(ino_num, new_dir_entry, SIZE_DIR_ITEM, offset);
+    if (write_bytes != SIZE_DIR_ITEM) return -1;
+    insert_dentry(ino_num, name, sub_ino_num);
+
+    return 0;
+}
+
+// move live entries to the front and release the blocks past them
+int compact_dir(int ino_num) {
+    int file_size = get_file_size(ino_num);
+    if (file_size < 0 || file_size % SIZE_DIR_ITEM != 0) return -1;
+    int buffer_size = (file_size + SIZE_BLOCK - 1) / SIZE_BLOCK * SIZE_BLOCK;
+    char* buffer = (char*) malloc(buffer_size);
+    int read_bytes = read_(ino_num, buffer, file_size, 0);
+    if (read_bytes != file_size) {
+        free(buffer);
+        return -1;
+    }
+
+    int new_size = 0;
+    for (int offset = 0; offset < file_size; offset += SIZE_DIR_ITEM) {
+        int sub_ino_num = -1;
+        memcpy(&sub_ino_num, buffer + offset, sizeof(sub_ino_num));
+        if (sub_ino_num < 0) continue;
+        if (new_size != offset) memcpy(buffer + new_size, buffer + offset, SIZE_DIR_ITEM);
+        new_size += SIZE_DIR_ITEM;
+    }
+    int new_num_blks = (new_size + SIZE_BLOCK - 1) / SIZE_BLOCK;
+    // rewrite the kept blocks whole, the tail of the last one zeroed
+    memset(buffer + new_size, 0, new_num_blks * SIZE_BLOCK - new_size);
+    int write_bytes = new_num_blks == 0 ? 0 : write_(ino_num, buffer, new_num_blks * SIZE_BLOCK, 0);
+    free(buffer);
+    if (write_bytes != new_num_blks * SIZE_BLOCK) return -1;
+    TRACE_DEBUG(TRACE_COMPACT_DIR, NULL, ino_num, file_size / SIZE_DIR_ITEM, new_size / SIZE_DIR_ITEM);
+
+    int result = truncate_blocks(ino_num, new_num_blks);
+    if (result < 0) return result;
+    result = set_file_size(ino_num, new_size);
+    if (result < 0) return result;
+    set_dir_hint(ino_num, 0, new_size);
+
+    return 0;
+}
+
 int remove_dir_entry(int ino_num, const char* name) {
     if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
-    if (get_inode_data(ino_num, INODE_FLAG_OFF) != 1) return -ENOTDIR; // not a directory [4]
+    if (get_inode_type(ino_num) != 1) return -ENOTDIR; // not a directory [4]
     
-    int file_size = get_inode_data(ino_num, INODE_USED_SIZE_OFF);
+    int file_size = get_file_size(ino_num);
     if (file_size % SIZE_DIR_ITEM != 0) return -1;
-    char* buffer = (char*) malloc(file_size);
-    int read_bytes = read_(ino_num, buffer, file_size, 0);
-    if (read_bytes != file_size) return -1;
-    
+
+    // without a hint the whole directory is scanned to count its tombstones
+    int num_free = 0;
+    int scan_from = file_size;
+    bool hinted = get_dir_hint(ino_num, &num_free, &scan_from);
+    if (!hinted) {
+        num_free = 0;
+        scan_from = file_size;
+    }
+
+    char buffer[SIZE_BLOCK];
     char filename[SIZE_FILENAME + 1];
     memset(filename, 0, SIZE_FILENAME + 1);
+    int found_offset = -1;
     int offset = 0;
-    while (offset < file_size) {
-        int sub_ino_num = -1;
-        memcpy(&sub_ino_num, buffer + offset, sizeof(sub_ino_num));
-        memcpy(filename, buffer + offset + sizeof(sub_ino_num), SIZE_FILENAME);
-        if (strcmp(filename, name) == 0 && sub_ino_num >=0) break;
-        offset += SIZE_DIR_ITEM;
-    }
-    if (offset < file_size) {
-        // write last directory entry to offset
-        int last_entry_offset = file_size - SIZE_DIR_ITEM;
-        write_(ino_num, buffer + last_entry_offset, SIZE_DIR_ITEM, offset);
-        memset(buffer + last_entry_offset, 0, SIZE_DIR_ITEM);
-        write_(ino_num, buffer + last_entry_offset, SIZE_DIR_ITEM, last_entry_offset);
-
-        // reclaim block if necessary
-        file_size = file_size - SIZE_DIR_ITEM;
-        int blk_idx = file_size / SIZE_BLOCK;
-        if (file_size % SIZE_BLOCK == 0) {
-            int result = reclaim_block(ino_num, blk_idx);
-            if (result < 0) return result;
+    while (offset < file_size && (found_offset < 0 || !hinted)) {
+        int len = SIZE_BLOCK < file_size - offset ? SIZE_BLOCK : file_size - offset;
+        int read_bytes = read_(ino_num, buffer, len, offset);
+        if (read_bytes != len) return -1;
+        for (int pos = 0; pos < len; pos += SIZE_DIR_ITEM) {
+            int sub_ino_num = -1;
+            memcpy(&sub_ino_num, buffer + pos, sizeof(sub_ino_num));
+            memcpy(filename, buffer + pos + sizeof(sub_ino_num), SIZE_FILENAME);
+            if (sub_ino_num < 0) {
+                if (!hinted) {
+                    num_free++;
+                    if (offset + pos < scan_from) scan_from = offset + pos;
+                }
+            }
+            else if (found_offset < 0 && strcmp(filename, name) == 0) found_offset = offset + pos;
         }
-        int result = set_inode_data(ino_num, file_size, INODE_USED_SIZE_OFF);
-        if (result < 0) return result;
-
-        free(buffer);
-        return 0;
+        offset += len;
     }
+    if (found_offset < 0) return -ENOENT; // no such file or directory [4]
+
+    // tombstone the entry in place
+    char free_entry[SIZE_DIR_ITEM];
+    memset(free_entry, 0, SIZE_DIR_ITEM);
+    int free_ino_num = -1;
+    memcpy(free_entry, &free_ino_num, sizeof(free_ino_num));
+    int write_bytes = write_(ino_num, free_entry, SIZE_DIR_ITEM, found_offset);
+    if (write_bytes != SIZE_DIR_ITEM) return -1;
+    drop_dentry(ino_num, name);
+    num_free++;
+    if (found_offset < scan_from) scan_from = found_offset;
+
+    // an opened directory is compacted by the first removal after it is released
+    if (num_free >= DIR_COMPACT_MIN_FREE && num_free * DIR_COMPACT_FREE_RATIO >= file_size / SIZE_DIR_ITEM && !is_dir_open(ino_num)) return compact_dir(ino_num);
+    set_dir_hint(ino_num, num_free, scan_from);
 
-    free(buffer);
-    return -ENOENT; // no such file or directory [4]
+    return 0;
 }
 
+int add_links_count(int ino_num, int delta) {
+    int links_count = get_inode_data(ino_num, INODE_LINKS_COUNT_OFF);
+    if (links_count < 0) return links_count;
+    return set_inode_data(ino_num, links_count + delta, INODE_LINKS_COUNT_OFF);
+}
+
+// remove an inode, a directory with everything below it, the caller holds its lock exclusively
 int rmdir_(int ino_num) {
     if (ino_num < 0 || ino_num >= NUM_INODE) return -1;
 
-    int file_flag = get_inode_data(ino_num, INODE_FLAG_OFF);
+    int file_flag = get_inode_type(ino_num);
     if (file_flag < 0) return file_flag;
     // regular file or soft link
     if (file_flag == 0 || file_flag == 2) {
@@ -588,7 +1585,7 @@ int rmdir_(int ino_num) {
             int result = remove_file_blocks(ino_num);
             if (result < 0) return result;
             
-            result = set_imap_bit(ino_num, 0);
+            result = free_inode(ino_num);
             if (result < 0) return result;
         }
         
@@ -596,48 +1593,77 @@ int rmdir_(int ino_num) {
     }
     // direcotory
     else if (file_flag == 1) {
-        int file_size = get_inode_data(ino_num, INODE_USED_SIZE_OFF);
+        // read the entries once and tear down every child, the directory is
+        // freed as a whole so its entries are never rewritten one by one
+        int file_size = get_file_size(ino_num);
         if (file_size < 0 || file_size % SIZE_DIR_ITEM != 0) return -1;
         char* buffer = (char*) malloc(file_size);
         int read_bytes = read_(ino_num, buffer, file_size, 0);
-        if (read_bytes != file_size) return -1;
-        
+        if (read_bytes != file_size) {
+            free(buffer);
+            return -1;
+        }
+
+        // the links count is checked before any child is freed
+        int num_subdirs = 0;
+        for (int cur_offset = 0; cur_offset < file_size; cur_offset += SIZE_DIR_ITEM) {
+            int sub_ino_num = -1;
+            memcpy(&sub_ino_num, buffer + cur_offset, sizeof(sub_ino_num));
+            if (sub_ino_num < 0 || sub_ino_num >= NUM_INODE) continue;
+            int entry_flag = get_inode_type(sub_ino_num);
+            if (entry_flag < 0) {
+                free(buffer);
+                return entry_flag;
+            }
+            if (entry_flag == 1) num_subdirs++; // subdir ".." link
+        }
+        int file_links_count = get_inode_data(ino_num, INODE_LINKS_COUNT_OFF);
+        if (file_links_count < 0 || file_links_count != 2 + num_subdirs) {
+            free(buffer);
+            if (file_links_count < 0) return file_links_count;
+            TRACE_ERROR(TRACE_BAD_LINKS_COUNT, NULL, ino_num, file_links_count, 0);
+            return -1; // self, "." pointing to self and ".." of each subdir
+        }
+
+        // the entry of each freed child is tombstoned in the buffer, so a failure part way leaves no entry to a
+        // freed inode once the buffer is written back
         char filename[SIZE_FILENAME + 1];
         memset(filename, 0, SIZE_FILENAME + 1);
-        int cur_offset = 0;
-        while (cur_offset < file_size) {
+        int num_freed_subdirs = 0;
+        for (int cur_offset = 0; cur_offset < file_size; cur_offset += SIZE_DIR_ITEM) {
             int sub_ino_num = -1;
             memcpy(&sub_ino_num, buffer + cur_offset, sizeof(sub_ino_num));
             memcpy(filename, buffer + cur_offset + sizeof(sub_ino_num), SIZE_FILENAME);
-            if (sub_ino_num >= 0 && sub_ino_num < NUM_INODE) {
-                int entry_flag = get_inode_data(sub_ino_num, INODE_FLAG_OFF);
-                if (entry_flag < 0) return entry_flag;
-                int result = rmdir_(sub_ino_num); // remove recursively
-                if (result < 0) return result;
-                if (entry_flag == 1) { // subdir ".." link
-                    int file_links_count = get_inode_data(ino_num, INODE_LINKS_COUNT_OFF);
-                    if (file_links_count < 0) return file_links_count;
-                    int result = set_inode_data(ino_num, file_links_count - 1, INODE_LINKS_COUNT_OFF);
-                    if (result < 0) return result;
-                }
+            if (sub_ino_num < 0 || sub_ino_num >= NUM_INODE) continue;
+            drop_dentry(ino_num, filename);
+            int result = lock_inode(sub_ino_num, true); // below its parent in the lock order
+            int entry_flag = result < 0 ? result : get_inode_type(sub_ino_num);
+            if (result >= 0) {
+                result = entry_flag < 0 ? entry_flag : rmdir_(sub_ino_num); // remove recursively
+                unlock_inode(sub_ino_num);
             }
-            
-            int result = remove_dir_entry(ino_num, filename);
-            if (result < 0) return result;
-            
-            cur_offset += SIZE_DIR_ITEM;
+            if (result < 0) {
+                int write_bytes = cur_offset > 0 ? write_(ino_num, buffer, cur_offset, 0) : 0;
+                if (num_freed_subdirs > 0) add_links_count(ino_num, -num_freed_subdirs);
+                drop_dir_hint(ino_num);
+                free(buffer);
+                return write_bytes < 0 ? write_bytes : result;
+            }
+            sub_ino_num = -1;
+            memcpy(buffer + cur_offset, &sub_ino_num, sizeof(sub_ino_num));
+            if (entry_flag == 1) num_freed_subdirs++;
         }
+        free(buffer);
+        TRACE_DEBUG(TRACE_RMDIR, NULL, ino_num, file_size / SIZE_DIR_ITEM, num_subdirs);
 
-        int file_links_count = get_inode_data(ino_num, INODE_LINKS_COUNT_OFF);
-        if (file_links_count < 0) return file_links_count;
-        if (file_links_count != 2) {
-            printf("[ERROR] rmdir_: ino_num = %d, links_count = %d\n", ino_num, file_links_count);
-            return -1; // self and "." pointing to self
-        }
+        // release all directory blocks in one pass
         int result = remove_file_blocks(ino_num);
         if (result < 0) return result;
+        result = set_file_size(ino_num, 0);
+        if (result < 0) return result;
+        drop_dir_hint(ino_num);
 
-        result = set_imap_bit(ino_num, 0);
+        result = free_inode(ino_num);
         if (result < 0) return result;
 
         return 0;
@@ -645,32 +1671,458 @@ int rmdir_(int ino_num) {
     else return -1; // not suported type
 }
 
-int get_inode_number(const char* path) {
-    // get inode number from an absolute path
-    int plen = strlen(path);
-    int ino_num = ROOT_INUM; // root
-    int lpos = 1; // bypass the preceding '/'
-    while (lpos < plen) {
-        int rpos = lpos;
-        while (rpos < plen && path[rpos] != '/')
-            rpos++;
-        char name[SIZE_FILENAME + 1];
-        memset(name, 0, SIZE_FILENAME + 1);
-        memcpy(name, path + lpos, rpos - lpos);
-        int new_ino_num = find_dir_entry_ino(ino_num, name);
-        if (new_ino_num < 0) return new_ino_num;
-        ino_num = new_ino_num;
-        lpos = rpos + 1;
+// lock an inode found by lookup with generation generation, it may have been freed and its number reused for
+// another file before it was locked, -ESTALE then and the caller looks its path up again
+int lock_found_inode(int ino_num, unsigned int generation, bool exclusive) {
+    int result = lock_inode(ino_num, exclusive);
+    if (result < 0) return result;
+    if (get_imap_bit(ino_num) != 1 || inode_generation(ino_num) != generation) {
+        unlock_inode(ino_num);
+        stats_add(STAT_LOOKUP_RETRY, 1);
+        return -ESTALE; // stale file handle [4]
+    }
+    return ino_num;
+}
+
+// inode number of an absolute path, its generation is returned in *generation (see inode_generation)
+// -ESTALE if a directory on the way was freed before it was locked, the caller looks the path up again
+int get_inode_number(const char* path, unsigned int* generation) {
+    int plen = strlen(path);
+    int ino_num = ROOT_INUM; // root
+    unsigned int ino_generation = inode_generation(ROOT_INUM);
+    int lpos = 1; // bypass the preceding '/'
+    while (lpos < plen) {
+        int rpos = lpos;
+        while (rpos < plen && path[rpos] != '/')
+            rpos++;
+        if (rpos - lpos > SIZE_FILENAME) return -ENOENT; // no such file or directory [4]
+        char name[SIZE_FILENAME + 1];
+        memset(name, 0, SIZE_FILENAME + 1);
+        memcpy(name, path + lpos, rpos - lpos);
+        unsigned int new_generation = 0;
+        int new_ino_num = lookup_path_dentry(ino_num, ino_generation, name, &new_generation);
+        if (new_ino_num < 0) {
+            // one directory locked at a time, so lookups hold no lock when they return
+            int result = lock_found_inode(ino_num, ino_generation, false);
+            if (result < 0) return result;
+            new_ino_num = find_dir_entry_ino(ino_num, name);
+            // the entry found stays until the directory is unlocked, so its inode is not freed before
+            if (new_ino_num >= 0 && new_ino_num < NUM_INODE) new_generation = inode_generation(new_ino_num);
+            unlock_inode(ino_num);
+        }
+        if (new_ino_num < 0) return new_ino_num;
+        ino_num = new_ino_num;
+        ino_generation = new_generation;
+        lpos = rpos + 1;
+    }
+    *generation = ino_generation;
+    return ino_num;
+}
+
+// inode number of the parent directory of an absolute path, last name is copied to file_name of SIZE_FILENAME + 1 bytes
+// its generation is returned in *generation, as by get_inode_number
+int get_parent_inode_number(const char* path, char* file_name, unsigned int* generation) {
+    int plen = strlen(path);
+    int pos = plen - 1;
+    while(pos >= 0 && path[pos] != '/') pos--;
+    if (pos < 0) return -ENOENT; // no such file or directory [4]
+    int file_name_len = plen - 1 - pos;
+    if (file_name_len <= 0) return -ENOENT; // no such file or directory [4]
+    if (file_name_len > SIZE_FILENAME) return -ENAMETOOLONG; // file name too long [4]
+    memset(file_name, 0, SIZE_FILENAME + 1);
+    memcpy(file_name, path + pos + 1, file_name_len);
+    if (pos == 0) pos = 1; // root path 
+    char* parent_name = (char*) malloc(pos + 1);
+    memset(parent_name, 0, pos + 1);
+    memcpy(parent_name, path, pos);
+
+    int parent_ino_num = get_inode_number(parent_name, generation);
+    free(parent_name);
+    if (parent_ino_num < 0) return parent_ino_num;
+    if (parent_ino_num >= NUM_INODE) return -1;
+    if (get_inode_type(parent_ino_num) != 1) return -ENOTDIR; // not a directory [4]
+    return parent_ino_num;
+}
+
+// inode number of an absolute path, locked
+int lock_path(const char* path, bool exclusive) {
+    while (true) {
+        unsigned int generation = 0;
+        int ino_num = get_inode_number(path, &generation);
+        if (ino_num >= NUM_INODE) return -1;
+        if (ino_num >= 0) ino_num = lock_found_inode(ino_num, generation, exclusive);
+        if (ino_num != -ESTALE) return ino_num;
+    }
+}
+
+// inode number of the parent directory of an absolute path locked exclusively, see get_parent_inode_number
+int lock_parent_dir(const char* path, char* file_name) {
+    while (true) {
+        unsigned int generation = 0;
+        int parent_ino_num = get_parent_inode_number(path, file_name, &generation);
+        if (parent_ino_num >= 0) parent_ino_num = lock_found_inode(parent_ino_num, generation, true);
+        if (parent_ino_num != -ESTALE) return parent_ino_num;
+    }
+}
+
+// point an existing directory entry to another inode in place
+int set_dir_entry_ino(int ino_num, const char* name, int sub_ino_num) {
+    int file_size = get_file_size(ino_num);
+    if (file_size < 0 || file_size % SIZE_DIR_ITEM != 0) return -1;
+    char buffer[SIZE_BLOCK];
+    char filename[SIZE_FILENAME + 1];
+    memset(filename, 0, SIZE_FILENAME + 1);
+    int offset = 0;
+    while (offset < file_size) {
+        int len = SIZE_BLOCK < file_size - offset ? SIZE_BLOCK : file_size - offset;
+        int read_bytes = read_(ino_num, buffer, len, offset);
+        if (read_bytes != len) return -1;
+        for (int pos = 0; pos < len; pos += SIZE_DIR_ITEM) {
+            int entry_ino_num = -1;
+            memcpy(&entry_ino_num, buffer + pos, sizeof(entry_ino_num));
+            memcpy(filename, buffer + pos + sizeof(entry_ino_num), SIZE_FILENAME);
+            if (entry_ino_num < 0 || strcmp(filename, name) != 0) continue;
+            int write_bytes = write_(ino_num, (const char*) &sub_ino_num, sizeof(sub_ino_num), offset + pos);
+            if (write_bytes != sizeof(sub_ino_num)) return -1;
+            insert_dentry(ino_num, name, sub_ino_num);
+            return 0;
+        }
+        offset += len;
+    }
+
+    return -ENOENT; // no such file or directory [4]
+}
+
+// return 1 if a directory has no entries, 0 if it has and negative integer if not success
+int is_dir_empty(int ino_num) {
+    int file_size = get_file_size(ino_num);
+    if (file_size < 0 || file_size % SIZE_DIR_ITEM != 0) return -1;
+    char buffer[SIZE_BLOCK];
+    int offset = 0;
+    while (offset < file_size) {
+        int len = SIZE_BLOCK < file_size - offset ? SIZE_BLOCK : file_size - offset;
+        int read_bytes = read_(ino_num, buffer, len, offset);
+        if (read_bytes != len) return -1;
+        for (int pos = 0; pos < len; pos += SIZE_DIR_ITEM) {
+            int sub_ino_num = -1;
+            memcpy(&sub_ino_num, buffer + pos, sizeof(sub_ino_num));
+            if (sub_ino_num >= 0) return 0;
+        }
+        offset += len;
+    }
+
+    return 1;
+}
+
+// path names an entry below directory dir_path
+bool is_path_below(const char* path, const char* dir_path) {
+    int dlen = strlen(dir_path);
+    return strncmp(path, dir_path, dlen) == 0 && path[dlen] == '/';
+}
+
+// length of the directory part of an absolute path, 0 for entries of the root directory
+int dir_path_len(const char* path) {
+    int pos = strlen(path) - 1;
+    while (pos > 0 && path[pos] != '/') pos--;
+    return pos;
+}
+
+// the directory holding path is below the directory holding other_path
+bool is_dir_below(const char* path, const char* other_path) {
+    int len = dir_path_len(other_path);
+    return dir_path_len(path) > len && strncmp(path, other_path, len) == 0 && path[len] == '/';
+}
+
+// move the entry from_name of from_parent_ino_num to to_name of to_parent_ino_num, both parents locked exclusively
+// the directory ".." links are kept in the parents' links count
+int rename_entry_(int from_parent_ino_num, const char* from_name, int to_parent_ino_num, const char* to_name, int from_ino_num, int to_ino_num, unsigned int flags) {
+    int from_flag = get_inode_type(from_ino_num);
+    if (from_flag < 0) return from_flag;
+    int to_flag = to_ino_num >= 0 ? get_inode_type(to_ino_num) : -1;
+    if (to_ino_num >= 0 && to_flag < 0) return to_flag;
+
+    if (flags & RENAME_EXCHANGE) {
+        if (to_ino_num < 0) return -ENOENT; // no such file or directory [4]
+        int result = set_dir_entry_ino(from_parent_ino_num, from_name, to_ino_num);
+        if (result < 0) return result;
+        result = set_dir_entry_ino(to_parent_ino_num, to_name, from_ino_num);
+        if (result < 0) return result;
+        if (from_parent_ino_num != to_parent_ino_num && (from_flag == 1) != (to_flag == 1)) {
+            int delta = from_flag == 1 ? 1 : -1; // subdirectory moved to to_parent
+            result = add_links_count(to_parent_ino_num, delta);
+            if (result < 0) return result;
+            result = add_links_count(from_parent_ino_num, -delta);
+            if (result < 0) return result;
+        }
+        return 0;
+    }
+
+    if (to_ino_num == from_ino_num) return 0; // same file
+    if (to_ino_num >= 0) {
+        if (flags & RENAME_NOREPLACE) return -EEXIST; // file exists [4]
+        if (from_flag == 1 && to_flag != 1) return -ENOTDIR; // not a directory [4]
+        if (from_flag != 1 && to_flag == 1) return -EISDIR; // is a directory [4]
+        if (to_flag == 1) {
+            int empty = is_dir_empty(to_ino_num);
+            if (empty < 0) return empty;
+            if (!empty) return -ENOTEMPTY; // directory not empty [4]
+        }
+    }
+
+    // the target entry names the moved inode before the source entry is removed, a crash in between leaves both
+    // entries on device: fsck keeps a file under both names and fixes its links count to 2, and drops the entry of
+    // a directory found second, as a directory has one parent
+    // the entry is switched to the moved inode in one write, the replaced inode is dropped once the move is done
+    int result = to_ino_num >= 0 ? set_dir_entry_ino(to_parent_ino_num, to_name, from_ino_num) : add_dir_entry(to_parent_ino_num, to_name, from_ino_num);
+    if (result < 0) return result;
+    result = remove_dir_entry(from_parent_ino_num, from_name);
+    if (result < 0) {
+        // the source keeps its name, the target entry is put back
+        if (to_ino_num >= 0) set_dir_entry_ino(to_parent_ino_num, to_name, to_ino_num);
+        else remove_dir_entry(to_parent_ino_num, to_name);
+        return result;
+    }
+    if (to_ino_num >= 0) {
+        result = rmdir_(to_ino_num);
+        if (result < 0) return result;
+        if (to_flag == 1) {
+            result = add_links_count(to_parent_ino_num, -1);
+            if (result < 0) return result;
+        }
+    }
+    if (from_flag == 1 && from_parent_ino_num != to_parent_ino_num) {
+        result = add_links_count(from_parent_ino_num, -1);
+        if (result < 0) return result;
+        result = add_links_count(to_parent_ino_num, 1);
+        if (result < 0) return result;
+    }
+
+    return 0;
+}
+
+// lock the inodes named by a rename below their locked parents, directories first, then by inode number
+int rename_children_(int from_parent_ino_num, const char* from_name, int to_parent_ino_num, const char* to_name, unsigned int flags) {
+    int from_ino_num = find_dir_entry_ino(from_parent_ino_num, from_name);
+    if (from_ino_num < 0) return from_ino_num;
+    if (from_ino_num >= NUM_INODE) return -1;
+    int to_ino_num = find_dir_entry_ino(to_parent_ino_num, to_name);
+    if (to_ino_num < 0 && to_ino_num != -ENOENT) return to_ino_num;
+    if (to_ino_num >= NUM_INODE) return -1;
+    if (to_ino_num < 0) {
+        int result = lock_inode(from_ino_num, true);
+        if (result < 0) return result;
+        result = rename_entry_(from_parent_ino_num, from_name, to_parent_ino_num, to_name, from_ino_num, to_ino_num, flags);
+        unlock_inode(from_ino_num);
+        return result;
+    }
+
+    int from_flag = get_inode_type(from_ino_num);
+    if (from_flag < 0) return from_flag;
+    int to_flag = get_inode_type(to_ino_num);
+    if (to_flag < 0) return to_flag;
+    int result = 0;
+    if ((from_flag == 1) == (to_flag == 1)) result = lock_inode_pair(from_ino_num, to_ino_num, true, true);
+    else {
+        int first = from_flag == 1 ? from_ino_num : to_ino_num;
+        result = lock_inode(first, true);
+        if (result >= 0) {
+            result = lock_inode(first == from_ino_num ? to_ino_num : from_ino_num, true);
+            if (result < 0) unlock_inode(first);
+        }
+    }
+    if (result < 0) return result;
+    result = rename_entry_(from_parent_ino_num, from_name, to_parent_ino_num, to_name, from_ino_num, to_ino_num, flags);
+    unlock_inode_pair(from_ino_num, to_ino_num);
+    return result;
+}
+
+// move a directory entry, no data is copied
+int rename_(const char* from_path, const char* to_path, unsigned int flags) {
+    if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) != 0) return -EINVAL; // invalid argument [4]
+    if ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE)) return -EINVAL; // invalid argument [4]
+
+    // renames between directories are serialized, so no other one moves a directory above or below another
+    // while their parents are looked up and locked
+    bool cross_dir = dir_path_len(from_path) != dir_path_len(to_path) || strncmp(from_path, to_path, dir_path_len(from_path)) != 0;
+    if (cross_dir) pthread_mutex_lock(&rename_lock);
+    char from_name[SIZE_FILENAME + 1];
+    char to_name[SIZE_FILENAME + 1];
+    int result = -ESTALE;
+    while (result == -ESTALE) {
+        unsigned int from_generation = 0, to_generation = 0;
+        int from_parent_ino_num = get_parent_inode_number(from_path, from_name, &from_generation);
+        int to_parent_ino_num = from_parent_ino_num < 0 ? from_parent_ino_num : get_parent_inode_number(to_path, to_name, &to_generation);
+        result = to_parent_ino_num;
+        // a directory cannot be moved below itself, checked before locking as the lock order takes ancestors first
+        if (result >= 0 && (is_path_below(to_path, from_path) || ((flags & RENAME_EXCHANGE) && is_path_below(from_path, to_path)))) result = -EINVAL; // invalid argument [4]
+        if (result >= 0 && from_parent_ino_num == to_parent_ino_num) result = lock_found_inode(from_parent_ino_num, from_generation, true);
+        else if (result >= 0) {
+            bool from_first = is_dir_below(to_path, from_path) || (!is_dir_below(from_path, to_path) && from_parent_ino_num < to_parent_ino_num);
+            int first = from_first ? from_parent_ino_num : to_parent_ino_num;
+            result = lock_found_inode(first, from_first ? from_generation : to_generation, true);
+            if (result >= 0) {
+                result = lock_found_inode(from_first ? to_parent_ino_num : from_parent_ino_num, from_first ? to_generation : from_generation, true);
+                if (result < 0) unlock_inode(first);
+            }
+        }
+        if (result >= 0) {
+            result = rename_children_(from_parent_ino_num, from_name, to_parent_ino_num, to_name, flags);
+            unlock_inode_pair(from_parent_ino_num, to_parent_ino_num);
+        }
+    }
+    if (cross_dir) pthread_mutex_unlock(&rename_lock);
+
+    return result < 0 ? result : 0;
+}
+
+// share a compressed cluster whole, or copy it when one of its blocks is at the maximum reference count
+int clone_cluster(int src_ino_num, int dst_ino_num, int cluster_idx) {
+    int first_blk = cluster_idx * COMPRESS_CLUSTER_BLKS;
+    long long ptrs[COMPRESS_CLUSTER_BLKS];
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+        int result = get_block_ptr(src_ino_num, first_blk + i, &ptrs[i]);
+        if (result < 0) return result;
+        if (!BLK_PTR_IS_COMPRESSED(ptrs[i]) || (i == 0 && ptrs[i] == BLK_PTR_CLUSTER_TAIL)) return -1;
+    }
+
+    int result = 0;
+    int num_counted = 0;
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS && result >= 0; i++) {
+        if (ptrs[i] == BLK_PTR_CLUSTER_TAIL) continue;
+        result = add_block_refcount(BLK_PTR_IDX(ptrs[i]), 1);
+        if (result >= 0) num_counted = i + 1;
+    }
+    if (result == -EMLINK) {
+        for (int i = 0; i < num_counted; i++) {
+            if (ptrs[i] != BLK_PTR_CLUSTER_TAIL) add_block_refcount(BLK_PTR_IDX(ptrs[i]), -1);
+        }
+        char cluster[COMPRESS_CLUSTER_SIZE];
+        result = read_cluster(src_ino_num, cluster_idx, cluster);
+        if (result < 0) return result;
+        return write_cluster(dst_ino_num, cluster_idx, cluster);
+    }
+    if (result < 0) return result;
+    for (int i = 0; i < COMPRESS_CLUSTER_BLKS; i++) {
+        result = set_block_ptr(dst_ino_num, first_blk + i, ptrs[i]);
+        if (result < 0) return result;
+        if (ptrs[i] == BLK_PTR_CLUSTER_TAIL) continue;
+        share_dirty_block(BLK_PTR_IDX(ptrs[i]));
+        stats_add(STAT_CLONE_BLOCK, 1);
+    }
+    return 0;
+}
+
+// make regular file dst_ino_num a copy of src_ino_num sharing its written data blocks, the copy costs metadata only
+// holes and unwritten blocks become holes of the copy, blocks at the maximum reference count are copied
+int clone_(int src_ino_num, int dst_ino_num) {
+    if (!(superblock.features & FEATURE_REFLINK)) return -EOPNOTSUPP; // operation not supported [4]
+    if (src_ino_num == dst_ino_num) return -EINVAL; // invalid argument [4]
+    if (get_inode_type(src_ino_num) != 0 || get_inode_type(dst_ino_num) != 0) return -EINVAL; // invalid argument [4]
+
+    off_t file_size = get_file_size(src_ino_num);
+    if (file_size < 0) return file_size;
+    int result = truncate_(dst_ino_num, 0);
+    if (result < 0) return result;
+    if (is_inline(src_ino_num)) {
+        char buffer[SIZE_BLOCK];
+        result = read_(src_ino_num, buffer, file_size, 0);
+        if (result == file_size) result = write_(dst_ino_num, buffer, file_size, 0);
+        return result == file_size ? 0 : (result < 0 ? result : -1);
+    }
+    if (is_inline(dst_ino_num)) {
+        result = uninline_(dst_ino_num);
+        if (result < 0) return result;
+    }
+
+    int num_blks = get_inode_data(src_ino_num, INODE_NUM_BLKS_OFF);
+    if (num_blks < 0) return num_blks;
+    TRACE_DEBUG(TRACE_CLONE, NULL, dst_ino_num, src_ino_num, num_blks);
+    result = init_block_slots(dst_ino_num, 0, num_blks);
+    if (result < 0) return result;
+    result = set_inode_data(dst_ino_num, num_blks, INODE_NUM_BLKS_OFF);
+    if (result < 0) return result;
+    for (int blk_idx = 0; blk_idx < num_blks; blk_idx++) {
+        long long ptr = BLK_PTR_HOLE;
+        result = get_block_ptr(src_ino_num, blk_idx, &ptr);
+        if (result < 0) return result;
+        if (BLK_PTR_IS_COMPRESSED(ptr)) {
+            if (blk_idx % COMPRESS_CLUSTER_BLKS != 0) return -1;
+            result = clone_cluster(src_ino_num, dst_ino_num, blk_idx / COMPRESS_CLUSTER_BLKS);
+            if (result < 0) return result;
+            blk_idx += COMPRESS_CLUSTER_BLKS - 1;
+            continue;
+        }
+        if (ptr == BLK_PTR_HOLE || (ptr & BLK_PTR_UNWRITTEN) != 0) continue;
+
+        result = add_block_refcount(ptr, 1);
+        if (result == -EMLINK) {
+            char blk_buff[SIZE_BLOCK];
+            if (read_block(src_ino_num, blk_idx, blk_buff) != SIZE_BLOCK) return -1;
+            if (write_block(dst_ino_num, blk_idx, blk_buff) != SIZE_BLOCK) return -1;
+            continue;
+        }
+        if (result < 0) return result;
+        result = set_block_ptr(dst_ino_num, blk_idx, ptr);
+        if (result < 0) return result;
+        // a shared block dirty in cache is written back by the fsync of either file, nothing is written here
+        share_dirty_block(ptr);
+        stats_add(STAT_CLONE_BLOCK, 1);
+    }
+
+    return set_file_size(dst_ino_num, file_size);
+}
+
+// read-only virtual files exposing runtime statistics, they are not stored on device
+#define STATS_DIR_PATH "/.toyfs"
+#define STATS_TEXT_PATH "/.toyfs/stats"
+#define STATS_JSON_PATH "/.toyfs/stats.json"
+
+bool is_stats_path(const char* path) {
+    return strcmp(path, STATS_DIR_PATH) == 0 || strcmp(path, STATS_TEXT_PATH) == 0 || strcmp(path, STATS_JSON_PATH) == 0;
+}
+
+// statistics report rendered when a virtual file is opened, so that all reads of one open see the same snapshot
+struct StatsReport {
+    int length;
+    char data[];
+};
+
+struct StatsReport* render_stats_report(const char* path) {
+    struct ThreadStats* snapshot = (struct ThreadStats*) malloc(sizeof(struct ThreadStats));
+    stats_snapshot(snapshot);
+    struct StatGauges gauges;
+    pthread_mutex_lock(&cache_lock);
+    gauges.cache_blocks = queue->count;
+    gauges.cache_capacity = queue->cache_capacity;
+    gauges.cache_dirty_blocks = num_dirty_blocks;
+    gauges.meta_cache_blocks = gauges.meta_cache_capacity = 0;
+    if (meta_queue != NULL) {
+        gauges.meta_cache_blocks = meta_queue->count;
+        gauges.meta_cache_capacity = meta_queue->cache_capacity;
     }
-    return ino_num;
+    if (bitmap_queue != NULL) {
+        gauges.meta_cache_blocks += bitmap_queue->count;
+        gauges.meta_cache_capacity += bitmap_queue->cache_capacity;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    bool json = strcmp(path, STATS_JSON_PATH) == 0;
+    int size = 16384;
+    struct StatsReport* report = NULL;
+    while (true) {
+        report = (struct StatsReport*) realloc(report, sizeof(struct StatsReport) + size);
+        if (json) report->length = stats_format_json(report->data, size, snapshot, &gauges);
+        else report->length = stats_format_text(report->data, size, snapshot, &gauges);
+        if (report->length < size) break;
+        size = report->length + 1;
+    }
+
+    free(snapshot);
+    return report;
 }
 
-static int do_getattr(const char* path, struct stat* st) {
-    printf("[FUSE CALL] getattr: path = %s\n", path);
-    int ino_num = get_inode_number(path);
-    if (ino_num < 0) return ino_num;
-    if (ino_num >= NUM_INODE) return -1;
-    
+// fill the attributes of a locked inode
+int getattr_(int ino_num, struct stat* st) {
     // st_dev is ignored [1]
     st->st_ino = ino_num; // set to inode number inside the file system [1]
     st->st_nlink = get_inode_data(ino_num, INODE_LINKS_COUNT_OFF);
@@ -684,10 +2136,10 @@ static int do_getattr(const char* path, struct stat* st) {
     // st_blksize is ignored
     st->st_blocks = get_inode_data(ino_num, INODE_NUM_BLKS_OFF); // set to number of data blocks assigned, slightly different from [2] 
     if (st->st_blocks < 0) return -1;
-    st->st_size = get_inode_data(ino_num, INODE_USED_SIZE_OFF); // same as [2]
+    st->st_size = get_file_size(ino_num); // same as [2]
     if (st->st_size < 0) return -1;
     
-    int file_flag = get_inode_data(ino_num, INODE_FLAG_OFF);
+    int file_flag = get_inode_type(ino_num);
     if (file_flag < 0) return file_flag;
     if (file_flag == 0) {
         st->st_mode = S_IFREG | 0644; // currently no mode info in inode, set to 644 for regular
@@ -702,81 +2154,172 @@ static int do_getattr(const char* path, struct stat* st) {
     return 0;
 }
 
-static int do_readdir(const char* path, void* res_buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
-    printf("[FUSE CALL] readdir: path = %s\n", path);
-
-    int ino_num = get_inode_number(path);
+static int do_getattr(const char* path, struct stat* st) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_GETATTR, 0, 0);
+    if (is_stats_path(path)) {
+        memset(st, 0, sizeof(struct stat));
+        st->st_uid = getuid();
+        st->st_gid = getgid();
+        st->st_atime = st->st_mtime = st->st_ctime = time(NULL);
+        if (strcmp(path, STATS_DIR_PATH) == 0) {
+            st->st_mode = S_IFDIR | 0555;
+            st->st_nlink = 2;
+        }
+        else {
+            st->st_mode = S_IFREG | 0444; // size is unknown until opened, reads use direct io
+            st->st_nlink = 1;
+        }
+        return 0;
+    }
+    int ino_num = lock_path(path, false);
     if (ino_num < 0) return ino_num;
-    if (ino_num >= NUM_INODE) return -1;
-    
-    if (get_inode_data(ino_num, INODE_FLAG_OFF) != 1) return -ENOTDIR; // not a directory [4]
+    int result = getattr_(ino_num, st);
+    unlock_inode(ino_num);
+    return result;
+}
+
+#define READDIR_BATCH_BLKS 8 // directory blocks read per batch by readdir
 
-    filler(res_buf, ".", NULL, 0); // current Directory
-    filler(res_buf, "..", NULL, 0); // parent Directory
+// list a locked directory from resume cookie offset
+int readdir_(int ino_num, void* res_buf, fuse_fill_dir_t filler, off_t offset) {
+    if (get_inode_type(ino_num) != 1) return -ENOTDIR; // not a directory [4]
+    // offsets are resume cookies: 1 after ".", 2 after "..", 3 + i after the i-th directory entry
+    if (offset < 1 && filler(res_buf, ".", NULL, 1)) return 0; // current Directory
+    if (offset < 2 && filler(res_buf, "..", NULL, 2)) return 0; // parent Directory
 
-    int file_size = get_inode_data(ino_num, INODE_USED_SIZE_OFF);
+    int file_size = get_file_size(ino_num);
     if (file_size < 0 || file_size % SIZE_DIR_ITEM != 0) return -1;
-    char* buffer = (char*) malloc(file_size);
-    int read_bytes = read_(ino_num, buffer, file_size, 0);
-    if (read_bytes != file_size) return -1;
-    
+
+    // stream the directory a batch of blocks at a time, prefetching the inodes listed in each batch
+    char buffer[READDIR_BATCH_BLKS * SIZE_BLOCK];
+    int sub_ino_nums[READDIR_BATCH_BLKS * SIZE_BLOCK / SIZE_DIR_ITEM];
     char filename[SIZE_FILENAME + 1];
     memset(filename, 0, SIZE_FILENAME + 1);
-    int cur_offset = 0;
+    off_t cur_offset = offset < 2 ? 0 : (offset - 2) * SIZE_DIR_ITEM;
     while (cur_offset < file_size) {
-        int sub_ino_num = -1;
-        memcpy(&sub_ino_num, buffer + cur_offset, sizeof(sub_ino_num));
-        memcpy(filename, buffer + cur_offset + sizeof(sub_ino_num), SIZE_FILENAME);
-        if (sub_ino_num >= 0) filler(res_buf, filename, NULL, 0);
-        cur_offset += SIZE_DIR_ITEM;
+        int len = READDIR_BATCH_BLKS * SIZE_BLOCK - cur_offset % SIZE_BLOCK;
+        if (len > file_size - cur_offset) len = file_size - cur_offset;
+        int read_bytes = read_(ino_num, buffer, len, cur_offset);
+        if (read_bytes != len) return -1;
+
+        int num_entries = 0;
+        for (int pos = 0; pos < len; pos += SIZE_DIR_ITEM) {
+            int sub_ino_num = -1;
+            memcpy(&sub_ino_num, buffer + pos, sizeof(sub_ino_num));
+            if (sub_ino_num >= 0 && sub_ino_num < NUM_INODE) sub_ino_nums[num_entries++] = sub_ino_num;
+        }
+        int result = prefetch_inodes(sub_ino_nums, num_entries);
+        if (result < 0) return result;
+
+        for (int pos = 0; pos < len; pos += SIZE_DIR_ITEM) {
+            int sub_ino_num = -1;
+            memcpy(&sub_ino_num, buffer + pos, sizeof(sub_ino_num));
+            memcpy(filename, buffer + pos + sizeof(sub_ino_num), SIZE_FILENAME);
+            if (sub_ino_num < 0 || sub_ino_num >= NUM_INODE) continue;
+            // the following getattr of each entry resolves its path from the dentry cache
+            insert_dentry(ino_num, filename, sub_ino_num);
+            struct stat st;
+            memset(&st, 0, sizeof(struct stat));
+            st.st_ino = sub_ino_num;
+            int file_flag = get_inode_type(sub_ino_num);
+            st.st_mode = file_flag == 1 ? S_IFDIR : file_flag == 2 ? S_IFLNK : S_IFREG;
+            if (filler(res_buf, filename, &st, 3 + (cur_offset + pos) / SIZE_DIR_ITEM)) return 0; // buffer full
+        }
+        cur_offset += len;
     }
 
-    free(buffer);
     return 0;
 }
 
-static int do_read(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
-    printf("[FUSE CALL] read: path = %s, size = %ld, offset = %ld\n", path, size, offset);
-    int ino_num = get_inode_number(path);
+static int do_readdir(const char* path, void* res_buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_READDIR, 0, 0);
+    if (strcmp(path, STATS_DIR_PATH) == 0) {
+        filler(res_buf, ".", NULL, 0);
+        filler(res_buf, "..", NULL, 0);
+        filler(res_buf, STATS_TEXT_PATH + strlen(STATS_DIR_PATH) + 1, NULL, 0);
+        filler(res_buf, STATS_JSON_PATH + strlen(STATS_DIR_PATH) + 1, NULL, 0);
+        return 0;
+    }
+
+    int ino_num = lock_path(path, false);
     if (ino_num < 0) return ino_num;
-    return read_(ino_num, buffer, size, offset);
+    int result = readdir_(ino_num, res_buf, filler, offset);
+    unlock_inode(ino_num);
+    return result;
 }
 
-static int do_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* info) {
-    printf("[FUSE CALL] write: path = %s, size = %ld, offset = %ld\n", path, size, offset);
-    int ino_num = get_inode_number(path);
+// the handle keeps the inode number + 1 of the directory, 0 for the statistics directory
+static int do_opendir(const char* path, struct fuse_file_info* fi) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_OPENDIR, 0, 0);
+    fi->fh = 0;
+    if (strcmp(path, STATS_DIR_PATH) == 0) return 0;
+
+    int ino_num = lock_path(path, false);
     if (ino_num < 0) return ino_num;
-    return write_(ino_num, buffer, size, offset);
+    int result = get_inode_type(ino_num) != 1 ? -ENOTDIR : 0; // not a directory [4]
+    if (result == 0) {
+        add_dir_open_count(ino_num, 1);
+        fi->fh = ino_num + 1;
+    }
+    unlock_inode(ino_num);
+    return result;
 }
 
-static int do_mkdir(const char* path, mode_t mode) {
-    printf("[FUSE CALL] mkdir: path = %s\n", path);
+static int do_releasedir(const char* path, struct fuse_file_info* fi) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_RELEASEDIR, 0, 0);
+    if (fi->fh > 0) add_dir_open_count(fi->fh - 1, -1);
+    return 0;
+}
 
-    // get new file and parent info
-    int plen = strlen(path);
-    int pos = plen - 1;
-    while(path[pos] != '/') pos--;
-    if (pos < 0) return -ENOENT; // no such file or directory [4]
-    int file_name_len = plen - 1 - pos;
-    if (file_name_len <= 0) return -ENOENT; // no such file or directory [4]
-    if (file_name_len > SIZE_FILENAME) return -ENAMETOOLONG; // file name too long [4]
-    char file_name[SIZE_FILENAME + 1];
-    memset(file_name, 0, SIZE_FILENAME + 1);
-    memcpy(file_name, path + pos + 1, file_name_len);
-    if (pos == 0) pos = 1; // root path 
-    char* parent_name = (char*) malloc(pos + 1);
-    memset(parent_name, 0, pos + 1);
-    memcpy(parent_name, path, pos);
+static int do_open(const char* path, struct fuse_file_info* fi) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_OPEN, 0, 0);
+    if (!is_stats_path(path)) return 0; // regular files are looked up by path on every call
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES; // permission denied [4]
 
-    int parent_ino_num = get_inode_number(parent_name);
-    free(parent_name);
-    if (parent_ino_num < 0) return parent_ino_num;
-    if (parent_ino_num >= NUM_INODE) return -1;
-    if (get_inode_data(parent_ino_num, INODE_FLAG_OFF) != 1) return -1; // parent need to be a directory
+    fi->direct_io = 1; // report size is unknown to getattr
+    fi->fh = (uint64_t) (uintptr_t) render_stats_report(path);
+    return 0;
+}
+
+static int do_release(const char* path, struct fuse_file_info* fi) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_RELEASE, 0, 0);
+    if (is_stats_path(path)) free((struct StatsReport*) (uintptr_t) fi->fh);
+    return 0;
+}
+
+static int do_read(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_READ, size, offset);
+    if (is_stats_path(path)) {
+        struct StatsReport* report = (fi != NULL) ? (struct StatsReport*) (uintptr_t) fi->fh : NULL;
+        if (report == NULL) return -EISDIR; // is a directory [4]
+        if (offset >= report->length) return 0;
+        int read_size = (size < report->length - offset) ? size : report->length - offset;
+        memcpy(buffer, report->data + offset, read_size);
+        return read_size;
+    }
+    int ino_num = lock_path(path, false);
+    if (ino_num < 0) return ino_num;
+    int result = read_(ino_num, buffer, size, offset);
+    unlock_inode(ino_num);
+    if (result == -1) return -EIO; // input/output error [4], e.g. a block not matching its checksum
+    return result;
+}
+
+static int do_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* info) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_WRITE, size, offset);
+    int ino_num = lock_path(path, true);
+    if (ino_num < 0) return ino_num;
+    int result = write_(ino_num, buffer, size, offset);
+    unlock_inode(ino_num);
+    return result;
+}
+
+// create directory file_name in a locked directory
+int mkdir_(int parent_ino_num, const char* file_name) {
     int file_ino_num = find_dir_entry_ino(parent_ino_num, file_name);
     if (file_ino_num >= 0) return -EEXIST; // file exists [4]
 
-    // file info
+    // file info, the new inode is not locked as no other operation finds it before its entry is added
     file_ino_num = get_new_inode();
     if (file_ino_num < 0) return file_ino_num;
     if (file_ino_num >= NUM_INODE) return -1;
@@ -786,7 +2329,7 @@ static int do_mkdir(const char* path, mode_t mode) {
     if (result < 0) return result;
     result = set_inode_data(file_ino_num, 2, INODE_LINKS_COUNT_OFF);  // direcotry has another "." file pointing to itself
     if (result < 0) return result;
-    result = set_inode_data(file_ino_num, 0, INODE_USED_SIZE_OFF);
+    result = set_file_size(file_ino_num, 0);
     if (result < 0) return result;
     
     // parent directory info
@@ -794,41 +2337,22 @@ static int do_mkdir(const char* path, mode_t mode) {
     if (links_count < 0) return links_count;
     result = set_inode_data(parent_ino_num, links_count + 1, INODE_LINKS_COUNT_OFF);
     if (result < 0) return result;
-    char new_dir_entry[SIZE_DIR_ITEM];
-    memset(new_dir_entry, 0, SIZE_DIR_ITEM);
-    memcpy(new_dir_entry, &file_ino_num, sizeof(file_ino_num));
-    memcpy(new_dir_entry + sizeof(file_ino_num), file_name, SIZE_FILENAME);
-    int file_size = get_inode_data(parent_ino_num, INODE_USED_SIZE_OFF);
-    if (file_size < 0) return -1;
-    int write_bytes = write_(parent_ino_num, new_dir_entry, SIZE_DIR_ITEM, file_size);
-    
-    return write_bytes == SIZE_DIR_ITEM ? 0 : -1;
+    return add_dir_entry(parent_ino_num, file_name, file_ino_num);
 }
 
-static int do_mknod(const char* path, mode_t mode, dev_t rdev) {
-    printf("[FUSE CALL] mknod: path = %s\n", path);
+static int do_mkdir(const char* path, mode_t mode) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_MKDIR, 0, 0);
 
-    // get new file and parent info
-    int plen = strlen(path);
-    int pos = plen - 1;
-    while(path[pos] != '/') pos--;
-    if (pos < 0) return -ENOENT; // no such file or directory [4]
-    int file_name_len = plen - 1 - pos;
-    if (file_name_len <= 0) return -ENOENT; // no such file or directory [4]
-    if (file_name_len > SIZE_FILENAME) return -ENAMETOOLONG; // file name too long [4]
     char file_name[SIZE_FILENAME + 1];
-    memset(file_name, 0, SIZE_FILENAME + 1);
-    memcpy(file_name, path + pos + 1, file_name_len);
-    if (pos == 0) pos = 1; // root path 
-    char* parent_name = (char*) malloc(pos + 1);
-    memset(parent_name, 0, pos + 1);
-    memcpy(parent_name, path, pos);
-
-    int parent_ino_num = get_inode_number(parent_name);
-    free(parent_name);
+    int parent_ino_num = lock_parent_dir(path, file_name);
     if (parent_ino_num < 0) return parent_ino_num;
-    if (parent_ino_num >= NUM_INODE) return -1;
-    if (get_inode_data(parent_ino_num, INODE_FLAG_OFF) != 1) return -1; // parent need to be a directory
+    int result = mkdir_(parent_ino_num, file_name);
+    unlock_inode(parent_ino_num);
+    return result;
+}
+
+// create regular file file_name in a locked directory
+int mknod_(int parent_ino_num, const char* file_name) {
     int file_ino_num = find_dir_entry_ino(parent_ino_num, file_name);
     if (file_ino_num >= 0) return -EEXIST; // file exists [4]
 
@@ -836,110 +2360,86 @@ static int do_mknod(const char* path, mode_t mode, dev_t rdev) {
     file_ino_num = get_new_inode();
     if (file_ino_num < 0) return file_ino_num;
     if (file_ino_num >= NUM_INODE) return -1;
-    int result = set_inode_data(file_ino_num, 0, INODE_FLAG_OFF); // regular
+    int flag_bits = new_file_flag_bits(file_ino_num);
+    if (flag_bits < 0) return flag_bits;
+    if (superblock.features & FEATURE_COMPRESS) flag_bits |= INODE_FLAG_COMPRESS;
+    int result = set_inode_data(file_ino_num, 0 | flag_bits, INODE_FLAG_OFF); // regular
     if (result < 0) return result;
     result = set_inode_data(file_ino_num, 0, INODE_NUM_BLKS_OFF);
     if (result < 0) return result;
     result = set_inode_data(file_ino_num, 1, INODE_LINKS_COUNT_OFF);
     if (result < 0) return result;
-    result = set_inode_data(file_ino_num, 0, INODE_USED_SIZE_OFF);
+    result = set_file_size(file_ino_num, 0);
     if (result < 0) return result;
     
     // parent directory info
-    char new_dir_entry[SIZE_DIR_ITEM];
-    memset(new_dir_entry, 0, SIZE_DIR_ITEM);
-    memcpy(new_dir_entry, &file_ino_num, sizeof(file_ino_num));
-    memcpy(new_dir_entry + sizeof(file_ino_num), file_name, SIZE_FILENAME);
-    int file_size = get_inode_data(parent_ino_num, INODE_USED_SIZE_OFF);
-    if (file_size < 0) return -1;
-    int write_bytes = write_(parent_ino_num, new_dir_entry, SIZE_DIR_ITEM, file_size);
-
-    return write_bytes == SIZE_DIR_ITEM ? 0 : -1;
+    return add_dir_entry(parent_ino_num, file_name, file_ino_num);
 }
 
-static int do_unlink(const char* path) {
-    printf("[FUSE CALL] unlink: path = %s\n", path);
+static int do_mknod(const char* path, mode_t mode, dev_t rdev) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_MKNOD, 0, 0);
 
-    // get delete file and parent info
-    int plen = strlen(path);
-    int pos = plen - 1;
-    while(path[pos] != '/') pos--;
-    if (pos < 0) return -ENOENT; // no such file or directory [4]
-    int file_name_len = plen - 1 - pos;
-    if (file_name_len <= 0) return -ENOENT; // no such file or directory [4]
-    if (file_name_len > SIZE_FILENAME) return -ENAMETOOLONG; // file name too long [4]
     char file_name[SIZE_FILENAME + 1];
-    memset(file_name, 0, SIZE_FILENAME + 1);
-    memcpy(file_name, path + pos + 1, file_name_len);
-    if (pos == 0) pos = 1; // root path 
-    char* parent_name = (char*) malloc(pos + 1);
-    memset(parent_name, 0, pos + 1);
-    memcpy(parent_name, path, pos);
-
-    int parent_ino_num = get_inode_number(parent_name);
-    free(parent_name);
+    int parent_ino_num = lock_parent_dir(path, file_name);
     if (parent_ino_num < 0) return parent_ino_num;
-    if (parent_ino_num >= NUM_INODE) return -1;
-    if (get_inode_data(parent_ino_num, INODE_FLAG_OFF) != 1) return -1; // parent need to be a directory
+    int result = mknod_(parent_ino_num, file_name);
+    unlock_inode(parent_ino_num);
+    return result;
+}
+
+// remove entry file_name of a locked directory, and the file with its last link
+int unlink_(int parent_ino_num, const char* file_name) {
     int file_ino_num = find_dir_entry_ino(parent_ino_num, file_name);
     if (file_ino_num < 0) return file_ino_num;
     if (file_ino_num >= NUM_INODE) return -1;
     
     // remove file
-    if (get_inode_data(file_ino_num, INODE_FLAG_OFF) == 1) return -EISDIR; // is a directory [4]
+    if (get_inode_type(file_ino_num) == 1) return -EISDIR; // is a directory [4]
+    drop_dentry(parent_ino_num, file_name); // before the inode is freed, see free_inode
+    int result = lock_inode(file_ino_num, true);
+    if (result < 0) return result;
     int links_count = get_inode_data(file_ino_num, INODE_LINKS_COUNT_OFF);
-    if (links_count < 0) return links_count;
-    if (links_count < 1) return -1;
-    if (links_count > 1) {
-        int result = set_inode_data(file_ino_num, links_count - 1, INODE_LINKS_COUNT_OFF);
-        if (result < 0) return result;
-    }
+    if (links_count < 1) result = links_count < 0 ? links_count : -1;
+    else if (links_count > 1) result = set_inode_data(file_ino_num, links_count - 1, INODE_LINKS_COUNT_OFF);
     else {
-        int result = remove_file_blocks(file_ino_num);
-        if (result < 0) return result;
+        result = remove_file_blocks(file_ino_num);
         // free inode
-        result = set_imap_bit(file_ino_num, 0);
-        if (result < 0) return result;
+        if (result >= 0) result = free_inode(file_ino_num);
     }
+    unlock_inode(file_ino_num);
+    if (result < 0) return result;
 
     // remove parent directory entry
-    int result = remove_dir_entry(parent_ino_num, file_name);
+    result = remove_dir_entry(parent_ino_num, file_name);
     if (result < 0) return result;
 
     return 0;
 }
 
-static int do_rmdir(const char* path) {
-    printf("[FUSE CALL] rmdir: path = %s\n", path);
+static int do_unlink(const char* path) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_UNLINK, 0, 0);
 
-    // get delete file and parent info
-    int plen = strlen(path);
-    int pos = plen - 1;
-    while(path[pos] != '/') pos--;
-    if (pos < 0) return -ENOENT; // no such file or directory [4]
-    int file_name_len = plen - 1 - pos;
-    if (file_name_len <= 0) return -ENOENT; // no such file or directory [4]
-    if (file_name_len > SIZE_FILENAME) return -ENAMETOOLONG; // file name too long [4]
     char file_name[SIZE_FILENAME + 1];
-    memset(file_name, 0, SIZE_FILENAME + 1);
-    memcpy(file_name, path + pos + 1, file_name_len);
-    if (pos == 0) pos = 1; // root path 
-    char* parent_name = (char*) malloc(pos + 1);
-    memset(parent_name, 0, pos + 1);
-    memcpy(parent_name, path, pos);
-
-    int parent_ino_num = get_inode_number(parent_name);
-    free(parent_name);
+    int parent_ino_num = lock_parent_dir(path, file_name);
     if (parent_ino_num < 0) return parent_ino_num;
-    if (parent_ino_num >= NUM_INODE) return -1;
-    if (get_inode_data(parent_ino_num, INODE_FLAG_OFF) != 1) return -1; // parent need to be a directory
+    int result = unlink_(parent_ino_num, file_name);
+    unlock_inode(parent_ino_num);
+    return result;
+}
+
+// remove subdirectory file_name of a locked directory with everything below it
+int rmdir_entry_(int parent_ino_num, const char* file_name) {
     int file_ino_num = find_dir_entry_ino(parent_ino_num, file_name);
     if (file_ino_num < 0) return file_ino_num;
     if (file_ino_num >= NUM_INODE) return -1;
 
     // remove directory
-    if (get_inode_data(file_ino_num, INODE_FLAG_OFF) != 1) return -ENOTDIR; // not a directory [4]
-    int result = rmdir_(file_ino_num);
+    if (get_inode_type(file_ino_num) != 1) return -ENOTDIR; // not a directory [4]
+    drop_dentry(parent_ino_num, file_name); // before the inode is freed, see free_inode
+    int result = lock_inode(file_ino_num, true);
+    if (result < 0) return result;
+    result = rmdir_(file_ino_num);
+    unlock_inode(file_ino_num);
     if (result < 0) return result;
 
     // remove parent directory entry
@@ -953,36 +2453,26 @@ static int do_rmdir(const char* path) {
     return 0;
 }
 
-static int do_link(const char* target_path, const char* path) {
-    printf("[FUSE CALL] link: target_path = %s, path = %s\n", target_path, path);
-
-    // target file info
-    int target_ino_num = get_inode_number(target_path);
-    if (target_ino_num < 0) return target_ino_num;
-    if (target_ino_num >= NUM_INODE) return -1;
-    if (get_inode_data(target_ino_num, INODE_FLAG_OFF) == 1) return -EPERM; // operation not permitted [4]: cannot hard link to directory
+static int do_rmdir(const char* path) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_RMDIR, 0, 0);
 
-    // get new file and parent info
-    int plen = strlen(path);
-    int pos = plen - 1;
-    while(path[pos] != '/') pos--;
-    if (pos < 0) return -ENOENT; // no such file or directory [4]
-    int file_name_len = plen - 1 - pos;
-    if (file_name_len <= 0) return -ENOENT; // no such file or directory [4]
-    if (file_name_len > SIZE_FILENAME) return -ENAMETOOLONG; // file name too long [4]
     char file_name[SIZE_FILENAME + 1];
-    memset(file_name, 0, SIZE_FILENAME + 1);
-    memcpy(file_name, path + pos + 1, file_name_len);
-    if (pos == 0) pos = 1; // root path 
-    char* parent_name = (char*) malloc(pos + 1);
-    memset(parent_name, 0, pos + 1);
-    memcpy(parent_name, path, pos);
-
-    int parent_ino_num = get_inode_number(parent_name);
-    free(parent_name);
+    int parent_ino_num = lock_parent_dir(path, file_name);
     if (parent_ino_num < 0) return parent_ino_num;
-    if (parent_ino_num >= NUM_INODE) return -1;
-    if (get_inode_data(parent_ino_num, INODE_FLAG_OFF) != 1) return -1; // parent need to be a directory
+    int result = rmdir_entry_(parent_ino_num, file_name);
+    unlock_inode(parent_ino_num);
+    return result;
+}
+
+static int do_rename(const char* from_path, const char* to_path) {
+    TRACE_INFO(TRACE_FUSE_CALL, from_path, STAT_OP_RENAME, 0, 0);
+    if (is_stats_path(from_path) || is_stats_path(to_path)) return -EACCES; // permission denied [4]
+
+    return rename_(from_path, to_path, 0);
+}
+
+// add entry file_name for a locked file to a locked directory
+int link_(int parent_ino_num, const char* file_name, int target_ino_num) {
     int file_ino_num = find_dir_entry_ino(parent_ino_num, file_name);
     if (file_ino_num >= 0 && file_ino_num < NUM_INODE) return -EEXIST; // file exists [4]
     if (file_ino_num >= NUM_INODE) return -1;
@@ -995,41 +2485,38 @@ static int do_link(const char* target_path, const char* path) {
     if (result < 0) return result;    
 
     // parent directory info
-    char new_dir_entry[SIZE_DIR_ITEM];
-    memset(new_dir_entry, 0, SIZE_DIR_ITEM);
-    memcpy(new_dir_entry, &file_ino_num, sizeof(file_ino_num));
-    memcpy(new_dir_entry + sizeof(file_ino_num), file_name, SIZE_FILENAME);
-    int file_size = get_inode_data(parent_ino_num, INODE_USED_SIZE_OFF);
-    if (file_size < 0) return -1;
-    int write_bytes = write_(parent_ino_num, new_dir_entry, SIZE_DIR_ITEM, file_size);
-    
-    return write_bytes == SIZE_DIR_ITEM ? 0 : -1;
+    return add_dir_entry(parent_ino_num, file_name, file_ino_num);
 }
 
-static int do_symlink(const char* target_path, const char* path) {
-    printf("[FUSE CALL] symlink: target_path = %s, path = %s\n", target_path, path);
-
-    // get new file and parent info
-    int plen = strlen(path);
-    int pos = plen - 1;
-    while(path[pos] != '/') pos--;
-    if (pos < 0) return -ENOENT; // no such file or directory [4]
-    int file_name_len = plen - 1 - pos;
-    if (file_name_len <= 0) return -ENOENT; // no such file or directory [4]
-    if (file_name_len > SIZE_FILENAME) return -ENAMETOOLONG; // file name too long [4]
-    char file_name[SIZE_FILENAME + 1];
-    memset(file_name, 0, SIZE_FILENAME + 1);
-    memcpy(file_name, path + pos + 1, file_name_len);
-    if (pos == 0) pos = 1; // root path 
-    char* parent_name = (char*) malloc(pos + 1);
-    memset(parent_name, 0, pos + 1);
-    memcpy(parent_name, path, pos);
+static int do_link(const char* target_path, const char* path) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_LINK, 0, 0);
+
+    // target file info, looked up before any lock is taken
+    int result = -ESTALE;
+    while (result == -ESTALE) {
+        unsigned int target_generation = 0;
+        int target_ino_num = get_inode_number(target_path, &target_generation);
+        if (target_ino_num == -ESTALE) continue;
+        if (target_ino_num < 0) return target_ino_num;
+        if (target_ino_num >= NUM_INODE) return -1;
+        if (get_inode_type(target_ino_num) == 1) return -EPERM; // operation not permitted [4]: cannot hard link to directory
+
+        // the directory before the file in the lock order
+        char file_name[SIZE_FILENAME + 1];
+        int parent_ino_num = lock_parent_dir(path, file_name);
+        if (parent_ino_num < 0) return parent_ino_num;
+        result = lock_found_inode(target_ino_num, target_generation, true);
+        if (result >= 0) {
+            result = link_(parent_ino_num, file_name, target_ino_num);
+            unlock_inode(target_ino_num);
+        }
+        unlock_inode(parent_ino_num);
+    }
+    return result;
+}
 
-    int parent_ino_num = get_inode_number(parent_name);
-    free(parent_name);
-    if (parent_ino_num < 0) return parent_ino_num;
-    if (parent_ino_num >= NUM_INODE) return -1;
-    if (get_inode_data(parent_ino_num, INODE_FLAG_OFF) != 1) return -1; // parent need to be a directory
+// create soft link file_name to target_path in a locked directory
+int symlink_(int parent_ino_num, const char* file_name, const char* target_path) {
     int file_ino_num = find_dir_entry_ino(parent_ino_num, file_name);
     if (file_ino_num >= 0) return -EEXIST; // file exists [4]
 
@@ -1037,39 +2524,40 @@ static int do_symlink(const char* target_path, const char* path) {
     file_ino_num = get_new_inode();
     if (file_ino_num < 0) return file_ino_num;
     if (file_ino_num >= NUM_INODE) return -1;
-    int result = set_inode_data(file_ino_num, 2, INODE_FLAG_OFF); // soft link
+    int flag_bits = new_file_flag_bits(file_ino_num);
+    if (flag_bits < 0) return flag_bits;
+    int result = set_inode_data(file_ino_num, 2 | flag_bits, INODE_FLAG_OFF); // soft link
     if (result < 0) return result;
     result = set_inode_data(file_ino_num, 0, INODE_NUM_BLKS_OFF);
     if (result < 0) return result;
     result = set_inode_data(file_ino_num, 1, INODE_LINKS_COUNT_OFF);
     if (result < 0) return result;
-    result = set_inode_data(file_ino_num, 0, INODE_USED_SIZE_OFF);
+    result = set_file_size(file_ino_num, 0);
     if (result < 0) return result;
     int write_bytes = write_(file_ino_num, target_path, strlen(target_path), 0);
     if (write_bytes != strlen(target_path)) return -1;
     
     // parent directory info
-    char new_dir_entry[SIZE_DIR_ITEM];
-    memset(new_dir_entry, 0, SIZE_DIR_ITEM);
-    memcpy(new_dir_entry, &file_ino_num, sizeof(file_ino_num));
-    memcpy(new_dir_entry + sizeof(file_ino_num), file_name, SIZE_FILENAME);
-    int file_size = get_inode_data(parent_ino_num, INODE_USED_SIZE_OFF);
-    if (file_size < 0) return -1;
-    write_bytes = write_(parent_ino_num, new_dir_entry, SIZE_DIR_ITEM, file_size);
-    return write_bytes == SIZE_DIR_ITEM ? 0 : -1;
+    return add_dir_entry(parent_ino_num, file_name, file_ino_num);
 }
 
-static int do_readlink(const char* path, char* res_buf, size_t buf_len) {
-    printf("[FUSE CALL] readlink: path = %s, buf_len = %lu\n", path, buf_len);
+static int do_symlink(const char* target_path, const char* path) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_SYMLINK, 0, 0);
 
-    int ino_num = get_inode_number(path);
-    if (ino_num < 0) return ino_num;
-    if (ino_num >= NUM_INODE) return -1;
-    
-    if (get_inode_data(ino_num, INODE_FLAG_OFF) != 2) return -1; // not a link
+    char file_name[SIZE_FILENAME + 1];
+    int parent_ino_num = lock_parent_dir(path, file_name);
+    if (parent_ino_num < 0) return parent_ino_num;
+    int result = symlink_(parent_ino_num, file_name, target_path);
+    unlock_inode(parent_ino_num);
+    return result;
+}
+
+// copy the target of a locked soft link
+int readlink_(int ino_num, char* res_buf, size_t buf_len) {
+    if (get_inode_type(ino_num) != 2) return -1; // not a link
 
     memset(res_buf, 0, buf_len);
-    int file_size = get_inode_data(ino_num, INODE_USED_SIZE_OFF);
+    int file_size = get_file_size(ino_num);
     if (file_size < 0) return file_size;
     int read_size = (file_size < buf_len -1) ? file_size : (buf_len - 1); // buf_len contains a null end for string
     int read_bytes = read_(ino_num, res_buf, read_size, 0);
@@ -1078,30 +2566,187 @@ static int do_readlink(const char* path, char* res_buf, size_t buf_len) {
     return 0;
 }
 
+static int do_readlink(const char* path, char* res_buf, size_t buf_len) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_READLINK, buf_len, 0);
+
+    int ino_num = lock_path(path, false);
+    if (ino_num < 0) return ino_num;
+    int result = readlink_(ino_num, res_buf, buf_len);
+    unlock_inode(ino_num);
+    return result;
+}
+
+static int do_truncate(const char* path, off_t size) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_TRUNCATE, size, 0);
+    if (is_stats_path(path)) return -EACCES; // permission denied [4]
+
+    int ino_num = lock_path(path, true);
+    if (ino_num < 0) return ino_num;
+    int result = get_inode_type(ino_num);
+    if (result == 1) result = -EISDIR; // is a directory [4]
+    else if (result > 0) result = -EINVAL; // invalid argument [4]
+    else if (result == 0) result = truncate_(ino_num, size);
+    unlock_inode(ino_num);
+    return result;
+}
+
+static int do_ftruncate(const char* path, off_t size, struct fuse_file_info* fi) {
+    return do_truncate(path, size); // files are looked up by path, see do_open
+}
+
+static int do_fallocate(const char* path, int mode, off_t offset, off_t len, struct fuse_file_info* fi) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_FALLOCATE, len, offset);
+    if (is_stats_path(path)) return -EACCES; // permission denied [4]
+
+    int ino_num = lock_path(path, true);
+    if (ino_num < 0) return ino_num;
+    int result = get_inode_type(ino_num);
+    if (result == 1) result = -EISDIR; // is a directory [4]
+    else if (result > 0) result = -ENODEV; // no such device [4]
+    else if (result == 0) result = fallocate_(ino_num, mode, offset, len);
+    unlock_inode(ino_num);
+    return result;
+}
+
 static int do_utimens(const char* a, const struct timespec tv[2]) {
     return 0; // an empty function to prevent prompt in 'touch file'
 }
 
+static int do_flush(const char* path, struct fuse_file_info* fi) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_FLUSH, 0, 0);
+    return 0; // dirty blocks live in the shared block cache, nothing is buffered per file handle
+}
+
+static int do_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_FSYNC, datasync, 0);
+
+    int ino_num = lock_path(path, false);
+    if (ino_num < 0) return ino_num;
+    int result = sync_inode(ino_num, datasync);
+    unlock_inode(ino_num);
+    return result < 0 ? -EIO : 0; // input/output error [4]
+}
+
+static int do_fsyncdir(const char* path, int datasync, struct fuse_file_info* fi) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_FSYNCDIR, datasync, 0);
+
+    int ino_num = lock_path(path, false);
+    if (ino_num < 0) return ino_num;
+    int result = get_inode_type(ino_num) != 1 ? -ENOTDIR : 0; // not a directory [4]
+    if (result == 0) result = sync_inode(ino_num, datasync) < 0 ? -EIO : 0; // input/output error [4], directory entries are data blocks of the directory inode
+    unlock_inode(ino_num);
+    return result;
+}
+
+static int do_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags, void* data) {
+    TRACE_INFO(TRACE_FUSE_CALL, path, STAT_OP_IOCTL, cmd, 0);
+    if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS; // function not implemented [4]
+    if (is_stats_path(path)) return -ENOTTY; // inappropriate ioctl for device [4]
+    if ((unsigned int) cmd == TOYFS_IOC_SEEK) {
+        struct ToyfsSeekArgs* args = (struct ToyfsSeekArgs*) data;
+        int ino_num = lock_path(path, false);
+        if (ino_num < 0) return ino_num;
+        int flag = get_inode_type(ino_num);
+        off_t result = flag < 0 ? flag : flag == 1 ? -EISDIR : seek_(ino_num, args->offset, args->whence); // is a directory [4]
+        unlock_inode(ino_num);
+        if (result < 0) return result;
+        args->offset = result;
+        return 0;
+    }
+    if ((unsigned int) cmd != TOYFS_IOC_CLONE) return -ENOTTY; // inappropriate ioctl for device [4]
+
+    struct ToyfsCloneArgs* args = (struct ToyfsCloneArgs*) data;
+    args->src_path[TOYFS_IOC_PATH_MAX - 1] = 0;
+    if (is_stats_path(args->src_path)) return -EACCES; // permission denied [4]
+    int result = -ESTALE;
+    while (result == -ESTALE) {
+        unsigned int src_generation = 0, dst_generation = 0;
+        int src_ino_num = get_inode_number(args->src_path, &src_generation);
+        int dst_ino_num = src_ino_num < 0 ? src_ino_num : get_inode_number(path, &dst_generation);
+        if (dst_ino_num == -ESTALE) continue;
+        if (dst_ino_num < 0) return dst_ino_num;
+        if (src_ino_num >= NUM_INODE || dst_ino_num >= NUM_INODE) return -1;
+        int src_flag = get_inode_type(src_ino_num);
+        if (src_flag < 0) return src_flag;
+        if (src_flag == 1) return -EISDIR; // is a directory [4]
+        if (get_inode_type(dst_ino_num) != 0) return -EINVAL; // invalid argument [4]
+
+        // two regular files, locked by inode number
+        result = lock_inode_pair(src_ino_num, dst_ino_num, false, true);
+        if (result < 0) return result;
+        // either may have been freed and its number reused before it was locked, see lock_found_inode
+        bool stale = get_imap_bit(src_ino_num) != 1 || get_imap_bit(dst_ino_num) != 1 || inode_generation(src_ino_num) != src_generation || inode_generation(dst_ino_num) != dst_generation;
+        result = stale ? -ESTALE : clone_(src_ino_num, dst_ino_num);
+        unlock_inode_pair(src_ino_num, dst_ino_num);
+        if (stale) stats_add(STAT_LOOKUP_RETRY, 1);
+    }
+    return result;
+}
+
+// fuse entry points, timed for the latency histograms
+#define TIMED_CALL(op, call) \
+    uint64_t start = stats_now_ns(); \
+    int result = call; \
+    stats_record(op, stats_now_ns() - start); \
+    return result;
+
+static int timed_getattr(const char* path, struct stat* st) { TIMED_CALL(STAT_OP_GETATTR, do_getattr(path, st)) }
+static int timed_readdir(const char* path, void* res_buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_READDIR, do_readdir(path, res_buf, filler, offset, fi)) }
+static int timed_opendir(const char* path, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_OPENDIR, do_opendir(path, fi)) }
+static int timed_releasedir(const char* path, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_RELEASEDIR, do_releasedir(path, fi)) }
+static int timed_open(const char* path, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_OPEN, do_open(path, fi)) }
+static int timed_release(const char* path, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_RELEASE, do_release(path, fi)) }
+static int timed_read(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_READ, do_read(path, buffer, size, offset, fi)) }
+static int timed_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_WRITE, do_write(path, buffer, size, offset, fi)) }
+static int timed_mkdir(const char* path, mode_t mode) { TIMED_CALL(STAT_OP_MKDIR, do_mkdir(path, mode)) }
+static int timed_mknod(const char* path, mode_t mode, dev_t rdev) { TIMED_CALL(STAT_OP_MKNOD, do_mknod(path, mode, rdev)) }
+static int timed_unlink(const char* path) { TIMED_CALL(STAT_OP_UNLINK, do_unlink(path)) }
+static int timed_rmdir(const char* path) { TIMED_CALL(STAT_OP_RMDIR, do_rmdir(path)) }
+static int timed_rename(const char* from_path, const char* to_path) { TIMED_CALL(STAT_OP_RENAME, do_rename(from_path, to_path)) }
+static int timed_link(const char* target_path, const char* path) { TIMED_CALL(STAT_OP_LINK, do_link(target_path, path)) }
+static int timed_symlink(const char* target_path, const char* path) { TIMED_CALL(STAT_OP_SYMLINK, do_symlink(target_path, path)) }
+static int timed_readlink(const char* path, char* res_buf, size_t buf_len) { TIMED_CALL(STAT_OP_READLINK, do_readlink(path, res_buf, buf_len)) }
+static int timed_truncate(const char* path, off_t size) { TIMED_CALL(STAT_OP_TRUNCATE, do_truncate(path, size)) }
+static int timed_ftruncate(const char* path, off_t size, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_TRUNCATE, do_ftruncate(path, size, fi)) }
+static int timed_fallocate(const char* path, int mode, off_t offset, off_t len, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_FALLOCATE, do_fallocate(path, mode, offset, len, fi)) }
+static int timed_utimens(const char* path, const struct timespec tv[2]) { TIMED_CALL(STAT_OP_UTIMENS, do_utimens(path, tv)) }
+static int timed_flush(const char* path, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_FLUSH, do_flush(path, fi)) }
+static int timed_fsync(const char* path, int datasync, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_FSYNC, do_fsync(path, datasync, fi)) }
+static int timed_fsyncdir(const char* path, int datasync, struct fuse_file_info* fi) { TIMED_CALL(STAT_OP_FSYNCDIR, do_fsyncdir(path, datasync, fi)) }
+static int timed_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags, void* data) { TIMED_CALL(STAT_OP_IOCTL, do_ioctl(path, cmd, arg, fi, flags, data)) }
+
 static struct fuse_operations operations = {
-    .getattr = do_getattr,
-    .readdir = do_readdir,
-    .read = do_read,
-    .write = do_write,
-    .mkdir = do_mkdir,
-    .mknod = do_mknod,
-    .unlink = do_unlink,
-    .rmdir = do_rmdir,
-    .link = do_link,
-    .symlink = do_symlink,
-    .readlink = do_readlink,
-    .utimens = do_utimens,
+    .getattr = timed_getattr,
+    .opendir = timed_opendir,
+    .readdir = timed_readdir,
+    .releasedir = timed_releasedir,
+    .open = timed_open,
+    .release = timed_release,
+    .read = timed_read,
+    .write = timed_write,
+    .mkdir = timed_mkdir,
+    .mknod = timed_mknod,
+    .unlink = timed_unlink,
+    .rmdir = timed_rmdir,
+    .rename = timed_rename,
+    .link = timed_link,
+    .symlink = timed_symlink,
+    .readlink = timed_readlink,
+    .utimens = timed_utimens,
+    .truncate = timed_truncate,
+    .ftruncate = timed_ftruncate,
+    .fallocate = timed_fallocate,
+    .flush = timed_flush,
+    .fsync = timed_fsync,
+    .fsyncdir = timed_fsyncdir,
+    .ioctl = timed_ioctl,
 };
 
 void* back_ground_write_back_thread(void* arg)   {  
 	while(true) {
 		sleep(30); // write back every 30 seconds
 		printf ("[BACK GROUND THREAD] synchronizing dirty blocks ...\n");
-        write_dirty_blocks_back(queue);
+        write_dirty_blocks_back();
         printf ("[BACK GROUND THREAD] synchronization done\n");
 	}	
 }
@@ -1109,30 +2754,73 @@ void* back_ground_write_back_thread(void* arg)   {
 pthread_t tid;
 
 int main(int argc, char* argv[]) {
+    // take --device=[path] out of fuse arguments, e.g. a sparse image file for testing and benchmarks
+    // and --clean-frames=[count], the least recently used cache frames the cache cleaner keeps clean, 0 for none
+    // and --dirty-ratio=[percent], --dirty-background-ratio=[percent], the dirty block thresholds of the cache
+    // and --meta-cache-blocks=[count], the cache size of metadata blocks, --pin-bitmaps to keep all bitmap blocks cached
+    unsigned clean_frames = 1024;
+    unsigned meta_cache_blks = 8192;
+    bool pin_bitmaps = false;
+    int fuse_argc = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "--device=", strlen("--device=")) == 0) device_path = argv[i] + strlen("--device=");
+        else if (strncmp(argv[i], "--clean-frames=", strlen("--clean-frames=")) == 0) clean_frames = strtoul(argv[i] + strlen("--clean-frames="), NULL, 10);
+        else if (strncmp(argv[i], "--dirty-ratio=", strlen("--dirty-ratio=")) == 0) dirty_ratio = strtoul(argv[i] + strlen("--dirty-ratio="), NULL, 10);
+        else if (strncmp(argv[i], "--dirty-background-ratio=", strlen("--dirty-background-ratio=")) == 0) dirty_background_ratio = strtoul(argv[i] + strlen("--dirty-background-ratio="), NULL, 10);
+        else if (strncmp(argv[i], "--meta-cache-blocks=", strlen("--meta-cache-blocks=")) == 0) meta_cache_blks = strtoul(argv[i] + strlen("--meta-cache-blocks="), NULL, 10);
+        else if (strcmp(argv[i], "--pin-bitmaps") == 0) pin_bitmaps = true;
+        else argv[fuse_argc++] = argv[i];
+    }
+    if (dirty_ratio < 1 || dirty_ratio > 100) dirty_ratio = 20;
+    if (dirty_background_ratio >= dirty_ratio) dirty_background_ratio = dirty_ratio / 2;
+    argc = fuse_argc;
+
     queue = create_cache_queue(83568); // 10446 pages = 83568 blocks = 42786816 bytes
     hash = create_hash_table(100); // ensure conflics count in one hash bucket is less than 83568 / 4
+    dirty_table = create_dirty_table(1024);
 
     int result = get_superblock();
     if (result < 0) return -1;
+    if (meta_cache_blks < 64) meta_cache_blks = 64;
+    result = create_meta_caches(meta_cache_blks, pin_bitmaps);
+    if (result < 0) return -1;
+
+    if (TOYFS_TRACE_LEVEL > TRACE_LEVEL_NONE) {
+        const char* trace_path = getenv("TOYFS_TRACE_FILE");
+        if (trace_path == NULL) trace_path = "toyfs.trace";
+        if (trace_start(trace_path) < 0) printf("[TRACE] failed to open trace file %s\n", trace_path);
+        else printf("[TRACE] tracing at level %s to %s\n", trace_level_names[TOYFS_TRACE_LEVEL], trace_path);
+    }
 
 	int error = pthread_create(&tid, NULL, back_ground_write_back_thread, NULL);
 	if(error != 0) {
         printf("[BACK GROUND THREAD] background thread failed to create: [%s]\n", strerror(error));
 	}
+    if (clean_frames > queue->cache_capacity / 4) clean_frames = queue->cache_capacity / 4;
+    error = start_cache_cleaner(clean_frames);
+    if (error < 0) printf("[CACHE CLEANER] cache cleaner failed to start: [%s]\n", strerror(-error));
 
     result = fuse_main(argc, argv, &operations, NULL);
     if (result < 0) return result;
 
     printf("[SIGINT HANDLE] free cache space and write back dirty blocks ...\n");
-    while(!is_queue_empty(queue)) dequeue(queue, hash);
+    stop_cache_cleaner();
+    write_dirty_blocks_back();
+    destroy_meta_caches();
+    while (!is_queue_empty(queue) && dequeue(queue, hash) == 0);
     free(queue);
     free(hash->buckets);
     free(hash);
-
-    printf("[SUMMARY] total disk read request = %d\n", num_read_requests);
-    printf("[SUMMARY] total disk write request = %d\n", num_write_requests);
-    printf("[SUMMARY] total disk read request without cache (theoretically) = %d\n", num_read_requests_without_cache);
-    printf("[SUMMARY] total disk write request without cache (theoretically) = %d\n", num_write_requests_without_cache);
+    clear_dirty_table(dirty_table);
+    free(dirty_table->buckets);
+    free(dirty_table);
+
+    uint64_t trace_dropped = trace_stop();
+    if (TOYFS_TRACE_LEVEL > TRACE_LEVEL_NONE) printf("[SUMMARY] trace records dropped = %llu\n", (unsigned long long) trace_dropped);
+    printf("[SUMMARY] total disk read request = %llu\n", (unsigned long long) stats_op_count(STAT_OP_DEV_READ));
+    printf("[SUMMARY] total disk write request = %llu\n", (unsigned long long) stats_op_count(STAT_OP_DEV_WRITE));
+    printf("[SUMMARY] total disk read request without cache (theoretically) = %llu\n", (unsigned long long) stats_counter_total(STAT_BLOCK_READ_NO_CACHE));
+    printf("[SUMMARY] total disk write request without cache (theoretically) = %llu\n", (unsigned long long) stats_counter_total(STAT_BLOCK_WRITE_NO_CACHE));
 
     return 0;
 }
@@ -0,0 +1,86 @@
+/*
+Copy a file on a mounted toyfs by sharing its data blocks, later writes to either file copy the blocks they touch
+
+Usage: ./toyfs-clone [source file] [destination file]
+*/
+#include "toyfs_ioctl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+// find the mount point holding path by walking up while the device stays the same
+int find_mount_root(const char* path, char* root) {
+    struct stat st;
+    if (stat(path, &st) < 0) return -errno;
+    strncpy(root, path, PATH_MAX - 1);
+    root[PATH_MAX - 1] = 0;
+    while (strcmp(root, "/") != 0) {
+        char parent[PATH_MAX];
+        strcpy(parent, root);
+        char* dir = dirname(parent);
+        struct stat parent_st;
+        if (stat(dir, &parent_st) < 0) return -errno;
+        if (parent_st.st_dev != st.st_dev) break;
+        memmove(root, dir, strlen(dir) + 1);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        printf("Usage: %s source destination\n", argv[0]);
+        return 1;
+    }
+
+    char src_path[PATH_MAX];
+    if (realpath(argv[1], src_path) == NULL) {
+        perror("source file");
+        return 1;
+    }
+    int fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("destination file");
+        return 1;
+    }
+    char dst_path[PATH_MAX];
+    if (realpath(argv[2], dst_path) == NULL) {
+        perror("destination file");
+        close(fd);
+        return 1;
+    }
+
+    // toyfs looks files up by path from its root, both files have to be under the same mount point
+    char src_root[PATH_MAX], dst_root[PATH_MAX];
+    int result = find_mount_root(src_path, src_root);
+    if (result == 0) result = find_mount_root(dst_path, dst_root);
+    if (result == 0 && strcmp(src_root, dst_root) != 0) result = -EXDEV; // invalid cross-device link
+    if (result < 0) {
+        printf("%s: %s\n", argv[1], strerror(-result));
+        close(fd);
+        return 1;
+    }
+
+    struct ToyfsCloneArgs args;
+    memset(&args, 0, sizeof(args));
+    const char* relative = strcmp(src_root, "/") == 0 ? src_path : src_path + strlen(src_root);
+    if (strlen(relative) >= TOYFS_IOC_PATH_MAX) {
+        printf("%s: %s\n", argv[1], strerror(ENAMETOOLONG));
+        close(fd);
+        return 1;
+    }
+    strcpy(args.src_path, relative);
+    if (ioctl(fd, TOYFS_IOC_CLONE, &args) < 0) {
+        perror("clone");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ioctl commands of toyfs, shared by toyfs and the toyfs-clone tool
+
+FUSE 2 has no copy_file_range or FICLONE, the clone is requested on the destination file instead
+FUSE 2 does not pass lseek to file systems either, SEEK_DATA and SEEK_HOLE are answered through an ioctl
+*/
+#ifndef __TOYFS_IOCTL_H_
+#define __TOYFS_IOCTL_H_
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define TOYFS_IOC_PATH_MAX 512
+
+// make the open file a copy of src_path sharing its data blocks, src_path is relative to the mount point
+struct ToyfsCloneArgs {
+    char src_path[TOYFS_IOC_PATH_MAX];
+};
+
+#define TOYFS_IOC_CLONE _IOW('t', 1, struct ToyfsCloneArgs)
+
+// offset of the next data or hole at or after offset, whence is SEEK_DATA or SEEK_HOLE, fails with ENXIO past the end
+struct ToyfsSeekArgs {
+    long long offset;
+    int whence;
+};
+
+#define TOYFS_IOC_SEEK _IOWR('t', 2, struct ToyfsSeekArgs)
+
+// lseek(2) finding data and holes of files on toyfs through TOYFS_IOC_SEEK, plain lseek on other file systems
+static inline off_t toyfs_lseek(int fd, off_t offset, int whence) {
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) return lseek(fd, offset, whence);
+    struct ToyfsSeekArgs args = { offset, whence };
+    if (ioctl(fd, TOYFS_IOC_SEEK, &args) == 0) return lseek(fd, args.offset, SEEK_SET);
+    if (errno != ENOTTY) return -1;
+    return lseek(fd, offset, whence);
+}
+
+#endif
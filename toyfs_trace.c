@@ -0,0 +1,57 @@
+/*
+Decoder for binary trace files written by toyfs built with `make trace`
+
+Usage: ./toyfs-trace [trace file]
+*/
+#include "trace.h"
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+int main(int argc, char* argv[]) {
+    const char* path = argc > 1 ? argv[1] : "toyfs.trace";
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("open trace file failed");
+        return 1;
+    }
+
+    char magic[sizeof(TRACE_FILE_MAGIC)];
+    int magic_len = strlen(TRACE_FILE_MAGIC);
+    if (fread(magic, 1, magic_len, file) != magic_len || memcmp(magic, TRACE_FILE_MAGIC, magic_len) != 0) {
+        printf("%s is not a toyfs trace file\n", path);
+        fclose(file);
+        return 1;
+    }
+
+    // records of different threads are drained in batches, times are printed relative to the first record read
+    struct TraceRecord record;
+    uint64_t first_time_ns = 0;
+    uint64_t num_records = 0;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (num_records++ == 0) first_time_ns = record.time_ns;
+        int64_t relative_ns = (int64_t) (record.time_ns - first_time_ns);
+        const char* level = record.level <= TRACE_LEVEL_DEBUG ? trace_level_names[record.level] : "?";
+        if (record.event >= NUM_TRACE_EVENTS) {
+            printf("%14.3f us [T%u] %-5s unknown event %u\n", relative_ns / 1000.0, record.thread_id, level, record.event);
+            continue;
+        }
+
+        const struct TraceEventInfo* info = &trace_events[record.event];
+        printf("%14.3f us [T%u] %-5s %s:", relative_ns / 1000.0, record.thread_id, level, info->name);
+        if (record.str[0] != 0) printf(" \"%.*s\"", TRACE_STR_SIZE, record.str);
+        for (int i = 0; i < 3; i++) {
+            if (info->arg_names[i] == NULL) continue;
+            if (record.event == TRACE_FUSE_CALL && i == 0 && record.args[0] >= 0 && record.args[0] < NUM_STAT_OPS) {
+                printf(" %s = %s", info->arg_names[i], stat_op_names[record.args[0]]);
+            }
+            else printf(" %s = %" PRId64, info->arg_names[i], record.args[i]);
+        }
+        printf("\n");
+    }
+
+    printf("%" PRIu64 " records\n", num_records);
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,251 @@
+/*
+Binary tracing: fixed-size records in per-thread lock-free ring buffers,
+drained to a trace file by a background thread and printed by toyfs-trace
+
+Trace points are compiled out unless TOYFS_TRACE_LEVEL is defined above TRACE_LEVEL_NONE,
+e.g. `make trace` builds with TOYFS_TRACE_LEVEL=TRACE_LEVEL_DEBUG
+*/
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define TRACE_LEVEL_NONE 0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO 2
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef TOYFS_TRACE_LEVEL
+#define TOYFS_TRACE_LEVEL TRACE_LEVEL_NONE
+#endif
+
+const char* trace_level_names[] = { "NONE", "ERROR", "INFO", "DEBUG" };
+
+// trace events, names of the three integer arguments are listed in trace_events
+enum TraceEvent {
+    TRACE_FUSE_CALL, // string: path
+    TRACE_READ_BLOCK,
+    TRACE_WRITE_BLOCK,
+    TRACE_ASSIGN_BLOCK,
+    TRACE_ASSIGN_PTR_BLOCK,
+    TRACE_RECLAIM_BLOCK,
+    TRACE_RECLAIM_PTR_BLOCK,
+    TRACE_BAD_BLOCK_INDEX,
+    TRACE_NO_SPACE, // string: "inode" or "block"
+    TRACE_BAD_LINKS_COUNT,
+    TRACE_TRUNCATE,
+    TRACE_PUNCH_HOLE,
+    TRACE_RMDIR,
+    TRACE_COMPACT_DIR,
+    TRACE_COW_BLOCK,
+    TRACE_CLONE,
+    TRACE_COMPRESS_CLUSTER,
+    TRACE_DEDUP_BLOCK,
+    NUM_TRACE_EVENTS
+};
+
+struct TraceEventInfo {
+    const char* name;
+    const char* arg_names[3]; // NULL for unused arguments
+};
+
+const struct TraceEventInfo trace_events[NUM_TRACE_EVENTS] = {
+    { "fuse_call", { "op", "size", "offset" } },
+    { "read_block", { "ino_num", "blk_idx", "data_reg_idx" } },
+    { "write_block", { "ino_num", "blk_idx", "data_reg_idx" } },
+    { "assign_block", { "ino_num", "blk_idx", "data_reg_idx" } },
+    { "assign_ptr_block", { "ino_num", "blk_idx", "data_reg_idx" } },
+    { "reclaim_block", { "ino_num", "blk_idx", "data_reg_idx" } },
+    { "reclaim_ptr_block", { "ino_num", "blk_idx", "data_reg_idx" } },
+    { "bad_block_index", { "ino_num", "blk_idx", NULL } },
+    { "no_space", { NULL, NULL, NULL } },
+    { "bad_links_count", { "ino_num", "links_count", NULL } },
+    { "truncate", { "ino_num", "num_blks", "new_num_blks" } },
+    { "punch_hole", { "ino_num", "from_blk", "to_blk" } },
+    { "rmdir", { "ino_num", "num_entries", "num_subdirs" } },
+    { "compact_dir", { "ino_num", "num_entries", "new_num_entries" } },
+    { "cow_block", { "ino_num", "blk_idx", "data_reg_idx" } },
+    { "clone", { "ino_num", "src_ino_num", "num_blks" } },
+    { "compress_cluster", { "ino_num", "cluster_idx", "num_blks" } },
+    { "dedup_block", { "ino_num", "blk_idx", "data_reg_idx" } },
+};
+
+#define TRACE_STR_SIZE 24
+
+// one trace record, 64 bytes
+struct TraceRecord {
+    uint64_t time_ns; // CLOCK_MONOTONIC
+    int64_t args[3];
+    uint32_t thread_id; // registration order of the recording thread
+    uint16_t event;
+    uint8_t level;
+    uint8_t reserved;
+    char str[TRACE_STR_SIZE]; // tail of a path, nul terminated
+};
+
+#define TRACE_FILE_MAGIC "toyfs_trace_v1\n"
+
+#if TOYFS_TRACE_LEVEL > TRACE_LEVEL_NONE
+
+#define TRACE_RING_SIZE 8192 // records per thread, power of 2
+#define TRACE_DRAIN_INTERVAL_US 10000
+
+// single producer (owner thread) single consumer (drain thread) ring buffer
+struct TraceRing {
+    struct TraceRecord records[TRACE_RING_SIZE];
+    uint64_t head; // next slot to write, only advanced by producer
+    uint64_t tail; // next slot to read, only advanced by consumer
+    uint64_t dropped; // records lost because ring was full
+    uint32_t thread_id;
+    struct TraceRing* next; // next ring in registry
+};
+
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // protects ring registry
+struct TraceRing* trace_rings = NULL;
+uint32_t trace_num_threads = 0;
+__thread struct TraceRing* my_trace_ring = NULL;
+FILE* trace_file = NULL;
+volatile bool trace_running = false;
+pthread_t trace_tid;
+
+struct TraceRing* get_trace_ring() {
+    if (my_trace_ring != NULL) return my_trace_ring;
+
+    struct TraceRing* ring = (struct TraceRing*) calloc(1, sizeof(struct TraceRing));
+    pthread_mutex_lock(&trace_lock);
+    ring->thread_id = trace_num_threads++;
+    ring->next = trace_rings;
+    trace_rings = ring;
+    pthread_mutex_unlock(&trace_lock);
+    my_trace_ring = ring;
+
+    return my_trace_ring;
+}
+
+void trace_record(int level, int event, const char* str, int64_t arg0, int64_t arg1, int64_t arg2) {
+    struct TraceRing* ring = get_trace_ring();
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct TraceRecord* record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    record->time_ns = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->args[2] = arg2;
+    record->thread_id = ring->thread_id;
+    record->event = event;
+    record->level = level;
+    record->reserved = 0;
+    record->str[0] = 0;
+    if (str != NULL) {
+        size_t len = strlen(str);
+        const char* tail = len < TRACE_STR_SIZE ? str : str + len - (TRACE_STR_SIZE - 1);
+        strncpy(record->str, tail, TRACE_STR_SIZE - 1);
+        record->str[TRACE_STR_SIZE - 1] = 0;
+    }
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// copy all published records to trace file
+void trace_drain() {
+    pthread_mutex_lock(&trace_lock);
+    for (struct TraceRing* ring = trace_rings; ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        while (tail < head) {
+            uint64_t start = tail & (TRACE_RING_SIZE - 1);
+            uint64_t count = head - tail;
+            if (count > TRACE_RING_SIZE - start) count = TRACE_RING_SIZE - start; // stop at wrap around
+            fwrite(&ring->records[start], sizeof(struct TraceRecord), count, trace_file);
+            tail += count;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    fflush(trace_file);
+}
+
+void* trace_drain_thread(void* arg) {
+    while (trace_running) {
+        usleep(TRACE_DRAIN_INTERVAL_US);
+        trace_drain();
+    }
+    return NULL;
+}
+
+// open trace file and start drain thread, return 0 on success
+int trace_start(const char* path) {
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL) return -1;
+    fwrite(TRACE_FILE_MAGIC, 1, strlen(TRACE_FILE_MAGIC), trace_file);
+
+    trace_running = true;
+    int error = pthread_create(&trace_tid, NULL, trace_drain_thread, NULL);
+    if (error != 0) {
+        trace_running = false;
+        fclose(trace_file);
+        trace_file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// stop drain thread and write remaining records, return number of dropped records
+uint64_t trace_stop() {
+    if (trace_file == NULL) return 0;
+    trace_running = false;
+    pthread_join(trace_tid, NULL);
+    trace_drain();
+    fclose(trace_file);
+    trace_file = NULL;
+
+    uint64_t dropped = 0;
+    pthread_mutex_lock(&trace_lock);
+    for (struct TraceRing* ring = trace_rings; ring != NULL; ring = ring->next) dropped += ring->dropped;
+    pthread_mutex_unlock(&trace_lock);
+    return dropped;
+}
+
+#define TRACE_RECORD(level, event, str, arg0, arg1, arg2) trace_record(level, event, str, arg0, arg1, arg2)
+
+#else
+
+int trace_start(const char* path) { return 0; }
+uint64_t trace_stop() { return 0; }
+
+#define TRACE_RECORD(level, event, str, arg0, arg1, arg2) ((void) 0)
+
+#endif
+
+#if TOYFS_TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(event, str, arg0, arg1, arg2) TRACE_RECORD(TRACE_LEVEL_ERROR, event, str, arg0, arg1, arg2)
+#else
+#define TRACE_ERROR(event, str, arg0, arg1, arg2) ((void) 0)
+#endif
+
+#if TOYFS_TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(event, str, arg0, arg1, arg2) TRACE_RECORD(TRACE_LEVEL_INFO, event, str, arg0, arg1, arg2)
+#else
+#define TRACE_INFO(event, str, arg0, arg1, arg2) ((void) 0)
+#endif
+
+#if TOYFS_TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(event, str, arg0, arg1, arg2) TRACE_RECORD(TRACE_LEVEL_DEBUG, event, str, arg0, arg1, arg2)
+#else
+#define TRACE_DEBUG(event, str, arg0, arg1, arg2) ((void) 0)
+#endif
+
+#endif
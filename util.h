@@ -7,56 +7,47 @@ Data structures and utilities for accessing toyfs
 #ifndef __UTIL_H_
 #define __UTIL_H_
 
+#include "layout.h"
+#include "mkfs.h"
 #include "cache.h"
 #include <string.h>
+#include <limits.h>
+
+// metadata blocks are cached apart from data blocks when meta_queue exists, so that file data traffic does not
+// evict the bitmaps and inode table blocks every operation needs, pinned bitmaps have a cache of their own
+struct CacheQueue* queue_of(long long block_id) {
+    if (bitmap_queue != NULL && block_id >= IMAP_START_BLK && block_id < INODE_TABLE_START_BLK) return bitmap_queue;
+    if (meta_queue != NULL && block_id < DATA_REG_START_BLK) return meta_queue;
+    return queue;
+}
 
-unsigned int num_read_requests_without_cache = 0;
-unsigned int num_write_requests_without_cache = 0;
-
-#define SIZE_BLOCK 512 // 512 bytes per block
-
-const char* magic_string = "zz_toyfs"; // magic string to identify toyfs
-
-struct SuperBlock {
-    unsigned int size_ibmap;
-    unsigned int size_dbmap;
-    unsigned int size_inode;
-    unsigned int size_filename;
-    unsigned int root_inum;
-    unsigned int num_disk_ptrs_per_inode;
-} superblock;
-
-#define SIZE_IBMAP ((int)superblock.size_ibmap)
-#define SIZE_DBMAP ((int)superblock.size_dbmap)
-#define SIZE_INODE ((int)superblock.size_inode)
-#define SIZE_FILENAME ((int)superblock.size_filename)
-#define ROOT_INUM ((int)superblock.root_inum)
-#define NUM_DISK_PTRS_PER_INODE ((int)superblock.num_disk_ptrs_per_inode)
-
-#define NUM_INODE (SIZE_IBMAP * 8)
-#define NUM_DATA_BLKS (SIZE_DBMAP * 8)
-
-#define NUM_BLKS_SUPERBLOCK 8 // set to 1 page = 8 blocks
-#define NUM_BLKS_IMAP (SIZE_IBMAP / SIZE_BLOCK)
-#define NUM_BLKS_DMAP (SIZE_DBMAP / SIZE_BLOCK)
-#define NUM_BLKS_INODE_TABLE (SIZE_INODE * NUM_INODE / SIZE_BLOCK)
+struct Hash* hash_of(long long block_id) {
+    if (bitmap_queue != NULL && block_id >= IMAP_START_BLK && block_id < INODE_TABLE_START_BLK) return bitmap_hash;
+    if (meta_queue != NULL && block_id < DATA_REG_START_BLK) return meta_hash;
+    return hash;
+}
 
-#define SUPERBLOCK_START_BLK 0
-#define IMAP_START_BLK NUM_BLKS_SUPERBLOCK
-#define DMAP_START_BLK (IMAP_START_BLK + NUM_BLKS_IMAP)
-#define INODE_TABLE_START_BLK (DMAP_START_BLK + NUM_BLKS_DMAP)
-#define DATA_REG_START_BLK (INODE_TABLE_START_BLK + NUM_BLKS_INODE_TABLE)
+// get_block_cache for metadata blocks, under cache_lock
+struct CacheNode* get_meta_block_cache(long long block_id) {
+    return get_block_cache(queue_of(block_id), hash_of(block_id), block_id);
+}
 
-int initialize_block(int block_id) {
+// fill a block with byte value, the old content is not read from device
+int initialize_block(long long block_id, int value) {
     pthread_mutex_lock(&cache_lock);
 
-    struct CacheNode* block_cache = get_block_cache(queue, hash, block_id);
-    if (block_cache == NULL) return -1;
-    memset(block_cache->block_ptr, 0, SIZE_BLOCK);
+    struct CacheNode* block_cache = fetch_block_cache(queue_of(block_id), hash_of(block_id), block_id, false);
+    if (block_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&block_cache->content_lock);
+    memset(block_cache->block_ptr, value, SIZE_BLOCK);
+    pthread_rwlock_unlock(&block_cache->content_lock);
 
-    block_cache->dirty = true;
+    mark_block_dirty(dirty_table, block_cache, DIRTY_OWNER_NONE);
 
-    num_write_requests_without_cache++;
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
     pthread_mutex_unlock(&cache_lock);
 
     return 0;
@@ -65,11 +56,14 @@ int initialize_block(int block_id) {
 int set_imap_bit(int ino_num, int bit) {
     pthread_mutex_lock(&cache_lock);
     
-    int block_id = IMAP_START_BLK + ino_num / (SIZE_BLOCK * 8);
+    long long block_id = IMAP_START_BLK + ino_num / (SIZE_BLOCK * 8);
     int byte_offset = (ino_num % (SIZE_BLOCK * 8)) / 8;
     int bit_offset = (ino_num % (SIZE_BLOCK * 8)) % 8;
-    struct CacheNode* imap_cache = get_block_cache(queue, hash, block_id);
-    if (imap_cache == NULL) return -1;
+    struct CacheNode* imap_cache = get_meta_block_cache(block_id);
+    if (imap_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
     char byte_mask = 1 << bit_offset;
     char byte;
     memcpy(&byte, imap_cache->block_ptr + byte_offset, sizeof(byte));
@@ -77,9 +71,10 @@ int set_imap_bit(int ino_num, int bit) {
     else byte = byte & (~byte_mask);
     memcpy(imap_cache->block_ptr + byte_offset, &byte, sizeof(byte));
 
-    imap_cache->dirty = true;
+    mark_block_dirty(dirty_table, imap_cache, DIRTY_OWNER_ALLOC);
+    if (!bit) stats_add(STAT_FREE_INODE, 1);
 
-    num_write_requests_without_cache++;
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
     pthread_mutex_unlock(&cache_lock);
 
     return 0;
@@ -88,31 +83,64 @@ int set_imap_bit(int ino_num, int bit) {
 int get_imap_bit(int ino_num) {
     pthread_mutex_lock(&cache_lock);
 
-    int block_id = IMAP_START_BLK + ino_num / (SIZE_BLOCK * 8);
+    long long block_id = IMAP_START_BLK + ino_num / (SIZE_BLOCK * 8);
     int byte_offset = (ino_num % (SIZE_BLOCK * 8)) / 8;
     int bit_offset = (ino_num % (SIZE_BLOCK * 8)) % 8;
-    struct CacheNode* imap_cache = get_block_cache(queue, hash, block_id);
-    if (imap_cache == NULL) return -1;
+    struct CacheNode* imap_cache = get_meta_block_cache(block_id);
+    if (imap_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
     char byte_mask = 1 << bit_offset;
     char byte;
     memcpy(&byte, imap_cache->block_ptr + byte_offset, sizeof(byte));
     
-    num_read_requests_without_cache++;
+    stats_add(STAT_BLOCK_READ_NO_CACHE, 1);
     pthread_mutex_unlock(&cache_lock);
     
     if ((byte & byte_mask) != 0) return 1;
     return 0;
 }
 
+// find a free inode from inode hint on, wrapping around, and mark it used under the same lock
+// so that concurrent creates never get the same inode, return -ENOSPC if no inode is free
+int alloc_inode(int hint, int* scanned) {
+    pthread_mutex_lock(&cache_lock);
+
+    int bits_per_blk = SIZE_BLOCK * 8;
+    for (*scanned = 0; *scanned < NUM_INODE; (*scanned)++) {
+        int ino_num = (hint + *scanned) % NUM_INODE;
+        struct CacheNode* imap_cache = get_meta_block_cache(IMAP_START_BLK + ino_num / bits_per_blk);
+        if (imap_cache == NULL) {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        int bit = ino_num % bits_per_blk;
+        if ((imap_cache->block_ptr[bit / 8] & (1 << (bit % 8))) != 0) continue;
+        imap_cache->block_ptr[bit / 8] |= 1 << (bit % 8);
+        mark_block_dirty(dirty_table, imap_cache, DIRTY_OWNER_ALLOC);
+
+        stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
+        pthread_mutex_unlock(&cache_lock);
+        (*scanned)++;
+        return ino_num;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    return -ENOSPC; // no space left on device [4]
+}
 
-int set_dmap_bit(int data_reg_idx, int bit) {
+int set_dmap_bit(long long data_reg_idx, int bit) {
     pthread_mutex_lock(&cache_lock);
 
-    int block_id = DMAP_START_BLK + data_reg_idx / (SIZE_BLOCK * 8);
+    long long block_id = DMAP_START_BLK + data_reg_idx / (SIZE_BLOCK * 8);
     int byte_offset = (data_reg_idx % (SIZE_BLOCK * 8)) / 8;
     int bit_offset = (data_reg_idx % (SIZE_BLOCK * 8)) % 8;
-    struct CacheNode* dmap_cache = get_block_cache(queue, hash, block_id);
-    if (dmap_cache == NULL) return -1;
+    struct CacheNode* dmap_cache = get_meta_block_cache(block_id);
+    if (dmap_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
     char byte_mask = 1 << bit_offset;
     char byte;
     memcpy(&byte, dmap_cache->block_ptr + byte_offset, sizeof(byte));
@@ -120,55 +148,384 @@ int set_dmap_bit(int data_reg_idx, int bit) {
     else byte = byte & (~byte_mask);
     memcpy(dmap_cache->block_ptr + byte_offset, &byte, sizeof(byte));
 
-    dmap_cache->dirty = true;
+    mark_block_dirty(dirty_table, dmap_cache, DIRTY_OWNER_ALLOC);
+    if (!bit) stats_add(STAT_FREE_BLOCK, 1);
 
-    num_write_requests_without_cache++;
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
     pthread_mutex_unlock(&cache_lock);
 
     return 0;
 }
 
-int get_dmap_bit(int data_reg_idx) {
+int get_dmap_bit(long long data_reg_idx) {
     pthread_mutex_lock(&cache_lock);
 
-    int block_id = DMAP_START_BLK + data_reg_idx / (SIZE_BLOCK * 8);
+    long long block_id = DMAP_START_BLK + data_reg_idx / (SIZE_BLOCK * 8);
     int byte_offset = (data_reg_idx % (SIZE_BLOCK * 8)) / 8;
     int bit_offset = (data_reg_idx % (SIZE_BLOCK * 8)) % 8;
-    struct CacheNode* dmap_cache = get_block_cache(queue, hash, block_id);
-    if (dmap_cache == NULL) return -1;
+    struct CacheNode* dmap_cache = get_meta_block_cache(block_id);
+    if (dmap_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
     char byte_mask = 1 << bit_offset;
     char byte;
     memcpy(&byte, dmap_cache->block_ptr + byte_offset, sizeof(byte));
     
-    num_read_requests_without_cache++;
+    stats_add(STAT_BLOCK_READ_NO_CACHE, 1);
     pthread_mutex_unlock(&cache_lock);
 
     if ((byte & byte_mask) != 0) return 1;
     return 0;
 }
 
-// inode data offset:
-//     0 for flag, 1 for number blocks assigned
-//     2 for used size, 3 for links count
-//     > 3 for block pointers
-#define INODE_FLAG_OFF 0
-#define INODE_NUM_BLKS_OFF 1
-#define INODE_USED_SIZE_OFF 2
-#define INODE_LINKS_COUNT_OFF 3
-#define INODE_BLK_PTR_OFF 4
+// allocate a run of up to want contiguous free data blocks, searching from data block hint and wrapping around
+// full bitmap bytes are skipped whole, the run is marked allocated under the same lock
+// return first data block of the run with its length in *got, -ENOSPC if no block is free
+long long alloc_data_blocks(long long hint, int want, int* got) {
+    pthread_mutex_lock(&cache_lock);
+
+    int bits_per_blk = SIZE_BLOCK * 8;
+    long long scanned = 0;
+    long long start = -1;
+    long long data_reg_idx = (hint >= 0 && hint < NUM_DATA_BLKS) ? hint : 0;
+    struct CacheNode* dmap_cache = NULL;
+    long long cached_block_id = -1;
+    while (scanned < NUM_DATA_BLKS) {
+        long long block_id = DMAP_START_BLK + data_reg_idx / bits_per_blk;
+        if (block_id != cached_block_id) {
+            dmap_cache = get_meta_block_cache(block_id);
+            if (dmap_cache == NULL) {
+                pthread_mutex_unlock(&cache_lock);
+                return -1;
+            }
+            cached_block_id = block_id;
+        }
+        int bit = data_reg_idx % bits_per_blk;
+        unsigned char byte = dmap_cache->block_ptr[bit / 8];
+        int step = 1;
+        if (byte == 0xff && bit % 8 == 0) step = 8;
+        else if ((byte & (1 << (bit % 8))) == 0) {
+            start = data_reg_idx;
+            break;
+        }
+        scanned += step;
+        data_reg_idx += step;
+        if (data_reg_idx >= NUM_DATA_BLKS) data_reg_idx = 0;
+    }
+    stats_add(STAT_ALLOC_BITS_SCANNED, scanned + 1);
+    if (start < 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return -ENOSPC; // no space left on device [4]
+    }
+
+    // extend the run up to want blocks, without wrapping around
+    int run = 0;
+    while (run < want && start + run < NUM_DATA_BLKS) {
+        long long block_id = DMAP_START_BLK + (start + run) / bits_per_blk;
+        if (block_id != cached_block_id) {
+            dmap_cache = get_meta_block_cache(block_id);
+            if (dmap_cache == NULL) break;
+            cached_block_id = block_id;
+        }
+        int bit = (start + run) % bits_per_blk;
+        if ((dmap_cache->block_ptr[bit / 8] & (1 << (bit % 8))) != 0) break;
+        dmap_cache->block_ptr[bit / 8] |= 1 << (bit % 8);
+        mark_block_dirty(dirty_table, dmap_cache, DIRTY_OWNER_ALLOC);
+        run++;
+    }
+    stats_add(STAT_ALLOC_BLOCK, run);
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
+
+    pthread_mutex_unlock(&cache_lock);
+
+    *got = run;
+    return start;
+}
+
+int compare_long_long(const void* a, const void* b) {
+    long long x = *(const long long*) a, y = *(const long long*) b;
+    return (x > y) - (x < y);
+}
+
+// number of owners of a data block besides the first, 0 without the reflink feature
+int get_block_refcount(long long data_reg_idx) {
+    if (!(superblock.features & FEATURE_REFLINK)) return 0;
+    pthread_mutex_lock(&cache_lock);
+
+    long long block_id = REFCOUNT_START_BLK + data_reg_idx / SIZE_BLOCK;
+    struct CacheNode* refcount_cache = get_meta_block_cache(block_id);
+    if (refcount_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    int refcount = (unsigned char) refcount_cache->block_ptr[data_reg_idx % SIZE_BLOCK];
+
+    stats_add(STAT_BLOCK_READ_NO_CACHE, 1);
+    pthread_mutex_unlock(&cache_lock);
+
+    return refcount;
+}
+
+// add delta owners to a data block, return the new reference count
+int add_block_refcount(long long data_reg_idx, int delta) {
+    if (!(superblock.features & FEATURE_REFLINK)) return -EOPNOTSUPP; // operation not supported [4]
+    pthread_mutex_lock(&cache_lock);
+
+    long long block_id = REFCOUNT_START_BLK + data_reg_idx / SIZE_BLOCK;
+    struct CacheNode* refcount_cache = get_meta_block_cache(block_id);
+    if (refcount_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    int refcount = (unsigned char) refcount_cache->block_ptr[data_reg_idx % SIZE_BLOCK] + delta;
+    if (refcount < 0 || refcount > REFCOUNT_MAX) {
+        pthread_mutex_unlock(&cache_lock);
+        return -EMLINK; // too many links [4]
+    }
+    refcount_cache->block_ptr[data_reg_idx % SIZE_BLOCK] = refcount;
+
+    mark_block_dirty(dirty_table, refcount_cache, DIRTY_OWNER_ALLOC);
+
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
+    pthread_mutex_unlock(&cache_lock);
+
+    return refcount;
+}
+
+// dedup map bit of a data block under cache_lock, NULL if the map block cannot be read
+unsigned char* dedup_map_byte(long long data_reg_idx, struct CacheNode** map_cache) {
+    *map_cache = get_meta_block_cache(DEDUP_MAP_START_BLK + data_reg_idx / (SIZE_BLOCK * 8));
+    if (*map_cache == NULL) return NULL;
+    return (unsigned char*) (*map_cache)->block_ptr + (data_reg_idx % (SIZE_BLOCK * 8)) / 8;
+}
+
+// 1 if a data block was written to a regular file since it was allocated, so it may be shared by content
+int get_dedup_map_bit(long long data_reg_idx) {
+    pthread_mutex_lock(&cache_lock);
+
+    struct CacheNode* map_cache = NULL;
+    unsigned char* byte = dedup_map_byte(data_reg_idx, &map_cache);
+    int bit = byte == NULL ? -1 : (*byte >> (data_reg_idx % 8)) & 1;
+
+    stats_add(STAT_BLOCK_READ_NO_CACHE, 1);
+    pthread_mutex_unlock(&cache_lock);
+
+    return bit;
+}
+
+// data block recorded for fingerprint in the dedup index, -1 if none
+// only blocks with their dedup map bit set are returned, their content may still differ
+long long lookup_dedup_index(uint64_t fingerprint) {
+    pthread_mutex_lock(&cache_lock);
+
+    struct CacheNode* index_cache = get_meta_block_cache(DEDUP_INDEX_START_BLK + fingerprint % NUM_BLKS_DEDUP_INDEX);
+    if (index_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    unsigned int tag = fingerprint >> 32;
+    unsigned int entries[DEDUP_ENTRIES_PER_BLK * 2];
+    memcpy(entries, index_cache->block_ptr, SIZE_BLOCK);
+    long long found = -1;
+    for (int i = 0; i < DEDUP_ENTRIES_PER_BLK && found < 0; i++) {
+        if (entries[i * 2] != tag || entries[i * 2 + 1] == 0) continue;
+        long long data_reg_idx = entries[i * 2 + 1] - 1LL;
+        struct CacheNode* map_cache = NULL;
+        unsigned char* byte = dedup_map_byte(data_reg_idx, &map_cache);
+        if (byte != NULL && (*byte >> (data_reg_idx % 8)) & 1) found = data_reg_idx;
+    }
+
+    stats_add(STAT_BLOCK_READ_NO_CACHE, 1);
+    pthread_mutex_unlock(&cache_lock);
+
+    return found;
+}
+
+// record data block data_reg_idx under fingerprint and set its dedup map bit
+// it replaces an entry of the same fingerprint, a free entry or one of a freed block, or else the entry chosen by fingerprint
+int insert_dedup_index(uint64_t fingerprint, long long data_reg_idx) {
+    pthread_mutex_lock(&cache_lock);
+
+    struct CacheNode* map_cache = NULL;
+    unsigned char* byte = dedup_map_byte(data_reg_idx, &map_cache);
+    if (byte == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    if (((*byte >> (data_reg_idx % 8)) & 1) == 0) {
+        *byte |= 1 << (data_reg_idx % 8);
+        mark_block_dirty(dirty_table, map_cache, DIRTY_OWNER_ALLOC);
+    }
+
+    struct CacheNode* index_cache = get_meta_block_cache(DEDUP_INDEX_START_BLK + fingerprint % NUM_BLKS_DEDUP_INDEX);
+    if (index_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    unsigned int tag = fingerprint >> 32;
+    unsigned int entries[DEDUP_ENTRIES_PER_BLK * 2];
+    memcpy(entries, index_cache->block_ptr, SIZE_BLOCK);
+    int slot = -1;
+    for (int i = 0; i < DEDUP_ENTRIES_PER_BLK && slot < 0; i++) {
+        if (entries[i * 2] == tag || entries[i * 2 + 1] == 0) slot = i;
+    }
+    for (int i = 0; i < DEDUP_ENTRIES_PER_BLK && slot < 0; i++) {
+        long long old_data_reg_idx = entries[i * 2 + 1] - 1LL;
+        unsigned char* old_byte = dedup_map_byte(old_data_reg_idx, &map_cache);
+        if (old_byte != NULL && ((*old_byte >> (old_data_reg_idx % 8)) & 1) == 0) slot = i;
+    }
+    if (slot < 0) slot = tag % DEDUP_ENTRIES_PER_BLK;
+    unsigned int entry[2] = { tag, (unsigned int) data_reg_idx + 1 };
+    memcpy(index_cache->block_ptr + slot * DEDUP_ENTRY_SIZE, entry, DEDUP_ENTRY_SIZE);
+
+    mark_block_dirty(dirty_table, index_cache, DIRTY_OWNER_ALLOC);
+
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+// add an owner to written data block data_reg_idx if it is still in the dedup map and holds the content of buffer
+// checked and counted under one lock, so a block freed or rewritten by its file in between is not shared
+// return 1 if counted, 0 if not, -EMLINK at the maximum reference count
+int share_data_block(long long data_reg_idx, const char* buffer) {
+    pthread_mutex_lock(&cache_lock);
+
+    struct CacheNode* map_cache = NULL;
+    unsigned char* byte = dedup_map_byte(data_reg_idx, &map_cache);
+    if (byte == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    if (((*byte >> (data_reg_idx % 8)) & 1) == 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    struct CacheNode* data_block_cache = get_block_cache(queue, hash, DATA_REG_START_BLK + data_reg_idx);
+    if (data_block_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    pthread_rwlock_rdlock(&data_block_cache->content_lock);
+    int diff = memcmp(data_block_cache->block_ptr, buffer, SIZE_BLOCK);
+    pthread_rwlock_unlock(&data_block_cache->content_lock);
+    if (diff != 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    struct CacheNode* refcount_cache = get_meta_block_cache(REFCOUNT_START_BLK + data_reg_idx / SIZE_BLOCK);
+    if (refcount_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    unsigned char* refcount = (unsigned char*) refcount_cache->block_ptr + data_reg_idx % SIZE_BLOCK;
+    if (*refcount >= REFCOUNT_MAX) {
+        pthread_mutex_unlock(&cache_lock);
+        return -EMLINK; // too many links [4]
+    }
+    (*refcount)++;
+    mark_block_dirty(dirty_table, refcount_cache, DIRTY_OWNER_ALLOC);
+
+    stats_add(STAT_BLOCK_READ_NO_CACHE, 1);
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
+    pthread_mutex_unlock(&cache_lock);
+
+    return 1;
+}
+
+// a data block now shared by content: when dirty, it is written back by the fsync of any file
+void share_dirty_block(long long data_reg_idx) {
+    pthread_mutex_lock(&cache_lock);
+
+    struct CacheNode* block_cache = find_block_cache(hash, DATA_REG_START_BLK + data_reg_idx);
+    if (block_cache != NULL && block_cache->dirty) mark_block_dirty(dirty_table, block_cache, DIRTY_OWNER_ALLOC);
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// free data blocks with one pass over the data block bitmap, whole bytes are cleared for runs of 8 blocks
+// cached copies of the freed blocks are not written back
+// shared blocks only lose one owner, they are left out of data_reg_idxs
+int free_data_blocks(long long* data_reg_idxs, int count) {
+    qsort(data_reg_idxs, count, sizeof(long long), compare_long_long);
+    pthread_mutex_lock(&cache_lock);
+
+    if (superblock.features & FEATURE_REFLINK) {
+        int num_kept = 0;
+        for (int i = 0; i < count; i++) {
+            struct CacheNode* refcount_cache = get_meta_block_cache(REFCOUNT_START_BLK + data_reg_idxs[i] / SIZE_BLOCK);
+            if (refcount_cache == NULL) {
+                pthread_mutex_unlock(&cache_lock);
+                return -1;
+            }
+            unsigned char* refcount = (unsigned char*) refcount_cache->block_ptr + data_reg_idxs[i] % SIZE_BLOCK;
+            if (*refcount == 0) {
+                data_reg_idxs[num_kept++] = data_reg_idxs[i];
+                continue;
+            }
+            (*refcount)--;
+            mark_block_dirty(dirty_table, refcount_cache, DIRTY_OWNER_ALLOC);
+        }
+        count = num_kept;
+    }
+    // freed blocks leave the dedup map, their dedup index entries become stale
+    for (int i = 0; i < count && (superblock.features & FEATURE_DEDUP); i++) {
+        struct CacheNode* map_cache = NULL;
+        unsigned char* byte = dedup_map_byte(data_reg_idxs[i], &map_cache);
+        if (byte == NULL) {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        if (((*byte >> (data_reg_idxs[i] % 8)) & 1) == 0) continue;
+        *byte &= ~(1 << (data_reg_idxs[i] % 8));
+        mark_block_dirty(dirty_table, map_cache, DIRTY_OWNER_ALLOC);
+    }
+
+    int i = 0;
+    while (i < count) {
+        long long block_id = DMAP_START_BLK + data_reg_idxs[i] / (SIZE_BLOCK * 8);
+        struct CacheNode* dmap_cache = get_meta_block_cache(block_id);
+        if (dmap_cache == NULL) {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        while (i < count && DMAP_START_BLK + data_reg_idxs[i] / (SIZE_BLOCK * 8) == block_id) {
+            int byte_offset = (data_reg_idxs[i] % (SIZE_BLOCK * 8)) / 8;
+            int bit_offset = (data_reg_idxs[i] % (SIZE_BLOCK * 8)) % 8;
+            int run = (bit_offset == 0 && i + 7 < count && data_reg_idxs[i + 7] == data_reg_idxs[i] + 7) ? 8 : 1;
+            if (run == 8) dmap_cache->block_ptr[byte_offset] = 0;
+            else dmap_cache->block_ptr[byte_offset] &= ~(1 << bit_offset);
+            for (int j = i; j < i + run; j++) discard_block_cache(hash, DATA_REG_START_BLK + data_reg_idxs[j]);
+            i += run;
+        }
+        mark_block_dirty(dirty_table, dmap_cache, DIRTY_OWNER_ALLOC);
+        stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
+    }
+    stats_add(STAT_FREE_BLOCK, count);
+
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
 
 int set_inode_data(int ino_num, int inode_data, int data_offset) {
     pthread_mutex_lock(&cache_lock);
 
-    int block_id = INODE_TABLE_START_BLK + (ino_num * SIZE_INODE) / SIZE_BLOCK;
-    int inode_offset = (ino_num * SIZE_INODE) % SIZE_BLOCK;
-    struct CacheNode* inode_cache = get_block_cache(queue, hash, block_id);
-    if (inode_cache == NULL) return -1;
+    long long block_id = INODE_BLK(ino_num);
+    int inode_offset = INODE_BLK_OFFSET(ino_num);
+    struct CacheNode* inode_cache = get_meta_block_cache(block_id);
+    if (inode_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
     memcpy(inode_cache->block_ptr + inode_offset + data_offset * sizeof(inode_data), &inode_data, sizeof(inode_data));
     
-    inode_cache->dirty = true;
+    mark_block_dirty(dirty_table, inode_cache, DIRTY_OWNER_NONE);
+    if (data_offset != INODE_LINKS_COUNT_OFF) get_dirty_list(dirty_table, ino_num, true)->meta_dirty = true; // fdatasync needs size and block pointers
 
-    num_write_requests_without_cache++;
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
     pthread_mutex_unlock(&cache_lock);
 
     return 0;
@@ -177,157 +534,686 @@ int set_inode_data(int ino_num, int inode_data, int data_offset) {
 int get_inode_data(int ino_num, int data_offset) {
     pthread_mutex_lock(&cache_lock);
 
-    int block_id = INODE_TABLE_START_BLK + (ino_num * SIZE_INODE) / SIZE_BLOCK;
-    int inode_offset = (ino_num * SIZE_INODE) % SIZE_BLOCK;
-    struct CacheNode* inode_cache = get_block_cache(queue, hash, block_id);
-    if (inode_cache == NULL) return -1;
+    long long block_id = INODE_BLK(ino_num);
+    int inode_offset = INODE_BLK_OFFSET(ino_num);
+    struct CacheNode* inode_cache = get_meta_block_cache(block_id);
+    if (inode_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
     int inode_data = -1;
     memcpy(&inode_data, inode_cache->block_ptr + inode_offset + data_offset * sizeof(inode_data), sizeof(inode_data));
 
-    num_read_requests_without_cache++;
+    stats_add(STAT_BLOCK_READ_NO_CACHE, 1);
     pthread_mutex_unlock(&cache_lock);
 
     return inode_data;
 }
 
-int set_data_block_data(int data_reg_idx, const char* buffer, int size, int offset) {
+// used size of a file, with the 64bit feature its high 32 bits follow the inode fields
+off_t get_file_size(int ino_num) {
     pthread_mutex_lock(&cache_lock);
 
-    int block_id = DATA_REG_START_BLK + data_reg_idx;
-    struct CacheNode* data_block_cache = get_block_cache(queue, hash, block_id);
-    if (data_block_cache == NULL) return -1;
-    memcpy(data_block_cache->block_ptr + offset, buffer, size);
-
-    data_block_cache->dirty = true;
+    struct CacheNode* inode_cache = get_meta_block_cache(INODE_BLK(ino_num));
+    if (inode_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    const char* inode = inode_cache->block_ptr + INODE_BLK_OFFSET(ino_num);
+    unsigned int size_lo = 0, size_hi = 0;
+    memcpy(&size_lo, inode + INODE_USED_SIZE_OFF * sizeof(int), sizeof(size_lo));
+    if (superblock.features & FEATURE_64BIT) memcpy(&size_hi, inode + INODE_SIZE_HI_OFF * sizeof(int), sizeof(size_hi));
 
-    num_write_requests_without_cache++;
+    stats_add(STAT_BLOCK_READ_NO_CACHE, 1);
     pthread_mutex_unlock(&cache_lock);
 
-    return size;
+    return (off_t) size_hi << 32 | size_lo;
 }
 
-int get_data_block_data(int data_reg_idx, char* buffer, int size, int offset) {
+int set_file_size(int ino_num, off_t size) {
     pthread_mutex_lock(&cache_lock);
 
-    int block_id = DATA_REG_START_BLK + data_reg_idx;
-    struct CacheNode* data_block_cache = get_block_cache(queue, hash, block_id);
-    if (data_block_cache == NULL) return -1;
-    memcpy(buffer, data_block_cache->block_ptr + offset, size);
+    struct CacheNode* inode_cache = get_meta_block_cache(INODE_BLK(ino_num));
+    if (inode_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    char* inode = inode_cache->block_ptr + INODE_BLK_OFFSET(ino_num);
+    unsigned int size_lo = size, size_hi = (unsigned long long) size >> 32;
+    memcpy(inode + INODE_USED_SIZE_OFF * sizeof(int), &size_lo, sizeof(size_lo));
+    if (superblock.features & FEATURE_64BIT) memcpy(inode + INODE_SIZE_HI_OFF * sizeof(int), &size_hi, sizeof(size_hi));
 
-    num_read_requests_without_cache++;
+    mark_block_dirty(dirty_table, inode_cache, DIRTY_OWNER_NONE);
+    get_dirty_list(dirty_table, ino_num, true)->meta_dirty = true;
+
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
     pthread_mutex_unlock(&cache_lock);
 
-    return size;
+    return 0;
 }
 
-int initialize_toyfs() {    
-    superblock.size_ibmap = 196608; // 4 pages = 384 blocks = 196608 bytes = 1572864 bits
-    superblock.size_dbmap = 196608; // 4 pages = 384 blocks = 196608 bytes = 1572864 bits
-    superblock.size_inode = 32; // 32 bytes
-    superblock.size_filename = 12; // 12 byes
-    superblock.root_inum = 0;
-    superblock.num_disk_ptrs_per_inode = 4;
-
+// block pointer ptr_idx of an inode, direct pointers first and then the roots of the pointer tiers
+int get_inode_ptr(int ino_num, int ptr_idx, long long* ptr) {
     pthread_mutex_lock(&cache_lock);
-    
-    int block_id = SUPERBLOCK_START_BLK;
-    struct CacheNode* superblock_cache = get_block_cache(queue, hash, block_id);
-    if (superblock_cache == NULL) return -1;
-
-    // initialize superblock
-    int magic_str_len = strlen(magic_string); // magic string len toyfs
-    memcpy(superblock_cache->block_ptr, magic_string, magic_str_len);
-    memcpy(superblock_cache->block_ptr + magic_str_len, &superblock.size_ibmap, sizeof(unsigned int));
-    memcpy(superblock_cache->block_ptr + magic_str_len + sizeof(unsigned int), &superblock.size_dbmap, sizeof(unsigned int));
-    memcpy(superblock_cache->block_ptr + magic_str_len + 2 * sizeof(unsigned int), &superblock.size_inode, sizeof(unsigned int));
-    memcpy(superblock_cache->block_ptr + magic_str_len + 3 * sizeof(unsigned int), &superblock.size_filename, sizeof(unsigned int));
-    memcpy(superblock_cache->block_ptr + magic_str_len + 4 * sizeof(unsigned int), &superblock.root_inum, sizeof(unsigned int));
-    memcpy(superblock_cache->block_ptr + magic_str_len + 5 * sizeof(unsigned int), &superblock.num_disk_ptrs_per_inode, sizeof(unsigned int));
-    superblock_cache->dirty = true;
-
-    pthread_mutex_unlock(&cache_lock);
-
-    // initialize bitmap
-    for (int i = 0; i < NUM_BLKS_IMAP; i++) {
-        int result = initialize_block(IMAP_START_BLK + i);
-        if (result < 0) return result;
-    }
-    for (int i = 0; i < NUM_BLKS_DMAP; i++) {
-        int result = initialize_block(DMAP_START_BLK + i);
-        if (result < 0) return result;
+
+    struct CacheNode* inode_cache = get_meta_block_cache(INODE_BLK(ino_num));
+    if (inode_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
     }
+    *ptr = decode_blk_ptr(inode_cache->block_ptr + INODE_BLK_OFFSET(ino_num) + INODE_BLK_PTR_POS + ptr_idx * SIZE_DATA_BLK_PTR);
+
+    stats_add(STAT_BLOCK_READ_NO_CACHE, 1);
     pthread_mutex_unlock(&cache_lock);
 
-    // initialize root directory
-    // initialize root inode
-    int result = set_imap_bit(ROOT_INUM, 1);
-    if (result < 0) return -1;
-    result = set_inode_data(ROOT_INUM, 1, INODE_FLAG_OFF); // directory
-    if (result < 0) return result;
-    result = set_inode_data(ROOT_INUM, 0, INODE_NUM_BLKS_OFF);
-    if (result < 0) return result;
-    result = set_inode_data(ROOT_INUM, 2, INODE_LINKS_COUNT_OFF);  // direcotry has another "." file pointing to itself
-    if (result < 0) return result;
-    result = set_inode_data(ROOT_INUM, 0, INODE_USED_SIZE_OFF);
-    if (result < 0) return result;
+    return 0;
+}
+
+int set_inode_ptr(int ino_num, int ptr_idx, long long ptr) {
+    pthread_mutex_lock(&cache_lock);
+
+    struct CacheNode* inode_cache = get_meta_block_cache(INODE_BLK(ino_num));
+    if (inode_cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    encode_blk_ptr(inode_cache->block_ptr + INODE_BLK_OFFSET(ino_num) + INODE_BLK_PTR_POS + ptr_idx * SIZE_DATA_BLK_PTR, ptr);
+
+    mark_block_dirty(dirty_table, inode_cache, DIRTY_OWNER_NONE);
+    get_dirty_list(dirty_table, ino_num, true)->meta_dirty = true;
+
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
+    pthread_mutex_unlock(&cache_lock);
 
     return 0;
 }
 
-int get_superblock() {
+// bring the inode table and inode bitmap blocks of the given inodes to cache
+int prefetch_inodes(const int* ino_nums, int count) {
+    if (count <= 0) return 0;
+    // the inode bitmap blocks too, operations on an inode check that it is still in use once locked
+    long long* block_ids = (long long*) malloc(2 * count * sizeof(long long));
+    for (int i = 0; i < count; i++) {
+        block_ids[2 * i] = INODE_BLK(ino_nums[i]);
+        block_ids[2 * i + 1] = IMAP_START_BLK + ino_nums[i] / (SIZE_BLOCK * 8);
+    }
+    qsort(block_ids, 2 * count, sizeof(long long), compare_long_long);
+    int num_ids = 1;
+    for (int i = 1; i < 2 * count; i++) {
+        if (block_ids[i] != block_ids[num_ids - 1]) block_ids[num_ids++] = block_ids[i];
+    }
+
+    // inode bitmap blocks sort before inode table blocks, the two may be in different caches
+    int num_imap_ids = 0;
+    while (num_imap_ids < num_ids && block_ids[num_imap_ids] < INODE_TABLE_START_BLK) num_imap_ids++;
     pthread_mutex_lock(&cache_lock);
+    int result = prefetch_block_cache(queue_of(IMAP_START_BLK), hash_of(IMAP_START_BLK), block_ids, num_imap_ids);
+    if (result >= 0) result = prefetch_block_cache(queue_of(INODE_TABLE_START_BLK), hash_of(INODE_TABLE_START_BLK), block_ids + num_imap_ids, num_ids - num_imap_ids);
+    pthread_mutex_unlock(&cache_lock);
 
-    int block_id = SUPERBLOCK_START_BLK;
-    struct CacheNode* superblock_cache = get_block_cache(queue, hash, block_id);
-    if (superblock_cache == NULL) return -1;
+    free(block_ids);
+    return result < 0 ? result : 0;
+}
 
-    int magic_str_len = strlen(magic_string); // magic string len toyfs
-    char* magic_str_disk = (char*) malloc(magic_str_len + 1);
-    magic_str_disk[magic_str_len] = 0;
-    memcpy(magic_str_disk, superblock_cache->block_ptr, magic_str_len);
-    if (strcmp(magic_str_disk, magic_string) == 0) {
-        printf("[TOYFS] toyfs recognized\n");
-        memcpy(&superblock.size_ibmap, superblock_cache->block_ptr + magic_str_len, sizeof(unsigned int));
-        memcpy(&superblock.size_dbmap, superblock_cache->block_ptr + magic_str_len + sizeof(unsigned int), sizeof(unsigned int));
-        memcpy(&superblock.size_inode, superblock_cache->block_ptr + magic_str_len + 2 * sizeof(unsigned int), sizeof(unsigned int));
-        memcpy(&superblock.size_filename, superblock_cache->block_ptr + magic_str_len + 3 * sizeof(unsigned int), sizeof(unsigned int));
-        memcpy(&superblock.root_inum, superblock_cache->block_ptr + magic_str_len + 4 * sizeof(unsigned int), sizeof(unsigned int));
-        memcpy(&superblock.num_disk_ptrs_per_inode, superblock_cache->block_ptr + magic_str_len + 5 * sizeof(unsigned int), sizeof(unsigned int));
+// file type of an inode, without flag bits
+int get_inode_type(int ino_num) {
+    int flag = get_inode_data(ino_num, INODE_FLAG_OFF);
+    return flag < 0 ? flag : flag & INODE_TYPE_MASK;
+}
 
+// copy inline data of an inode, offset is relative to the start of its inline data
+int get_inode_inline_data(int ino_num, char* buffer, int size, int offset) {
+    pthread_mutex_lock(&cache_lock);
+
+    long long block_id = INODE_BLK(ino_num);
+    int inode_offset = INODE_BLK_OFFSET(ino_num);
+    struct CacheNode* inode_cache = get_meta_block_cache(block_id);
+    if (inode_cache == NULL) {
         pthread_mutex_unlock(&cache_lock);
+        return -1;
     }
-    else {
+    memcpy(buffer, inode_cache->block_ptr + inode_offset + INODE_INLINE_DATA_POS + offset, size);
+
+    stats_add(STAT_BLOCK_READ_NO_CACHE, 1);
+    pthread_mutex_unlock(&cache_lock);
+
+    return size;
+}
+
+// write inline data of an inode, zeros if buffer is NULL
+int set_inode_inline_data(int ino_num, const char* buffer, int size, int offset) {
+    pthread_mutex_lock(&cache_lock);
+
+    long long block_id = INODE_BLK(ino_num);
+    int inode_offset = INODE_BLK_OFFSET(ino_num);
+    struct CacheNode* inode_cache = get_meta_block_cache(block_id);
+    if (inode_cache == NULL) {
         pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    if (buffer == NULL) memset(inode_cache->block_ptr + inode_offset + INODE_INLINE_DATA_POS + offset, 0, size);
+    else memcpy(inode_cache->block_ptr + inode_offset + INODE_INLINE_DATA_POS + offset, buffer, size);
+
+    mark_block_dirty(dirty_table, inode_cache, DIRTY_OWNER_NONE);
+    get_dirty_list(dirty_table, ino_num, true)->meta_dirty = true; // file data lives in the inode table block
+
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
+    pthread_mutex_unlock(&cache_lock);
+
+    return size;
+}
+
+// data blocks are copied outside cache_lock, under the content lock of their pinned node
+int set_data_block_data(int ino_num, long long data_reg_idx, const char* buffer, int size, int offset) {
+    pthread_mutex_lock(&cache_lock);
+    long long block_id = DATA_REG_START_BLK + data_reg_idx;
+    // a block overwritten whole is not read from device first
+    struct CacheNode* data_block_cache = pin_block_cache(queue, hash, block_id, size < SIZE_BLOCK);
+    pthread_mutex_unlock(&cache_lock);
+    if (data_block_cache == NULL) return -1;
+
+    pthread_rwlock_wrlock(&data_block_cache->content_lock);
+    memcpy(data_block_cache->block_ptr + offset, buffer, size);
+    pthread_rwlock_unlock(&data_block_cache->content_lock);
+
+    // marked dirty after the copy, a write-back in between writes the new data and the block is written again
+    pthread_mutex_lock(&cache_lock);
+    mark_block_dirty(dirty_table, data_block_cache, ino_num);
+    unpin_block_cache(data_block_cache);
+    pthread_mutex_unlock(&cache_lock);
+
+    stats_add(STAT_BLOCK_WRITE_NO_CACHE, 1);
+    return size;
+}
+
+int get_data_block_data(long long data_reg_idx, char* buffer, int size, int offset) {
+    pthread_mutex_lock(&cache_lock);
+    long long block_id = DATA_REG_START_BLK + data_reg_idx;
+    struct CacheNode* data_block_cache = pin_block_cache(queue, hash, block_id, true);
+    pthread_mutex_unlock(&cache_lock);
+    if (data_block_cache == NULL) return -1;
+
+    pthread_rwlock_rdlock(&data_block_cache->content_lock);
+    memcpy(buffer, data_block_cache->block_ptr + offset, size);
+    pthread_rwlock_unlock(&data_block_cache->content_lock);
+    unpin_block_cache(data_block_cache);
+
+    stats_add(STAT_BLOCK_READ_NO_CACHE, 1);
+    return size;
+}
+
+// count pointers of a pointer block from pointer ptr_off
+int get_ptr_block_data(long long data_reg_idx, long long* ptrs, int count, int ptr_off) {
+    char buffer[SIZE_BLOCK];
+    int result = get_data_block_data(data_reg_idx, buffer, count * SIZE_DATA_BLK_PTR, ptr_off * SIZE_DATA_BLK_PTR);
+    if (result < 0) return result;
+    for (int i = 0; i < count; i++) ptrs[i] = decode_blk_ptr(buffer + i * SIZE_DATA_BLK_PTR);
+    return count;
+}
 
+int set_ptr_block_data(int ino_num, long long data_reg_idx, const long long* ptrs, int count, int ptr_off) {
+    char buffer[SIZE_BLOCK];
+    for (int i = 0; i < count; i++) encode_blk_ptr(buffer + i * SIZE_DATA_BLK_PTR, ptrs[i]);
+    int result = set_data_block_data(ino_num, data_reg_idx, buffer, count * SIZE_DATA_BLK_PTR, ptr_off * SIZE_DATA_BLK_PTR);
+    return result < 0 ? result : count;
+}
+
+// checksum table blocks, read on first use and kept in memory outside the block cache whose reads and write-backs
+// they check, changed ones are written by write_dirty_blocks_back and sync_inode, all under cache_lock
+unsigned int** csum_blocks = NULL; // NUM_BLKS_CSUM entries, NULL until read
+bool* csum_dirty = NULL;
+
+unsigned int* get_checksum_entry(long long block_id) {
+    long long csum_blk = block_id / CSUM_PER_BLK;
+    if (csum_blocks[csum_blk] == NULL) {
+        unsigned int* block;
+        if (posix_memalign((void**) &block, SIZE_BLOCK, SIZE_BLOCK) != 0) return NULL;
+        int fd = open(device_path, O_RDONLY | O_DIRECT);
+        if (fd < 0) {
+            free(block);
+            return NULL;
+        }
+        io_read(fd, block, CSUM_START_BLK + csum_blk);
+        close(fd);
+        csum_blocks[csum_blk] = block;
+    }
+    return csum_blocks[csum_blk] + block_id % CSUM_PER_BLK;
+}
+
+// verify_block_hook: a block without recorded checksum passes
+bool verify_block_checksum(long long block_id, const char* data) {
+    if (!has_checksum(block_id)) return true;
+    unsigned int* entry = get_checksum_entry(block_id);
+    if (entry == NULL) return false;
+    if (*entry == CSUM_NONE) return true;
+    stats_add(STAT_CHECKSUM_VERIFY, 1);
+    if (*entry == block_checksum(data)) return true;
+    stats_add(STAT_CHECKSUM_ERROR, 1);
+    printf("[TOYFS] block %lld does not match its checksum, it is torn or corrupted\n", block_id);
+    return false;
+}
+
+// record_block_hook
+void record_block_checksum(long long block_id, const char* data) {
+    if (!has_checksum(block_id)) return;
+    unsigned int* entry = get_checksum_entry(block_id);
+    if (entry == NULL) return;
+    *entry = block_checksum(data);
+    csum_dirty[block_id / CSUM_PER_BLK] = true;
+}
+
+// write back changed checksum table blocks, under cache_lock
+// return 0 on success and negative integer if not success, the blocks not written stay changed
+int write_checksums(int fd) {
+    int error = 0;
+    for (long long i = 0; csum_dirty != NULL && i < NUM_BLKS_CSUM; i++) {
+        if (!csum_dirty[i]) continue;
+        int result = io_write(fd, csum_blocks[i], CSUM_START_BLK + i);
+        if (result == 0) csum_dirty[i] = false;
+        else if (error == 0) error = result;
+    }
+    return error;
+}
+
+// read superblock from device, format device if it is not toyfs
+int get_superblock() {
+    int fd = open(device_path, O_RDONLY | O_DIRECT);
+    if (fd < 0) return fd;
+    char* block;
+    if (posix_memalign((void**) &block, SIZE_BLOCK, SIZE_BLOCK) != 0) {
+        close(fd);
+        return -1;
+    }
+    io_read(fd, block, SUPERBLOCK_START_BLK);
+    close(fd);
+    bool recognized = decode_superblock(block);
+    free(block);
+
+    if (recognized) {
+        printf("[TOYFS] toyfs recognized\n");
+    }
+    else {
         printf("[TOYFS] device %s is not of toyfs format. formatting %s ...\n", device_path, device_path);
-        int result = initialize_toyfs();
+        struct MkfsOptions options;
+        default_mkfs_options(&options);
+        int result = format_toyfs(device_path, &options);
         if (result < 0) return result;
         printf("[TOYFS] formatting done\n");
     }
 
+    if (superblock.block_size != SIZE_BLOCK) {
+        printf("[TOYFS] block size %u is not supported\n", superblock.block_size);
+        return -1;
+    }
+    if ((superblock.features & ~SUPPORTED_FEATURES) != 0) {
+        printf("[TOYFS] unknown features 0x%x\n", superblock.features & ~SUPPORTED_FEATURES);
+        return -1;
+    }
+    if (superblock.features & FEATURE_CHECKSUM) {
+        csum_blocks = (unsigned int**) calloc(NUM_BLKS_CSUM, sizeof(unsigned int*));
+        csum_dirty = (bool*) calloc(NUM_BLKS_CSUM, sizeof(bool));
+        verify_block_hook = verify_block_checksum;
+        record_block_hook = record_block_checksum;
+    }
+
     return 0;
 }
 
-int write_dirty_blocks_back(struct CacheQueue* queue) {
+// data, metadata and bitmap caches, those that exist
+int get_block_caches(struct CacheQueue** queues, struct Hash** hashes) {
+    int count = 0;
+    struct CacheQueue* all_queues[] = { queue, meta_queue, bitmap_queue };
+    struct Hash* all_hashes[] = { hash, meta_hash, bitmap_hash };
+    for (int i = 0; i < 3; i++) {
+        if (all_queues[i] == NULL) continue;
+        queues[count] = all_queues[i];
+        hashes[count++] = all_hashes[i];
+    }
+    return count;
+}
+
+// give metadata blocks a cache of meta_blks blocks apart from data blocks, after the superblock is read
+// with pin_bitmaps the inode and data block bitmaps get a cache holding all of them, read in now with large requests
+int create_meta_caches(unsigned meta_blks, bool pin_bitmaps) {
+    meta_queue = create_cache_queue(meta_blks);
+    meta_hash = create_hash_table(meta_blks / 8 + 1);
+    if (!pin_bitmaps) return 0;
+
+    int num_blks = INODE_TABLE_START_BLK - IMAP_START_BLK;
+    bitmap_queue = create_cache_queue(num_blks);
+    bitmap_hash = create_hash_table(num_blks / 8 + 1);
+    long long* block_ids = (long long*) malloc(num_blks * sizeof(long long));
+    for (int i = 0; i < num_blks; i++) block_ids[i] = IMAP_START_BLK + i;
+    pthread_mutex_lock(&cache_lock);
+    int result = prefetch_block_cache(bitmap_queue, bitmap_hash, block_ids, num_blks);
+    pthread_mutex_unlock(&cache_lock);
+    free(block_ids);
+    return result < 0 ? result : 0;
+}
+
+// drop the metadata caches, their dirty blocks are written back first in block order
+void destroy_meta_caches() {
+    struct CacheQueue* queues[] = { meta_queue, bitmap_queue };
+    struct Hash* hashes[] = { meta_hash, bitmap_hash };
+    pthread_mutex_lock(&cache_lock);
+    int num_nodes = 0;
+    for (int i = 0; i < 2; i++) num_nodes += queues[i] != NULL ? queues[i]->num_dirty : 0;
+    int fd = num_nodes > 0 ? open(device_path, O_WRONLY | O_DIRECT) : -1;
+    if (fd >= 0) {
+        struct CacheNode** nodes = (struct CacheNode**) malloc(num_nodes * sizeof(struct CacheNode*));
+        num_nodes = 0;
+        for (int i = 0; i < 2; i++) {
+            if (queues[i] == NULL) continue;
+            for (struct CacheNode* node = queues[i]->front; node != NULL; node = node->queue_next) {
+                if (node->dirty) nodes[num_nodes++] = node;
+            }
+        }
+        pthread_mutex_lock(&write_back_lock);
+        int result = write_back_blocks(fd, nodes, num_nodes);
+        if (result == 0) result = write_checksums(fd);
+        pthread_mutex_unlock(&write_back_lock);
+        free(nodes);
+        close(fd);
+        if (result < 0) printf("[TOYFS] metadata blocks could not be written back, they are lost\n");
+    }
+    // with the device not opened, dequeue writes each dirty block back as it evicts it
+    for (int i = 0; i < 2; i++) {
+        if (queues[i] == NULL) continue;
+        while (!is_queue_empty(queues[i]) && dequeue(queues[i], hashes[i]) == 0);
+        free(queues[i]);
+        free(hashes[i]->buckets);
+        free(hashes[i]);
+    }
+    meta_queue = bitmap_queue = NULL;
+    meta_hash = bitmap_hash = NULL;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int write_dirty_blocks_back() {
     pthread_mutex_lock(&cache_lock);
     
-    struct CacheNode* cache_node = queue->front;
-    while (cache_node != NULL) {
-        if (cache_node->dirty) {
-            int fd = open(device_path, O_WRONLY | O_DIRECT);
-            if (fd < 0) return fd;
-            io_write(fd, cache_node->block_ptr, cache_node->block_id);
-            int result = close(fd);
-            if (result < 0) return result;
-            
-            cache_node->dirty = false;    
+    int fd = open(device_path, O_WRONLY | O_DIRECT);
+    if (fd < 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return fd;
+    }
+    pthread_mutex_lock(&write_back_lock);
+    // in block order, so the blocks of files written sequentially go out in large requests
+    struct CacheQueue* queues[3];
+    struct Hash* hashes[3];
+    int num_caches = get_block_caches(queues, hashes);
+    int num_nodes = 0;
+    for (int i = 0; i < num_caches; i++) num_nodes += queues[i]->count;
+    struct CacheNode** nodes = (struct CacheNode**) malloc((num_nodes + 1) * sizeof(struct CacheNode*));
+    num_nodes = 0;
+    for (int i = 0; i < num_caches; i++) {
+        for (struct CacheNode* node = queues[i]->front; node != NULL; node = node->queue_next) {
+            if (node->dirty) nodes[num_nodes++] = node;
         }
-        cache_node = cache_node->queue_next;
     }
+    int result = write_back_blocks(fd, nodes, num_nodes);
+    free(nodes);
+    if (result == 0) result = write_checksums(fd);
+    // blocks the device failed to take stay dirty in the lists of their owners
+    if (result == 0) clear_dirty_table(dirty_table);
+    pthread_mutex_unlock(&write_back_lock);
+    if (close(fd) < 0 && result == 0) result = -EIO; // input/output error [4]
 
     pthread_mutex_unlock(&cache_lock);
 
+    return result;
+}
+
+// copy dirty nodes for a write-back outside cache_lock, under cache_lock
+// the nodes are sorted by block and their data copied to buffer and recorded by the checksum hook, then they are marked
+// clean, so a write in the meantime dirties them again, and pinned, so they are neither evicted nor read back from
+// device before written, owners receives the inode each node was dirty for, see finish_write_back
+void copy_for_write_back(struct CacheNode** nodes, int* owners, int count, char* buffer) {
+    qsort(nodes, count, sizeof(struct CacheNode*), compare_block_id);
+    for (int i = 0; i < count; i++) {
+        struct CacheNode* node = nodes[i];
+        pthread_rwlock_rdlock(&node->content_lock);
+        memcpy(buffer + i * SIZE_BLOCK, node->block_ptr, SIZE_BLOCK);
+        pthread_rwlock_unlock(&node->content_lock);
+        if (record_block_hook != NULL) record_block_hook(node->block_id, buffer + i * SIZE_BLOCK);
+        owners[i] = node->dirty_list != NULL ? node->dirty_list->ino_num : DIRTY_OWNER_NONE;
+        clear_block_dirty(node);
+        __atomic_add_fetch(&node->pins, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// write the copies of copy_for_write_back, consecutive blocks with one request, under write_back_lock only
+// return 0 on success and the error of the first failed request otherwise
+int write_back_copies(int fd, struct CacheNode** nodes, int count, char* buffer) {
+    struct iovec iov[WRITE_BACK_RUN_BLKS];
+    int error = 0;
+    int i = 0;
+    while (i < count) {
+        int run = 1;
+        while (i + run < count && run < WRITE_BACK_RUN_BLKS && nodes[i + run]->block_id == nodes[i]->block_id + run) run++;
+        for (int j = 0; j < run; j++) {
+            iov[j].iov_base = buffer + (i + j) * SIZE_BLOCK;
+            iov[j].iov_len = SIZE_BLOCK;
+        }
+        int result = io_write_run(fd, iov, nodes[i]->block_id, run);
+        if (result < 0 && error == 0) error = result;
+        i += run;
+    }
+    if (error == 0) stats_add(STAT_CACHE_WRITE_BACK, count);
+    return error;
+}
+
+// end a write-back of copy_for_write_back under cache_lock: after a device error the nodes not written again since
+// are dirty again for their owners, then the pins are released
+void finish_write_back(struct CacheNode** nodes, const int* owners, int count, bool failed) {
+    for (int i = 0; i < count; i++) {
+        if (failed && !nodes[i]->dirty) mark_block_dirty(dirty_table, nodes[i], owners[i]);
+        unpin_block_cache(nodes[i]);
+    }
+}
+
+// add the nodes of a dirty list to nodes if not NULL, return their number
+int collect_dirty_list(struct DirtyList* list, struct CacheNode** nodes) {
+    int count = 0;
+    for (struct CacheNode* node = list != NULL ? list->first : NULL; node != NULL; node = node->dirty_next) {
+        if (nodes != NULL) nodes[count] = node;
+        count++;
+    }
+    return count;
+}
+
+// write back dirty blocks of one inode, the allocation bitmaps they depend on,
+// and its inode table block, then flush the device
+// datasync skips the inode table block unless size or block pointers changed
+// the blocks are copied under cache_lock and written and flushed without it, so other operations go on meanwhile
+// return 0 on success and negative integer if not success, the blocks stay dirty if the device failed
+int sync_inode(int ino_num, int datasync) {
+    pthread_mutex_lock(&cache_lock);
+
+    int fd = open(device_path, O_WRONLY | O_DIRECT);
+    if (fd < 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return fd;
+    }
+
+    struct DirtyList* list = get_dirty_list(dirty_table, ino_num, false);
+    struct DirtyList* alloc_list = get_dirty_list(dirty_table, DIRTY_OWNER_ALLOC, false);
+    bool meta_dirty = list == NULL || list->meta_dirty;
+    long long block_id = INODE_BLK(ino_num);
+    struct CacheNode* inode_cache = (!datasync || meta_dirty) ? find_block_cache(hash_of(block_id), block_id) : NULL;
+    // an inline file tracks its inode table block in its own list, it is written with the list
+    if (inode_cache != NULL && (!inode_cache->dirty || (inode_cache->dirty_list != NULL && (inode_cache->dirty_list == list || inode_cache->dirty_list == alloc_list)))) inode_cache = NULL;
+    int num_nodes = collect_dirty_list(list, NULL) + collect_dirty_list(alloc_list, NULL) + 1;
+    // recording the checksums of the copies changes at most one more checksum table block each
+    int num_csums = 0;
+    for (long long i = 0; csum_dirty != NULL && i < NUM_BLKS_CSUM; i++) num_csums += csum_dirty[i];
+    if (csum_dirty != NULL) num_csums = num_csums + num_nodes < NUM_BLKS_CSUM ? num_csums + num_nodes : NUM_BLKS_CSUM;
+
+    struct CacheNode** nodes = (struct CacheNode**) malloc(num_nodes * sizeof(struct CacheNode*));
+    int* owners = (int*) malloc(num_nodes * sizeof(int));
+    long long* csum_blks = (long long*) malloc((num_csums + 1) * sizeof(long long));
+    char* buffer = NULL;
+    if (nodes == NULL || owners == NULL || csum_blks == NULL || posix_memalign((void**) &buffer, SIZE_BLOCK, (num_nodes + num_csums) * SIZE_BLOCK) != 0) {
+        pthread_mutex_unlock(&cache_lock);
+        free(nodes);
+        free(owners);
+        free(csum_blks);
+        close(fd);
+        return -ENOMEM; // out of memory [4]
+    }
+    num_nodes = collect_dirty_list(list, nodes);
+    num_nodes += collect_dirty_list(alloc_list, nodes + num_nodes);
+    if (inode_cache != NULL) nodes[num_nodes++] = inode_cache;
+    copy_for_write_back(nodes, owners, num_nodes, buffer);
+    num_csums = 0;
+    for (long long i = 0; csum_dirty != NULL && i < NUM_BLKS_CSUM; i++) {
+        if (!csum_dirty[i]) continue;
+        memcpy(buffer + (num_nodes + num_csums) * SIZE_BLOCK, csum_blocks[i], SIZE_BLOCK);
+        csum_dirty[i] = false;
+        csum_blks[num_csums++] = i;
+    }
+    remove_dirty_list(dirty_table, ino_num);
+    pthread_mutex_lock(&write_back_lock);
+    pthread_mutex_unlock(&cache_lock);
+
+    int result = write_back_copies(fd, nodes, num_nodes, buffer);
+    for (int i = 0; i < num_csums; i++) {
+        int error = io_write(fd, buffer + (num_nodes + i) * SIZE_BLOCK, CSUM_START_BLK + csum_blks[i]);
+        if (error < 0 && result == 0) result = error;
+    }
+    // blocks of the file the cache cleaner is writing are no longer dirty, taking write_back_lock waited for them
+    pthread_mutex_unlock(&write_back_lock);
+    if (result == 0) result = io_flush(fd);
+    if (close(fd) < 0 && result == 0) result = -EIO; // input/output error [4]
+
+    pthread_mutex_lock(&cache_lock);
+    finish_write_back(nodes, owners, num_nodes, result < 0);
+    if (result < 0) {
+        for (int i = 0; i < num_csums; i++) csum_dirty[csum_blks[i]] = true;
+        if (meta_dirty) get_dirty_list(dirty_table, ino_num, true)->meta_dirty = true;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    free(buffer);
+    free(csum_blks);
+    free(owners);
+    free(nodes);
+    return result;
+}
+
+// write back the dirty nodes among the 2 * clean_frames_low least recently used nodes of a cache for the cache
+// cleaner, or with all the 2 * clean_frames_low least recently used dirty nodes, called under cache_lock and returns under it, the block data is copied under cache_lock and written after
+// releasing it, the nodes are clean from the copy on and stay pinned until written, so they are not read back from
+// device before, and write_back_lock is held until then, so a later write-back of a block is not overwritten
+// owners has room for 2 * clean_frames_low inodes, see copy_for_write_back
+// return number of blocks written and negative integer if not success, the blocks stay dirty if the device failed
+int clean_lru_tail(struct CacheQueue* queue, char* buffer, struct CacheNode** nodes, int* owners, bool all) {
+    int count = 0;
+    unsigned num_seen = 0;
+    for (struct CacheNode* node = queue->rear; node != NULL && count < 2 * clean_frames_low && (all || num_seen < 2 * clean_frames_low); node = node->queue_prev) {
+        if (node->dirty) nodes[count++] = node;
+        num_seen++;
+    }
+    if (count == 0) return 0;
+    int fd = open(device_path, O_WRONLY | O_DIRECT);
+    if (fd < 0) return fd;
+
+    copy_for_write_back(nodes, owners, count, buffer);
+    pthread_mutex_lock(&write_back_lock);
+    pthread_mutex_unlock(&cache_lock);
+
+    int result = write_back_copies(fd, nodes, count, buffer);
+    pthread_mutex_unlock(&write_back_lock);
+    if (close(fd) < 0 && result == 0) result = -EIO; // input/output error [4]
+    if (result == 0) stats_add(STAT_CACHE_CLEAN, count);
+
+    pthread_mutex_lock(&cache_lock);
+    finish_write_back(nodes, owners, count, result < 0);
+    return result < 0 ? result : count;
+}
+
+pthread_t cleaner_tid;
+
+void* cache_cleaner_thread(void* arg) {
+    char* buffer = NULL;
+    if (posix_memalign((void**) &buffer, SIZE_BLOCK, 2 * clean_frames_low * SIZE_BLOCK) != 0) return NULL;
+    struct CacheNode** nodes = (struct CacheNode**) malloc(2 * clean_frames_low * sizeof(struct CacheNode*));
+    int* owners = (int*) malloc(2 * clean_frames_low * sizeof(int));
+
+    pthread_mutex_lock(&cache_lock);
+    while (!cleaner_stop) {
+        // above the background threshold dirty data blocks are written back from the lru end until below it
+        bool over = queue->num_dirty > dirty_background_blocks(queue);
+        if (evictions_since_clean < clean_frames_low && !over) {
+            pthread_cond_wait(&cleaner_cond, &cache_lock);
+            continue;
+        }
+        evictions_since_clean = 0;
+        // data blocks first, with dirty blocks over the threshold the first cache having some
+        struct CacheQueue* queues[3];
+        struct Hash* hashes[3];
+        int num_caches = get_block_caches(queues, hashes);
+        int num_cleaned = 0;
+        for (int i = 0; i < num_caches && (num_cleaned == 0 || !over); i++) {
+            int result = clean_lru_tail(queues[i], buffer, nodes, owners, over);
+            if (result > 0) num_cleaned += result;
+        }
+        if (num_cleaned == 0 && over) pthread_cond_wait(&cleaner_cond, &cache_lock);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    free(owners);
+    free(nodes);
+    free(buffer);
+    return NULL;
+}
+
+// start the cache cleaner keeping low_frames least recently used nodes clean, none if 0
+int start_cache_cleaner(unsigned low_frames) {
+    if (low_frames == 0) return 0;
+    clean_frames_low = low_frames;
+    cleaner_stop = false;
+    int result = pthread_create(&cleaner_tid, NULL, cache_cleaner_thread, NULL);
+    if (result != 0) return -result;
+    pthread_mutex_lock(&cache_lock);
+    cleaner_running = true;
+    pthread_mutex_unlock(&cache_lock);
     return 0;
 }
 
+void stop_cache_cleaner() {
+    pthread_mutex_lock(&cache_lock);
+    bool running = cleaner_running;
+    cleaner_running = false;
+    cleaner_stop = true;
+    pthread_cond_signal(&cleaner_cond);
+    pthread_cond_broadcast(&dirty_cond);
+    pthread_mutex_unlock(&cache_lock);
+    if (running) pthread_join(cleaner_tid, NULL);
+}
+
+#define DIRTY_PAUSE_US_PER_BLK 50 // pause per block written halfway between the dirty thresholds
+#define DIRTY_PAUSE_MAX_US 200000
+
+// throttle a writer about to dirty num_blks blocks, with the cache cleaner running
+// above the background threshold the cleaner is woken and the writer is paused in proportion to how far the dirty data
+// blocks are towards the hard limit, at the hard limit it waits until the cleaner or another write-back brought them below
+void balance_dirty_blocks(int num_blks) {
+    pthread_mutex_lock(&cache_lock);
+    unsigned background = dirty_background_blocks(queue), limit = dirty_limit_blocks(queue);
+    if (!cleaner_running || queue->num_dirty <= background) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    pthread_cond_signal(&cleaner_cond);
+    stats_add(STAT_DIRTY_THROTTLE, 1);
+    while (cleaner_running && queue->num_dirty >= limit) pthread_cond_wait(&dirty_cond, &cache_lock);
+    long long pause_us = 0;
+    if (queue->num_dirty > background && limit > background) pause_us = 2LL * DIRTY_PAUSE_US_PER_BLK * num_blks * (queue->num_dirty - background) / (limit - background);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (pause_us > DIRTY_PAUSE_MAX_US) pause_us = DIRTY_PAUSE_MAX_US;
+    if (pause_us > 0) usleep(pause_us);
+}
+
 #endif